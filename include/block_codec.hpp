@@ -0,0 +1,46 @@
+// Block compression codecs for compressed storage in device memory
+#ifndef VRAM_BLOCK_CODEC_HPP
+#define VRAM_BLOCK_CODEC_HPP
+
+#include <cstddef>
+#include <memory>
+#include <string>
+
+namespace vram
+{
+    // Compresses whole block images. Codecs hold no per-call state, so one
+    // instance serves every thread. The CPU implementations below compress
+    // host buffers on their way to the device; a GPU kernel producing the
+    // same format can stand in for one without changing the stored data.
+    class block_codec
+    {
+    public:
+        virtual ~block_codec() = default;
+
+        virtual const char *name() const = 0;
+
+        // Compress `size` bytes at `in` into at most `capacity` bytes at
+        // `out`. Returns the compressed size, or 0 if it doesn't fit.
+        virtual size_t compress(const void *in, size_t size, void *out, size_t capacity) const = 0;
+
+        // Expand `in_size` compressed bytes into exactly `size` bytes at
+        // `out`; false if the input is malformed or expands to another size
+        virtual bool decompress(const void *in, size_t in_size, void *out, size_t size) const = 0;
+    };
+
+    // LZ4 block format (no frame header): greedy single-probe hash matching,
+    // so it trades some ratio for speed like LZ4's default level. Inputs are
+    // at most 64KiB, the format's match window.
+    class lz4_codec : public block_codec
+    {
+    public:
+        const char *name() const override { return "lz4"; }
+        size_t compress(const void *in, size_t size, void *out, size_t capacity) const override;
+        bool decompress(const void *in, size_t in_size, void *out, size_t size) const override;
+    };
+
+    // Codec by name ("lz4"); nullptr if unknown
+    std::unique_ptr<block_codec> make_codec(const std::string &name);
+}
+
+#endif
@@ -7,57 +7,371 @@
 #include <vector>
 #include <memory>
 #include <string>
+#include <atomic>
+#include <functional>
+#include <sys/types.h>
 
 namespace vram
 {
+    class block_codec;
+
     namespace cuda_mem
     {
         class block;
         typedef std::shared_ptr<block> block_ref;
 
+        // Opaque backend handles for an ordered transfer queue and a marker
+        // recorded in one (cudaStream_t / cudaEvent_t for the CUDA backend)
+        typedef void *stream_t;
+        typedef void *event_t;
+
+        // One contiguous copy between host and device memory
+        struct copy_op
+        {
+            void *dst;
+            const void *src;
+            size_t size;
+        };
+
+        // Device backend: everything that touches device or pinned host memory.
+        // The pool and block logic below is backend-agnostic and only talks to
+        // the device through this interface.
+        class backend
+        {
+        public:
+            virtual ~backend() = default;
+
+            virtual const char *name() const = 0;
+
+            // Bind to device `idx`; returns true on success
+            virtual bool init(size_t idx) = 0;
+            // Make initialized device `idx` current for the calling thread;
+            // later calls from this thread allocate and copy on it
+            virtual void bind(size_t idx) = 0;
+            virtual std::vector<std::string> list_devices() = 0;
+            virtual size_t total_memory() = 0;
+            // Device memory not allocated by anyone, this process or another
+            virtual size_t free_memory() = 0;
+            // NUMA node the current device is attached to, -1 if unknown
+            virtual int numa_node() = 0;
+
+            // Device memory (returns nullptr on failure)
+            virtual void *device_alloc(size_t size) = 0;
+            virtual void device_free(void *ptr) = 0;
+            virtual void device_memset(void *ptr, int value, size_t size) = 0;
+
+            // Pinned host memory (returns nullptr on failure)
+            virtual void *host_alloc(size_t size) = 0;
+            virtual void host_free(void *ptr) = 0;
+
+            // Synchronous copies
+            virtual void copy_to_device(void *dst, const void *src, size_t size) = 0;
+            virtual void copy_to_host(void *dst, const void *src, size_t size) = 0;
+
+            // Streams: copies queued on one stream complete in order
+            virtual stream_t stream_create() = 0;
+            virtual void stream_destroy(stream_t stream) = 0;
+            virtual void stream_synchronize(stream_t stream) = 0;
+
+            // Queue all copies in one direction on `stream` as a single batch.
+            // Host memory must stay valid until the stream has passed them.
+            virtual void copy_async(const copy_op *ops, size_t count, bool to_device, stream_t stream) = 0;
+
+            // Queue a fill of device memory on `stream`; no host data moves
+            virtual void memset_async(void *ptr, int value, size_t size, stream_t stream) = 0;
+
+            // Events mark a point in a stream; synchronizing on one waits for
+            // everything queued on that stream before it was recorded
+            virtual event_t event_create() = 0;
+            virtual void event_destroy(event_t event) = 0;
+            virtual void event_record(event_t event, stream_t stream) = 0;
+            virtual void event_synchronize(event_t event) = 0;
+
+            // Make later work on `stream` wait for `event` without blocking the host
+            virtual void stream_wait_event(stream_t stream, event_t event) = 0;
+
+            // Wait for all outstanding transfers
+            virtual void synchronize() = 0;
+        };
+
+        // Host-memory emulation of a device. Each copy costs
+        // `latency_ns` plus `size / bandwidth`; the bandwidth is shared by all
+        // threads per direction, like a full-duplex PCIe link.
+        struct host_backend_config
+        {
+            size_t memory = 1024ULL * 1024 * 1024; // emulated device size in bytes
+            uint64_t bandwidth = 0;                // bytes per second, 0 = unlimited
+            uint64_t latency_ns = 0;               // fixed cost per transfer
+            int numa_node = -1;                    // node the emulated devices report, -1 = none
+        };
+
+        std::unique_ptr<backend> make_cuda_backend();
+        std::unique_ptr<backend> make_host_backend(const host_backend_config &cfg = host_backend_config());
+
+        // Replace the active backend (default: CUDA). Releases all pools owned
+        // by the previous backend, so call it before init().
+        void set_backend(std::unique_ptr<backend> b);
+
+        // Select a backend by name ("cuda" or "host"); returns false if unknown
+        bool select_backend(const std::string &name, const host_backend_config &cfg = host_backend_config());
+
+        backend &current_backend();
+
         // Initialize CUDA backend; returns true on success
         bool init();
 
         // Set device index
         void set_device(size_t idx);
 
+        // Spread the pool over several devices (takes effect at init()). Each
+        // gets its own pool, staging buffers, streams and completion reaper;
+        // pool_size() and friends report totals, the overloads one device
+        // (by position in `ids`).
+        void set_devices(const std::vector<size_t> &ids);
+        size_t device_count();
+
+        // NUMA node of a pool device, -1 if unknown. Its staging buffers are
+        // allocated from that node's CPUs so they sit next to the device's
+        // PCIe root complex, and its completion reaper runs there.
+        int device_numa_node(size_t device);
+
         // Returns list of devices (names)
         std::vector<std::string> list_devices();
 
+        // Pool granularity: blocks handed out by allocate() are this many bytes,
+        // sliced from larger device slabs. A power of two from 4KiB up to
+        // block::size (the default); it can only change while the pool is empty.
+        bool set_block_size(size_t size);
+        size_t block_size();
+
         // Pool management
         // Increase device pool by approximately `size` bytes (rounded up to blocks).
-        // Returns actual bytes allocated.
-        size_t increase_pool(size_t size_in_bytes);
+        // Returns actual bytes allocated. Split over the devices in proportion
+        // to their memory. Without `clear` new blocks hold whatever the device
+        // memory held, for callers that never read a block before writing it.
+        // Safe to call while other threads allocate and transfer.
+        size_t increase_pool(size_t size_in_bytes, bool clear = true);
+        size_t increase_pool_on(size_t device, size_t size_in_bytes, bool clear = true);
         int pool_size();
         int pool_available();
+        int pool_size(size_t device);
+        int pool_available(size_t device);
 
-        // Return total device memory (bytes) available on the current CUDA device.
+        // Give device memory back while the pool is in use. Retires the
+        // device's least used slabs until at least `size_in_bytes` is covered
+        // and returns the bytes retired. A retired slab hands out no more
+        // blocks and is freed once its last block is released, so owners of
+        // retired() blocks should move their data and release them.
+        // pool_retiring() is the memory still waiting for that.
+        size_t shrink_pool_on(size_t device, size_t size_in_bytes);
+        size_t pool_retiring(size_t device);
+
+        // Return total device memory (bytes) available on the selected devices.
         size_t total_device_memory();
+        size_t total_device_memory(size_t device);
+        // Memory of pool device `device` that nobody has allocated yet
+        size_t free_device_memory(size_t device);
 
-        // Pinned staging pool (host buffers) - used for async transfers
-        bool init_staging_pool(int count = 8);
+        // Pinned staging pool (host buffers) - used for async transfers.
+        // `count` buffers per device are allocated up front; each device's pool
+        // grows on demand up to `max_count`, after which async writers wait for
+        // a free buffer.
+        bool init_staging_pool(int count = 8, int max_count = 256);
         void shutdown_staging_pool();
 
-        // Allocate block (returns nullptr if none available)
+        // Transfer streams shared by all threads; each thread is bound to one
+        // of them on first use. Created lazily with the default count if not
+        // initialized explicitly.
+        bool init_streams(int count = 4);
+
+        // Wait until every asynchronous write (and pipelined transfer, with
+        // its callback) submitted before this call has reached the device
+        void drain();
+
+        // Asynchronous writes (and pipelined transfers) not yet complete on
+        // the busiest device, and a wait until every device has at most
+        // `limit` of those submitted before the call still in flight. The
+        // overloads look at pool device `device` only.
+        size_t pending_writes();
+        void wait_pending(size_t limit);
+        size_t pending_writes(size_t device);
+        void wait_pending(size_t device, size_t limit);
+
+        // Free the device pool and staging buffers. Blocks still referenced
+        // must not be used afterwards.
+        void shutdown();
+
+        // Allocate block (returns nullptr if none available). allocate() takes
+        // it from the device with the most free blocks.
         block_ref allocate();
+        block_ref allocate_on(size_t device);
+
+        // Same without reference counting, for callers that track ownership
+        // themselves (the block map keeps one pointer per export block). The
+        // block lives in its device's block table until shutdown();
+        // release_block() waits for its pending writes and returns it.
+        block *acquire_block();
+        block *acquire_block(size_t device);
+        void release_block(block *b);
+
+        // One block-local piece of a batched transfer: `size` bytes at
+        // `offset` inside `blk`, to or from host memory at `data`
+        struct segment
+        {
+            block *blk;
+            off_t offset;
+            size_t size;
+            void *data;
+        };
+
+        // Batched transfers: all segments are submitted together with a single
+        // completion wait. Segments must not overlap. Segments without a block
+        // read as zeros and ignore writes. Segments on different devices are
+        // transferred in parallel.
+        void read_batch(const segment *segs, size_t count);
+        void write_batch(const segment *segs, size_t count);
+
+        // Asynchronous batched write: the data is copied into pinned staging
+        // buffers and the call returns once it is queued. Completion is
+        // tracked by a background reaper thread; see drain().
+        void write_batch_async(const segment *segs, size_t count);
+
+        // Staging buffers (block::size bytes of pinned memory) for callers
+        // that stage data themselves. With `wait` the call blocks until one is
+        // free; otherwise nullptr is returned when the pool is exhausted.
+        // Buffers come from the pool of `near`'s device (the first device if
+        // null) and must be released with a block on the same device.
+        void *acquire_staging_buffer(bool wait, const block *near = nullptr);
+        void release_staging_buffer(void *buf, const block *near = nullptr);
+
+        // Asynchronous batched write of segments whose data already lives in
+        // staging buffers. Ownership of `buffers` passes to the reaper, which
+        // returns them to the pool once the copies complete. Buffers are listed
+        // in the order of the segments staged in them, and each holds data for
+        // blocks of one device only.
+        void write_staged_async(const segment *segs, size_t count, void *const *buffers, size_t nbuffers);
+
+        // Asynchronously zero each segment's range on the device (`data` is
+        // ignored). Ordered and tracked like an asynchronous write.
+        void zero_batch_async(const segment *segs, size_t count);
+
+        // Pipelined batched transfers, straight between the device and the
+        // caller's memory. Each call queues its copies on the next of every
+        // device's streams (round-robin, so one thread keeps several batches
+        // in flight) and returns at once; `done` runs on a reaper thread
+        // once the whole batch has completed, or inline if no segment needed
+        // the device. It must not block. Until then `data` and the blocks'
+        // contents belong to the transfer: pinned memory (host_alloc) lets
+        // CUDA overlap the copies, and callers keep other writers off the
+        // blocks. Completions of one device are reported in submission order,
+        // those of different devices independently. Written blocks carry the
+        // write as their pending write, like write_batch_async().
+        typedef std::function<void()> completion;
+        void read_batch_async(const segment *segs, size_t count, completion done);
+        void write_batch_async(const segment *segs, size_t count, completion done);
+
+        // Compressed storage (off until a codec is set). Whole block images
+        // are compressed on the host and kept in variable-size slots: each
+        // size class, from 1/32 of a block up to half of one, is carved from
+        // pool blocks taken as needed and given back once their last slot is
+        // freed. An image that doesn't compress to half a block is left for
+        // the caller to store raw. Slots are written synchronously, so slots
+        // sharing a pool block never race on its pending-write token.
+        typedef uint64_t packed_ref; // 0 = none
+
+        // Install the codec after init(); nullptr turns compression off. Only
+        // while no slots are in use.
+        void set_codec(std::unique_ptr<block_codec> codec);
+        const block_codec *codec();
+
+        // Compress one whole block into a slot, on `device` if it has room.
+        // Returns 0 if the image doesn't compress well enough or no pool
+        // block is free.
+        packed_ref store_packed(const void *data, size_t device);
+        // Expand a slot into `out` (one whole block); false if it is corrupt
+        bool load_packed(packed_ref ref, void *out);
+        void free_packed(packed_ref ref);
+        // The slot's pool block is retired (see shrink_pool_on()), so its
+        // owner should store the data again elsewhere
+        bool packed_retired(packed_ref ref);
+        uint32_t packed_device(packed_ref ref);
+
+        struct packed_stats
+        {
+            uint64_t stored;        // images compressed into slots
+            uint64_t rejected;      // images that didn't compress enough
+            uint64_t bytes_in;      // uncompressed size of the stored images
+            uint64_t bytes_out;     // their compressed size
+            uint64_t compress_ns;   // codec time over stored and rejected images
+            uint64_t loads;
+            uint64_t decompress_ns;
+            size_t live;            // slots in use
+            size_t carrier_bytes;   // device memory of the pool blocks carved into slots
+        };
+        packed_stats packed_statistics();
 
         // Block abstraction
         class block
         {
         public:
+            // Largest block size (see set_block_size()); staging buffers are
+            // this big so any block fits in one
             static const size_t size = 64 * 1024; // must be <= 64KiB for nbdkit
 
-            // Construct with an allocated device pointer
-            explicit block(void *device_ptr);
-            ~block();
+            // Without a device pointer the block reads as zeros
+            block() = default;
+            // Construct with an allocated device pointer on pool device `device`
+            explicit block(void *device_ptr, uint32_t device = 0);
 
             void read(off_t offset, size_t size, void *data) const;
             void write(off_t offset, size_t size, const void *data, bool async = false);
+
+            // Wait until every write to this block has reached the device.
+            // Only this block's most recent write is waited for; transfers to
+            // other blocks are unaffected.
             void sync();
 
+            // Completion token of the newest asynchronous write, or nullptr
+            // once it has been reaped. Writers to one block are serialized by
+            // the caller; a later write on another stream is ordered behind
+            // this event, so it covers every earlier write as well.
+            event_t pending_write() const;
+
+            // Pool device the block lives on (position in set_devices())
+            uint32_t device() const { return dev; }
+
+            // Its slab is being given back (see shrink_pool_on())
+            bool retired() const { return retiring.load(std::memory_order_acquire); }
+
         private:
+            friend void read_batch(const segment *segs, size_t count);
+            friend void write_batch(const segment *segs, size_t count);
+            friend void write_batch_async(const segment *segs, size_t count);
+            friend void write_staged_async(const segment *segs, size_t count, void *const *buffers, size_t nbuffers);
+            friend void zero_batch_async(const segment *segs, size_t count);
+            friend void read_batch_async(const segment *segs, size_t count, completion done);
+            friend void write_batch_async(const segment *segs, size_t count, completion done);
+            friend size_t increase_pool_on(size_t device, size_t size_in_bytes, bool clear);
+            friend void release_block(block *b);
+            friend size_t shrink_pool_on(size_t device, size_t size_in_bytes);
+
+            void set_pending_write(event_t event, uint64_t seq);
+
+            // Segment maps to a block on pool device `device`
+            static bool on_device(const segment &s, size_t device);
+
+            // Shared body of read_batch_async() and write_batch_async(done)
+            static void pipeline(const segment *segs, size_t count, bool to_device, completion done);
+
             // Implementation-specific handle (device pointer)
             void *impl = nullptr;
+            // Pool generation the pointer was taken from
+            uint64_t generation = 0;
+            uint32_t dev = 0;
+            std::atomic<bool> retiring{false};
+            // Newest asynchronous write: its event and reaper sequence number
+            std::atomic<event_t> write_event{nullptr};
+            std::atomic<uint64_t> write_seq{0};
         };
     }
 }
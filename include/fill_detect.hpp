@@ -0,0 +1,21 @@
+// Same-fill detection for block payloads (vectorized where the CPU allows)
+#ifndef VRAM_FILL_DETECT_HPP
+#define VRAM_FILL_DETECT_HPP
+
+#include <cstddef>
+#include <cstdint>
+
+namespace vram
+{
+    // True if the `size` bytes at `data` are a single 64-bit word repeated;
+    // that word is stored in `word`. `size` must be a non-zero multiple of 8.
+    // Uses AVX-512 or AVX2 when the CPU supports them and exits at the first
+    // differing word, so ordinary data is rejected after a few cache lines.
+    bool same_filled(const void *data, size_t size, uint64_t &word);
+
+    // Write the bytes of a block filled with `word` that lie at `offset`
+    // (in the block) for `size` bytes to `out`
+    void expand_fill(uint64_t word, size_t offset, size_t size, void *out);
+}
+
+#endif
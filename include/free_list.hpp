@@ -0,0 +1,81 @@
+// Scalable pointer free list: per-thread magazines over a lock-free depot
+#ifndef VRAM_FREE_LIST_HPP
+#define VRAM_FREE_LIST_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+
+namespace vram
+{
+    // Pool of interchangeable pointers (device blocks, staging buffers).
+    // Each thread caches two magazines of up to MAGAZINE_SIZE pointers, so
+    // get() and put() normally touch only that thread's cache line. Full and
+    // empty magazines are traded through two lock-free stacks (the depot).
+    // When the depot runs dry get() takes magazines out of other threads'
+    // caches, so it only fails when the pool really is empty.
+    class free_list
+    {
+    public:
+        static const size_t MAGAZINE_SIZE = 32;
+
+        free_list();
+        ~free_list();
+        free_list(const free_list &) = delete;
+        free_list &operator=(const free_list &) = delete;
+
+        // Take a pointer; nullptr if the pool is empty
+        void *get();
+        // Return a pointer taken with get() or added with add()
+        void put(void *p);
+        // Add `count` new pointers
+        void add(void *const *items, size_t count);
+        // Pointers in the pool, wherever they are cached
+        size_t available() const;
+        // Forget every pointer; must not race with get() or put()
+        void clear();
+
+    private:
+        struct magazine
+        {
+            void *items[MAGAZINE_SIZE];
+            uint32_t count = 0;
+            std::atomic<uint32_t> next{0}; // depot stack link
+        };
+
+        // A thread's magazines (0 = none). Taken with an exchange, so another
+        // thread can steal them and threads sharing a slot stay correct.
+        struct alignas(64) slot
+        {
+            std::atomic<uint32_t> loaded{0};
+            std::atomic<uint32_t> previous{0};
+        };
+
+        static const size_t SLOTS = 128;
+        // Magazines live in chunks that double in size and are never freed
+        // before clear(), so an index stays valid while racing pops read it.
+        static const size_t FIRST_CHUNK = 64;
+        static const size_t CHUNKS = 32;
+
+        magazine &mag(uint32_t idx) const;
+        uint32_t new_magazine();
+        void push(std::atomic<uint64_t> &head, uint32_t idx);
+        uint32_t pop(std::atomic<uint64_t> &head);
+        void stash(std::atomic<uint32_t> &to, uint32_t idx);
+        uint32_t steal();
+
+        std::unique_ptr<slot[]> slots;
+        std::atomic<magazine *> chunks[CHUNKS];
+        uint32_t nmagazines = 0; // guarded by grow_mutex
+        std::mutex grow_mutex;
+        // Treiber stacks: ABA tag in the high 32 bits, magazine index below
+        std::atomic<uint64_t> full{0};
+        std::atomic<uint64_t> empty{0};
+        // Pointers not handed out; get() reserves one before searching
+        std::atomic<int64_t> avail{0};
+    };
+}
+
+#endif
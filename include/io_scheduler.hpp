@@ -0,0 +1,113 @@
+// Read-priority scheduling stage in front of cuda_mem transfers
+#ifndef VRAM_IO_SCHEDULER_HPP
+#define VRAM_IO_SCHEDULER_HPP
+
+#include "cuda_memory.hpp"
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <vector>
+
+namespace vram
+{
+    // Requests from many threads are queued here, split by device, and
+    // each device's queue is issued by whichever waiting thread finds that
+    // device idle (its dispatcher): it takes every queued request of one
+    // direction, sorts their segments by device address so neighbouring
+    // blocks become single copies, and submits them as one batch with one
+    // completion wait. The others sleep until their batch is done, so one
+    // submission serves a whole burst of page faults or writeback. Devices
+    // are dispatched independently: a read on one never waits for a batch
+    // being issued on another.
+    //
+    // Reads go first. Under STRICT a write batch is only issued when no read
+    // is queued for the device (reads can starve writes); under WEIGHTED at
+    // most `read_weight` read batches in a row pass waiting writes. Write
+    // batches are held back while their device already has `write_depth`
+    // asynchronous writes in flight, so reads never queue behind a deep
+    // backlog of writeback on the copy engines.
+    //
+    // Asynchronous writes are copied into staging buffers by the writing
+    // thread before they are queued, so a dispatcher never waits for one.
+    //
+    // Callers keep other writers off the blocks of a request until it
+    // returns (the plugin holds their entry locks), so batches never overlap.
+    class io_scheduler
+    {
+    public:
+        enum policy
+        {
+            STRICT,
+            WEIGHTED
+        };
+
+        struct config
+        {
+            policy order = WEIGHTED;
+            unsigned read_weight = 4;
+            size_t write_depth = 8;  // 0 = no bound
+            size_t max_batch = 1024; // segments per batch, at least one request
+        };
+
+        explicit io_scheduler(const config &cfg);
+
+        io_scheduler(const io_scheduler &) = delete;
+        io_scheduler &operator=(const io_scheduler &) = delete;
+
+        // Same contract as read_batch(); returns once the data is in memory
+        void read(const cuda_mem::segment *segs, size_t count);
+
+        // write_batch() or, with `async`, write_batch_async(); a batch
+        // holding any synchronous request is written synchronously
+        void write(const cuda_mem::segment *segs, size_t count, bool async);
+
+        // Requests and the batches they were issued in, by direction
+        uint64_t requests(bool write) const;
+        uint64_t batches(bool write) const;
+
+    private:
+        struct request
+        {
+            const cuda_mem::segment *segs; // sorted by device
+            void *const *buffers;          // staging buffers of an async write
+            bool write;
+            bool async;
+            size_t left; // parts not yet transferred
+        };
+
+        // The segments of a request that live on one device, and the
+        // staging buffers holding their data
+        struct part
+        {
+            request *r;
+            size_t device;
+            size_t first, count;
+            size_t first_buffer, buffers;
+            bool done;
+        };
+
+        // Dispatch state of one device
+        struct device_queue
+        {
+            std::deque<part *> reads, writes;
+            bool dispatching = false;
+            unsigned reads_in_row = 0;
+        };
+
+        void split(const cuda_mem::segment *segs, size_t count, std::vector<part> &parts);
+        void submit(request &r, std::vector<part> &parts);
+        // Choose the device's next batch direction; false if nothing may go now
+        bool pick(device_queue &q, size_t device, bool &write);
+        void dispatch(device_queue &q, bool write, std::unique_lock<std::mutex> &lk);
+
+        config cfg;
+        mutable std::mutex m;
+        std::condition_variable cv;
+        std::deque<device_queue> queues; // by device, grown on first use
+        uint64_t counts[2] = {}, batch_counts[2] = {};
+    };
+}
+
+#endif
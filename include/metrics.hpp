@@ -0,0 +1,109 @@
+// Process-wide counters and latency histograms in Prometheus text format
+#ifndef VRAM_METRICS_HPP
+#define VRAM_METRICS_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+
+namespace vram
+{
+    namespace metrics
+    {
+        // Series are registered up front and updated by id. Every thread
+        // updates its own shard with plain relaxed load/store pairs (no
+        // locked instructions, no shared cache lines); render() sums the
+        // shards. A thread's shard is handed to the next new thread when it
+        // exits, keeping its counts, so totals never go backwards.
+        static const size_t MAX_COUNTERS = 64;
+        static const size_t MAX_HISTOGRAMS = 16;
+
+        // Histogram buckets are powers of two in nanoseconds, from 2^10
+        // (about 1us) to 2^35 (about 34s), then +Inf
+        static const int FIRST_BUCKET = 10;
+        static const size_t BUCKETS = 27;
+
+        struct alignas(64) shard
+        {
+            std::atomic<uint64_t> counters[MAX_COUNTERS];
+            std::atomic<uint64_t> buckets[MAX_HISTOGRAMS][BUCKETS];
+            std::atomic<uint64_t> sum_ns[MAX_HISTOGRAMS];
+        };
+
+        // The calling thread's shard, attached on first use
+        shard *attach();
+        void detach(shard *s);
+
+        struct shard_ref
+        {
+            shard *s = nullptr;
+            ~shard_ref()
+            {
+                if (s)
+                    detach(s);
+            }
+        };
+
+        inline shard &local()
+        {
+            thread_local shard_ref ref;
+            if (!ref.s)
+                ref.s = attach();
+            return *ref.s;
+        }
+
+        typedef uint32_t id;
+
+        // `labels` is the inside of the braces (e.g. op="pread"), or empty.
+        // Series of one name share its help text and type. Registering the
+        // same series again returns its id; at most MAX_COUNTERS counters and
+        // MAX_HISTOGRAMS histograms exist, and registering past that returns
+        // the last one.
+        id counter(const std::string &name, const std::string &labels, const std::string &help);
+        id histogram(const std::string &name, const std::string &labels, const std::string &help);
+
+        // A value read when rendering, for state kept elsewhere (pool
+        // occupancy, cache hit counts). `monotonic` marks it a counter.
+        void sampled(const std::string &name, const std::string &labels, const std::string &help, bool monotonic, std::function<double()> read);
+
+        inline void add(id c, uint64_t n = 1)
+        {
+            std::atomic<uint64_t> &v = local().counters[c];
+            v.store(v.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+        }
+
+        // Bucket b counts durations in (2^(FIRST_BUCKET+b-1), 2^(FIRST_BUCKET+b)] ns
+        inline size_t bucket_of(uint64_t ns)
+        {
+            int width = ns > 1 ? 64 - __builtin_clzll(ns - 1) : 0;
+            return width <= FIRST_BUCKET ? 0 : std::min<size_t>((size_t)(width - FIRST_BUCKET), BUCKETS - 1);
+        }
+
+        inline void observe(id h, uint64_t ns)
+        {
+            shard &s = local();
+            std::atomic<uint64_t> &b = s.buckets[h][bucket_of(ns)];
+            b.store(b.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            s.sum_ns[h].store(s.sum_ns[h].load(std::memory_order_relaxed) + ns, std::memory_order_relaxed);
+        }
+
+        // Sum of a counter, or count of a histogram, over all threads
+        uint64_t value(id c);
+        uint64_t count(id h);
+
+        std::string render();
+
+        // Write render() to `path` through a temporary file and rename, so
+        // readers (e.g. node_exporter's textfile collector) never see a
+        // partial file
+        bool publish(const std::string &path);
+
+        // Forget every series and zero all shards
+        void clear();
+    }
+}
+
+#endif
@@ -0,0 +1,40 @@
+// NUMA topology from sysfs and CPU affinity helpers (no libnuma needed)
+#ifndef VRAM_NUMA_TOPOLOGY_HPP
+#define VRAM_NUMA_TOPOLOGY_HPP
+
+#include <sched.h>
+#include <string>
+#include <vector>
+
+namespace vram
+{
+    // Parse a kernel CPU list such as "0-3,8,10-11"; false if malformed
+    bool parse_cpulist(const std::string &list, std::vector<int> &cpus);
+
+    // CPUs of NUMA node `node` (empty if the node doesn't exist)
+    std::vector<int> node_cpus(int node);
+
+    // NUMA node a PCI device ("0000:3b:00.0") is attached to, or -1 when the
+    // platform doesn't report one (single-node hosts, VMs)
+    int pci_numa_node(const std::string &bus_id);
+
+    // Restrict the calling thread to `cpus`; false if the kernel refused
+    bool pin_thread(const std::vector<int> &cpus);
+
+    // Runs the calling thread on `cpus` for the guard's lifetime, so memory
+    // first touched meanwhile is placed on their node. An empty list is a no-op.
+    class cpu_binding
+    {
+    public:
+        explicit cpu_binding(const std::vector<int> &cpus);
+        ~cpu_binding();
+        cpu_binding(const cpu_binding &) = delete;
+        cpu_binding &operator=(const cpu_binding &) = delete;
+
+    private:
+        cpu_set_t saved;
+        bool bound = false;
+    };
+}
+
+#endif
@@ -0,0 +1,106 @@
+// Pinned host read cache for hot blocks (2Q replacement)
+#ifndef VRAM_READ_CACHE_HPP
+#define VRAM_READ_CACHE_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+namespace vram
+{
+    // Size-bounded cache of whole device blocks in pinned host memory, keyed
+    // by block index. Replacement is 2Q (Johnson & Shasha): blocks seen once
+    // go through a small FIFO (A1in) and only blocks re-referenced after
+    // leaving it (remembered by key in the A1out ghost list) are promoted to
+    // the main LRU (Am), so a one-off sequential scan can't flush the hot set.
+    //
+    // Callers must serialize all operations on the same block index (the
+    // plugin holds the block's entry lock); different blocks may be used
+    // concurrently.
+    class read_cache
+    {
+    public:
+        // `capacity` in bytes is rounded down to whole slots of `slot_size`
+        read_cache(size_t capacity, size_t slot_size);
+        ~read_cache();
+
+        read_cache(const read_cache &) = delete;
+        read_cache &operator=(const read_cache &) = delete;
+
+        // False if no pinned memory could be allocated
+        bool enabled() const { return slots > 0; }
+        size_t capacity() const { return slots * slot_size; }
+
+        // On a hit copy `size` bytes at `offset` of block `idx` into `out`
+        bool lookup(size_t idx, size_t offset, size_t size, void *out);
+
+        // Reserve a slot for block `idx` after a miss and return it for the
+        // caller to fill with the whole block, or nullptr if nothing can be
+        // evicted right now. The slot is invisible to lookups and can't be
+        // evicted until end_fill() or abort_fill().
+        void *begin_fill(size_t idx);
+        void end_fill(size_t idx);
+        void abort_fill(size_t idx);
+
+        // Write-through: refresh the cached copy of block `idx`, if any
+        void update(size_t idx, size_t offset, size_t size, const void *data);
+
+        // Drop block `idx` (e.g. after its contents were discarded)
+        void invalidate(size_t idx);
+
+        uint64_t hits() const;
+        uint64_t misses() const;
+
+    private:
+        enum queue_id : uint8_t
+        {
+            A1IN,
+            AM
+        };
+
+        struct entry
+        {
+            queue_id queue;
+            bool ready;
+            uint32_t slot;
+            std::list<size_t>::iterator pos;
+        };
+
+        struct shard
+        {
+            std::mutex m;
+            std::unordered_map<size_t, entry> map;
+            std::list<size_t> a1in; // front = newest
+            std::list<size_t> am;   // front = most recently used
+            std::list<size_t> a1out;
+            std::unordered_map<size_t, std::list<size_t>::iterator> ghosts;
+            std::vector<uint32_t> free_slots;
+            size_t kin = 0;  // A1in target size
+            size_t kout = 0; // A1out ghost capacity
+            uint64_t hits = 0;
+            uint64_t misses = 0;
+        };
+
+        static const size_t SHARDS = 16;
+
+        shard &shard_for(size_t idx) { return shards[idx % SHARDS]; }
+        char *slot_ptr(uint32_t slot) const { return base + (size_t)slot * slot_size; }
+
+        // Free a slot in `s` by evicting per 2Q; returns false if every
+        // resident block is still being filled
+        bool reclaim(shard &s);
+        bool evict_from(shard &s, std::list<size_t> &q, bool remember);
+        void remove(shard &s, std::unordered_map<size_t, entry>::iterator it);
+
+        size_t slot_size;
+        size_t slots = 0;
+        char *base = nullptr;
+        std::unique_ptr<shard[]> shards;
+    };
+}
+
+#endif
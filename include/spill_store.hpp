@@ -0,0 +1,88 @@
+// Host-side overflow tier for blocks that don't fit in device memory
+#ifndef VRAM_SPILL_STORE_HPP
+#define VRAM_SPILL_STORE_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace vram
+{
+    // One piece of a batched transfer: `size` bytes at `offset` inside slot
+    // `slot`, to or from `data`
+    struct spill_io
+    {
+        uint64_t slot;
+        size_t offset;
+        size_t size;
+        void *data;
+    };
+
+    // Fixed-size block slots in a file or block device (an NVMe partition,
+    // or a zram device) for blocks that don't fit in device memory. The path
+    // is opened with O_DIRECT where the filesystem allows it, so spilled data
+    // doesn't pile up in the page cache as well, and each batch goes to the
+    // kernel as one io_uring submission (plain pread/pwrite where io_uring is
+    // unavailable). Nothing in it outlives the process: every slot is free
+    // again on open.
+    //
+    // Callers must serialize operations on the same slot (the plugin holds
+    // the owning block's entry lock); different slots may be used concurrently.
+    class spill_store
+    {
+    public:
+        // `capacity` in bytes is rounded down to whole slots of `slot_size`
+        // (a multiple of 4KiB) and, for a block device, to its size. A
+        // regular file is created if needed and sized to the capacity (sparse).
+        spill_store(const std::string &path, size_t capacity, size_t slot_size);
+        ~spill_store();
+
+        spill_store(const spill_store &) = delete;
+        spill_store &operator=(const spill_store &) = delete;
+
+        // False if the path couldn't be opened
+        bool enabled() const { return fd >= 0 && slots > 0; }
+        // Whether I/O bypasses the page cache
+        bool direct() const { return o_direct; }
+        size_t capacity() const { return slots * slot_size; }
+        size_t used() const;
+
+        // Take a free slot; false if the store is full
+        bool reserve(uint64_t &slot);
+        void release(uint64_t slot);
+
+        // Batched transfers, true if every piece completed. Pieces must not
+        // overlap. Pieces not aligned to 4KiB (in the file or in memory) go
+        // through aligned bounce buffers; writes read-modify-write the pages
+        // they cover partly.
+        bool read_batch(const spill_io *ios, size_t count);
+        bool write_batch(const spill_io *ios, size_t count);
+
+        // Write one whole slot of `data` into a free slot and return its
+        // index in `slot`; false if the store is full or the write failed
+        bool store(const void *data, uint64_t &slot);
+
+        // Copy `size` bytes at `offset` of slot `slot` into `out`
+        bool load(uint64_t slot, size_t offset, size_t size, void *out);
+
+        // Overwrite `size` bytes at `offset` of slot `slot` in place
+        bool write(uint64_t slot, size_t offset, size_t size, const void *data);
+
+    private:
+        static const size_t ALIGN = 4096;
+
+        bool transfer(const spill_io *ios, size_t count, bool to_file);
+
+        int fd = -1;
+        bool o_direct = false;
+        size_t slot_size;
+        size_t slots = 0;
+        mutable std::mutex m;
+        std::vector<uint64_t> free_slots;
+        uint64_t fresh = 0; // slots from here on were never handed out
+    };
+}
+
+#endif
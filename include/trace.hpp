@@ -0,0 +1,86 @@
+// Request trace capture into a compact binary file, and reading it back
+#ifndef VRAM_TRACE_HPP
+#define VRAM_TRACE_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace vram
+{
+    namespace trace
+    {
+        enum op : uint8_t
+        {
+            PREAD,
+            PWRITE,
+            FLUSH,
+            TRIM,
+            ZERO
+        };
+
+        // One request, 32 bytes on disk. Times are nanoseconds of the
+        // steady clock since the trace started.
+        struct record
+        {
+            uint64_t start_ns;
+            uint64_t offset;
+            uint32_t length;
+            uint32_t latency_ns; // saturates at about 4.3s
+            uint32_t thread;     // small index, in order of each thread's first request
+            uint8_t type;        // op
+            uint8_t status;      // 0 or the errno returned
+            uint16_t reserved;
+        };
+        static_assert(sizeof(record) == 32, "trace records are 32 bytes");
+
+        // File layout: this header, then `records` records. Each thread's
+        // records are in order, but threads' runs are interleaved as they
+        // were flushed; load() sorts them by start time. `dropped` counts
+        // requests lost to a full ring.
+        struct file_header
+        {
+            char magic[8]; // "VRTRACE1"
+            uint32_t version;
+            uint32_t record_size;
+            uint64_t start_unix_ns; // wall clock at start_ns == 0
+            uint64_t records;
+            uint64_t dropped;
+        };
+
+        // Every recording thread gets a single-producer ring of
+        // `ring_records` entries (rounded up to a power of two) that a
+        // background writer drains every `interval_ms`. Recording takes no
+        // lock and never blocks: when a ring is full the record is dropped
+        // and counted. False if the file can't be created.
+        bool start(const std::string &path, size_t ring_records = 65536, uint32_t interval_ms = 100);
+
+        // Drain every ring, complete the header and close the file. No
+        // thread may be inside record() any more.
+        void stop();
+
+        inline std::atomic<bool> &enabled_flag()
+        {
+            static std::atomic<bool> on{false};
+            return on;
+        }
+        inline bool enabled() { return enabled_flag().load(std::memory_order_relaxed); }
+
+        // Nanoseconds since the trace started
+        uint64_t now_ns();
+
+        void record_op(op type, uint64_t offset, uint32_t length, uint64_t start_ns, uint64_t latency_ns, int status);
+
+        // Records written and dropped so far
+        uint64_t written();
+        uint64_t dropped();
+
+        // Read a trace file, sorted by start time. False (with a reason in
+        // `error`) if it isn't one.
+        bool load(const std::string &path, file_header &header, std::vector<record> &records, std::string &error);
+    }
+}
+
+#endif
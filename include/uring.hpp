@@ -0,0 +1,78 @@
+// Minimal io_uring over the raw syscalls (no liburing dependency)
+#ifndef VRAM_URING_HPP
+#define VRAM_URING_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <linux/io_uring.h>
+#include <sys/uio.h>
+
+namespace vram
+{
+    // One submission and completion queue pair. Not thread-safe: each
+    // thread that submits I/O owns its own ring. Where the kernel refuses
+    // io_uring (too old, or disabled by sysctl) ok() is false and callers
+    // fall back to plain syscalls.
+    class uring
+    {
+    public:
+        explicit uring(unsigned entries);
+        ~uring();
+
+        uring(const uring &) = delete;
+        uring &operator=(const uring &) = delete;
+
+        bool ok() const { return fd >= 0; }
+        unsigned size() const { return entries; }
+
+        // A zeroed submission entry queued for the next enter(), or nullptr
+        // while the queue holds `size()` unsubmitted entries
+        io_uring_sqe *next_sqe();
+
+        // Submit everything queued and wait until at least `wait`
+        // completions are available. Returns the number submitted, or
+        // -errno (EINTR included) if the call failed.
+        int enter(unsigned wait);
+
+        // Drop entries queued since the last successful enter(), so a
+        // failed submission isn't replayed by the next one
+        void discard();
+
+        // Consume each available completion and hand it to `f`; returns how
+        // many there were
+        template <class F>
+        unsigned reap(F f)
+        {
+            unsigned head = *cq_head, n = 0;
+            unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+            for (; head != tail; ++head, ++n)
+            {
+                // Free the slot before `f` runs, which may submit more work
+                io_uring_cqe c = cqes[head & cq_mask];
+                __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+                f(c);
+            }
+            return n;
+        }
+
+        // Register fixed buffers for IORING_OP_READ_FIXED/WRITE_FIXED
+        // (buf_index is the position in `iov`); false if the kernel refuses,
+        // e.g. over RLIMIT_MEMLOCK
+        bool register_buffers(const iovec *iov, unsigned count);
+
+    private:
+        void unmap_rings();
+
+        int fd = -1;
+        unsigned entries = 0;
+        void *sq_ptr = nullptr, *cq_ptr = nullptr;
+        size_t sq_len = 0, cq_len = 0, sqes_len = 0;
+        io_uring_sqe *sqes = nullptr;
+        unsigned *sq_head = nullptr, *sq_tail = nullptr, *sq_array = nullptr, sq_mask = 0;
+        unsigned *cq_head = nullptr, *cq_tail = nullptr, cq_mask = 0;
+        io_uring_cqe *cqes = nullptr;
+        unsigned queued = 0; // entries filled since the last enter()
+    };
+}
+
+#endif
@@ -0,0 +1,199 @@
+#include "block_codec.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+namespace vram
+{
+    namespace
+    {
+        const size_t MIN_MATCH = 4;
+        // The format ends every block with literals: a match starts at least
+        // MF_LIMIT bytes and ends at least LAST_LITERALS bytes before the end
+        const size_t MF_LIMIT = 12;
+        const size_t LAST_LITERALS = 5;
+        const size_t MAX_OFFSET = 65535;
+        const int HASH_BITS = 13;
+
+        uint32_t read32(const uint8_t *p)
+        {
+            uint32_t v;
+            memcpy(&v, p, sizeof(v));
+            return v;
+        }
+
+        uint32_t hash4(uint32_t v) { return (v * 2654435761u) >> (32 - HASH_BITS); }
+
+        // Bytes a length of `n` takes beyond its 4-bit token nibble
+        size_t length_bytes(size_t n) { return n < 15 ? 0 : (n - 15) / 255 + 1; }
+
+        uint8_t *put_length(uint8_t *op, size_t n)
+        {
+            for (n -= 15; n >= 255; n -= 255)
+                *op++ = 255;
+            *op++ = (uint8_t)n;
+            return op;
+        }
+
+        // Append one sequence (literals, then a match unless `match_len` is 0);
+        // nullptr if it doesn't fit before `end`
+        uint8_t *put_sequence(uint8_t *op, uint8_t *end, const uint8_t *lit, size_t lit_len, size_t offset, size_t match_len)
+        {
+            size_t ml = match_len ? match_len - MIN_MATCH : 0;
+            size_t need = 1 + length_bytes(lit_len) + lit_len + (match_len ? 2 + length_bytes(ml) : 0);
+            if (need > (size_t)(end - op))
+                return nullptr;
+            uint8_t *token = op++;
+            *token = (uint8_t)((lit_len < 15 ? lit_len : 15) << 4);
+            if (lit_len >= 15)
+                op = put_length(op, lit_len);
+            memcpy(op, lit, lit_len);
+            op += lit_len;
+            if (!match_len)
+                return op;
+            *op++ = (uint8_t)offset;
+            *op++ = (uint8_t)(offset >> 8);
+            *token |= (uint8_t)(ml < 15 ? ml : 15);
+            if (ml >= 15)
+                op = put_length(op, ml);
+            return op;
+        }
+
+        // Read a length continued past its token nibble; false past the input end
+        bool get_length(const uint8_t *src, size_t n, size_t &ip, size_t &len)
+        {
+            uint8_t b;
+            do
+            {
+                if (ip >= n)
+                    return false;
+                b = src[ip++];
+                len += b;
+            } while (b == 255);
+            return true;
+        }
+    }
+
+    size_t lz4_codec::compress(const void *in, size_t size, void *out, size_t capacity) const
+    {
+        const uint8_t *src = static_cast<const uint8_t *>(in);
+        uint8_t *op = static_cast<uint8_t *>(out), *end = op + capacity;
+        if (size > 65536)
+            return 0;
+        // Positions fit 16 bits within a 64KiB input; stale entries are
+        // harmless as every candidate is compared before use
+        uint16_t table[1 << HASH_BITS] = {};
+        size_t anchor = 0, ip = 1;
+        if (size > MF_LIMIT)
+        {
+            size_t limit = size - MF_LIMIT, misses = 0;
+            while (ip < limit)
+            {
+                uint32_t seq = read32(src + ip);
+                uint32_t h = hash4(seq);
+                size_t ref = table[h];
+                table[h] = (uint16_t)ip;
+                if (ref >= ip || ip - ref > MAX_OFFSET || read32(src + ref) != seq)
+                {
+                    // Step further the longer nothing matched, so incompressible
+                    // data is rejected quickly
+                    ip += 1 + (misses++ >> 6);
+                    continue;
+                }
+                misses = 0;
+                // Extend backwards over pending literals, then forwards
+                while (ip > anchor && ref > 0 && src[ip - 1] == src[ref - 1])
+                {
+                    --ip;
+                    --ref;
+                }
+                size_t len = MIN_MATCH, max = size - LAST_LITERALS - ip;
+                while (len < max && src[ref + len] == src[ip + len])
+                    ++len;
+                op = put_sequence(op, end, src + anchor, ip - anchor, ip - ref, len);
+                if (!op)
+                    return 0;
+                ip += len;
+                anchor = ip;
+                if (ip < limit)
+                    table[hash4(read32(src + ip - 2))] = (uint16_t)(ip - 2);
+            }
+        }
+        op = put_sequence(op, end, src + anchor, size - anchor, 0, 0);
+        return op ? (size_t)(op - static_cast<uint8_t *>(out)) : 0;
+    }
+
+    bool lz4_codec::decompress(const void *in, size_t in_size, void *out, size_t size) const
+    {
+        const uint8_t *src = static_cast<const uint8_t *>(in);
+        uint8_t *dst = static_cast<uint8_t *>(out);
+        size_t ip = 0, op = 0;
+        while (ip < in_size)
+        {
+            uint8_t token = src[ip++];
+            size_t lit = token >> 4;
+            if (lit == 15 && !get_length(src, in_size, ip, lit))
+                return false;
+            if (lit > in_size - ip || lit > size - op)
+                return false;
+            // Short literal runs are the common case: one fixed-size copy
+            if (lit <= 16 && in_size - ip >= 16 && size - op >= 16)
+                memcpy(dst + op, src + ip, 16);
+            else
+                memcpy(dst + op, src + ip, lit);
+            ip += lit;
+            op += lit;
+            // The last sequence has no match
+            if (ip == in_size)
+                break;
+            if (in_size - ip < 2)
+                return false;
+            size_t offset = src[ip] | (size_t)src[ip + 1] << 8;
+            ip += 2;
+            size_t len = token & 15;
+            if (len == 15 && !get_length(src, in_size, ip, len))
+                return false;
+            len += MIN_MATCH;
+            if (offset == 0 || offset > op || len > size - op)
+                return false;
+            const uint8_t *from = dst + op - offset;
+            uint8_t *to = dst + op;
+            op += len;
+            if (size - op < 8)
+            {
+                // Near the end: overlapping matches repeat the last `offset`
+                // bytes, so copy in chunks that never overlap
+                while (len)
+                {
+                    size_t n = std::min(len, (size_t)(to - from));
+                    memcpy(to, from, n);
+                    to += n;
+                    len -= n;
+                }
+                continue;
+            }
+            uint8_t *stop = to + len;
+            if (offset < 8)
+            {
+                // Lay down the first word bytewise, then continue from the
+                // nearest whole period at least a word back
+                for (size_t i = 0; i < 8; ++i)
+                    to[i] = from[i];
+                to += 8;
+                from = to - offset * ((8 + offset - 1) / offset);
+            }
+            // Copy in words, overshooting into output that later sequences
+            // overwrite anyway
+            for (; to < stop; to += 8, from += 8)
+                memcpy(to, from, 8);
+        }
+        return op == size;
+    }
+
+    std::unique_ptr<block_codec> make_codec(const std::string &name)
+    {
+        if (name == "lz4")
+            return std::unique_ptr<block_codec>(new lz4_codec());
+        return nullptr;
+    }
+}
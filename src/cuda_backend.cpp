@@ -0,0 +1,309 @@
+#include "cuda_memory.hpp"
+#include "numa_topology.hpp"
+#include <iostream>
+
+#ifdef USE_CUDA
+#include <cuda_runtime.h>
+#endif
+
+namespace vram
+{
+    namespace cuda_mem
+    {
+        // Backend driving a real GPU through the CUDA runtime
+        class cuda_backend : public backend
+        {
+        public:
+            const char *name() const override { return "cuda"; }
+
+            bool init(size_t idx) override
+            {
+#ifdef USE_CUDA
+                int devcount = 0;
+                if (cudaGetDeviceCount(&devcount) != cudaSuccess || devcount == 0)
+                {
+                    std::cerr << "cuda_mem: no CUDA devices found" << std::endl;
+                    return false;
+                }
+                if (idx >= (size_t)devcount)
+                {
+                    std::cerr << "cuda_mem: no CUDA device " << idx << " (" << devcount << " found)" << std::endl;
+                    return false;
+                }
+                device_count = devcount;
+                cudaSetDevice((int)idx);
+                std::cerr << "cuda_mem: initialized CUDA device " << idx << std::endl;
+                return true;
+#else
+                (void)idx;
+                std::cerr << "cuda_mem: compiled without USE_CUDA; backend disabled" << std::endl;
+                return false;
+#endif
+            }
+
+            void bind(size_t idx) override
+            {
+#ifdef USE_CUDA
+                // The current device is per thread in the runtime as well
+                cudaSetDevice(idx < (size_t)device_count ? (int)idx : 0);
+#else
+                (void)idx;
+#endif
+            }
+
+            std::vector<std::string> list_devices() override
+            {
+                std::vector<std::string> out;
+#ifdef USE_CUDA
+                int devcount = 0;
+                if (cudaGetDeviceCount(&devcount) == cudaSuccess)
+                {
+                    for (int i = 0; i < devcount; ++i)
+                    {
+                        cudaDeviceProp prop;
+                        cudaGetDeviceProperties(&prop, i);
+                        out.push_back(std::string(prop.name));
+                    }
+                }
+#endif
+                return out;
+            }
+
+            size_t total_memory() override
+            {
+#ifdef USE_CUDA
+                size_t free_bytes = 0, total_bytes = 0;
+                if (cudaMemGetInfo(&free_bytes, &total_bytes) == cudaSuccess)
+                {
+                    return total_bytes;
+                }
+                // Fallback: try device properties
+                int dev = 0;
+                if (cudaGetDevice(&dev) == cudaSuccess)
+                {
+                    cudaDeviceProp prop;
+                    if (cudaGetDeviceProperties(&prop, dev) == cudaSuccess)
+                    {
+                        return (size_t)prop.totalGlobalMem;
+                    }
+                }
+#endif
+                return 0;
+            }
+
+            size_t free_memory() override
+            {
+#ifdef USE_CUDA
+                size_t free_bytes = 0, total_bytes = 0;
+                if (cudaMemGetInfo(&free_bytes, &total_bytes) == cudaSuccess)
+                    return free_bytes;
+#endif
+                return 0;
+            }
+
+            int numa_node() override
+            {
+#ifdef USE_CUDA
+                int dev = 0;
+                char bus_id[32];
+                if (cudaGetDevice(&dev) == cudaSuccess && cudaDeviceGetPCIBusId(bus_id, sizeof(bus_id), dev) == cudaSuccess)
+                    return pci_numa_node(bus_id);
+#endif
+                return -1;
+            }
+
+            void *device_alloc(size_t size) override
+            {
+#ifdef USE_CUDA
+                void *ptr = nullptr;
+                if (cudaMalloc(&ptr, size) == cudaSuccess)
+                    return ptr;
+#else
+                (void)size;
+#endif
+                return nullptr;
+            }
+
+            void device_free(void *ptr) override
+            {
+#ifdef USE_CUDA
+                cudaFree(ptr);
+#else
+                (void)ptr;
+#endif
+            }
+
+            void device_memset(void *ptr, int value, size_t size) override
+            {
+#ifdef USE_CUDA
+                cudaMemset(ptr, value, size);
+#else
+                (void)ptr;
+                (void)value;
+                (void)size;
+#endif
+            }
+
+            void *host_alloc(size_t size) override
+            {
+#ifdef USE_CUDA
+                void *ptr = nullptr;
+                // Portable: staging buffers may feed copies to any device
+                if (cudaHostAlloc(&ptr, size, cudaHostAllocPortable) == cudaSuccess)
+                    return ptr;
+#else
+                (void)size;
+#endif
+                return nullptr;
+            }
+
+            void host_free(void *ptr) override
+            {
+#ifdef USE_CUDA
+                cudaFreeHost(ptr);
+#else
+                (void)ptr;
+#endif
+            }
+
+            void copy_to_device(void *dst, const void *src, size_t size) override
+            {
+#ifdef USE_CUDA
+                cudaMemcpy(dst, src, size, cudaMemcpyHostToDevice);
+#else
+                (void)dst;
+                (void)src;
+                (void)size;
+#endif
+            }
+
+            void copy_to_host(void *dst, const void *src, size_t size) override
+            {
+#ifdef USE_CUDA
+                cudaMemcpy(dst, src, size, cudaMemcpyDeviceToHost);
+#else
+                (void)dst;
+                (void)src;
+                (void)size;
+#endif
+            }
+
+            stream_t stream_create() override
+            {
+#ifdef USE_CUDA
+                cudaStream_t stream = nullptr;
+                if (cudaStreamCreateWithFlags(&stream, cudaStreamNonBlocking) == cudaSuccess)
+                    return stream;
+#endif
+                return nullptr;
+            }
+
+            void stream_destroy(stream_t stream) override
+            {
+#ifdef USE_CUDA
+                cudaStreamDestroy(static_cast<cudaStream_t>(stream));
+#else
+                (void)stream;
+#endif
+            }
+
+            void stream_synchronize(stream_t stream) override
+            {
+#ifdef USE_CUDA
+                cudaStreamSynchronize(static_cast<cudaStream_t>(stream));
+#else
+                (void)stream;
+#endif
+            }
+
+            void copy_async(const copy_op *ops, size_t count, bool to_device, stream_t stream) override
+            {
+#ifdef USE_CUDA
+                cudaMemcpyKind kind = to_device ? cudaMemcpyHostToDevice : cudaMemcpyDeviceToHost;
+                for (size_t i = 0; i < count; ++i)
+                    cudaMemcpyAsync(ops[i].dst, ops[i].src, ops[i].size, kind, static_cast<cudaStream_t>(stream));
+#else
+                (void)ops;
+                (void)count;
+                (void)to_device;
+                (void)stream;
+#endif
+            }
+
+            void memset_async(void *ptr, int value, size_t size, stream_t stream) override
+            {
+#ifdef USE_CUDA
+                cudaMemsetAsync(ptr, value, size, static_cast<cudaStream_t>(stream));
+#else
+                (void)ptr;
+                (void)value;
+                (void)size;
+                (void)stream;
+#endif
+            }
+
+            event_t event_create() override
+            {
+#ifdef USE_CUDA
+                cudaEvent_t ev = nullptr;
+                if (cudaEventCreateWithFlags(&ev, cudaEventDisableTiming) == cudaSuccess)
+                    return ev;
+#endif
+                return nullptr;
+            }
+
+            void event_destroy(event_t event) override
+            {
+#ifdef USE_CUDA
+                cudaEventDestroy(static_cast<cudaEvent_t>(event));
+#else
+                (void)event;
+#endif
+            }
+
+            void event_record(event_t event, stream_t stream) override
+            {
+#ifdef USE_CUDA
+                cudaEventRecord(static_cast<cudaEvent_t>(event), static_cast<cudaStream_t>(stream));
+#else
+                (void)event;
+                (void)stream;
+#endif
+            }
+
+            void event_synchronize(event_t event) override
+            {
+#ifdef USE_CUDA
+                cudaEventSynchronize(static_cast<cudaEvent_t>(event));
+#else
+                (void)event;
+#endif
+            }
+
+            void stream_wait_event(stream_t stream, event_t event) override
+            {
+#ifdef USE_CUDA
+                cudaStreamWaitEvent(static_cast<cudaStream_t>(stream), static_cast<cudaEvent_t>(event), 0);
+#else
+                (void)stream;
+                (void)event;
+#endif
+            }
+
+            void synchronize() override
+            {
+#ifdef USE_CUDA
+                cudaDeviceSynchronize();
+#endif
+            }
+
+        private:
+            int device_count = 0;
+        };
+
+        std::unique_ptr<backend> make_cuda_backend()
+        {
+            return std::make_unique<cuda_backend>();
+        }
+    }
+}
@@ -1,202 +1,911 @@
 #include "cuda_memory.hpp"
+#include "free_list.hpp"
+#include "numa_topology.hpp"
+#include <algorithm>
+#include <condition_variable>
 #include <cstring>
+#include <deque>
 #include <iostream>
+#include <mutex>
 #include <thread>
 
-#ifdef USE_CUDA
-#include <cuda_runtime.h>
-#endif
-
 namespace vram
 {
     namespace cuda_mem
     {
-        static size_t device_idx = 0;
+        // Backend device indices to use; init() creates one device_state each
+        static std::vector<size_t> device_ids{0};
+
+        // Active device backend (created lazily, CUDA unless replaced)
+        static std::unique_ptr<backend> active_backend;
+
+        static std::atomic<size_t> pool_block_size{block::size};
+
+        // Bumped on shutdown so blocks outliving the pool don't return stale pointers
+        static std::atomic<uint64_t> pool_generation{0};
+
+        // Staging and stream settings, applied to every device
+        static int staging_limit = 256;
+        static int stream_count = 4;
+
+        // Threads are bound round-robin to a stream slot on first use
+        static std::atomic<size_t> next_stream{0};
+
+        // Asynchronous writes (and pipelined transfers) awaiting completion,
+        // in submission order
+        struct queued_write
+        {
+            event_t event = nullptr;
+            uint64_t seq = 0;
+            std::vector<void *> staging;
+            completion done; // pipelined transfers: run once reaped
+        };
+
+        // One device allocation and the table of blocks sliced from it. Once
+        // retired it hands out no more blocks and is freed when the last of
+        // its `live` blocks comes back.
+        struct slab
+        {
+            void *base = nullptr;
+            size_t bytes = 0;
+            size_t nblocks = 0;
+            std::unique_ptr<block[]> table;
+            bool retired = false;
+            size_t live = 0;
+
+            bool holds(const block *b) const { return b >= table.get() && b < table.get() + nblocks; }
+        };
 
-        // Device block pool: pointers to block-sized device addresses (may point into larger base allocations)
-        static std::vector<void *> device_pool;
-        static std::mutex device_pool_mutex;
+        // Everything one device owns. Devices share none of it, so transfers
+        // to different GPUs never contend on a lock or a reaper.
+        struct device_state
+        {
+            size_t id = 0; // backend device index
+            int node = -1;
+            std::vector<int> cpus; // CPUs of `node`, empty if unknown
+
+            // Device block pool: free blocks of the slabs' block tables, so
+            // allocating and freeing only touch the free list. The mutex
+            // guards the slabs and the totals.
+            free_list pool;
+            std::mutex pool_mutex;
+            size_t pool_total = 0;
+            std::vector<std::unique_ptr<slab>> slabs;
+            std::vector<slab *> retiring; // retired slabs with blocks still out
+            // Set while shrink_pool_on() holds every free block; an allocator
+            // finding the pool empty then looks again under the mutex
+            std::atomic<bool> resizing{false};
+
+            // Pinned host staging pool. The mutex guards growth and waiting
+            // for a buffer; taking and returning one is lock-free.
+            free_list staging_pool;
+            std::mutex staging_mutex;
+            std::condition_variable staging_cv;
+            std::atomic<int> staging_waiters{0};
+            // Every pinned buffer the pool has allocated, so shutdown can free them
+            std::vector<void *> staging_allocations;
 
-        // Track base allocations so they can be freed (not yet exposed via API)
-        static std::vector<void *> base_allocations;
+            // Stream pool
+            std::vector<stream_t> streams;
+            std::mutex streams_mutex;
+            std::atomic<bool> streams_ready{false};
 
-        // Pinned host staging pool
-        static std::vector<void *> staging_pool;
-        static std::mutex staging_pool_mutex;
+            // Recycled events
+            std::vector<event_t> event_pool;
+            std::vector<event_t> event_allocations;
+            std::mutex event_mutex;
 
-        static int staging_count = 0;
+            std::deque<queued_write> pending;
+            std::mutex pending_mutex;
+            std::condition_variable pending_cv;   // wakes the reaper
+            std::condition_variable completed_cv; // wakes drain()
+            uint64_t submitted_seq = 0;
+            // Every write with seq <= completed_seq has reached the device
+            std::atomic<uint64_t> completed_seq{0};
+            std::thread reaper;
+            bool reaper_stop = false;
+            // Stream slot of the next pipelined transfer
+            std::atomic<size_t> next_pipelined{0};
+        };
+
+        static std::vector<std::unique_ptr<device_state>> devices;
+
+        backend &current_backend()
+        {
+            if (!active_backend)
+                active_backend = make_cuda_backend();
+            return *active_backend;
+        }
+
+        void set_backend(std::unique_ptr<backend> b)
+        {
+            shutdown();
+            devices.clear();
+            active_backend = std::move(b);
+        }
+
+        bool select_backend(const std::string &name, const host_backend_config &cfg)
+        {
+            if (name == "cuda")
+                set_backend(make_cuda_backend());
+            else if (name == "host")
+                set_backend(make_host_backend(cfg));
+            else
+                return false;
+            return true;
+        }
 
         bool init()
         {
-#ifdef USE_CUDA
-            int devcount = 0;
-            if (cudaGetDeviceCount(&devcount) != cudaSuccess || devcount == 0)
+            backend &be = current_backend();
+            // A device listed twice would get two pools over the same memory
+            for (size_t i = 0; i < device_ids.size(); ++i)
             {
-                std::cerr << "cuda_mem: no CUDA devices found" << std::endl;
-                return false;
+                if (std::find(device_ids.begin(), device_ids.begin() + i, device_ids[i]) != device_ids.begin() + i)
+                {
+                    std::cerr << "cuda_mem: device " << device_ids[i] << " listed twice" << std::endl;
+                    return false;
+                }
+            }
+            bool same = devices.size() == device_ids.size();
+            for (size_t i = 0; same && i < devices.size(); ++i)
+                same = devices[i]->id == device_ids[i];
+            if (!same)
+            {
+                shutdown();
+                devices.clear();
+            }
+            for (size_t i = 0; i < device_ids.size(); ++i)
+            {
+                if (!be.init(device_ids[i]))
+                {
+                    devices.clear();
+                    return false;
+                }
+                if (i == devices.size())
+                {
+                    devices.push_back(std::make_unique<device_state>());
+                    device_state &d = *devices.back();
+                    d.id = device_ids[i];
+                    be.bind(d.id);
+                    d.node = be.numa_node();
+                    d.cpus = node_cpus(d.node);
+                }
             }
-            if (device_idx >= (size_t)devcount)
-                device_idx = 0;
-            cudaSetDevice((int)device_idx);
-            std::cerr << "cuda_mem: initialized CUDA device " << device_idx << std::endl;
             return true;
-#else
-            std::cerr << "cuda_mem: compiled without USE_CUDA; backend disabled" << std::endl;
-            return false;
-#endif
         }
 
-        void set_device(size_t idx) { device_idx = idx; }
+        void set_device(size_t idx) { set_devices({idx}); }
+
+        void set_devices(const std::vector<size_t> &ids)
+        {
+            if (!ids.empty())
+                device_ids = ids;
+        }
+
+        size_t device_count() { return devices.size(); }
+
+        int device_numa_node(size_t device)
+        {
+            return device < devices.size() ? devices[device]->node : -1;
+        }
 
         std::vector<std::string> list_devices()
         {
-            std::vector<std::string> out;
-#ifdef USE_CUDA
-            int devcount = 0;
-            if (cudaGetDeviceCount(&devcount) == cudaSuccess)
+            return current_backend().list_devices();
+        }
+
+        bool set_block_size(size_t size)
+        {
+            if (size < 4096 || size > block::size || (size & (size - 1)))
+                return false;
+            for (auto &d : devices)
             {
-                for (int i = 0; i < devcount; ++i)
-                {
-                    cudaDeviceProp prop;
-                    cudaGetDeviceProperties(&prop, i);
-                    out.push_back(std::string(prop.name));
-                }
+                std::lock_guard<std::mutex> lg(d->pool_mutex);
+                if (d->pool_total)
+                    return false;
             }
-#endif
-            return out;
+            pool_block_size.store(size);
+            return true;
         }
 
-        size_t increase_pool(size_t size_in_bytes)
+        size_t block_size()
         {
-#ifdef USE_CUDA
-            // Allocate device memory in larger chunks and slice them into
-            // block::size pieces. This avoids making one cudaMalloc per small
-            // block which is slow and can fragment the driver.
-            const size_t CHUNK_SIZE = 4 * 1024 * 1024; // 4 MiB chunks
-            size_t requested_blocks = (size_in_bytes + block::size - 1) / block::size;
-            if (requested_blocks == 0)
+            return pool_block_size.load();
+        }
+
+        size_t increase_pool_on(size_t device, size_t size_in_bytes, bool clear)
+        {
+            // Allocate device memory in large slabs and slice them into
+            // block_size() pieces: one device allocation per small block is
+            // slow and fragments the driver. A slab that doesn't fit is
+            // retried at half the size, down to MIN_CHUNK.
+            const size_t MAX_CHUNK = 64 * 1024 * 1024;
+            const size_t MIN_CHUNK = 4 * 1024 * 1024;
+            const size_t bsize = block_size();
+            size_t requested_blocks = (size_in_bytes + bsize - 1) / bsize;
+            if (requested_blocks == 0 || device >= devices.size())
                 return 0;
 
-            size_t total_bytes = requested_blocks * block::size;
-            size_t chunks = (total_bytes + CHUNK_SIZE - 1) / CHUNK_SIZE;
+            backend &be = current_backend();
+            device_state &d = *devices[device];
+            be.bind(d.id);
+            size_t total_bytes = requested_blocks * bsize;
+            size_t chunk = MAX_CHUNK;
             size_t allocated_blocks = 0;
 
-            for (size_t c = 0; c < chunks; ++c)
+            for (size_t done = 0; done < total_bytes;)
             {
-                size_t this_chunk_bytes = std::min(CHUNK_SIZE, total_bytes - c * CHUNK_SIZE);
-                void *base = nullptr;
-                cudaError_t err = cudaMalloc(&base, this_chunk_bytes);
-                if (err != cudaSuccess)
-                    break;
-                cudaMemset(base, 0, this_chunk_bytes);
+                size_t this_chunk_bytes = std::min(chunk, total_bytes - done);
+                void *base = be.device_alloc(this_chunk_bytes);
+                if (!base)
+                {
+                    if (this_chunk_bytes <= MIN_CHUNK)
+                        break;
+                    chunk = std::max(MIN_CHUNK, this_chunk_bytes / 2 / bsize * bsize);
+                    continue;
+                }
+                if (clear)
+                    be.device_memset(base, 0, this_chunk_bytes);
+                done += this_chunk_bytes;
 
-                // Record base allocation so we can free later
+                // Slice this chunk into a table of block-sized pieces
                 {
-                    std::lock_guard<std::mutex> lg(device_pool_mutex);
-                    base_allocations.push_back(base);
-                    // Slice this chunk into block-sized pointers
-                    size_t nblocks = this_chunk_bytes / block::size;
+                    std::lock_guard<std::mutex> lg(d.pool_mutex);
+                    size_t nblocks = this_chunk_bytes / bsize;
+                    block *table = new block[nblocks];
+                    auto s = std::make_unique<slab>();
+                    s->base = base;
+                    s->bytes = this_chunk_bytes;
+                    s->nblocks = nblocks;
+                    s->table.reset(table);
+                    d.slabs.push_back(std::move(s));
+                    std::vector<void *> slices(nblocks);
                     for (size_t i = 0; i < nblocks; ++i)
                     {
-                        char *p = static_cast<char *>(base) + i * block::size;
-                        device_pool.push_back(static_cast<void *>(p));
-                        ++allocated_blocks;
+                        table[i].impl = static_cast<char *>(base) + i * bsize;
+                        table[i].generation = pool_generation.load();
+                        table[i].dev = (uint32_t)device;
+                        slices[i] = &table[i];
                     }
+                    d.pool.add(slices.data(), nblocks);
+                    allocated_blocks += nblocks;
+                    d.pool_total += nblocks;
                 }
             }
 
-            return allocated_blocks * block::size;
-#else
-            (void)size_in_bytes;
-            return 0;
-#endif
+            return allocated_blocks * bsize;
+        }
+
+        size_t increase_pool(size_t size_in_bytes, bool clear)
+        {
+            // Weighted by device memory so mixed cards fill up evenly; the last
+            // device takes the rounding remainder
+            backend &be = current_backend();
+            const size_t bsize = block_size();
+            size_t blocks = (size_in_bytes + bsize - 1) / bsize;
+            std::vector<size_t> weight(devices.size());
+            size_t sum = 0;
+            for (size_t i = 0; i < devices.size(); ++i)
+            {
+                be.bind(devices[i]->id);
+                weight[i] = be.total_memory();
+                sum += weight[i];
+            }
+            size_t added = 0, left = blocks;
+            for (size_t i = 0; i < devices.size(); ++i)
+            {
+                size_t share = left;
+                if (i + 1 < devices.size())
+                    share = sum ? (size_t)((unsigned __int128)blocks * weight[i] / sum) : blocks / devices.size();
+                left -= share;
+                added += increase_pool_on(i, share * bsize, clear);
+            }
+            return added;
         }
 
         int pool_size()
         {
-#ifdef USE_CUDA
-            std::lock_guard<std::mutex> lg(device_pool_mutex);
-            return (int)device_pool.size();
-#else
-            return 0;
-#endif
+            int total = 0;
+            for (size_t i = 0; i < devices.size(); ++i)
+                total += pool_size(i);
+            return total;
         }
 
         int pool_available()
         {
-#ifdef USE_CUDA
-            std::lock_guard<std::mutex> lg(device_pool_mutex);
-            return (int)device_pool.size();
-#else
-            return 0;
-#endif
+            int total = 0;
+            for (size_t i = 0; i < devices.size(); ++i)
+                total += pool_available(i);
+            return total;
         }
 
-        bool init_staging_pool(int count)
+        int pool_size(size_t device)
         {
-#ifdef USE_CUDA
-            staging_count = count;
-            for (int i = 0; i < count; ++i)
+            if (device >= devices.size())
+                return 0;
+            std::lock_guard<std::mutex> lg(devices[device]->pool_mutex);
+            return (int)devices[device]->pool_total;
+        }
+
+        int pool_available(size_t device)
+        {
+            if (device >= devices.size())
+                return 0;
+            return (int)devices[device]->pool.available();
+        }
+
+        // Allocate one staging buffer on the device's NUMA node: pinned pages
+        // are placed where they are first touched, so the allocating thread
+        // runs on the node's CPUs meanwhile
+        static void *alloc_staging(backend &be, device_state &d)
+        {
+            cpu_binding on_node(d.cpus);
+            be.bind(d.id);
+            void *p = be.host_alloc(block::size);
+            if (p)
+                memset(p, 0, block::size);
+            return p;
+        }
+
+        bool init_staging_pool(int count, int max_count)
+        {
+            backend &be = current_backend();
+            staging_limit = std::max(count, max_count);
+            bool ok = !devices.empty();
+            for (auto &dp : devices)
             {
-                void *hostptr = nullptr;
-                if (cudaHostAlloc(&hostptr, block::size, cudaHostAllocDefault) != cudaSuccess)
+                device_state &d = *dp;
+                std::lock_guard<std::mutex> lg(d.staging_mutex);
+                std::vector<void *> fresh;
+                for (int i = 0; i < count; ++i)
                 {
-                    // cleanup
-                    std::lock_guard<std::mutex> lg(staging_pool_mutex);
-                    for (void *p : staging_pool)
-                        cudaFreeHost(p);
-                    staging_pool.clear();
-                    return false;
+                    void *hostptr = alloc_staging(be, d);
+                    if (!hostptr)
+                    {
+                        // cleanup
+                        for (void *p : fresh)
+                            be.host_free(p);
+                        return false;
+                    }
+                    fresh.push_back(hostptr);
                 }
-                staging_pool.push_back(hostptr);
+                d.staging_pool.add(fresh.data(), fresh.size());
+                d.staging_allocations.insert(d.staging_allocations.end(), fresh.begin(), fresh.end());
             }
-            return true;
-#else
-            (void)count;
-            return false;
-#endif
+            return ok;
         }
 
-        void shutdown_staging_pool()
+        // Grow the pool by one buffer unless it is at its limit. Caller holds
+        // d.staging_mutex.
+        static void *grow_staging_locked(device_state &d)
         {
-#ifdef USE_CUDA
-            std::lock_guard<std::mutex> lg(staging_pool_mutex);
-            for (void *p : staging_pool)
+            if ((int)d.staging_allocations.size() >= staging_limit)
+                return nullptr;
+            void *p = alloc_staging(current_backend(), d);
+            if (p)
+                d.staging_allocations.push_back(p);
+            return p;
+        }
+
+        // Take a free staging buffer, growing the pool up to its limit.
+        // Returns nullptr if the pool is exhausted.
+        static void *try_acquire_staging(device_state &d)
+        {
+            void *p = d.staging_pool.get();
+            if (p)
+                return p;
+            std::lock_guard<std::mutex> lg(d.staging_mutex);
+            return grow_staging_locked(d);
+        }
+
+        // Blocking variant: waits for the reaper to return a buffer. Returns
+        // nullptr only if the backend can't provide pinned memory at all.
+        static void *acquire_staging(device_state &d)
+        {
+            void *p = d.staging_pool.get();
+            if (p)
+                return p;
+            std::unique_lock<std::mutex> lk(d.staging_mutex);
+            // Announce the wait before the last look, so a release racing
+            // with it either is seen here or sees us and notifies
+            d.staging_waiters.fetch_add(1);
+            for (;;)
             {
-                cudaFreeHost(p);
+                p = d.staging_pool.get();
+                if (!p)
+                    p = grow_staging_locked(d);
+                if (p || d.staging_allocations.empty())
+                    break;
+                d.staging_cv.wait(lk);
             }
-            staging_pool.clear();
-#endif
+            d.staging_waiters.fetch_sub(1);
+            return p;
         }
 
-        block_ref allocate()
+        static void release_staging(device_state &d, const std::vector<void *> &buffers)
         {
-#ifdef USE_CUDA
-            std::lock_guard<std::mutex> lg(device_pool_mutex);
-            if (device_pool.empty())
+            for (void *p : buffers)
+                d.staging_pool.put(p);
+            if (!buffers.empty() && d.staging_waiters.load())
+            {
+                std::lock_guard<std::mutex> lg(d.staging_mutex);
+                d.staging_cv.notify_all();
+            }
+        }
+
+        // Device state of the device `blk` lives on (the first one for nullptr)
+        static device_state *device_of(const block *blk)
+        {
+            size_t i = blk ? blk->device() : 0;
+            return i < devices.size() ? devices[i].get() : nullptr;
+        }
+
+        void *acquire_staging_buffer(bool wait, const block *near)
+        {
+            device_state *d = device_of(near);
+            if (!d)
                 return nullptr;
-            void *devptr = device_pool.back();
-            device_pool.pop_back();
-            return std::make_shared<block>(devptr);
-#else
-            return nullptr;
-#endif
+            return wait ? acquire_staging(*d) : try_acquire_staging(*d);
         }
 
-        // block implementation
-        block::block(void *device_ptr) : impl(device_ptr) {}
+        void release_staging_buffer(void *buf, const block *near)
+        {
+            device_state *d = device_of(near);
+            if (buf && d)
+                release_staging(*d, std::vector<void *>(1, buf));
+        }
+
+        void shutdown_staging_pool()
+        {
+            if (!active_backend)
+                return;
+            drain();
+            for (auto &dp : devices)
+            {
+                std::lock_guard<std::mutex> lg(dp->staging_mutex);
+                for (void *p : dp->staging_allocations)
+                {
+                    active_backend->host_free(p);
+                }
+                dp->staging_allocations.clear();
+                dp->staging_pool.clear();
+            }
+        }
+
+        static bool init_streams_on(backend &be, device_state &d, int count)
+        {
+            be.bind(d.id);
+            std::lock_guard<std::mutex> lg(d.streams_mutex);
+            for (stream_t st : d.streams)
+            {
+                be.stream_synchronize(st);
+                be.stream_destroy(st);
+            }
+            d.streams.clear();
+            for (int i = 0; i < count; ++i)
+            {
+                stream_t st = be.stream_create();
+                if (!st)
+                    break;
+                d.streams.push_back(st);
+            }
+            d.streams_ready.store(!d.streams.empty(), std::memory_order_release);
+            return !d.streams.empty();
+        }
+
+        bool init_streams(int count)
+        {
+            if (count <= 0)
+                return false;
+            backend &be = current_backend();
+            stream_count = count;
+            bool ok = !devices.empty();
+            for (auto &dp : devices)
+                ok = init_streams_on(be, *dp, count) && ok;
+            return ok;
+        }
+
+        // Make `d` current for the calling thread and return its stream in
+        // `slot` (modulo the device's stream count)
+        static stream_t enter_device(backend &be, device_state &d, size_t slot)
+        {
+            if (!d.streams_ready.load(std::memory_order_acquire))
+            {
+                bool empty;
+                {
+                    std::lock_guard<std::mutex> lg(d.streams_mutex);
+                    empty = d.streams.empty();
+                }
+                if (empty)
+                    init_streams_on(be, d, stream_count);
+            }
+            be.bind(d.id);
+            std::lock_guard<std::mutex> lg(d.streams_mutex);
+            return d.streams.empty() ? nullptr : d.streams[slot % d.streams.size()];
+        }
+
+        // The calling thread's stream on `d` (threads are spread round-robin)
+        static stream_t enter_device(backend &be, device_state &d)
+        {
+            static thread_local size_t slot = next_stream.fetch_add(1, std::memory_order_relaxed);
+            return enter_device(be, d, slot);
+        }
+
+        // Events are created on the device that is current (see enter_device)
+        static event_t acquire_event(device_state &d)
+        {
+            {
+                std::lock_guard<std::mutex> lg(d.event_mutex);
+                if (!d.event_pool.empty())
+                {
+                    event_t ev = d.event_pool.back();
+                    d.event_pool.pop_back();
+                    return ev;
+                }
+            }
+            event_t ev = current_backend().event_create();
+            std::lock_guard<std::mutex> lg(d.event_mutex);
+            d.event_allocations.push_back(ev);
+            return ev;
+        }
+
+        static void release_event(device_state &d, event_t ev)
+        {
+            std::lock_guard<std::mutex> lg(d.event_mutex);
+            d.event_pool.push_back(ev);
+        }
+
+        // Completion reaper: waits on one device's pending writes in
+        // submission order, returns their staging buffers and events, and
+        // advances its completed_seq
+        static void reap_pending(device_state *d)
+        {
+            backend &be = current_backend();
+            // It returns buffers and events to node-local pools; keep it there
+            if (!d->cpus.empty())
+                pin_thread(d->cpus);
+            std::unique_lock<std::mutex> lk(d->pending_mutex);
+            for (;;)
+            {
+                d->pending_cv.wait(lk, [d]
+                                   { return d->reaper_stop || !d->pending.empty(); });
+                if (d->pending.empty())
+                    return;
+                event_t ev = d->pending.front().event;
+                lk.unlock();
+                be.event_synchronize(ev);
+                lk.lock();
+                // Callbacks run before drain() can count the transfer as done
+                if (d->pending.front().done)
+                {
+                    completion cb = std::move(d->pending.front().done);
+                    lk.unlock();
+                    cb();
+                    lk.lock();
+                }
+                queued_write done = std::move(d->pending.front());
+                d->pending.pop_front();
+                // Buffers go back first so that after drain() the staging
+                // pool is idle and can be torn down
+                lk.unlock();
+                release_staging(*d, done.staging);
+                lk.lock();
+                d->completed_seq.store(done.seq, std::memory_order_release);
+                lk.unlock();
+                release_event(*d, ev);
+                d->completed_cv.notify_all();
+                lk.lock();
+            }
+        }
+
+        static void stop_reaper(device_state &d)
+        {
+            {
+                std::lock_guard<std::mutex> lg(d.pending_mutex);
+                if (!d.reaper.joinable())
+                    return;
+                d.reaper_stop = true;
+            }
+            d.pending_cv.notify_all();
+            d.reaper.join();
+            d.reaper_stop = false;
+        }
+
+        void drain()
+        {
+            for (auto &dp : devices)
+            {
+                device_state &d = *dp;
+                std::unique_lock<std::mutex> lk(d.pending_mutex);
+                uint64_t target = d.submitted_seq;
+                d.completed_cv.wait(lk, [&d, target]
+                                    { return d.completed_seq.load(std::memory_order_relaxed) >= target; });
+            }
+        }
+
+        size_t pending_writes(size_t device)
+        {
+            if (device >= devices.size())
+                return 0;
+            device_state &d = *devices[device];
+            std::lock_guard<std::mutex> lg(d.pending_mutex);
+            return d.submitted_seq - d.completed_seq.load(std::memory_order_relaxed);
+        }
+
+        size_t pending_writes()
+        {
+            size_t most = 0;
+            for (size_t i = 0; i < devices.size(); ++i)
+                most = std::max(most, pending_writes(i));
+            return most;
+        }
+
+        void wait_pending(size_t device, size_t limit)
+        {
+            if (device >= devices.size())
+                return;
+            device_state &d = *devices[device];
+            std::unique_lock<std::mutex> lk(d.pending_mutex);
+            if (d.submitted_seq <= limit)
+                return;
+            uint64_t target = d.submitted_seq - limit;
+            d.completed_cv.wait(lk, [&d, target]
+                                { return d.completed_seq.load(std::memory_order_relaxed) >= target; });
+        }
+
+        void wait_pending(size_t limit)
+        {
+            for (size_t i = 0; i < devices.size(); ++i)
+                wait_pending(i, limit);
+        }
+
+        // Compressed-storage carriers live in pool blocks (packed_store.cpp)
+        void drop_packed();
 
-        block::~block()
+        void shutdown()
         {
-#ifdef USE_CUDA
-            // Return device pointer to pool for reuse
-            if (impl)
+            if (!active_backend)
+                return;
+            drop_packed();
+            shutdown_staging_pool();
+            for (auto &dp : devices)
             {
-                std::lock_guard<std::mutex> lg(device_pool_mutex);
-                device_pool.push_back(impl);
+                device_state &d = *dp;
+                stop_reaper(d);
+                active_backend->bind(d.id);
+                {
+                    std::lock_guard<std::mutex> lg(d.streams_mutex);
+                    for (stream_t st : d.streams)
+                        active_backend->stream_destroy(st);
+                    d.streams.clear();
+                    d.streams_ready.store(false, std::memory_order_release);
+                }
+                {
+                    std::lock_guard<std::mutex> lg(d.event_mutex);
+                    for (event_t ev : d.event_allocations)
+                        active_backend->event_destroy(ev);
+                    d.event_allocations.clear();
+                    d.event_pool.clear();
+                }
+                std::lock_guard<std::mutex> lg(d.pool_mutex);
+                for (auto &s : d.slabs)
+                    active_backend->device_free(s->base);
+                d.pool.clear();
+                d.slabs.clear();
+                d.retiring.clear();
+                d.pool_total = 0;
             }
-#endif
-            impl = nullptr;
+            ++pool_generation;
+        }
+
+        // Free a retired slab whose blocks are all back. Caller holds d.pool_mutex.
+        static void free_slab_locked(device_state &d, slab *s)
+        {
+            backend &be = current_backend();
+            be.bind(d.id);
+            be.device_free(s->base);
+            d.retiring.erase(std::find(d.retiring.begin(), d.retiring.end(), s));
+            d.slabs.erase(std::find_if(d.slabs.begin(), d.slabs.end(), [s](const std::unique_ptr<slab> &p)
+                                       { return p.get() == s; }));
+        }
+
+        // Count a block of a retired slab off and free the slab after its last
+        // one. Caller holds d.pool_mutex.
+        static void return_retired_locked(device_state &d, block *b)
+        {
+            for (slab *s : d.retiring)
+            {
+                if (!s->holds(b))
+                    continue;
+                if (--s->live == 0)
+                    free_slab_locked(d, s);
+                return;
+            }
+        }
+
+        static void return_retired(device_state &d, block *b)
+        {
+            std::lock_guard<std::mutex> lg(d.pool_mutex);
+            return_retired_locked(d, b);
+        }
+
+        size_t shrink_pool_on(size_t device, size_t size_in_bytes)
+        {
+            if (device >= devices.size() || size_in_bytes == 0)
+                return 0;
+            device_state &d = *devices[device];
+            std::lock_guard<std::mutex> lg(d.pool_mutex);
+            // Take every free block out to see how much of each slab is in use
+            d.resizing.store(true);
+            std::vector<block *> free_blocks;
+            while (block *b = static_cast<block *>(d.pool.get()))
+                free_blocks.push_back(b);
+
+            std::vector<slab *> order;
+            for (auto &s : d.slabs)
+                if (!s->retired)
+                    order.push_back(s.get());
+            std::sort(order.begin(), order.end(), [](const slab *a, const slab *b)
+                      { return a->table.get() < b->table.get(); });
+            std::vector<size_t> nfree(order.size());
+            std::vector<size_t> owner(free_blocks.size(), SIZE_MAX);
+            for (size_t j = 0; j < free_blocks.size(); ++j)
+            {
+                block *b = free_blocks[j];
+                auto it = std::upper_bound(order.begin(), order.end(), b, [](const block *p, const slab *s)
+                                           { return p < s->table.get(); });
+                if (it != order.begin() && (*(it - 1))->holds(b))
+                    ++nfree[owner[j] = it - order.begin() - 1];
+                else
+                    return_retired_locked(d, b); // released after an earlier shrink began
+            }
+
+            // Emptiest slabs first: they free the most memory for the least copying
+            std::vector<size_t> by_use(order.size());
+            for (size_t i = 0; i < by_use.size(); ++i)
+                by_use[i] = i;
+            std::sort(by_use.begin(), by_use.end(), [&](size_t a, size_t b)
+                      { return order[a]->nblocks - nfree[a] < order[b]->nblocks - nfree[b]; });
+            size_t retired = 0;
+            for (size_t k : by_use)
+            {
+                if (retired >= size_in_bytes)
+                    break;
+                slab *s = order[k];
+                s->retired = true;
+                s->live = s->nblocks - nfree[k];
+                for (size_t i = 0; i < s->nblocks; ++i)
+                    s->table[i].retiring.store(true, std::memory_order_release);
+                d.pool_total -= s->nblocks;
+                d.retiring.push_back(s);
+                retired += s->bytes;
+            }
+
+            // Free blocks of the slabs that stay go back
+            std::vector<void *> keep;
+            for (size_t j = 0; j < free_blocks.size(); ++j)
+                if (owner[j] != SIZE_MAX && !order[owner[j]]->retired)
+                    keep.push_back(free_blocks[j]);
+            d.pool.add(keep.data(), keep.size());
+            for (size_t i = d.retiring.size(); i-- > 0;)
+                if (d.retiring[i]->live == 0)
+                    free_slab_locked(d, d.retiring[i]);
+            d.resizing.store(false);
+            return retired;
+        }
+
+        size_t pool_retiring(size_t device)
+        {
+            if (device >= devices.size())
+                return 0;
+            std::lock_guard<std::mutex> lg(devices[device]->pool_mutex);
+            size_t bytes = 0;
+            for (slab *s : devices[device]->retiring)
+                bytes += s->bytes;
+            return bytes;
+        }
+
+        block *acquire_block(size_t device)
+        {
+            if (device >= devices.size())
+                return nullptr;
+            device_state &d = *devices[device];
+            block *b = static_cast<block *>(d.pool.get());
+            if (!b && d.resizing.load())
+            {
+                std::lock_guard<std::mutex> lg(d.pool_mutex);
+                b = static_cast<block *>(d.pool.get());
+            }
+            // A block released just as its slab retired can still turn up here
+            while (b && b->retired())
+            {
+                return_retired(d, b);
+                b = static_cast<block *>(d.pool.get());
+            }
+            return b;
+        }
+
+        block *acquire_block()
+        {
+            size_t best = 0;
+            int most = 0;
+            for (size_t i = 0; i < devices.size(); ++i)
+            {
+                int avail = pool_available(i);
+                if (avail > most)
+                {
+                    best = i;
+                    most = avail;
+                }
+            }
+            block *b = acquire_block(best);
+            // Lost a race for the last blocks there; take any device with room
+            for (size_t i = 0; !b && i < devices.size(); ++i)
+                b = acquire_block(i);
+            return b;
+        }
+
+        void release_block(block *b)
+        {
+            // Blocks of a pool that was shut down have nowhere to go
+            if (!b || !b->impl || b->generation != pool_generation.load())
+                return;
+            b->sync();
+            // Its event may be recycled for another block's write; the next
+            // owner starts with nothing to wait for
+            b->set_pending_write(nullptr, 0);
+            if (b->retired())
+                return_retired(*devices[b->dev], b);
+            else
+                devices[b->dev]->pool.put(b);
+        }
+
+        // The table outlives the reference unless the pool is shut down first,
+        // in which case the block must not be touched at all
+        static block_ref make_ref(block *b)
+        {
+            if (!b)
+                return nullptr;
+            uint64_t gen = pool_generation.load();
+            return block_ref(b, [gen](block *p)
+                             { if (gen == pool_generation.load()) release_block(p); });
+        }
+
+        block_ref allocate_on(size_t device)
+        {
+            return make_ref(acquire_block(device));
+        }
+
+        block_ref allocate()
+        {
+            return make_ref(acquire_block());
+        }
+
+        // block implementation
+        block::block(void *device_ptr, uint32_t device) : impl(device_ptr), generation(pool_generation.load()), dev(device) {}
+
+        event_t block::pending_write() const
+        {
+            uint64_t seq = write_seq.load(std::memory_order_acquire);
+            // Tokens of a pool that was shut down are meaningless
+            if (seq == 0 || generation != pool_generation.load() ||
+                seq <= devices[dev]->completed_seq.load(std::memory_order_acquire))
+                return nullptr;
+            // The event may be recycled for a newer write once reaped; waiting
+            // on it then waits a little longer but is never too early.
+            return write_event.load(std::memory_order_relaxed);
+        }
+
+        void block::set_pending_write(event_t event, uint64_t seq)
+        {
+            write_event.store(event, std::memory_order_relaxed);
+            write_seq.store(seq, std::memory_order_release);
+        }
+
+        bool block::on_device(const segment &s, size_t device)
+        {
+            return s.blk && s.blk->impl && s.blk->dev == device;
         }
 
         void block::read(off_t offset, size_t sz, void *data) const
@@ -206,103 +915,403 @@ namespace vram
                 memset(data, 0, sz);
                 return;
             }
-#ifdef USE_CUDA
+            backend &be = current_backend();
+            event_t ev = pending_write();
+            if (ev)
+                be.event_synchronize(ev);
+            be.bind(devices[dev]->id);
             const char *src = static_cast<const char *>(impl) + offset;
-            cudaMemcpy(data, src, sz, cudaMemcpyDeviceToHost);
-#else
-            memset(data, 0, sz);
-#endif
+            be.copy_to_host(data, src, sz);
         }
 
         void block::write(off_t offset, size_t sz, const void *data, bool async)
         {
             if (!impl)
                 return;
-#ifdef USE_CUDA
+            segment seg{this, offset, sz, const_cast<void *>(data)};
+            if (async)
+            {
+                write_batch_async(&seg, 1);
+                return;
+            }
+            sync();
+            backend &be = current_backend();
+            be.bind(devices[dev]->id);
             char *dst = static_cast<char *>(impl) + offset;
-            if (!async)
+            be.copy_to_device(dst, data, sz);
+        }
+
+        void block::sync()
+        {
+            event_t ev = pending_write();
+            if (ev)
+                current_backend().event_synchronize(ev);
+        }
+
+        // Order the next copies on `stream` after any pending write to `blk`
+        static void order_after_pending(backend &be, stream_t stream, const block *blk)
+        {
+            event_t ev = blk->pending_write();
+            if (ev)
+                be.stream_wait_event(stream, ev);
+        }
+
+        // Per-thread op lists reused across batches to keep the I/O path free of allocations
+        static thread_local std::vector<copy_op> batch_ops;
+
+        // Add a copy to `ops`, extending the previous one when both ends
+        // continue it (neighbouring blocks of a slab read into or written
+        // from one buffer become a single transfer)
+        static void append_op(std::vector<copy_op> &ops, void *dst, const void *src, size_t size)
+        {
+            if (!ops.empty())
             {
-                cudaMemcpy(dst, data, sz, cudaMemcpyHostToDevice);
+                copy_op &last = ops.back();
+                if (static_cast<char *>(last.dst) + last.size == dst && static_cast<const char *>(last.src) + last.size == src)
+                {
+                    last.size += size;
+                    return;
+                }
             }
-            else
+            ops.push_back({dst, src, size});
+        }
+        static thread_local std::vector<block *> op_blocks;
+        static thread_local std::vector<stream_t> batch_streams;
+
+        // Batches are split by device and each part is issued on that device's
+        // stream before any is waited for, so a request striped over several
+        // GPUs uses all their links at once.
+        void read_batch(const segment *segs, size_t count)
+        {
+            for (size_t i = 0; i < count; ++i)
+                if (!segs[i].blk || !segs[i].blk->impl)
+                    memset(segs[i].data, 0, segs[i].size);
+            backend &be = current_backend();
+            batch_streams.clear();
+            for (size_t d = 0; d < devices.size(); ++d)
             {
-                // Try to obtain a pinned staging buffer
-                void *staging = nullptr;
+                batch_ops.clear();
+                for (size_t i = 0; i < count; ++i)
                 {
-                    std::lock_guard<std::mutex> lg(staging_pool_mutex);
-                    if (!staging_pool.empty())
-                    {
-                        staging = staging_pool.back();
-                        staging_pool.pop_back();
-                    }
+                    const segment &s = segs[i];
+                    if (block::on_device(s, d))
+                        append_op(batch_ops, s.data, static_cast<const char *>(s.blk->impl) + s.offset, s.size);
                 }
+                if (batch_ops.empty())
+                    continue;
+                stream_t stream = enter_device(be, *devices[d]);
+                for (size_t i = 0; i < count; ++i)
+                    if (block::on_device(segs[i], d))
+                        order_after_pending(be, stream, segs[i].blk);
+                be.copy_async(batch_ops.data(), batch_ops.size(), false, stream);
+                batch_streams.push_back(stream);
+            }
+            for (stream_t stream : batch_streams)
+                be.stream_synchronize(stream);
+        }
 
-                if (!staging)
+        void write_batch(const segment *segs, size_t count)
+        {
+            backend &be = current_backend();
+            batch_streams.clear();
+            for (size_t d = 0; d < devices.size(); ++d)
+            {
+                batch_ops.clear();
+                for (size_t i = 0; i < count; ++i)
                 {
-                    // allocate a temporary pinned buffer
-                    if (cudaHostAlloc(&staging, block::size, cudaHostAllocDefault) != cudaSuccess)
-                    {
-                        // fallback to synchronous copy
-                        cudaMemcpy(dst, data, sz, cudaMemcpyHostToDevice);
-                        return;
-                    }
+                    const segment &s = segs[i];
+                    if (block::on_device(s, d))
+                        append_op(batch_ops, static_cast<char *>(s.blk->impl) + s.offset, s.data, s.size);
                 }
+                if (batch_ops.empty())
+                    continue;
+                stream_t stream = enter_device(be, *devices[d]);
+                for (size_t i = 0; i < count; ++i)
+                    if (block::on_device(segs[i], d))
+                        order_after_pending(be, stream, segs[i].blk);
+                be.copy_async(batch_ops.data(), batch_ops.size(), true, stream);
+                batch_streams.push_back(stream);
+            }
+            for (stream_t stream : batch_streams)
+                be.stream_synchronize(stream);
+            // The streams waited for any earlier async write, so nothing is pending now
+            for (size_t i = 0; i < count; ++i)
+                if (segs[i].blk && segs[i].blk->impl)
+                    segs[i].blk->set_pending_write(nullptr, 0);
+        }
+
+        // Queue the work just issued on `stream` as one pending write of `d`;
+        // returns its completion token for the caller to hand to the blocks involved
+        static event_t submit_write(backend &be, device_state &d, stream_t stream, queued_write &op, uint64_t &seq)
+        {
+            op.event = acquire_event(d);
+            be.event_record(op.event, stream);
+            event_t ev = op.event;
+            {
+                std::lock_guard<std::mutex> lg(d.pending_mutex);
+                seq = op.seq = ++d.submitted_seq;
+                d.pending.push_back(std::move(op));
+                if (!d.reaper.joinable())
+                    d.reaper = std::thread(reap_pending, &d);
+            }
+            d.pending_cv.notify_one();
+            op = queued_write();
+            return ev;
+        }
 
-                // copy into pinned buffer then async copy to device
-                memcpy(staging, data, sz);
+        void write_batch_async(const segment *segs, size_t count)
+        {
+            backend &be = current_backend();
+            for (size_t di = 0; di < devices.size(); ++di)
+            {
+                size_t first = 0;
+                while (first < count && !block::on_device(segs[first], di))
+                    ++first;
+                if (first == count)
+                    continue;
+                device_state &d = *devices[di];
+                stream_t stream = enter_device(be, d);
 
-                cudaStream_t stream;
-                cudaStreamCreateWithFlags(&stream, cudaStreamNonBlocking);
-                cudaMemcpyAsync(dst, staging, sz, cudaMemcpyHostToDevice, stream);
+                // Writes to one block must land in order, but consecutive writes
+                // may sit on different streams; queue ours behind earlier ones.
+                // Callers serialize writers per block, so nothing new can start.
+                for (size_t i = first; i < count; ++i)
+                    if (block::on_device(segs[i], di))
+                        order_after_pending(be, stream, segs[i].blk);
 
-                // record an event and launch a small cleanup thread to return staging
-                cudaEvent_t ev;
-                cudaEventCreateWithFlags(&ev, cudaEventDisableTiming);
-                cudaEventRecord(ev, stream);
+                queued_write op;
+                batch_ops.clear();
+                op_blocks.clear();
+                // Queue what has been staged so far as one pending write
+                auto submit = [&]()
+                {
+                    if (batch_ops.empty())
+                        return;
+                    be.copy_async(batch_ops.data(), batch_ops.size(), true, stream);
+                    uint64_t seq;
+                    event_t ev = submit_write(be, d, stream, op, seq);
+                    // Each block now carries this write as its completion token
+                    for (block *b : op_blocks)
+                        b->set_pending_write(ev, seq);
+                    batch_ops.clear();
+                    op_blocks.clear();
+                };
 
-                std::thread([staging, ev]() mutable
-                            {
-                    cudaEventSynchronize(ev);
-                    cudaEventDestroy(ev);
-                    // return staging to pool
-                    std::lock_guard<std::mutex> lg(staging_pool_mutex);
-                    staging_pool.push_back(staging); })
-                    .detach();
+                // Segments are packed back to back into staging buffers, so small
+                // blocks don't each take a whole buffer
+                char *staging = nullptr;
+                size_t used = block::size;
+                for (size_t i = first; i < count; ++i)
+                {
+                    const segment &s = segs[i];
+                    if (!block::on_device(s, di))
+                        continue;
+                    char *dst = static_cast<char *>(s.blk->impl) + s.offset;
+                    if (block::size - used < s.size)
+                    {
+                        staging = static_cast<char *>(try_acquire_staging(d));
+                        if (!staging)
+                        {
+                            // Pool exhausted: hand over what we hold so the reaper
+                            // can recycle it, then wait for a buffer
+                            submit();
+                            staging = static_cast<char *>(acquire_staging(d));
+                            be.bind(d.id);
+                        }
+                        if (!staging)
+                        {
+                            // No pinned memory at all; fall back to a synchronous
+                            // copy. It isn't ordered with the streams, so let the
+                            // block's queued writes (just submitted) land first.
+                            s.blk->sync();
+                            be.copy_to_device(dst, s.data, s.size);
+                            used = block::size;
+                            continue;
+                        }
+                        op.staging.push_back(staging);
+                        used = 0;
+                    }
+                    memcpy(staging + used, s.data, s.size);
+                    append_op(batch_ops, dst, staging + used, s.size);
+                    used += s.size;
+                    op_blocks.push_back(s.blk);
+                }
+                submit();
+            }
+        }
 
-                cudaStreamDestroy(stream);
+        void write_staged_async(const segment *segs, size_t count, void *const *buffers, size_t nbuffers)
+        {
+            backend &be = current_backend();
+            // Hand each buffer to the reaper of the device its segments go to
+            static thread_local std::vector<size_t> owner;
+            owner.assign(nbuffers, 0);
+            for (size_t i = 0, b = 0; i < count && b < nbuffers; ++i)
+            {
+                const char *data = static_cast<const char *>(segs[i].data);
+                while (b < nbuffers && (data < buffers[b] || data >= static_cast<const char *>(buffers[b]) + block::size))
+                    ++b;
+                if (b < nbuffers && segs[i].blk)
+                    owner[b] = segs[i].blk->device();
+            }
+            for (size_t di = 0; di < devices.size(); ++di)
+            {
+                device_state &d = *devices[di];
+                queued_write op;
+                for (size_t b = 0; b < nbuffers; ++b)
+                    if (owner[b] == di)
+                        op.staging.push_back(buffers[b]);
+                batch_ops.clear();
+                op_blocks.clear();
+                for (size_t i = 0; i < count; ++i)
+                {
+                    const segment &s = segs[i];
+                    if (!block::on_device(s, di))
+                        continue;
+                    append_op(batch_ops, static_cast<char *>(s.blk->impl) + s.offset, s.data, s.size);
+                    op_blocks.push_back(s.blk);
+                }
+                if (batch_ops.empty())
+                {
+                    release_staging(d, op.staging);
+                    continue;
+                }
+                stream_t stream = enter_device(be, d);
+                for (block *b : op_blocks)
+                    order_after_pending(be, stream, b);
+                be.copy_async(batch_ops.data(), batch_ops.size(), true, stream);
+                uint64_t seq;
+                event_t ev = submit_write(be, d, stream, op, seq);
+                for (block *b : op_blocks)
+                    b->set_pending_write(ev, seq);
             }
-#endif
         }
 
-        void block::sync()
+        void zero_batch_async(const segment *segs, size_t count)
         {
-#ifdef USE_CUDA
-            cudaDeviceSynchronize();
-#endif
+            backend &be = current_backend();
+            for (size_t di = 0; di < devices.size(); ++di)
+            {
+                device_state &d = *devices[di];
+                stream_t stream = nullptr;
+                op_blocks.clear();
+                for (size_t i = 0; i < count; ++i)
+                {
+                    const segment &s = segs[i];
+                    if (!block::on_device(s, di))
+                        continue;
+                    if (!stream)
+                        stream = enter_device(be, d);
+                    order_after_pending(be, stream, s.blk);
+                    be.memset_async(static_cast<char *>(s.blk->impl) + s.offset, 0, s.size, stream);
+                    op_blocks.push_back(s.blk);
+                }
+                if (op_blocks.empty())
+                    continue;
+                queued_write op;
+                uint64_t seq;
+                event_t ev = submit_write(be, d, stream, op, seq);
+                for (block *b : op_blocks)
+                    b->set_pending_write(ev, seq);
+            }
         }
 
-        size_t total_device_memory()
+        void block::pipeline(const segment *segs, size_t count, bool to_device, completion done)
         {
-#ifdef USE_CUDA
-            size_t free_bytes = 0, total_bytes = 0;
-            if (cudaMemGetInfo(&free_bytes, &total_bytes) == cudaSuccess)
+            if (!to_device)
+                for (size_t i = 0; i < count; ++i)
+                    if (!segs[i].blk || !segs[i].blk->impl)
+                        memset(segs[i].data, 0, segs[i].size);
+            // `done` runs after the last device's part is reaped
+            size_t parts = 0;
+            for (size_t di = 0; di < devices.size(); ++di)
+                parts += std::any_of(segs, segs + count, [di](const segment &s)
+                                     { return on_device(s, di); });
+            if (!parts)
             {
-                return total_bytes;
+                if (done)
+                    done();
+                return;
             }
-            // Fallback: try device properties
-            int devcount = 0;
-            if (cudaGetDeviceCount(&devcount) == cudaSuccess && devcount > 0)
+            auto left = std::make_shared<std::atomic<size_t>>(parts);
+            backend &be = current_backend();
+            for (size_t di = 0; di < devices.size(); ++di)
             {
-                cudaDeviceProp prop;
-                if (cudaGetDeviceProperties(&prop, (int)device_idx) == cudaSuccess)
+                batch_ops.clear();
+                op_blocks.clear();
+                for (size_t i = 0; i < count; ++i)
                 {
-                    return (size_t)prop.totalGlobalMem;
+                    const segment &s = segs[i];
+                    if (!on_device(s, di))
+                        continue;
+                    char *dev_ptr = static_cast<char *>(s.blk->impl) + s.offset;
+                    if (to_device)
+                        append_op(batch_ops, dev_ptr, s.data, s.size);
+                    else
+                        append_op(batch_ops, s.data, dev_ptr, s.size);
+                    op_blocks.push_back(s.blk);
                 }
+                if (batch_ops.empty())
+                    continue;
+                device_state &d = *devices[di];
+                stream_t stream = enter_device(be, d, d.next_pipelined.fetch_add(1, std::memory_order_relaxed));
+                for (block *b : op_blocks)
+                    order_after_pending(be, stream, b);
+                be.copy_async(batch_ops.data(), batch_ops.size(), to_device, stream);
+                queued_write op;
+                op.done = [left, done]
+                {
+                    if (left->fetch_sub(1, std::memory_order_acq_rel) == 1 && done)
+                        done();
+                };
+                uint64_t seq;
+                event_t ev = submit_write(be, d, stream, op, seq);
+                if (to_device)
+                    for (block *b : op_blocks)
+                        b->set_pending_write(ev, seq);
             }
-            return 0;
-#else
-            return 0;
-#endif
+        }
+
+        void read_batch_async(const segment *segs, size_t count, completion done)
+        {
+            block::pipeline(segs, count, false, std::move(done));
+        }
+
+        void write_batch_async(const segment *segs, size_t count, completion done)
+        {
+            block::pipeline(segs, count, true, std::move(done));
+        }
+
+        size_t total_device_memory()
+        {
+            backend &be = current_backend();
+            if (devices.empty())
+                return be.total_memory();
+            size_t total = 0;
+            for (auto &dp : devices)
+            {
+                be.bind(dp->id);
+                total += be.total_memory();
+            }
+            return total;
+        }
+
+        size_t total_device_memory(size_t device)
+        {
+            if (device >= devices.size())
+                return 0;
+            backend &be = current_backend();
+            be.bind(devices[device]->id);
+            return be.total_memory();
+        }
+
+        size_t free_device_memory(size_t device)
+        {
+            if (device >= devices.size())
+                return 0;
+            backend &be = current_backend();
+            be.bind(devices[device]->id);
+            return be.free_memory();
         }
     }
 }
@@ -0,0 +1,101 @@
+#include "fill_detect.hpp"
+#include <cstring>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+namespace vram
+{
+    // Buffers may be unaligned, so words are loaded with memcpy
+    static bool same_filled_scalar(const uint64_t *w, size_t n, uint64_t v)
+    {
+        for (size_t i = 0; i < n; ++i)
+        {
+            uint64_t x;
+            memcpy(&x, w + i, sizeof(x));
+            if (x != v)
+                return false;
+        }
+        return true;
+    }
+
+#if defined(__x86_64__)
+    __attribute__((target("avx2"))) static bool same_filled_avx2(const uint64_t *w, size_t n, uint64_t v)
+    {
+        const __m256i pattern = _mm256_set1_epi64x((long long)v);
+        size_t i = 0;
+        // 128 bytes per step; one test per step keeps the early exit cheap
+        for (; i + 16 <= n; i += 16)
+        {
+            __m256i a = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(w + i)), pattern);
+            __m256i b = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(w + i + 4)), pattern);
+            __m256i c = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(w + i + 8)), pattern);
+            __m256i d = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(w + i + 12)), pattern);
+            __m256i diff = _mm256_or_si256(_mm256_or_si256(a, b), _mm256_or_si256(c, d));
+            if (!_mm256_testz_si256(diff, diff))
+                return false;
+        }
+        return same_filled_scalar(w + i, n - i, v);
+    }
+
+    __attribute__((target("avx512f"))) static bool same_filled_avx512(const uint64_t *w, size_t n, uint64_t v)
+    {
+        const __m512i pattern = _mm512_set1_epi64((long long)v);
+        size_t i = 0;
+        for (; i + 16 <= n; i += 16)
+        {
+            __mmask8 a = _mm512_cmpneq_epi64_mask(_mm512_loadu_si512(w + i), pattern);
+            __mmask8 b = _mm512_cmpneq_epi64_mask(_mm512_loadu_si512(w + i + 8), pattern);
+            if (a | b)
+                return false;
+        }
+        return same_filled_scalar(w + i, n - i, v);
+    }
+#endif
+
+    typedef bool (*same_filled_fn)(const uint64_t *, size_t, uint64_t);
+
+    static same_filled_fn pick_same_filled()
+    {
+#if defined(__x86_64__)
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f"))
+            return same_filled_avx512;
+        if (__builtin_cpu_supports("avx2"))
+            return same_filled_avx2;
+#endif
+        return same_filled_scalar;
+    }
+
+    bool same_filled(const void *data, size_t size, uint64_t &word)
+    {
+        static const same_filled_fn impl = pick_same_filled();
+        uint64_t first;
+        memcpy(&first, data, sizeof(first));
+        // Cheap rejection before the vector loop: most data differs early
+        const uint64_t *w = static_cast<const uint64_t *>(data);
+        uint64_t last;
+        memcpy(&last, static_cast<const char *>(data) + size - 8, sizeof(last));
+        if (first != last || !impl(w, size / 8, first))
+            return false;
+        word = first;
+        return true;
+    }
+
+    void expand_fill(uint64_t word, size_t offset, size_t size, void *out)
+    {
+        char *dst = static_cast<char *>(out);
+        const char *pattern = reinterpret_cast<const char *>(&word);
+        // Leading bytes up to the next word boundary of the block
+        while (size && offset % 8)
+        {
+            *dst++ = pattern[offset++ % 8];
+            --size;
+        }
+        for (; size >= 8; size -= 8, dst += 8)
+            memcpy(dst, &word, 8);
+        for (size_t i = 0; i < size; ++i)
+            dst[i] = pattern[i];
+    }
+}
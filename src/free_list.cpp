@@ -0,0 +1,203 @@
+#include "free_list.hpp"
+#include <thread>
+#include <utility>
+
+namespace vram
+{
+    // Threads take slots round-robin; past SLOTS threads they share
+    static size_t thread_slot()
+    {
+        static std::atomic<size_t> next{0};
+        static thread_local size_t slot = next.fetch_add(1, std::memory_order_relaxed);
+        return slot;
+    }
+
+    free_list::free_list() : slots(new slot[SLOTS])
+    {
+        for (auto &c : chunks)
+            c.store(nullptr, std::memory_order_relaxed);
+    }
+
+    free_list::~free_list()
+    {
+        clear();
+    }
+
+    free_list::magazine &free_list::mag(uint32_t idx) const
+    {
+        // Chunk k holds FIRST_CHUNK << k magazines
+        size_t i = idx - 1;
+        size_t k = 63 - __builtin_clzll(i / FIRST_CHUNK + 1);
+        return chunks[k].load(std::memory_order_acquire)[i - FIRST_CHUNK * ((size_t(1) << k) - 1)];
+    }
+
+    uint32_t free_list::new_magazine()
+    {
+        std::lock_guard<std::mutex> lg(grow_mutex);
+        size_t i = nmagazines;
+        size_t k = 63 - __builtin_clzll(i / FIRST_CHUNK + 1);
+        if (k >= CHUNKS)
+            return 0;
+        if (!chunks[k].load(std::memory_order_relaxed))
+            chunks[k].store(new magazine[FIRST_CHUNK << k], std::memory_order_release);
+        return ++nmagazines;
+    }
+
+    void free_list::push(std::atomic<uint64_t> &head, uint32_t idx)
+    {
+        magazine &m = mag(idx);
+        uint64_t old = head.load(std::memory_order_relaxed);
+        uint64_t top;
+        do
+        {
+            m.next.store((uint32_t)old, std::memory_order_relaxed);
+            top = ((old >> 32) + 1) << 32 | idx;
+        } while (!head.compare_exchange_weak(old, top, std::memory_order_release, std::memory_order_relaxed));
+    }
+
+    uint32_t free_list::pop(std::atomic<uint64_t> &head)
+    {
+        uint64_t old = head.load(std::memory_order_acquire);
+        while (uint32_t idx = (uint32_t)old)
+        {
+            // `next` may be stale if idx was popped meanwhile; the tag makes the CAS fail then
+            uint64_t top = ((old >> 32) + 1) << 32 | mag(idx).next.load(std::memory_order_relaxed);
+            if (head.compare_exchange_weak(old, top, std::memory_order_acquire, std::memory_order_acquire))
+                return idx;
+        }
+        return 0;
+    }
+
+    // Put a magazine back into an empty cache slot, or into the depot if a
+    // thread sharing the slot refilled it meanwhile
+    void free_list::stash(std::atomic<uint32_t> &to, uint32_t idx)
+    {
+        if (!idx)
+            return;
+        uint32_t expected = 0;
+        if (!to.compare_exchange_strong(expected, idx, std::memory_order_release, std::memory_order_relaxed))
+            push(mag(idx).count ? full : empty, idx);
+    }
+
+    // Depot is dry: take a non-empty magazine from any thread's cache
+    uint32_t free_list::steal()
+    {
+        for (size_t i = 0; i < SLOTS; ++i)
+        {
+            for (std::atomic<uint32_t> *s : {&slots[i].loaded, &slots[i].previous})
+            {
+                if (!s->load(std::memory_order_relaxed))
+                    continue;
+                uint32_t idx = s->exchange(0, std::memory_order_acquire);
+                if (!idx)
+                    continue;
+                if (mag(idx).count)
+                    return idx;
+                push(empty, idx);
+            }
+        }
+        return pop(full);
+    }
+
+    void *free_list::get()
+    {
+        if (avail.fetch_sub(1) <= 0)
+        {
+            avail.fetch_add(1);
+            return nullptr;
+        }
+        // A pointer is reserved for us; it may only be in flight between
+        // another thread's cache and the depot, so keep looking until found
+        slot &s = slots[thread_slot() % SLOTS];
+        uint32_t m;
+        for (;;)
+        {
+            m = s.loaded.exchange(0, std::memory_order_acquire);
+            if (m && mag(m).count)
+                break;
+            uint32_t prev = s.previous.exchange(0, std::memory_order_acquire);
+            if (prev && mag(prev).count)
+                std::swap(m, prev);
+            else
+            {
+                // Both empty: trade one for a full magazine, keep the other
+                if (m)
+                    push(empty, m);
+                m = pop(full);
+                if (!m)
+                    m = steal();
+            }
+            stash(s.previous, prev);
+            if (m)
+                break;
+            std::this_thread::yield();
+        }
+        magazine &mg = mag(m);
+        void *p = mg.items[--mg.count];
+        stash(s.loaded, m);
+        return p;
+    }
+
+    void free_list::put(void *p)
+    {
+        slot &s = slots[thread_slot() % SLOTS];
+        uint32_t m = s.loaded.exchange(0, std::memory_order_acquire);
+        if (!m || mag(m).count == MAGAZINE_SIZE)
+        {
+            uint32_t prev = s.previous.exchange(0, std::memory_order_acquire);
+            if (prev && mag(prev).count < MAGAZINE_SIZE)
+                std::swap(m, prev);
+            else
+            {
+                // Both full: hand one to the depot, keep the other
+                if (m)
+                    push(full, m);
+                m = pop(empty);
+                if (!m)
+                    m = new_magazine();
+            }
+            stash(s.previous, prev);
+        }
+        magazine &mg = mag(m);
+        mg.items[mg.count++] = p;
+        stash(s.loaded, m);
+        avail.fetch_add(1);
+    }
+
+    void free_list::add(void *const *items, size_t count)
+    {
+        for (size_t i = 0; i < count;)
+        {
+            uint32_t m = pop(empty);
+            if (!m)
+                m = new_magazine();
+            magazine &mg = mag(m);
+            while (mg.count < MAGAZINE_SIZE && i < count)
+                mg.items[mg.count++] = items[i++];
+            push(full, m);
+        }
+        avail.fetch_add((int64_t)count);
+    }
+
+    size_t free_list::available() const
+    {
+        int64_t n = avail.load(std::memory_order_relaxed);
+        return n > 0 ? (size_t)n : 0;
+    }
+
+    void free_list::clear()
+    {
+        std::lock_guard<std::mutex> lg(grow_mutex);
+        for (size_t i = 0; i < SLOTS; ++i)
+        {
+            slots[i].loaded.store(0, std::memory_order_relaxed);
+            slots[i].previous.store(0, std::memory_order_relaxed);
+        }
+        for (auto &c : chunks)
+            delete[] c.exchange(nullptr);
+        nmagazines = 0;
+        full.store(0);
+        empty.store(0);
+        avail.store(0);
+    }
+}
@@ -0,0 +1,331 @@
+#include "cuda_memory.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+namespace vram
+{
+    namespace cuda_mem
+    {
+        static uint64_t now_ns()
+        {
+            return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+                       std::chrono::steady_clock::now().time_since_epoch())
+                .count();
+        }
+
+        // Wait until the steady clock reaches `deadline`. Sleeping is far too
+        // coarse for microsecond-scale transfer costs, so only the bulk of a
+        // long wait is slept and the tail is spun.
+        static void wait_until_ns(uint64_t deadline)
+        {
+            const uint64_t SPIN_NS = 50 * 1000;
+            uint64_t now = now_ns();
+            if (deadline > now + SPIN_NS)
+                std::this_thread::sleep_for(std::chrono::nanoseconds(deadline - now - SPIN_NS));
+            while (now_ns() < deadline)
+                std::this_thread::yield();
+        }
+
+        // Emulated stream/event: just the modeled completion timestamp
+        struct host_stream
+        {
+            std::atomic<uint64_t> done_at{0};
+            size_t device = 0; // whose link its copies use
+        };
+
+        struct host_event
+        {
+            std::atomic<uint64_t> done_at{0};
+        };
+
+        // A copy batch or fill queued on a stream
+        struct host_op
+        {
+            std::vector<copy_op> copies;
+            void *ptr = nullptr; // fill target
+            int value = 0;
+            size_t size = 0;
+        };
+
+        // Device emulated in host RAM. Data moves with plain memcpy; the
+        // configured bandwidth and latency are charged by delaying the caller,
+        // so timings resemble a real PCIe transfer. Queued copies and fills
+        // only run once their modeled completion has passed and someone
+        // synchronizes with them, so a missing wait shows up as wrong data
+        // rather than slipping by. Several devices can be emulated, each with
+        // `cfg.memory` bytes and its own link.
+        class host_backend : public backend
+        {
+            static const size_t MAX_DEVICES = 16;
+
+        public:
+            explicit host_backend(const host_backend_config &cfg) : cfg(cfg) {}
+
+            ~host_backend() override
+            {
+                run_due(UINT64_MAX);
+                for (auto &kv : sizes)
+                    std::free(kv.first);
+            }
+
+            const char *name() const override { return "host"; }
+
+            bool init(size_t idx) override
+            {
+                if (idx >= MAX_DEVICES)
+                {
+                    std::cerr << "cuda_mem: no host emulation device " << idx << std::endl;
+                    return false;
+                }
+                std::cerr << "cuda_mem: initialized host emulation device " << idx
+                          << " (" << cfg.memory << " bytes, " << cfg.bandwidth << " B/s, "
+                          << cfg.latency_ns << " ns)" << std::endl;
+                return true;
+            }
+
+            void bind(size_t idx) override { current = idx < MAX_DEVICES ? idx : 0; }
+
+            std::vector<std::string> list_devices() override
+            {
+                return std::vector<std::string>(MAX_DEVICES, "host memory emulation");
+            }
+
+            size_t total_memory() override { return cfg.memory; }
+            size_t free_memory() override
+            {
+                std::lock_guard<std::mutex> lg(alloc_mutex);
+                return cfg.memory - devs[current].allocated;
+            }
+            int numa_node() override { return cfg.numa_node; }
+
+            void *device_alloc(size_t size) override
+            {
+                std::lock_guard<std::mutex> lg(alloc_mutex);
+                size_t &allocated = devs[current].allocated;
+                if (allocated + size > cfg.memory)
+                    return nullptr;
+                void *ptr = aligned(size);
+                if (ptr)
+                {
+                    allocated += size;
+                    sizes[ptr] = {size, current};
+                }
+                return ptr;
+            }
+
+            void device_free(void *ptr) override
+            {
+                // Like cudaFree, wait for queued work first
+                synchronize();
+                std::lock_guard<std::mutex> lg(alloc_mutex);
+                auto it = sizes.find(ptr);
+                if (it == sizes.end())
+                    return;
+                devs[it->second.second].allocated -= it->second.first;
+                sizes.erase(it);
+                std::free(ptr);
+            }
+
+            void device_memset(void *ptr, int value, size_t size) override
+            {
+                memset(ptr, value, size);
+            }
+
+            void *host_alloc(size_t size) override { return aligned(size); }
+            void host_free(void *ptr) override
+            {
+                synchronize();
+                std::free(ptr);
+            }
+
+            void copy_to_device(void *dst, const void *src, size_t size) override
+            {
+                uint64_t done = charge(devs[current].h2d_busy_until, size);
+                memcpy(dst, src, size);
+                wait_until_ns(done);
+            }
+
+            void copy_to_host(void *dst, const void *src, size_t size) override
+            {
+                uint64_t done = charge(devs[current].d2h_busy_until, size);
+                memcpy(dst, src, size);
+                wait_until_ns(done);
+            }
+
+            stream_t stream_create() override
+            {
+                host_stream *st = new host_stream();
+                st->device = current;
+                return st;
+            }
+
+            void stream_destroy(stream_t stream) override { delete static_cast<host_stream *>(stream); }
+
+            void stream_synchronize(stream_t stream) override
+            {
+                finish(static_cast<host_stream *>(stream)->done_at.load(std::memory_order_acquire));
+            }
+
+            void copy_async(const copy_op *ops, size_t count, bool to_device, stream_t stream) override
+            {
+                // A batch pays the fixed latency once and the wire time for
+                // its total size
+                size_t total = 0;
+                for (size_t i = 0; i < count; ++i)
+                    total += ops[i].size;
+                host_op op;
+                op.copies.assign(ops, ops + count);
+                device &dev = devs[static_cast<host_stream *>(stream)->device];
+                std::lock_guard<std::mutex> lg(queue_mutex);
+                uint64_t done = charge(to_device ? dev.h2d_busy_until : dev.d2h_busy_until, total);
+                queue(stream, done, std::move(op));
+            }
+
+            void memset_async(void *ptr, int value, size_t size, stream_t stream) override
+            {
+                // Stays on the device: only the launch latency is modeled
+                host_op op;
+                op.ptr = ptr;
+                op.value = value;
+                op.size = size;
+                std::lock_guard<std::mutex> lg(queue_mutex);
+                queue(stream, now_ns() + cfg.latency_ns, std::move(op));
+            }
+
+            event_t event_create() override { return new host_event(); }
+            void event_destroy(event_t event) override { delete static_cast<host_event *>(event); }
+
+            void event_record(event_t event, stream_t stream) override
+            {
+                static_cast<host_event *>(event)->done_at.store(static_cast<host_stream *>(stream)->done_at.load(std::memory_order_acquire), std::memory_order_release);
+            }
+
+            void event_synchronize(event_t event) override
+            {
+                finish(static_cast<host_event *>(event)->done_at.load(std::memory_order_acquire));
+            }
+
+            void stream_wait_event(stream_t stream, event_t event) override
+            {
+                // Later work on the stream completes after the event, so it
+                // also runs after everything the event covers
+                advance(stream, static_cast<host_event *>(event)->done_at.load(std::memory_order_acquire));
+            }
+
+            void synchronize() override
+            {
+                uint64_t busy = 0;
+                for (const device &dev : devs)
+                    busy = std::max({busy, dev.h2d_busy_until.load(), dev.d2h_busy_until.load()});
+                {
+                    std::lock_guard<std::mutex> lg(queue_mutex);
+                    if (!queued.empty())
+                        busy = std::max(busy, queued.rbegin()->first.first);
+                }
+                finish(busy + cfg.latency_ns);
+            }
+
+        private:
+            static void *aligned(size_t size)
+            {
+                const size_t ALIGN = 4096;
+                return std::aligned_alloc(ALIGN, (size + ALIGN - 1) / ALIGN * ALIGN);
+            }
+
+            // Move the stream's completion time forward to at least `done`
+            // and return it
+            static uint64_t advance(stream_t stream, uint64_t done)
+            {
+                std::atomic<uint64_t> &done_at = static_cast<host_stream *>(stream)->done_at;
+                uint64_t prev = done_at.load(std::memory_order_relaxed);
+                while (prev < done && !done_at.compare_exchange_weak(prev, done, std::memory_order_release))
+                    ;
+                return std::max(prev, done);
+            }
+
+            // Queue `op` on `stream`, finishing at `done` or after the work
+            // already on it. Caller holds queue_mutex.
+            void queue(stream_t stream, uint64_t done, host_op &&op)
+            {
+                queued.emplace(std::make_pair(advance(stream, done), next_seq++), std::move(op));
+            }
+
+            // Run every queued op modeled to complete by `until`, in
+            // completion order. A stream's ops, and ops queued behind an
+            // event, complete no earlier than those before them, so they run
+            // in the order the device would.
+            void run_due(uint64_t until)
+            {
+                std::lock_guard<std::mutex> lg(queue_mutex);
+                auto it = queued.begin();
+                for (; it != queued.end() && it->first.first <= until; ++it)
+                {
+                    const host_op &op = it->second;
+                    if (op.ptr)
+                        memset(op.ptr, op.value, op.size);
+                    for (const copy_op &c : op.copies)
+                        memcpy(c.dst, c.src, c.size);
+                }
+                queued.erase(queued.begin(), it);
+            }
+
+            // Wait until `at`, then run what has completed by then
+            void finish(uint64_t at)
+            {
+                wait_until_ns(at);
+                run_due(at);
+            }
+
+            // Reserve `size` bytes of link time on one direction and return the
+            // timestamp at which the transfer completes.
+            uint64_t charge(std::atomic<uint64_t> &busy_until, size_t size)
+            {
+                uint64_t now = now_ns();
+                if (!cfg.bandwidth)
+                    return now + cfg.latency_ns;
+                uint64_t wire = (uint64_t)((unsigned __int128)size * 1000000000ULL / cfg.bandwidth);
+                uint64_t busy = busy_until.load(std::memory_order_relaxed);
+                uint64_t end;
+                do
+                {
+                    end = std::max(now, busy) + wire;
+                } while (!busy_until.compare_exchange_weak(busy, end, std::memory_order_relaxed));
+                return end + cfg.latency_ns;
+            }
+
+            // Per-device memory accounting and full-duplex link
+            struct device
+            {
+                size_t allocated = 0;
+                std::atomic<uint64_t> h2d_busy_until{0};
+                std::atomic<uint64_t> d2h_busy_until{0};
+            };
+
+            host_backend_config cfg;
+            std::mutex alloc_mutex;
+            device devs[MAX_DEVICES];
+            // Allocation -> (size, device)
+            std::unordered_map<void *, std::pair<size_t, size_t>> sizes;
+            // Ops not run yet, keyed by (completion time, submission order)
+            std::mutex queue_mutex;
+            std::map<std::pair<uint64_t, uint64_t>, host_op> queued;
+            uint64_t next_seq = 0;
+            static thread_local size_t current;
+        };
+
+        thread_local size_t host_backend::current = 0;
+
+        std::unique_ptr<backend> make_host_backend(const host_backend_config &cfg)
+        {
+            return std::make_unique<host_backend>(cfg);
+        }
+    }
+}
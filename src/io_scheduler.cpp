@@ -0,0 +1,277 @@
+#include "io_scheduler.hpp"
+#include <algorithm>
+#include <cstring>
+#include <functional>
+
+namespace vram
+{
+    using cuda_mem::block;
+    using cuda_mem::segment;
+
+    io_scheduler::io_scheduler(const config &c) : cfg(c)
+    {
+        if (!cfg.max_batch)
+            cfg.max_batch = 1;
+    }
+
+    // Block tables are in device address order
+    static bool address_order(const segment &a, const segment &b)
+    {
+        return a.blk != b.blk ? std::less<const block *>()(a.blk, b.blk) : a.offset < b.offset;
+    }
+
+    static bool device_order(const segment &a, const segment &b)
+    {
+        return a.blk->device() != b.blk->device() ? a.blk->device() < b.blk->device() : address_order(a, b);
+    }
+
+    // The calling thread's request: its segments that need a device, in
+    // device order, their data once staged, and the staging buffers
+    static thread_local std::vector<segment> sorted, staged;
+    static thread_local std::vector<void *> staging;
+
+    // Holes read as zeros right away and ignore writes
+    static void collect(const segment *segs, size_t count, bool read)
+    {
+        sorted.clear();
+        for (size_t i = 0; i < count; ++i)
+        {
+            if (segs[i].blk)
+                sorted.push_back(segs[i]);
+            else if (read)
+                memset(segs[i].data, 0, segs[i].size);
+        }
+        std::sort(sorted.begin(), sorted.end(), device_order);
+    }
+
+    void io_scheduler::read(const segment *segs, size_t count)
+    {
+        if (!count)
+            return;
+        {
+            std::lock_guard<std::mutex> lg(m);
+            ++counts[false];
+        }
+        static thread_local std::vector<part> parts;
+        collect(segs, count, true);
+        request r = {sorted.data(), nullptr, false, false, 0};
+        split(sorted.data(), sorted.size(), parts);
+        submit(r, parts);
+    }
+
+    void io_scheduler::write(const segment *segs, size_t count, bool async)
+    {
+        if (!count)
+            return;
+        {
+            std::lock_guard<std::mutex> lg(m);
+            ++counts[true];
+        }
+        static thread_local std::vector<part> parts;
+        collect(segs, count, false);
+        if (!async)
+        {
+            request r = {sorted.data(), nullptr, true, false, 0};
+            split(sorted.data(), sorted.size(), parts);
+            submit(r, parts);
+            return;
+        }
+        auto submit_staged = [this]
+        {
+            request r = {staged.data(), staging.data(), true, true, 0};
+            submit(r, parts);
+            staged.clear();
+            staging.clear();
+            parts.clear();
+        };
+        // Pack the data back to back into staging buffers, one run per
+        // device. A writer only waits for a buffer while it holds none: when
+        // the pool runs dry it first queues what it has staged, whose
+        // buffers come back once written.
+        staged.clear();
+        staging.clear();
+        parts.clear();
+        char *buf = nullptr;
+        size_t used = 0;
+        for (size_t i = 0; i < sorted.size(); ++i)
+        {
+            const segment &s = sorted[i];
+            size_t device = s.blk->device();
+            bool fresh = parts.empty() || parts.back().device != device;
+            if (fresh || block::size - used < s.size)
+            {
+                void *b = cuda_mem::acquire_staging_buffer(false, s.blk);
+                if (!b && !staging.empty())
+                {
+                    submit_staged();
+                    fresh = true;
+                }
+                if (!b)
+                    b = cuda_mem::acquire_staging_buffer(true, s.blk);
+                if (!b)
+                {
+                    // No pinned memory at all: write the rest synchronously
+                    request r = {sorted.data() + i, nullptr, true, false, 0};
+                    split(sorted.data() + i, sorted.size() - i, parts);
+                    submit(r, parts);
+                    return;
+                }
+                if (fresh)
+                    parts.push_back({nullptr, device, staged.size(), 0, staging.size(), 0, false});
+                staging.push_back(b);
+                ++parts.back().buffers;
+                buf = static_cast<char *>(b);
+                used = 0;
+            }
+            memcpy(buf + used, s.data, s.size);
+            staged.push_back({s.blk, s.offset, s.size, buf + used});
+            ++parts.back().count;
+            used += s.size;
+        }
+        submit_staged();
+    }
+
+    uint64_t io_scheduler::requests(bool write) const
+    {
+        std::lock_guard<std::mutex> lg(m);
+        return counts[write];
+    }
+
+    uint64_t io_scheduler::batches(bool write) const
+    {
+        std::lock_guard<std::mutex> lg(m);
+        return batch_counts[write];
+    }
+
+    void io_scheduler::split(const segment *segs, size_t count, std::vector<part> &out)
+    {
+        out.clear();
+        for (size_t i = 0; i < count; ++i)
+        {
+            size_t device = segs[i].blk->device();
+            if (out.empty() || out.back().device != device)
+                out.push_back({nullptr, device, i, 0, 0, 0, false});
+            ++out.back().count;
+        }
+    }
+
+    bool io_scheduler::pick(device_queue &q, size_t device, bool &write)
+    {
+        bool can_write = !q.writes.empty() && (!cfg.write_depth || cuda_mem::pending_writes(device) < cfg.write_depth);
+        if (!q.reads.empty() && (!can_write || cfg.order == STRICT || q.reads_in_row < cfg.read_weight))
+            write = false;
+        else if (can_write)
+            write = true;
+        else
+            return false;
+        return true;
+    }
+
+    void io_scheduler::submit(request &r, std::vector<part> &ps)
+    {
+        std::unique_lock<std::mutex> lk(m);
+        r.left = ps.size();
+        for (part &p : ps)
+        {
+            p.r = &r;
+            while (queues.size() <= p.device)
+                queues.emplace_back();
+            device_queue &q = queues[p.device];
+            (r.write ? q.writes : q.reads).push_back(&p);
+        }
+        while (r.left)
+        {
+            // Issue a batch on an idle device this request waits for
+            device_queue *idle = nullptr;
+            size_t held = SIZE_MAX;
+            bool write = false;
+            for (part &p : ps)
+            {
+                device_queue &q = queues[p.device];
+                if (p.done || q.dispatching)
+                    continue;
+                if (pick(q, p.device, write))
+                {
+                    idle = &q;
+                    break;
+                }
+                held = p.device;
+            }
+            if (idle)
+                dispatch(*idle, write, lk);
+            else if (held == SIZE_MAX)
+                cv.wait(lk);
+            else
+            {
+                // Only writes are queued there and the device is busy with
+                // earlier ones; a read arriving meanwhile dispatches itself
+                lk.unlock();
+                cuda_mem::wait_pending(held, cfg.write_depth - 1);
+                lk.lock();
+            }
+        }
+    }
+
+    // The merged segment list and staging buffers of the batch being
+    // dispatched; only the dispatcher touches them
+    static thread_local std::vector<segment> merged;
+    static thread_local std::vector<void *> merged_buffers;
+
+    void io_scheduler::dispatch(device_queue &q, bool write, std::unique_lock<std::mutex> &lk)
+    {
+        std::deque<part *> &queue = write ? q.writes : q.reads;
+        std::vector<part *> batch;
+        size_t segs = 0;
+        bool async = true;
+        while (!queue.empty() && (batch.empty() || segs + queue.front()->count <= cfg.max_batch))
+        {
+            part *p = queue.front();
+            queue.pop_front();
+            batch.push_back(p);
+            segs += p->count;
+            async = async && p->r->async;
+        }
+        if (write)
+            q.reads_in_row = 0;
+        else if (!q.writes.empty())
+            ++q.reads_in_row;
+        ++batch_counts[write];
+        q.dispatching = true;
+        lk.unlock();
+
+        merged.clear();
+        merged_buffers.clear();
+        for (part *p : batch)
+        {
+            const segment *s = p->r->segs + p->first;
+            merged.insert(merged.end(), s, s + p->count);
+            if (p->buffers)
+                merged_buffers.insert(merged_buffers.end(), p->r->buffers + p->first_buffer, p->r->buffers + p->first_buffer + p->buffers);
+        }
+        if (write && async)
+        {
+            // Each part is already in address order, and the buffers follow
+            // the segments staged in them
+            cuda_mem::write_staged_async(merged.data(), merged.size(), merged_buffers.data(), merged_buffers.size());
+        }
+        else
+        {
+            std::sort(merged.begin(), merged.end(), address_order);
+            if (!write)
+                cuda_mem::read_batch(merged.data(), merged.size());
+            else
+                cuda_mem::write_batch(merged.data(), merged.size());
+            for (void *b : merged_buffers)
+                cuda_mem::release_staging_buffer(b, merged.front().blk);
+        }
+
+        lk.lock();
+        for (part *p : batch)
+        {
+            p->done = true;
+            --p->r->left;
+        }
+        q.dispatching = false;
+        cv.notify_all();
+    }
+}
@@ -0,0 +1,218 @@
+#include "metrics.hpp"
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <unistd.h>
+
+namespace vram
+{
+    namespace metrics
+    {
+        namespace
+        {
+            enum family_type
+            {
+                COUNTER,
+                GAUGE,
+                HISTOGRAM
+            };
+
+            struct series
+            {
+                std::string labels;
+                id slot;                     // counter or histogram id
+                std::function<double()> read; // sampled series
+            };
+
+            struct family
+            {
+                std::string name, help;
+                family_type type;
+                std::vector<series> members;
+            };
+
+            std::mutex registry_mutex;
+            std::vector<family> families;
+            id next_counter = 0, next_histogram = 0;
+            // Every shard ever attached, and those of exited threads
+            std::vector<std::unique_ptr<shard>> shards;
+            std::vector<shard *> idle;
+
+            // Caller holds registry_mutex
+            family &family_for(const std::string &name, const std::string &help, family_type type)
+            {
+                for (family &f : families)
+                    if (f.name == name)
+                        return f;
+                families.push_back({name, help, type, {}});
+                return families.back();
+            }
+
+            id add_series(const std::string &name, const std::string &labels, const std::string &help, family_type type, id &next, size_t limit)
+            {
+                std::lock_guard<std::mutex> lg(registry_mutex);
+                family &f = family_for(name, help, type);
+                for (const series &s : f.members)
+                    if (s.labels == labels)
+                        return s.slot;
+                id slot = next < limit ? next++ : (id)(limit - 1);
+                f.members.push_back({labels, slot, nullptr});
+                return slot;
+            }
+
+            void zero(shard &s)
+            {
+                for (std::atomic<uint64_t> &c : s.counters)
+                    c.store(0, std::memory_order_relaxed);
+                for (auto &h : s.buckets)
+                    for (std::atomic<uint64_t> &b : h)
+                        b.store(0, std::memory_order_relaxed);
+                for (std::atomic<uint64_t> &n : s.sum_ns)
+                    n.store(0, std::memory_order_relaxed);
+            }
+
+            // `name{labels,extra}`, leaving out empty parts
+            std::string series_name(const std::string &name, const std::string &labels, const std::string &extra = "")
+            {
+                std::string all = labels.empty() ? extra : extra.empty() ? labels : labels + "," + extra;
+                return all.empty() ? name : name + "{" + all + "}";
+            }
+
+            void append(std::string &out, const std::string &name, double v)
+            {
+                char buf[64];
+                snprintf(buf, sizeof(buf), " %.15g\n", v);
+                out += name;
+                out += buf;
+            }
+        }
+
+        shard *attach()
+        {
+            std::lock_guard<std::mutex> lg(registry_mutex);
+            if (!idle.empty())
+            {
+                shard *s = idle.back();
+                idle.pop_back();
+                return s;
+            }
+            shards.emplace_back(new shard);
+            zero(*shards.back());
+            return shards.back().get();
+        }
+
+        void detach(shard *s)
+        {
+            std::lock_guard<std::mutex> lg(registry_mutex);
+            idle.push_back(s);
+        }
+
+        id counter(const std::string &name, const std::string &labels, const std::string &help)
+        {
+            return add_series(name, labels, help, COUNTER, next_counter, MAX_COUNTERS);
+        }
+
+        id histogram(const std::string &name, const std::string &labels, const std::string &help)
+        {
+            return add_series(name, labels, help, HISTOGRAM, next_histogram, MAX_HISTOGRAMS);
+        }
+
+        void sampled(const std::string &name, const std::string &labels, const std::string &help, bool monotonic, std::function<double()> read)
+        {
+            std::lock_guard<std::mutex> lg(registry_mutex);
+            family_for(name, help, monotonic ? COUNTER : GAUGE).members.push_back({labels, 0, std::move(read)});
+        }
+
+        uint64_t value(id c)
+        {
+            std::lock_guard<std::mutex> lg(registry_mutex);
+            uint64_t sum = 0;
+            for (auto &s : shards)
+                sum += s->counters[c].load(std::memory_order_relaxed);
+            return sum;
+        }
+
+        uint64_t count(id h)
+        {
+            std::lock_guard<std::mutex> lg(registry_mutex);
+            uint64_t sum = 0;
+            for (auto &s : shards)
+                for (const std::atomic<uint64_t> &b : s->buckets[h])
+                    sum += b.load(std::memory_order_relaxed);
+            return sum;
+        }
+
+        std::string render()
+        {
+            std::lock_guard<std::mutex> lg(registry_mutex);
+            static const char *type_names[] = {"counter", "gauge", "histogram"};
+            std::string out;
+            for (const family &f : families)
+            {
+                out += "# HELP " + f.name + " " + f.help + "\n";
+                out += "# TYPE " + f.name + " " + type_names[f.type] + "\n";
+                for (const series &m : f.members)
+                {
+                    if (m.read)
+                    {
+                        append(out, series_name(f.name, m.labels), m.read());
+                        continue;
+                    }
+                    if (f.type == COUNTER)
+                    {
+                        uint64_t sum = 0;
+                        for (auto &s : shards)
+                            sum += s->counters[m.slot].load(std::memory_order_relaxed);
+                        append(out, series_name(f.name, m.labels), (double)sum);
+                        continue;
+                    }
+                    // Prometheus buckets are cumulative, with upper bounds in seconds
+                    uint64_t total = 0, sum_ns = 0;
+                    for (size_t b = 0; b < BUCKETS; ++b)
+                    {
+                        for (auto &s : shards)
+                            total += s->buckets[m.slot][b].load(std::memory_order_relaxed);
+                        char le[48];
+                        if (b + 1 < BUCKETS)
+                            snprintf(le, sizeof(le), "le=\"%.12g\"", (double)(1ULL << (FIRST_BUCKET + b)) / 1e9);
+                        else
+                            snprintf(le, sizeof(le), "le=\"+Inf\"");
+                        append(out, series_name(f.name + "_bucket", m.labels, le), (double)total);
+                    }
+                    for (auto &s : shards)
+                        sum_ns += s->sum_ns[m.slot].load(std::memory_order_relaxed);
+                    append(out, series_name(f.name + "_sum", m.labels), sum_ns / 1e9);
+                    append(out, series_name(f.name + "_count", m.labels), (double)total);
+                }
+            }
+            return out;
+        }
+
+        bool publish(const std::string &path)
+        {
+            std::string text = render();
+            std::string tmp = path + ".tmp";
+            FILE *f = fopen(tmp.c_str(), "w");
+            if (!f)
+                return false;
+            bool ok = fwrite(text.data(), 1, text.size(), f) == text.size();
+            ok = fclose(f) == 0 && ok;
+            if (!ok || rename(tmp.c_str(), path.c_str()) != 0)
+            {
+                unlink(tmp.c_str());
+                return false;
+            }
+            return true;
+        }
+
+        void clear()
+        {
+            std::lock_guard<std::mutex> lg(registry_mutex);
+            families.clear();
+            next_counter = next_histogram = 0;
+            for (auto &s : shards)
+                zero(*s);
+        }
+    }
+}
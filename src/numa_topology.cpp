@@ -0,0 +1,90 @@
+#include "numa_topology.hpp"
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <fstream>
+#include <pthread.h>
+
+namespace vram
+{
+    bool parse_cpulist(const std::string &list, std::vector<int> &cpus)
+    {
+        cpus.clear();
+        const char *p = list.c_str();
+        while (*p && !isspace((unsigned char)*p))
+        {
+            char *end;
+            long lo = strtol(p, &end, 10), hi = lo;
+            if (end == p || lo < 0)
+                return false;
+            if (*end == '-')
+            {
+                p = end + 1;
+                hi = strtol(p, &end, 10);
+                if (end == p || hi < lo)
+                    return false;
+            }
+            if (hi >= CPU_SETSIZE)
+                return false;
+            for (long c = lo; c <= hi; ++c)
+                cpus.push_back((int)c);
+            p = end;
+            if (*p == ',')
+                ++p;
+            else if (*p && !isspace((unsigned char)*p))
+                return false;
+        }
+        return !cpus.empty();
+    }
+
+    std::vector<int> node_cpus(int node)
+    {
+        std::vector<int> cpus;
+        if (node < 0)
+            return cpus;
+        std::ifstream f("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+        std::string line;
+        if (!std::getline(f, line) || !parse_cpulist(line, cpus))
+            cpus.clear();
+        return cpus;
+    }
+
+    int pci_numa_node(const std::string &bus_id)
+    {
+        // sysfs names use lower-case hex and a 4-digit domain; CUDA reports
+        // upper case and may pad the domain to 8 digits
+        std::string id = bus_id;
+        size_t colon = id.find(':');
+        if (colon != std::string::npos && colon > 4)
+            id.erase(0, colon - 4);
+        std::transform(id.begin(), id.end(), id.begin(), [](unsigned char c)
+                       { return (char)tolower(c); });
+        std::ifstream f("/sys/bus/pci/devices/" + id + "/numa_node");
+        int node = -1;
+        if (!(f >> node))
+            return -1;
+        return node;
+    }
+
+    bool pin_thread(const std::vector<int> &cpus)
+    {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (int c : cpus)
+            CPU_SET(c, &set);
+        return !cpus.empty() && pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+    }
+
+    cpu_binding::cpu_binding(const std::vector<int> &cpus)
+    {
+        if (cpus.empty() || pthread_getaffinity_np(pthread_self(), sizeof(saved), &saved) != 0)
+            return;
+        bound = pin_thread(cpus);
+    }
+
+    cpu_binding::~cpu_binding()
+    {
+        if (bound)
+            pthread_setaffinity_np(pthread_self(), sizeof(saved), &saved);
+    }
+}
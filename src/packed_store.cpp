@@ -0,0 +1,232 @@
+#include "cuda_memory.hpp"
+#include "block_codec.hpp"
+#include <chrono>
+#include <mutex>
+
+namespace vram
+{
+    namespace cuda_mem
+    {
+        // Slots per pool block in each size class, smallest slots first
+        static const uint32_t CLASS_SLOTS[] = {32, 16, 12, 10, 8, 6, 5, 4, 3, 2};
+        static const size_t NCLASSES = sizeof(CLASS_SLOTS) / sizeof(CLASS_SLOTS[0]);
+
+        // A pool block carved into equal slots of one size class. Aligned so
+        // a packed_ref keeps the slot index in the low bits of its address.
+        struct alignas(64) carrier
+        {
+            block *blk;
+            uint32_t cls;
+            uint32_t used = 0;      // bit per slot
+            size_t pos = SIZE_MAX;  // index in its class's partial list; SIZE_MAX = not listed
+            uint32_t len[32] = {};  // compressed bytes in each slot
+            carrier *prev = nullptr, *next = nullptr;
+        };
+
+        // One device's carriers, and those with free slots per class
+        struct packed_device_state
+        {
+            std::mutex m;
+            carrier *all = nullptr;
+            std::vector<carrier *> partial[NCLASSES];
+        };
+
+        static std::unique_ptr<block_codec> active_codec;
+        static std::vector<std::unique_ptr<packed_device_state>> packed_devices;
+        static std::atomic<uint64_t> stat_stored{0}, stat_rejected{0}, stat_in{0}, stat_out{0};
+        static std::atomic<uint64_t> stat_compress_ns{0}, stat_loads{0}, stat_decompress_ns{0};
+        static std::atomic<size_t> live_slots{0}, live_carriers{0};
+
+        static size_t slot_bytes(size_t cls) { return block_size() / CLASS_SLOTS[cls] / 16 * 16; }
+
+        static uint32_t full_mask(size_t cls) { return CLASS_SLOTS[cls] == 32 ? ~0u : (1u << CLASS_SLOTS[cls]) - 1; }
+
+        static carrier *carrier_of(packed_ref ref) { return reinterpret_cast<carrier *>(ref & ~(packed_ref)63); }
+
+        static uint64_t elapsed_ns(std::chrono::steady_clock::time_point since)
+        {
+            return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - since).count();
+        }
+
+        // Caller holds p.m
+        static void unlist(packed_device_state &p, carrier *c)
+        {
+            std::vector<carrier *> &list = p.partial[c->cls];
+            list[c->pos] = list.back();
+            list[c->pos]->pos = c->pos;
+            list.pop_back();
+            c->pos = SIZE_MAX;
+        }
+
+        static void enlist(packed_device_state &p, carrier *c)
+        {
+            c->pos = p.partial[c->cls].size();
+            p.partial[c->cls].push_back(c);
+        }
+
+        // Take a free slot of class `cls`, on `device` if it can spare one
+        static bool take_slot(size_t device, size_t cls, carrier *&out, uint32_t &slot)
+        {
+            size_t n = packed_devices.size();
+            for (size_t k = 0; k < n; ++k)
+            {
+                size_t d = (device + k) % n;
+                packed_device_state &p = *packed_devices[d];
+                std::lock_guard<std::mutex> lg(p.m);
+                std::vector<carrier *> &list = p.partial[cls];
+                carrier *c = nullptr;
+                while (!list.empty() && !c)
+                {
+                    c = list.back();
+                    // A retired block takes no new slots; it goes once its owners move out
+                    if (c->blk->retired())
+                    {
+                        unlist(p, c);
+                        c = nullptr;
+                    }
+                }
+                if (!c)
+                {
+                    block *b = acquire_block(d);
+                    if (!b)
+                        continue;
+                    c = new carrier;
+                    c->blk = b;
+                    c->cls = (uint32_t)cls;
+                    c->next = p.all;
+                    if (p.all)
+                        p.all->prev = c;
+                    p.all = c;
+                    enlist(p, c);
+                    ++live_carriers;
+                }
+                slot = (uint32_t)__builtin_ctz(~c->used);
+                c->used |= 1u << slot;
+                if (c->used == full_mask(cls))
+                    unlist(p, c);
+                out = c;
+                return true;
+            }
+            return false;
+        }
+
+        void set_codec(std::unique_ptr<block_codec> codec)
+        {
+            active_codec = std::move(codec);
+            packed_devices.clear();
+            for (size_t d = 0; d < device_count(); ++d)
+                packed_devices.emplace_back(new packed_device_state);
+        }
+
+        const block_codec *codec() { return active_codec.get(); }
+
+        packed_ref store_packed(const void *data, size_t device)
+        {
+            if (!active_codec || packed_devices.empty())
+                return 0;
+            size_t max = slot_bytes(NCLASSES - 1);
+            thread_local std::vector<uint8_t> buf;
+            buf.resize(max);
+            auto start = std::chrono::steady_clock::now();
+            size_t n = active_codec->compress(data, block_size(), buf.data(), max);
+            stat_compress_ns += elapsed_ns(start);
+            if (!n)
+            {
+                ++stat_rejected;
+                return 0;
+            }
+            size_t cls = 0;
+            while (slot_bytes(cls) < n)
+                ++cls;
+            carrier *c;
+            uint32_t slot;
+            if (!take_slot(device % packed_devices.size(), cls, c, slot))
+                return 0;
+            segment s = {c->blk, (off_t)(slot * slot_bytes(cls)), n, buf.data()};
+            write_batch(&s, 1);
+            c->len[slot] = (uint32_t)n;
+            ++stat_stored;
+            stat_in += block_size();
+            stat_out += n;
+            ++live_slots;
+            return reinterpret_cast<packed_ref>(c) | slot;
+        }
+
+        bool load_packed(packed_ref ref, void *out)
+        {
+            carrier *c = carrier_of(ref);
+            uint32_t slot = (uint32_t)(ref & 63);
+            thread_local std::vector<uint8_t> buf;
+            buf.resize(c->len[slot]);
+            segment s = {c->blk, (off_t)(slot * slot_bytes(c->cls)), buf.size(), buf.data()};
+            read_batch(&s, 1);
+            auto start = std::chrono::steady_clock::now();
+            bool ok = active_codec->decompress(buf.data(), buf.size(), out, block_size());
+            stat_decompress_ns += elapsed_ns(start);
+            ++stat_loads;
+            return ok;
+        }
+
+        void free_packed(packed_ref ref)
+        {
+            carrier *c = carrier_of(ref);
+            uint32_t slot = (uint32_t)(ref & 63);
+            packed_device_state &p = *packed_devices[c->blk->device()];
+            --live_slots;
+            {
+                std::lock_guard<std::mutex> lg(p.m);
+                c->used &= ~(1u << slot);
+                if (c->used)
+                {
+                    if (c->pos == SIZE_MAX && !c->blk->retired())
+                        enlist(p, c);
+                    return;
+                }
+                if (c->pos != SIZE_MAX)
+                    unlist(p, c);
+                (c->prev ? c->prev->next : p.all) = c->next;
+                if (c->next)
+                    c->next->prev = c->prev;
+            }
+            --live_carriers;
+            release_block(c->blk);
+            delete c;
+        }
+
+        bool packed_retired(packed_ref ref) { return carrier_of(ref)->blk->retired(); }
+
+        uint32_t packed_device(packed_ref ref) { return carrier_of(ref)->blk->device(); }
+
+        packed_stats packed_statistics()
+        {
+            packed_stats s;
+            s.stored = stat_stored.load();
+            s.rejected = stat_rejected.load();
+            s.bytes_in = stat_in.load();
+            s.bytes_out = stat_out.load();
+            s.compress_ns = stat_compress_ns.load();
+            s.loads = stat_loads.load();
+            s.decompress_ns = stat_decompress_ns.load();
+            s.live = live_slots.load();
+            s.carrier_bytes = live_carriers.load() * block_size();
+            return s;
+        }
+
+        // Forget every carrier; called by shutdown(), which frees their blocks
+        void drop_packed()
+        {
+            for (auto &p : packed_devices)
+            {
+                for (std::vector<carrier *> &list : p->partial)
+                    list.clear();
+                while (carrier *c = p->all)
+                {
+                    p->all = c->next;
+                    delete c;
+                }
+            }
+            live_slots = 0;
+            live_carriers = 0;
+        }
+    }
+}
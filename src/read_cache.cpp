@@ -0,0 +1,192 @@
+#include "read_cache.hpp"
+#include "cuda_memory.hpp"
+#include <algorithm>
+#include <cstring>
+
+namespace vram
+{
+    read_cache::read_cache(size_t capacity, size_t slot_size)
+        : slot_size(slot_size), shards(new shard[SHARDS])
+    {
+        size_t per_shard = capacity / slot_size / SHARDS;
+        if (per_shard == 0)
+            return;
+        base = static_cast<char *>(cuda_mem::current_backend().host_alloc(per_shard * SHARDS * slot_size));
+        if (!base)
+            return;
+        slots = per_shard * SHARDS;
+        for (size_t i = 0; i < SHARDS; ++i)
+        {
+            shard &s = shards[i];
+            // 2Q's recommended tuning: A1in holds 25% of the slots, A1out
+            // remembers as many keys as half the slots
+            s.kin = std::max<size_t>(1, per_shard / 4);
+            s.kout = std::max<size_t>(1, per_shard / 2);
+            for (size_t k = 0; k < per_shard; ++k)
+                s.free_slots.push_back((uint32_t)(i * per_shard + k));
+        }
+    }
+
+    read_cache::~read_cache()
+    {
+        if (base)
+            cuda_mem::current_backend().host_free(base);
+    }
+
+    bool read_cache::lookup(size_t idx, size_t offset, size_t size, void *out)
+    {
+        if (!slots)
+            return false;
+        shard &s = shard_for(idx);
+        std::lock_guard<std::mutex> lg(s.m);
+        auto it = s.map.find(idx);
+        if (it == s.map.end() || !it->second.ready)
+        {
+            ++s.misses;
+            return false;
+        }
+        entry &e = it->second;
+        // Am is LRU; A1in is a FIFO and isn't reordered on a hit
+        if (e.queue == AM)
+            s.am.splice(s.am.begin(), s.am, e.pos);
+        memcpy(out, slot_ptr(e.slot) + offset, size);
+        ++s.hits;
+        return true;
+    }
+
+    void *read_cache::begin_fill(size_t idx)
+    {
+        if (!slots)
+            return nullptr;
+        shard &s = shard_for(idx);
+        std::lock_guard<std::mutex> lg(s.m);
+        if (s.map.count(idx))
+            return nullptr;
+        if (s.free_slots.empty() && !reclaim(s))
+            return nullptr;
+        uint32_t slot = s.free_slots.back();
+        s.free_slots.pop_back();
+
+        entry e;
+        e.ready = false;
+        e.slot = slot;
+        auto ghost = s.ghosts.find(idx);
+        if (ghost != s.ghosts.end())
+        {
+            // Re-referenced after aging out of A1in: it's hot
+            s.a1out.erase(ghost->second);
+            s.ghosts.erase(ghost);
+            e.queue = AM;
+            s.am.push_front(idx);
+            e.pos = s.am.begin();
+        }
+        else
+        {
+            e.queue = A1IN;
+            s.a1in.push_front(idx);
+            e.pos = s.a1in.begin();
+        }
+        s.map.emplace(idx, e);
+        return slot_ptr(slot);
+    }
+
+    void read_cache::end_fill(size_t idx)
+    {
+        shard &s = shard_for(idx);
+        std::lock_guard<std::mutex> lg(s.m);
+        auto it = s.map.find(idx);
+        if (it != s.map.end())
+            it->second.ready = true;
+    }
+
+    void read_cache::abort_fill(size_t idx)
+    {
+        invalidate(idx);
+    }
+
+    void read_cache::update(size_t idx, size_t offset, size_t size, const void *data)
+    {
+        if (!slots)
+            return;
+        shard &s = shard_for(idx);
+        std::lock_guard<std::mutex> lg(s.m);
+        auto it = s.map.find(idx);
+        if (it != s.map.end() && it->second.ready)
+            memcpy(slot_ptr(it->second.slot) + offset, data, size);
+    }
+
+    void read_cache::invalidate(size_t idx)
+    {
+        if (!slots)
+            return;
+        shard &s = shard_for(idx);
+        std::lock_guard<std::mutex> lg(s.m);
+        auto it = s.map.find(idx);
+        if (it != s.map.end())
+            remove(s, it);
+    }
+
+    uint64_t read_cache::hits() const
+    {
+        uint64_t total = 0;
+        for (size_t i = 0; i < SHARDS; ++i)
+        {
+            std::lock_guard<std::mutex> lg(shards[i].m);
+            total += shards[i].hits;
+        }
+        return total;
+    }
+
+    uint64_t read_cache::misses() const
+    {
+        uint64_t total = 0;
+        for (size_t i = 0; i < SHARDS; ++i)
+        {
+            std::lock_guard<std::mutex> lg(shards[i].m);
+            total += shards[i].misses;
+        }
+        return total;
+    }
+
+    bool read_cache::reclaim(shard &s)
+    {
+        if (s.a1in.size() > s.kin && evict_from(s, s.a1in, true))
+            return true;
+        if (evict_from(s, s.am, false))
+            return true;
+        return evict_from(s, s.a1in, true);
+    }
+
+    bool read_cache::evict_from(shard &s, std::list<size_t> &q, bool remember)
+    {
+        // Oldest first, skipping blocks that are still being filled
+        for (auto pos = q.rbegin(); pos != q.rend(); ++pos)
+        {
+            size_t idx = *pos;
+            auto it = s.map.find(idx);
+            if (!it->second.ready)
+                continue;
+            remove(s, it);
+            if (remember)
+            {
+                s.a1out.push_front(idx);
+                s.ghosts[idx] = s.a1out.begin();
+                if (s.a1out.size() > s.kout)
+                {
+                    s.ghosts.erase(s.a1out.back());
+                    s.a1out.pop_back();
+                }
+            }
+            return true;
+        }
+        return false;
+    }
+
+    void read_cache::remove(shard &s, std::unordered_map<size_t, entry>::iterator it)
+    {
+        entry &e = it->second;
+        (e.queue == AM ? s.am : s.a1in).erase(e.pos);
+        s.free_slots.push_back(e.slot);
+        s.map.erase(it);
+    }
+}
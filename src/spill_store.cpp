@@ -0,0 +1,297 @@
+#include "spill_store.hpp"
+#include "uring.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace vram
+{
+    namespace
+    {
+        // One read or write of the file
+        struct file_op
+        {
+            bool write;
+            void *buf;
+            size_t len;
+            off_t pos;
+        };
+
+        // Complete an op with plain syscalls from byte `done` on
+        bool finish_sync(int fd, const file_op &op, size_t done)
+        {
+            char *p = static_cast<char *>(op.buf);
+            while (done < op.len)
+            {
+                ssize_t n = op.write ? pwrite(fd, p + done, op.len - done, op.pos + (off_t)done)
+                                     : pread(fd, p + done, op.len - done, op.pos + (off_t)done);
+                if (n < 0 && errno == EINTR)
+                    continue;
+                if (n <= 0)
+                    return false;
+                done += (size_t)n;
+            }
+            return true;
+        }
+
+        // Run `count` ops on `file` through `r`, a ring's worth per
+        // submission, and wait for all of them. res[i] is op i's byte count
+        // or -errno; ops not reaped keep -EIO.
+        void run_ring(uring &r, int file, const file_op *ops, size_t count, ssize_t *res)
+        {
+            // Completions are tagged with the batch, so any left over from a
+            // batch abandoned on a failed submission are ignored
+            thread_local uint64_t batch = 0;
+            ++batch;
+            for (size_t first = 0; first < count; first += r.size())
+            {
+                unsigned n = (unsigned)std::min<size_t>(r.size(), count - first);
+                for (unsigned i = 0; i < n; ++i)
+                {
+                    const file_op &op = ops[first + i];
+                    io_uring_sqe &sqe = *r.next_sqe();
+                    sqe.opcode = op.write ? IORING_OP_WRITE : IORING_OP_READ;
+                    sqe.fd = file;
+                    sqe.addr = (uint64_t)(uintptr_t)op.buf;
+                    sqe.len = (uint32_t)op.len;
+                    sqe.off = (uint64_t)op.pos;
+                    sqe.user_data = batch << 32 | (first + i);
+                    res[first + i] = -EIO;
+                }
+                unsigned reaped = 0;
+                while (reaped < n)
+                {
+                    int e = r.enter(n - reaped);
+                    if (e < 0 && e != -EINTR && e != -EAGAIN && e != -EBUSY)
+                    {
+                        r.discard();
+                        return;
+                    }
+                    r.reap([&](const io_uring_cqe &c)
+                           {
+                               if (c.user_data >> 32 != (batch & 0xffffffff))
+                                   return;
+                               res[c.user_data & 0xffffffff] = c.res;
+                               ++reaped;
+                           });
+                }
+            }
+        }
+
+        // Run ops through the thread's ring (set up on its first batch);
+        // anything it leaves short or failed (e.g. an opcode an old kernel
+        // lacks) is retried synchronously
+        bool run_ops(int fd, const std::vector<file_op> &ops)
+        {
+            thread_local uring r(64);
+            thread_local std::vector<ssize_t> res;
+            res.assign(ops.size(), 0);
+            if (r.ok())
+                run_ring(r, fd, ops.data(), ops.size(), res.data());
+            for (size_t i = 0; i < ops.size(); ++i)
+                if (res[i] < 0 || (size_t)res[i] < ops[i].len)
+                    if (!finish_sync(fd, ops[i], res[i] < 0 ? 0 : (size_t)res[i]))
+                        return false;
+            return true;
+        }
+
+        // Per-thread aligned scratch for pieces O_DIRECT can't take as they are
+        struct bounce_arena
+        {
+            char *base = nullptr;
+            size_t size = 0;
+            ~bounce_arena() { std::free(base); }
+            char *get(size_t need, size_t align)
+            {
+                if (need > size)
+                {
+                    std::free(base);
+                    size = (need + align - 1) / align * align;
+                    base = static_cast<char *>(std::aligned_alloc(align, size));
+                    if (!base)
+                        size = 0;
+                }
+                return base;
+            }
+        };
+    }
+
+    spill_store::spill_store(const std::string &path, size_t capacity, size_t slot_size)
+        : slot_size(slot_size)
+    {
+        fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC | O_DIRECT, 0600);
+        o_direct = fd >= 0;
+        // tmpfs and some network filesystems refuse O_DIRECT
+        if (fd < 0 && errno == EINVAL)
+            fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+        if (fd < 0)
+            return;
+        struct stat st;
+        if (fstat(fd, &st) != 0)
+        {
+            close(fd);
+            fd = -1;
+            return;
+        }
+        if (S_ISBLK(st.st_mode))
+        {
+            off_t end = lseek(fd, 0, SEEK_END);
+            if (end >= 0 && (size_t)end < capacity)
+                capacity = (size_t)end;
+        }
+        else if (ftruncate(fd, (off_t)(capacity / slot_size * slot_size)) != 0)
+        {
+            close(fd);
+            fd = -1;
+            return;
+        }
+        slots = capacity / slot_size;
+    }
+
+    spill_store::~spill_store()
+    {
+        if (fd >= 0)
+            close(fd);
+    }
+
+    size_t spill_store::used() const
+    {
+        std::lock_guard<std::mutex> lg(m);
+        return fresh - free_slots.size();
+    }
+
+    bool spill_store::reserve(uint64_t &slot)
+    {
+        std::lock_guard<std::mutex> lg(m);
+        if (!free_slots.empty())
+        {
+            slot = free_slots.back();
+            free_slots.pop_back();
+        }
+        else if (fresh < slots)
+            slot = fresh++;
+        else
+            return false;
+        return true;
+    }
+
+    void spill_store::release(uint64_t slot)
+    {
+        std::lock_guard<std::mutex> lg(m);
+        free_slots.push_back(slot);
+    }
+
+    bool spill_store::transfer(const spill_io *ios, size_t count, bool to_file)
+    {
+        // Each piece goes straight between the file and the caller's memory,
+        // or through an aligned span of the bounce arena covering whole pages
+        thread_local bounce_arena arena;
+        thread_local std::vector<size_t> bounce_at;
+        thread_local std::vector<file_op> ops;
+        const size_t DIRECT = SIZE_MAX;
+        bounce_at.assign(count, DIRECT);
+        size_t need = 0;
+        for (size_t i = 0; i < count; ++i)
+        {
+            size_t pos = ios[i].slot * slot_size + ios[i].offset, end = pos + ios[i].size;
+            size_t a0 = pos / ALIGN * ALIGN, a1 = (end + ALIGN - 1) / ALIGN * ALIGN;
+            if (o_direct && (pos != a0 || end != a1 || (uintptr_t)ios[i].data % ALIGN))
+            {
+                bounce_at[i] = need;
+                need += a1 - a0;
+            }
+        }
+        char *bounce = need ? arena.get(need, ALIGN) : nullptr;
+        if (need && !bounce)
+            return false;
+
+        auto span = [&](size_t i, size_t &pos, size_t &a0, size_t &a1)
+        {
+            pos = ios[i].slot * slot_size + ios[i].offset;
+            a0 = pos / ALIGN * ALIGN;
+            a1 = (pos + ios[i].size + ALIGN - 1) / ALIGN * ALIGN;
+        };
+        size_t pos, a0, a1;
+        if (to_file && need)
+        {
+            // Pages a write covers only partly keep the rest of their contents
+            ops.clear();
+            for (size_t i = 0; i < count; ++i)
+            {
+                if (bounce_at[i] == DIRECT)
+                    continue;
+                span(i, pos, a0, a1);
+                if (pos != a0 || pos + ios[i].size != a1)
+                    ops.push_back({false, bounce + bounce_at[i], a1 - a0, (off_t)a0});
+            }
+            if (!run_ops(fd, ops))
+                return false;
+            for (size_t i = 0; i < count; ++i)
+            {
+                if (bounce_at[i] == DIRECT)
+                    continue;
+                span(i, pos, a0, a1);
+                memcpy(bounce + bounce_at[i] + (pos - a0), ios[i].data, ios[i].size);
+            }
+        }
+
+        ops.clear();
+        for (size_t i = 0; i < count; ++i)
+        {
+            span(i, pos, a0, a1);
+            if (bounce_at[i] == DIRECT)
+                ops.push_back({to_file, ios[i].data, ios[i].size, (off_t)pos});
+            else
+                ops.push_back({to_file, bounce + bounce_at[i], a1 - a0, (off_t)a0});
+        }
+        if (!run_ops(fd, ops))
+            return false;
+        if (!to_file && need)
+        {
+            for (size_t i = 0; i < count; ++i)
+            {
+                if (bounce_at[i] == DIRECT)
+                    continue;
+                span(i, pos, a0, a1);
+                memcpy(ios[i].data, bounce + bounce_at[i] + (pos - a0), ios[i].size);
+            }
+        }
+        return true;
+    }
+
+    bool spill_store::read_batch(const spill_io *ios, size_t count)
+    {
+        return transfer(ios, count, false);
+    }
+
+    bool spill_store::write_batch(const spill_io *ios, size_t count)
+    {
+        return transfer(ios, count, true);
+    }
+
+    bool spill_store::store(const void *data, uint64_t &slot)
+    {
+        if (!reserve(slot))
+            return false;
+        if (write(slot, 0, slot_size, data))
+            return true;
+        release(slot);
+        return false;
+    }
+
+    bool spill_store::load(uint64_t slot, size_t offset, size_t size, void *out)
+    {
+        spill_io io{slot, offset, size, out};
+        return read_batch(&io, 1);
+    }
+
+    bool spill_store::write(uint64_t slot, size_t offset, size_t size, const void *data)
+    {
+        spill_io io{slot, offset, size, const_cast<void *>(data)};
+        return write_batch(&io, 1);
+    }
+}
@@ -0,0 +1,242 @@
+#include "trace.hpp"
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+namespace vram
+{
+    namespace trace
+    {
+        namespace
+        {
+            // Single-producer, single-consumer: the recording thread moves
+            // `head`, the writer moves `tail`, each on its own cache line
+            struct alignas(64) ring
+            {
+                std::unique_ptr<record[]> slots;
+                uint64_t mask = 0;
+                uint32_t thread = 0;
+                alignas(64) std::atomic<uint64_t> head{0};
+                uint64_t cached_tail = 0; // the producer's last look at `tail`
+                std::atomic<uint64_t> lost{0};
+                alignas(64) std::atomic<uint64_t> tail{0};
+            };
+
+            // Guards the rings and the file
+            std::mutex registry_mutex;
+            std::vector<std::unique_ptr<ring>> rings;
+            size_t ring_size = 0;
+            FILE *out = nullptr;
+            file_header header;
+            std::chrono::steady_clock::time_point origin;
+            std::atomic<uint64_t> generation{0};
+            std::atomic<uint64_t> total_written{0};
+            uint64_t final_dropped = 0;
+
+            std::thread writer;
+            std::mutex writer_mutex;
+            std::condition_variable writer_cv;
+            bool writer_stop = false;
+            uint32_t interval = 100;
+
+            // Rings are dropped on stop(); a thread re-attaches when the
+            // generation it attached in has passed
+            struct thread_ring
+            {
+                ring *r = nullptr;
+                uint64_t gen = 0;
+            };
+            thread_local thread_ring mine;
+
+            ring *attach()
+            {
+                std::lock_guard<std::mutex> lg(registry_mutex);
+                if (!out)
+                    return nullptr;
+                std::unique_ptr<ring> r(new ring);
+                r->slots.reset(new record[ring_size]);
+                r->mask = ring_size - 1;
+                r->thread = (uint32_t)rings.size();
+                rings.push_back(std::move(r));
+                return rings.back().get();
+            }
+
+            // Caller holds registry_mutex
+            void drain_locked()
+            {
+                for (auto &r : rings)
+                {
+                    uint64_t t = r->tail.load(std::memory_order_relaxed);
+                    uint64_t h = r->head.load(std::memory_order_acquire);
+                    for (uint64_t at = t; at != h;)
+                    {
+                        size_t i = at & r->mask;
+                        size_t n = std::min<uint64_t>(h - at, ring_size - i);
+                        fwrite(&r->slots[i], sizeof(record), n, out);
+                        at += n;
+                    }
+                    total_written.fetch_add(h - t, std::memory_order_relaxed);
+                    r->tail.store(h, std::memory_order_release);
+                }
+                fflush(out);
+            }
+
+            void write_loop()
+            {
+                std::unique_lock<std::mutex> lk(writer_mutex);
+                while (!writer_stop)
+                {
+                    writer_cv.wait_for(lk, std::chrono::milliseconds(interval));
+                    lk.unlock();
+                    {
+                        std::lock_guard<std::mutex> lg(registry_mutex);
+                        drain_locked();
+                    }
+                    lk.lock();
+                }
+            }
+        }
+
+        bool start(const std::string &path, size_t ring_records, uint32_t interval_ms)
+        {
+            stop();
+            std::lock_guard<std::mutex> lg(registry_mutex);
+            out = fopen(path.c_str(), "wb");
+            if (!out)
+                return false;
+            ring_size = 2;
+            while (ring_size < ring_records)
+                ring_size <<= 1;
+            header = file_header();
+            memcpy(header.magic, "VRTRACE1", 8);
+            header.version = 1;
+            header.record_size = sizeof(record);
+            header.start_unix_ns = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+            fwrite(&header, sizeof(header), 1, out);
+            origin = std::chrono::steady_clock::now();
+            total_written.store(0, std::memory_order_relaxed);
+            final_dropped = 0;
+            generation.fetch_add(1, std::memory_order_release);
+            interval = std::max<uint32_t>(1, interval_ms);
+            writer_stop = false;
+            writer = std::thread(write_loop);
+            enabled_flag().store(true, std::memory_order_release);
+            return true;
+        }
+
+        void stop()
+        {
+            enabled_flag().store(false, std::memory_order_release);
+            if (writer.joinable())
+            {
+                {
+                    std::lock_guard<std::mutex> lg(writer_mutex);
+                    writer_stop = true;
+                }
+                writer_cv.notify_all();
+                writer.join();
+            }
+            std::lock_guard<std::mutex> lg(registry_mutex);
+            if (!out)
+                return;
+            drain_locked();
+            for (auto &r : rings)
+                final_dropped += r->lost.load(std::memory_order_relaxed);
+            header.records = total_written.load(std::memory_order_relaxed);
+            header.dropped = final_dropped;
+            fseek(out, 0, SEEK_SET);
+            fwrite(&header, sizeof(header), 1, out);
+            fclose(out);
+            out = nullptr;
+            rings.clear();
+        }
+
+        uint64_t now_ns()
+        {
+            return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - origin).count();
+        }
+
+        void record_op(op type, uint64_t offset, uint32_t length, uint64_t start_ns, uint64_t latency_ns, int status)
+        {
+            thread_ring &m = mine;
+            uint64_t gen = generation.load(std::memory_order_acquire);
+            if (m.gen != gen)
+            {
+                m.r = attach();
+                m.gen = gen;
+            }
+            if (!m.r)
+                return;
+            ring &r = *m.r;
+            uint64_t h = r.head.load(std::memory_order_relaxed);
+            if (h - r.cached_tail > r.mask)
+            {
+                r.cached_tail = r.tail.load(std::memory_order_acquire);
+                if (h - r.cached_tail > r.mask)
+                {
+                    r.lost.store(r.lost.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+                    return;
+                }
+            }
+            record &e = r.slots[h & r.mask];
+            e.start_ns = start_ns;
+            e.offset = offset;
+            e.length = length;
+            e.latency_ns = (uint32_t)std::min<uint64_t>(latency_ns, UINT32_MAX);
+            e.thread = r.thread;
+            e.type = type;
+            e.status = (uint8_t)std::min(status < 0 ? -status : status, 255);
+            e.reserved = 0;
+            r.head.store(h + 1, std::memory_order_release);
+        }
+
+        uint64_t written()
+        {
+            return total_written.load(std::memory_order_relaxed);
+        }
+
+        uint64_t dropped()
+        {
+            std::lock_guard<std::mutex> lg(registry_mutex);
+            uint64_t n = final_dropped;
+            for (auto &r : rings)
+                n += r->lost.load(std::memory_order_relaxed);
+            return n;
+        }
+
+        bool load(const std::string &path, file_header &hdr, std::vector<record> &records, std::string &error)
+        {
+            records.clear();
+            FILE *f = fopen(path.c_str(), "rb");
+            if (!f)
+            {
+                error = "cannot open " + path;
+                return false;
+            }
+            bool ok = fread(&hdr, sizeof(hdr), 1, f) == 1 && !memcmp(hdr.magic, "VRTRACE1", 8);
+            if (!ok)
+                error = path + " is not a trace file";
+            else if (hdr.version != 1 || hdr.record_size != sizeof(record))
+            {
+                error = path + ": unsupported trace version " + std::to_string(hdr.version);
+                ok = false;
+            }
+            // A trace cut short by a crash has a zero count in its header;
+            // take whatever whole records made it to the file
+            record buf[1024];
+            for (size_t n; ok && (n = fread(buf, sizeof(record), 1024, f)) > 0;)
+                records.insert(records.end(), buf, buf + n);
+            fclose(f);
+            if (!ok)
+                return false;
+            std::stable_sort(records.begin(), records.end(), [](const record &a, const record &b)
+                             { return a.start_ns < b.start_ns; });
+            return true;
+        }
+    }
+}
@@ -0,0 +1,100 @@
+#include "uring.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace vram
+{
+    uring::uring(unsigned want)
+    {
+        io_uring_params p;
+        memset(&p, 0, sizeof(p));
+        fd = (int)syscall(__NR_io_uring_setup, want, &p);
+        if (fd < 0)
+            return;
+        bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+        sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        cq_len = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+        if (single)
+            sq_len = cq_len = std::max(sq_len, cq_len);
+        sqes_len = p.sq_entries * sizeof(io_uring_sqe);
+        sq_ptr = mmap(nullptr, sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+        cq_ptr = single ? sq_ptr : mmap(nullptr, cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        void *s = mmap(nullptr, sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+        if (sq_ptr == MAP_FAILED || cq_ptr == MAP_FAILED || s == MAP_FAILED)
+        {
+            if (s != MAP_FAILED)
+                munmap(s, sqes_len);
+            unmap_rings();
+            close(fd);
+            fd = -1;
+            return;
+        }
+        sqes = static_cast<io_uring_sqe *>(s);
+        char *sq = static_cast<char *>(sq_ptr), *cq = static_cast<char *>(cq_ptr);
+        sq_head = reinterpret_cast<unsigned *>(sq + p.sq_off.head);
+        sq_tail = reinterpret_cast<unsigned *>(sq + p.sq_off.tail);
+        sq_mask = *reinterpret_cast<unsigned *>(sq + p.sq_off.ring_mask);
+        sq_array = reinterpret_cast<unsigned *>(sq + p.sq_off.array);
+        cq_head = reinterpret_cast<unsigned *>(cq + p.cq_off.head);
+        cq_tail = reinterpret_cast<unsigned *>(cq + p.cq_off.tail);
+        cq_mask = *reinterpret_cast<unsigned *>(cq + p.cq_off.ring_mask);
+        cqes = reinterpret_cast<io_uring_cqe *>(cq + p.cq_off.cqes);
+        entries = p.sq_entries;
+    }
+
+    uring::~uring()
+    {
+        if (fd < 0)
+            return;
+        munmap(sqes, sqes_len);
+        unmap_rings();
+        close(fd);
+    }
+
+    void uring::unmap_rings()
+    {
+        if (cq_ptr != MAP_FAILED && cq_ptr && cq_ptr != sq_ptr)
+            munmap(cq_ptr, cq_len);
+        if (sq_ptr != MAP_FAILED && sq_ptr)
+            munmap(sq_ptr, sq_len);
+    }
+
+    io_uring_sqe *uring::next_sqe()
+    {
+        unsigned tail = *sq_tail;
+        // Entries between the kernel's head and our tail aren't consumed yet
+        if (tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= entries)
+            return nullptr;
+        unsigned idx = tail & sq_mask;
+        io_uring_sqe *sqe = &sqes[idx];
+        memset(sqe, 0, sizeof(*sqe));
+        sq_array[idx] = idx;
+        __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+        ++queued;
+        return sqe;
+    }
+
+    int uring::enter(unsigned wait)
+    {
+        long r = syscall(__NR_io_uring_enter, fd, queued, wait, wait ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+        if (r < 0)
+            return -errno;
+        queued -= std::min<unsigned>(queued, (unsigned)r);
+        return (int)r;
+    }
+
+    void uring::discard()
+    {
+        __atomic_store_n(sq_tail, __atomic_load_n(sq_head, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+        queued = 0;
+    }
+
+    bool uring::register_buffers(const iovec *iov, unsigned count)
+    {
+        return syscall(__NR_io_uring_register, fd, IORING_REGISTER_BUFFERS, iov, count) == 0;
+    }
+}
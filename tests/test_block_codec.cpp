@@ -0,0 +1,85 @@
+#include "block_codec.hpp"
+#include <iostream>
+#include <vector>
+#include <random>
+#include <cstring>
+
+using namespace vram;
+
+int main() {
+    std::cout << "test: block_codec starting" << std::endl;
+
+    std::unique_ptr<block_codec> codec = make_codec("lz4");
+    if (!codec || make_codec("nope")) {
+        std::cerr << "ERROR: codec lookup by name" << std::endl;
+        return 2;
+    }
+
+    const size_t size = 64 * 1024;
+    std::mt19937_64 rng(7);
+    std::vector<uint8_t> in(size), packed(size), out(size);
+
+    // Typical swap contents: mostly zeros with scattered records, text-like
+    // runs, long repeats with short periods, and short inputs near the limits
+    struct sample { const char *name; size_t size; bool compressible; };
+    for (sample s : {sample{"sparse", size, true}, sample{"text", size, true}, sample{"periodic", size, true},
+                     sample{"tiny", 13, false}, sample{"empty", 0, false}}) {
+        memset(in.data(), 0, size);
+        if (!strcmp(s.name, "sparse"))
+            for (size_t i = 0; i < size; i += 512) in[i + rng() % 500] = (uint8_t)rng();
+        else if (!strcmp(s.name, "text"))
+            for (size_t i = 0; i < size;) {
+                const char *words[] = {"swap ", "page ", "kernel ", "memory ", "device "};
+                for (const char *w = words[rng() % 5]; *w && i < size; ++w) in[i++] = (uint8_t)*w;
+            }
+        else if (!strcmp(s.name, "periodic"))
+            for (size_t i = 0; i < size; ++i) in[i] = (uint8_t)(i % 3 == 0 ? 'a' : i % 7);
+        else
+            for (size_t i = 0; i < s.size; ++i) in[i] = (uint8_t)rng();
+        size_t n = codec->compress(in.data(), s.size, packed.data(), packed.size());
+        if ((s.size && !n) || (s.compressible && n > s.size / 2)) {
+            std::cerr << "ERROR: " << s.name << " compressed to " << n << " of " << s.size << " bytes" << std::endl;
+            return 2;
+        }
+        memset(out.data(), 0xee, size);
+        if (!codec->decompress(packed.data(), n, out.data(), s.size) || memcmp(in.data(), out.data(), s.size) != 0) {
+            std::cerr << "ERROR: " << s.name << " did not round-trip" << std::endl;
+            return 2;
+        }
+    }
+
+    // Random data doesn't fit in a buffer smaller than itself
+    for (size_t i = 0; i < size; ++i) in[i] = (uint8_t)rng();
+    if (codec->compress(in.data(), size, packed.data(), size / 2) != 0) {
+        std::cerr << "ERROR: incompressible block reported as compressed" << std::endl;
+        return 2;
+    }
+    size_t n = codec->compress(in.data(), size, packed.data(), packed.size());
+    std::vector<uint8_t> room(size + size / 255 + 16);
+    if (n || !(n = codec->compress(in.data(), size, room.data(), room.size())) || !codec->decompress(room.data(), n, out.data(), size) || memcmp(in.data(), out.data(), size) != 0) {
+        std::cerr << "ERROR: incompressible block round-trip with room for expansion" << std::endl;
+        return 2;
+    }
+
+    // Malformed input must be rejected without writing past the output
+    for (size_t i = 0; i < size; ++i) in[i] = (uint8_t)(i % 251 < 40 ? i % 13 : 0);
+    n = codec->compress(in.data(), size, packed.data(), packed.size());
+    if (!n || codec->decompress(packed.data(), n - 1, out.data(), size) || codec->decompress(packed.data(), n, out.data(), size - 1)) {
+        std::cerr << "ERROR: truncated input or short output accepted" << std::endl;
+        return 2;
+    }
+    for (int round = 0; round < 2000; ++round) {
+        std::vector<uint8_t> bad(packed.begin(), packed.begin() + n);
+        for (int k = 0; k < 4; ++k) bad[rng() % n] = (uint8_t)rng();
+        std::vector<uint8_t> guarded(size + 64, 0x5a);
+        codec->decompress(bad.data(), n, guarded.data(), size);
+        for (size_t i = size; i < guarded.size(); ++i)
+            if (guarded[i] != 0x5a) {
+                std::cerr << "ERROR: corrupt input wrote past the output" << std::endl;
+                return 2;
+            }
+    }
+
+    std::cout << "test: block_codec finished" << std::endl;
+    return 0;
+}
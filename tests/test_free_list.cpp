@@ -0,0 +1,104 @@
+#include "free_list.hpp"
+#include <iostream>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <set>
+#include <random>
+
+using namespace vram;
+
+int main() {
+    std::cout << "test: free_list starting" << std::endl;
+
+    const size_t N = 1000;
+    std::vector<char> storage(N);
+    std::vector<void *> items(N);
+    for (size_t i = 0; i < N; ++i) items[i] = &storage[i];
+
+    // Every pointer comes out exactly once, then the list reports empty
+    free_list fl;
+    fl.add(items.data(), N);
+    std::set<void *> seen;
+    for (size_t i = 0; i < N; ++i) {
+        void *p = fl.get();
+        if (!p || !seen.insert(p).second) {
+            std::cerr << "ERROR: missing or duplicate pointer" << std::endl;
+            return 3;
+        }
+    }
+    if (fl.get() || fl.available() != 0) {
+        std::cerr << "ERROR: empty list handed out a pointer" << std::endl;
+        return 3;
+    }
+    for (void *p : seen) fl.put(p);
+    if (fl.available() != N) {
+        std::cerr << "ERROR: available() after put" << std::endl;
+        return 3;
+    }
+
+    // Pointers cached by another thread are stolen rather than reported missing
+    {
+        free_list small;
+        small.add(items.data(), 40);
+        std::thread t([&] {
+            std::vector<void *> held;
+            for (int i = 0; i < 40; ++i) held.push_back(small.get());
+            for (void *p : held) small.put(p);
+        });
+        t.join();
+        for (int i = 0; i < 40; ++i) {
+            if (!small.get()) {
+                std::cerr << "ERROR: pointer stranded in another thread's cache" << std::endl;
+                return 3;
+            }
+        }
+        if (small.get()) {
+            std::cerr << "ERROR: stole more than was there" << std::endl;
+            return 3;
+        }
+    }
+
+    // Concurrent churn: no pointer is ever held by two threads at once
+    {
+        free_list shared;
+        shared.add(items.data(), N);
+        std::vector<std::atomic<int>> owner(N);
+        std::atomic<bool> bad{false};
+        std::vector<std::thread> threads;
+        for (int t = 0; t < 16; ++t) {
+            threads.emplace_back([&, t] {
+                std::mt19937 rng(t);
+                std::vector<void *> held;
+                for (int op = 0; op < 100000; ++op) {
+                    if (held.size() < 80 && (held.empty() || rng() % 2)) {
+                        void *p = shared.get();
+                        if (!p) continue;
+                        size_t i = static_cast<char *>(p) - storage.data();
+                        if (owner[i].exchange(t + 1) != 0) bad = true;
+                        held.push_back(p);
+                    } else {
+                        void *p = held.back();
+                        held.pop_back();
+                        owner[static_cast<char *>(p) - storage.data()].store(0);
+                        shared.put(p);
+                    }
+                }
+                for (void *p : held) {
+                    owner[static_cast<char *>(p) - storage.data()].store(0);
+                    shared.put(p);
+                }
+            });
+        }
+        for (auto &th : threads) th.join();
+        std::set<void *> all;
+        while (void *p = shared.get()) all.insert(p);
+        if (bad || all.size() != N) {
+            std::cerr << "ERROR: concurrent get/put lost or shared pointers (" << all.size() << ")" << std::endl;
+            return 3;
+        }
+    }
+
+    std::cout << "test: free_list finished" << std::endl;
+    return 0;
+}
@@ -0,0 +1,215 @@
+#include "cuda_memory.hpp"
+#include "io_scheduler.hpp"
+#include <iostream>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+
+using namespace vram;
+using cuda_mem::segment;
+
+typedef std::chrono::steady_clock clock_type;
+
+static double ms_since(clock_type::time_point t) {
+    return std::chrono::duration<double, std::milli>(clock_type::now() - t).count();
+}
+
+// One block-sized request per call against `blk`, recording the order in
+// which the calls return
+struct ordered {
+    std::atomic<int> next{0};
+    int order[8] = {};
+};
+
+static void run_in_order(io_scheduler &s, ordered &o, cuda_mem::block **blks, char *buf, const char *kinds) {
+    std::vector<std::thread> ts;
+    for (int i = 0; kinds[i]; ++i) {
+        ts.emplace_back([&, i] {
+            segment sg = {blks[i], 0, 4096, buf + i * 4096};
+            if (kinds[i] == 'r') s.read(&sg, 1);
+            else s.write(&sg, 1, false);
+            o.order[i] = o.next++;
+        });
+        // Let each request queue before the next one arrives
+        std::this_thread::sleep_for(std::chrono::milliseconds(4));
+    }
+    for (auto &t : ts) t.join();
+}
+
+int main() {
+    std::cout << "test: io_scheduler starting" << std::endl;
+
+    cuda_mem::host_backend_config hcfg;
+    hcfg.memory = 8 << 20;
+    if (!cuda_mem::select_backend("host", hcfg) || !cuda_mem::init()) {
+        std::cerr << "ERROR: host backend init failed" << std::endl;
+        return 2;
+    }
+    const size_t bs = cuda_mem::block_size();
+    cuda_mem::increase_pool(bs * 64, false);
+
+    // Concurrent requests from many threads land intact, and whole bursts
+    // share batches
+    {
+        io_scheduler s(io_scheduler::config{});
+        const int threads = 8, per = 4;
+        std::vector<cuda_mem::block *> blks(threads * per);
+        for (auto &b : blks) b = cuda_mem::acquire_block();
+        std::vector<char> src(blks.size() * bs), dst(blks.size() * bs);
+        for (size_t i = 0; i < src.size(); ++i) src[i] = (char)(i * 7 + i / bs);
+        std::vector<std::thread> ts;
+        for (int t = 0; t < threads; ++t) {
+            ts.emplace_back([&, t] {
+                std::vector<segment> segs;
+                for (int j = 0; j < per; ++j) {
+                    size_t k = t * per + j;
+                    segs.push_back({blks[k], 0, bs, src.data() + k * bs});
+                }
+                for (int round = 0; round < 20; ++round) {
+                    s.write(segs.data(), segs.size(), round % 2);
+                    for (int j = 0; j < per; ++j) segs[j].data = dst.data() + (t * per + j) * bs;
+                    s.read(segs.data(), segs.size());
+                    for (int j = 0; j < per; ++j) segs[j].data = src.data() + (t * per + j) * bs;
+                }
+            });
+        }
+        for (auto &t : ts) t.join();
+        if (memcmp(src.data(), dst.data(), src.size()) != 0) {
+            std::cerr << "ERROR: scheduled transfers corrupted data" << std::endl;
+            return 3;
+        }
+        if (s.requests(false) != threads * 20 || s.requests(true) != threads * 20 ||
+            s.batches(false) > s.requests(false) || s.batches(true) > s.requests(true)) {
+            std::cerr << "ERROR: scheduler counts off: " << s.requests(false) << " reads in " << s.batches(false)
+                      << " batches, " << s.requests(true) << " writes in " << s.batches(true) << std::endl;
+            return 4;
+        }
+        // Partial segments of one block and holes go through too
+        segment parts[3] = {{blks[0], (off_t)(bs / 2), bs / 2, dst.data() + bs / 2}, {blks[0], 0, bs / 2, dst.data()}, {nullptr, 0, 64, dst.data() + bs}};
+        s.read(parts, 3);
+        if (memcmp(dst.data(), src.data(), bs) != 0 || dst[bs] != 0 || dst[bs + 63] != 0) {
+            std::cerr << "ERROR: unordered partial read wrong" << std::endl;
+            return 5;
+        }
+        cuda_mem::drain();
+        for (auto b : blks) cuda_mem::release_block(b);
+        std::cout << "concurrent scheduling verified: " << s.requests(false) << " reads in " << s.batches(false)
+                  << " batches, " << s.requests(true) << " writes in " << s.batches(true) << std::endl;
+    }
+
+    // With every copy costing 20ms, requests arriving during one batch are
+    // issued together in the next
+    hcfg.latency_ns = 20 * 1000 * 1000;
+    cuda_mem::select_backend("host", hcfg);
+    cuda_mem::init();
+    cuda_mem::increase_pool(bs * 16, false);
+    std::vector<cuda_mem::block *> blks(8);
+    for (auto &b : blks) b = cuda_mem::acquire_block();
+    std::vector<char> buf(8 * 4096);
+    {
+        io_scheduler s(io_scheduler::config{});
+        std::vector<std::thread> ts;
+        for (int i = 0; i < 8; ++i) {
+            ts.emplace_back([&, i] {
+                segment sg = {blks[i], 0, 4096, buf.data() + i * 4096};
+                s.read(&sg, 1);
+            });
+            if (!i) std::this_thread::sleep_for(std::chrono::milliseconds(4));
+        }
+        for (auto &t : ts) t.join();
+        if (s.batches(false) != 2) {
+            std::cerr << "ERROR: expected 8 reads in 2 batches, got " << s.batches(false) << std::endl;
+            return 6;
+        }
+        std::cout << "merging verified" << std::endl;
+    }
+
+    // One request per batch so the order is visible: the first read holds
+    // the device while a write and two more reads queue behind it
+    {
+        io_scheduler::config c;
+        c.order = io_scheduler::STRICT;
+        c.max_batch = 1;
+        io_scheduler s(c);
+        ordered o;
+        run_in_order(s, o, blks.data(), buf.data(), "rwrr");
+        if (o.order[0] != 0 || o.order[1] != 3 || o.order[2] != 1 || o.order[3] != 2) {
+            std::cerr << "ERROR: strict order " << o.order[0] << o.order[1] << o.order[2] << o.order[3] << ", expected 0312" << std::endl;
+            return 7;
+        }
+        c.order = io_scheduler::WEIGHTED;
+        c.read_weight = 1;
+        io_scheduler w(c);
+        ordered p;
+        run_in_order(w, p, blks.data(), buf.data(), "rwrr");
+        if (p.order[0] != 0 || p.order[1] != 2 || p.order[2] != 1 || p.order[3] != 3) {
+            std::cerr << "ERROR: weighted order " << p.order[0] << p.order[1] << p.order[2] << p.order[3] << ", expected 0213" << std::endl;
+            return 8;
+        }
+        std::cout << "read priority verified" << std::endl;
+    }
+
+    // Asynchronous writes wait while a device has write_depth of them in flight
+    {
+        io_scheduler::config c;
+        c.write_depth = 1;
+        io_scheduler s(c);
+        segment a = {blks[0], 0, 4096, buf.data()}, b = {blks[1], 0, 4096, buf.data() + 4096};
+        auto start = clock_type::now();
+        s.write(&a, 1, true);
+        double first = ms_since(start);
+        if (cuda_mem::pending_writes() != 1) {
+            std::cerr << "ERROR: expected one write in flight, got " << cuda_mem::pending_writes() << std::endl;
+            return 9;
+        }
+        s.write(&b, 1, true);
+        double second = ms_since(start);
+        if (first > 10 || second < 15) {
+            std::cerr << "ERROR: write depth not enforced: " << first << "ms, " << second << "ms" << std::endl;
+            return 10;
+        }
+        cuda_mem::wait_pending(0);
+        if (cuda_mem::pending_writes() != 0) {
+            std::cerr << "ERROR: writes still pending after wait_pending(0)" << std::endl;
+            return 11;
+        }
+        std::cout << "write depth verified (" << first << "ms, " << second << "ms)" << std::endl;
+    }
+    for (auto b : blks) cuda_mem::release_block(b);
+    cuda_mem::shutdown();
+
+    // Devices are dispatched independently: a read on one isn't held up by
+    // a write being issued on another
+    hcfg.latency_ns = 100 * 1000 * 1000;
+    cuda_mem::select_backend("host", hcfg);
+    cuda_mem::set_devices({0, 1});
+    if (!cuda_mem::init()) {
+        std::cerr << "ERROR: two-device init failed" << std::endl;
+        return 12;
+    }
+    cuda_mem::increase_pool(bs * 8, false);
+    {
+        io_scheduler s(io_scheduler::config{});
+        cuda_mem::block *b0 = cuda_mem::acquire_block(0), *b1 = cuda_mem::acquire_block(1);
+        segment w = {b0, 0, 4096, buf.data()}, r = {b1, 0, 4096, buf.data() + 4096};
+        std::thread writer([&] { s.write(&w, 1, false); });
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        auto start = clock_type::now();
+        s.read(&r, 1);
+        double took = ms_since(start);
+        writer.join();
+        if (took > 150) {
+            std::cerr << "ERROR: read on device 1 took " << took << "ms behind a write on device 0" << std::endl;
+            return 13;
+        }
+        cuda_mem::release_block(b0);
+        cuda_mem::release_block(b1);
+        std::cout << "per-device dispatch verified (" << took << "ms)" << std::endl;
+    }
+    cuda_mem::shutdown();
+
+    std::cout << "test: io_scheduler passed" << std::endl;
+    return 0;
+}
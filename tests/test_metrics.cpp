@@ -0,0 +1,103 @@
+#include "metrics.hpp"
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <vector>
+#include <cstdio>
+#include <unistd.h>
+
+using namespace vram;
+
+static bool has_line(const std::string &text, const std::string &line) {
+    return text.find(line + "\n") != std::string::npos;
+}
+
+int main() {
+    std::cout << "test: metrics starting" << std::endl;
+
+    metrics::id reads = metrics::counter("t_requests_total", "op=\"read\"", "Requests");
+    metrics::id writes = metrics::counter("t_requests_total", "op=\"write\"", "Requests");
+    metrics::id lat = metrics::histogram("t_duration_seconds", "", "Latency");
+    if (metrics::counter("t_requests_total", "op=\"read\"", "Requests") != reads || reads == writes) {
+        std::cerr << "ERROR: series ids" << std::endl;
+        return 2;
+    }
+    double level = 7;
+    metrics::sampled("t_level", "", "Level", false, [&] { return level; });
+
+    // Threads come and go; shards of exited threads keep their counts
+    for (int round = 0; round < 3; ++round) {
+        std::vector<std::thread> th;
+        for (int t = 0; t < 4; ++t)
+            th.emplace_back([&] {
+                for (int i = 0; i < 10000; ++i) {
+                    metrics::add(reads);
+                    metrics::add(writes, 2);
+                }
+                metrics::observe(lat, 500);       // below the first bound
+                metrics::observe(lat, 3000);      // (2^11, 2^12] ns
+                metrics::observe(lat, 1ULL << 40); // past the last bound
+            });
+        for (auto &x : th) x.join();
+    }
+    if (metrics::value(reads) != 120000 || metrics::value(writes) != 240000 || metrics::count(lat) != 36) {
+        std::cerr << "ERROR: sharded totals " << metrics::value(reads) << " " << metrics::value(writes) << " " << metrics::count(lat) << std::endl;
+        return 2;
+    }
+    if (metrics::bucket_of(0) != 0 || metrics::bucket_of(1024) != 0 || metrics::bucket_of(1025) != 1 || metrics::bucket_of(2048) != 1 || metrics::bucket_of(2049) != 2 || metrics::bucket_of(~0ULL) != metrics::BUCKETS - 1) {
+        std::cerr << "ERROR: bucket boundaries" << std::endl;
+        return 2;
+    }
+
+    std::string text = metrics::render();
+    const char *expect[] = {
+        "# HELP t_requests_total Requests", "# TYPE t_requests_total counter",
+        "t_requests_total{op=\"read\"} 120000", "t_requests_total{op=\"write\"} 240000",
+        "# TYPE t_duration_seconds histogram",
+        "t_duration_seconds_bucket{le=\"1.024e-06\"} 12", "t_duration_seconds_bucket{le=\"4.096e-06\"} 24",
+        "t_duration_seconds_bucket{le=\"34.359738368\"} 24", "t_duration_seconds_bucket{le=\"+Inf\"} 36",
+        "t_duration_seconds_count 36", "# TYPE t_level gauge", "t_level 7"};
+    for (const char *line : expect) {
+        if (!has_line(text, line)) {
+            std::cerr << "ERROR: missing '" << line << "' in:\n" << text << std::endl;
+            return 2;
+        }
+    }
+    if (text.find("# TYPE t_requests_total") != text.rfind("# TYPE t_requests_total")) {
+        std::cerr << "ERROR: family header repeated" << std::endl;
+        return 2;
+    }
+
+    // Published atomically to a file
+    char dir[] = "/tmp/test_metrics_XXXXXX";
+    if (!mkdtemp(dir)) {
+        std::cerr << "ERROR: mkdtemp failed" << std::endl;
+        return 2;
+    }
+    std::string path = std::string(dir) + "/vram.prom";
+    level = 9;
+    if (!metrics::publish(path) || metrics::publish(std::string(dir) + "/missing/vram.prom")) {
+        std::cerr << "ERROR: publish" << std::endl;
+        return 2;
+    }
+    std::ifstream in(path);
+    std::stringstream file;
+    file << in.rdbuf();
+    if (!has_line(file.str(), "t_level 9") || access((path + ".tmp").c_str(), F_OK) == 0) {
+        std::cerr << "ERROR: published file" << std::endl;
+        return 2;
+    }
+    unlink(path.c_str());
+    rmdir(dir);
+
+    metrics::clear();
+    metrics::id again = metrics::counter("t_other_total", "", "Other");
+    if (metrics::render().empty() || metrics::value(again) != 0 || metrics::render().find("t_requests_total") != std::string::npos) {
+        std::cerr << "ERROR: clear" << std::endl;
+        return 2;
+    }
+
+    std::cout << "test: metrics finished" << std::endl;
+    return 0;
+}
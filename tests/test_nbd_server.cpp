@@ -0,0 +1,453 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <map>
+#include <thread>
+#include <chrono>
+#include <cstring>
+#include <csignal>
+#include <endian.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Drives ./bin/nbd_server (host backend, Unix socket) through the NBD
+// handshake and every command, with simple and structured replies.
+
+static const uint64_t IHAVEOPT = 0x49484156454f5054ULL;
+static const uint32_t REQUEST_MAGIC = 0x25609513;
+static const uint64_t EXPORT_SIZE = 16 << 20;
+static const char *SOCKET_PATH = "/tmp/test_nbd_server.sock";
+
+static void put16(char *p, uint16_t v) { v = htobe16(v); memcpy(p, &v, 2); }
+static void put32(char *p, uint32_t v) { v = htobe32(v); memcpy(p, &v, 4); }
+static void put64(char *p, uint64_t v) { v = htobe64(v); memcpy(p, &v, 8); }
+static uint16_t get16(const char *p) { uint16_t v; memcpy(&v, p, 2); return be16toh(v); }
+static uint32_t get32(const char *p) { uint32_t v; memcpy(&v, p, 4); return be32toh(v); }
+static uint64_t get64(const char *p) { uint64_t v; memcpy(&v, p, 8); return be64toh(v); }
+
+static bool read_all(int fd, void *p, size_t n) {
+    for (char *c = static_cast<char *>(p); n;) {
+        ssize_t r = read(fd, c, n);
+        if (r <= 0) return false;
+        c += r; n -= (size_t)r;
+    }
+    return true;
+}
+
+static bool write_all(int fd, const void *p, size_t n) {
+    for (const char *c = static_cast<const char *>(p); n;) {
+        ssize_t r = send(fd, c, n, MSG_NOSIGNAL);
+        if (r <= 0) return false;
+        c += r; n -= (size_t)r;
+    }
+    return true;
+}
+
+static int connect_server() {
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, SOCKET_PATH);
+    for (int i = 0; i < 200; ++i) {
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (connect(fd, (sockaddr *)&addr, sizeof(addr)) == 0) return fd;
+        close(fd);
+        usleep(25000);
+    }
+    return -1;
+}
+
+static bool send_option(int fd, uint32_t opt, const std::string &data) {
+    char h[16];
+    put64(h, IHAVEOPT); put32(h + 8, opt); put32(h + 12, (uint32_t)data.size());
+    return write_all(fd, h, 16) && write_all(fd, data.data(), data.size());
+}
+
+// Next option reply: type and payload
+static bool option_reply(int fd, uint32_t &type, std::string &data) {
+    char h[20];
+    if (!read_all(fd, h, 20)) return false;
+    type = get32(h + 12);
+    data.assign(get32(h + 16), '\0');
+    return data.empty() || read_all(fd, &data[0], data.size());
+}
+
+static std::string go_request(const std::string &name, bool block_size) {
+    std::string d(4 + name.size() + 2 + (block_size ? 2 : 0), '\0');
+    put32(&d[0], (uint32_t)name.size());
+    memcpy(&d[4], name.data(), name.size());
+    put16(&d[4 + name.size()], block_size ? 1 : 0);
+    if (block_size) put16(&d[6 + name.size()], 3);
+    return d;
+}
+
+// Handshake up to transmission; returns the fd or -1
+static int open_export(bool structured) {
+    int fd = connect_server();
+    char greet[18], flags[4];
+    if (fd < 0 || !read_all(fd, greet, 18) || get64(greet + 8) != IHAVEOPT || get16(greet + 16) != 3) return -1;
+    put32(flags, 3);
+    if (!write_all(fd, flags, 4)) return -1;
+    uint32_t type;
+    std::string data;
+    if (structured && (!send_option(fd, 8, "") || !option_reply(fd, type, data) || type != 1)) return -1;
+    if (!send_option(fd, 7, go_request("", false))) return -1;
+    for (;;) {
+        if (!option_reply(fd, type, data)) return -1;
+        if (type == 1) return fd;
+        if (type != 3) return -1;
+    }
+}
+
+static bool send_request(int fd, uint16_t type, uint16_t flags, uint64_t handle, uint64_t offset, uint32_t len, const char *payload = nullptr) {
+    char h[28];
+    put32(h, REQUEST_MAGIC); put16(h + 4, flags); put16(h + 6, type); put64(h + 8, handle); put64(h + 16, offset); put32(h + 24, len);
+    return write_all(fd, h, 28) && (!payload || write_all(fd, payload, len));
+}
+
+// Simple reply: error and handle; a successful read's data follows
+static bool simple_reply(int fd, uint32_t &err, uint64_t &handle) {
+    char h[16];
+    if (!read_all(fd, h, 16) || get32(h) != 0x67446698) return false;
+    err = get32(h + 4); handle = get64(h + 8);
+    return true;
+}
+
+static bool simple(int fd, uint16_t type, uint16_t flags, uint64_t offset, uint32_t len, const char *payload, char *out, uint32_t &err) {
+    static uint64_t next = 1;
+    uint64_t handle = next++, got = 0;
+    if (!send_request(fd, type, flags, handle, offset, len, payload) || !simple_reply(fd, err, got) || got != handle) return false;
+    return type != 0 || err || read_all(fd, out, len);
+}
+
+// Structured read: fills `out` from data and hole chunks; counts them
+static bool structured_read(int fd, uint16_t flags, uint64_t offset, uint32_t len, char *out, uint32_t &err, int &data_chunks, int &hole_chunks) {
+    err = 0; data_chunks = hole_chunks = 0;
+    if (!send_request(fd, 0, flags, 77, offset, len)) return false;
+    for (;;) {
+        char h[20];
+        if (!read_all(fd, h, 20) || get32(h) != 0x668e33ef || get64(h + 8) != 77) return false;
+        uint16_t cflags = get16(h + 4), type = get16(h + 6);
+        std::string p(get32(h + 16), '\0');
+        if (!p.empty() && !read_all(fd, &p[0], p.size())) return false;
+        if (type == 1) {
+            uint64_t at = get64(&p[0]);
+            memcpy(out + (at - offset), p.data() + 8, p.size() - 8);
+            ++data_chunks;
+        }
+        else if (type == 2) {
+            memset(out + (get64(&p[0]) - offset), 0, get32(&p[8]));
+            ++hole_chunks;
+        }
+        else if (type == 32769) err = get32(&p[0]);
+        if (cflags & 1) return true;
+    }
+}
+
+static void fill(std::vector<char> &v, size_t off, size_t len, unsigned seed) {
+    for (size_t i = 0; i < len; ++i) v[off + i] = (char)((i * 31 + seed) >> 3);
+}
+
+static int run_tests() {
+    std::vector<char> model(EXPORT_SIZE, 0), buf(4 << 20);
+    uint32_t err = 0;
+
+    // Negotiation: export list, block sizes, unknown names and options
+    int fd = connect_server();
+    char greet[18], flags[4];
+    put32(flags, 3);
+    if (fd < 0 || !read_all(fd, greet, 18) || !write_all(fd, flags, 4)) {
+        std::cerr << "ERROR: greeting" << std::endl;
+        return 2;
+    }
+    uint32_t type;
+    std::string data;
+    if (!send_option(fd, 3, "") || !option_reply(fd, type, data) || type != 2 || data.substr(4) != "vram" || !option_reply(fd, type, data) || type != 1) {
+        std::cerr << "ERROR: LIST" << std::endl;
+        return 2;
+    }
+    if (!send_option(fd, 42, "") || !option_reply(fd, type, data) || type != 0x80000001) {
+        std::cerr << "ERROR: unknown option not refused" << std::endl;
+        return 2;
+    }
+    if (!send_option(fd, 7, go_request("other", false)) || !option_reply(fd, type, data) || type != 0x80000006) {
+        std::cerr << "ERROR: unknown export not refused" << std::endl;
+        return 2;
+    }
+    bool export_info = false, block_info = false;
+    if (!send_option(fd, 7, go_request("vram", true))) return 2;
+    while (option_reply(fd, type, data) && type == 3) {
+        if (get16(&data[0]) == 0) export_info = get64(&data[2]) == EXPORT_SIZE && (get16(&data[10]) & 1);
+        if (get16(&data[0]) == 3) block_info = get32(&data[2]) == 1 && get32(&data[6]) == 4096 && get32(&data[10]) >= (1 << 20);
+    }
+    if (type != 1 || !export_info || !block_info) {
+        std::cerr << "ERROR: GO replies" << std::endl;
+        return 2;
+    }
+
+    // Unwritten space reads as zeros
+    if (!simple(fd, 0, 0, 0, 256 << 10, nullptr, buf.data(), err) || err || memcmp(buf.data(), model.data(), 256 << 10)) {
+        std::cerr << "ERROR: fresh read" << std::endl;
+        return 2;
+    }
+
+    // Unaligned writes spanning blocks, and one larger than the pinned buffer
+    struct { uint64_t off; uint32_t len; } writes[] = {{1000, 200000}, {65536, 65536}, {5 << 20, 3 << 20}, {EXPORT_SIZE - 4096, 4096}};
+    unsigned seed = 1;
+    for (auto &w : writes) {
+        fill(model, w.off, w.len, seed++);
+        if (!simple(fd, 1, 0, w.off, w.len, model.data() + w.off, nullptr, err) || err) {
+            std::cerr << "ERROR: write at " << w.off << std::endl;
+            return 2;
+        }
+    }
+    for (uint64_t off = 0; off < EXPORT_SIZE; off += 4 << 20) {
+        if (!simple(fd, 0, 0, off, 4 << 20, nullptr, buf.data(), err) || err || memcmp(buf.data(), model.data() + off, 4 << 20)) {
+            std::cerr << "ERROR: read back at " << off << std::endl;
+            return 2;
+        }
+    }
+
+    // Trim (whole and partial blocks), write-zeroes with and without NO_HOLE, FUA, flush
+    memset(model.data() + 30000, 0, 140000);
+    memset(model.data() + (5 << 20) + 100, 0, 200000);
+    memset(model.data() + (6 << 20), 0, 65536);
+    if (!simple(fd, 4, 0, 30000, 140000, nullptr, nullptr, err) || err ||
+        !simple(fd, 6, 1, (5 << 20) + 100, 200000, nullptr, nullptr, err) || err ||
+        !simple(fd, 6, 2, 6 << 20, 65536, nullptr, nullptr, err) || err ||
+        !simple(fd, 3, 0, 0, 0, nullptr, nullptr, err) || err) {
+        std::cerr << "ERROR: trim/zero/flush" << std::endl;
+        return 2;
+    }
+    for (uint64_t off : {0ULL, 4ULL << 20, 8ULL << 20}) {
+        if (!simple(fd, 0, 0, off, 4 << 20, nullptr, buf.data(), err) || err || memcmp(buf.data(), model.data() + off, 4 << 20)) {
+            std::cerr << "ERROR: read after trim at " << off << std::endl;
+            return 2;
+        }
+    }
+
+    // Out of range requests fail; the connection stays usable
+    if (!simple(fd, 0, 0, EXPORT_SIZE - 10, 20, nullptr, buf.data(), err) || err != 22 ||
+        !simple(fd, 1, 0, EXPORT_SIZE, 512, buf.data(), nullptr, err) || err != 28 ||
+        !simple(fd, 9, 0, 0, 0, nullptr, nullptr, err) || err != 22) {
+        std::cerr << "ERROR: invalid requests" << std::endl;
+        return 2;
+    }
+
+    // Requests sent back to back without waiting; replies matched by handle
+    std::map<uint64_t, uint64_t> offsets;
+    for (uint64_t h = 100; h < 116; ++h) {
+        offsets[h] = (h - 100) * 70000;
+        if (!send_request(fd, 0, 0, h, offsets[h], 4096)) return 2;
+    }
+    for (int i = 0; i < 16; ++i) {
+        uint64_t h = 0;
+        if (!simple_reply(fd, err, h) || err || !offsets.count(h) || !read_all(fd, buf.data(), 4096) || memcmp(buf.data(), model.data() + offsets[h], 4096)) {
+            std::cerr << "ERROR: pipelined reads" << std::endl;
+            return 2;
+        }
+        offsets.erase(h);
+    }
+
+    // More requests than the queue depth, reads and writes mixed: replies
+    // come back as transfers finish, overlapping writes land in order
+    // (sent from a thread, like a real client, so neither side's socket fills up)
+    std::vector<char> payload(300 * 8192);
+    std::map<uint64_t, int> kinds;
+    std::vector<uint64_t> offs;
+    for (uint64_t h = 200; h < 500; ++h) {
+        uint64_t off = (h % 3 == 0) ? (3 << 20) : (h - 200) * 12288 + 512;
+        bool write = h % 3 != 1;
+        if (write) {
+            std::vector<char> tmp(8192);
+            fill(tmp, 0, 8192, (unsigned)h);
+            memcpy(payload.data() + (h - 200) * 8192, tmp.data(), 8192);
+            memcpy(model.data() + off, tmp.data(), 8192);
+        }
+        kinds[h] = write;
+        offs.push_back(off);
+    }
+    std::map<uint64_t, int> is_write = kinds;
+    bool sent = true;
+    std::thread sender([&] {
+        for (uint64_t h = 200; h < 500; ++h)
+            sent = sent && send_request(fd, is_write[h] ? 1 : 0, 0, h, offs[h - 200], 8192, is_write[h] ? payload.data() + (h - 200) * 8192 : nullptr);
+    });
+    for (int i = 0; i < 300; ++i) {
+        uint64_t h = 0;
+        if (!simple_reply(fd, err, h) || err || !kinds.count(h) || (!kinds[h] && !read_all(fd, buf.data(), 8192))) {
+            std::cerr << "ERROR: queue depth replies" << std::endl;
+            sender.detach();
+            return 2;
+        }
+        kinds.erase(h);
+    }
+    sender.join();
+    if (!sent) {
+        std::cerr << "ERROR: sending pipelined requests" << std::endl;
+        return 2;
+    }
+    for (uint64_t off = 0; off < EXPORT_SIZE; off += 4 << 20) {
+        if (!simple(fd, 0, 0, off, 4 << 20, nullptr, buf.data(), err) || err || memcmp(buf.data(), model.data() + off, 4 << 20)) {
+            std::cerr << "ERROR: read back after pipelined writes at " << off << std::endl;
+            return 2;
+        }
+    }
+
+    // Structured replies on a second connection see the first one's writes
+    int sfd = open_export(true);
+    int data_chunks = 0, hole_chunks = 0;
+    if (sfd < 0 || !structured_read(sfd, 0, 7 << 20, 2 << 20, buf.data(), err, data_chunks, hole_chunks) || err || memcmp(buf.data(), model.data() + (7 << 20), 2 << 20) || !data_chunks || !hole_chunks) {
+        std::cerr << "ERROR: structured read " << data_chunks << " " << hole_chunks << std::endl;
+        return 2;
+    }
+    if (!structured_read(sfd, 4, 7 << 20, 2 << 20, buf.data(), err, data_chunks, hole_chunks) || err || data_chunks != 1 || hole_chunks || memcmp(buf.data(), model.data() + (7 << 20), 2 << 20)) {
+        std::cerr << "ERROR: structured read with DF" << std::endl;
+        return 2;
+    }
+    if (!structured_read(sfd, 0, EXPORT_SIZE, 4096, buf.data(), err, data_chunks, hole_chunks) || err != 22) {
+        std::cerr << "ERROR: structured error chunk" << std::endl;
+        return 2;
+    }
+
+    // Disconnect closes the connection
+    if (!send_request(fd, 2, 0, 1, 0, 0) || read(fd, buf.data(), 1) != 0) {
+        std::cerr << "ERROR: disconnect" << std::endl;
+        return 2;
+    }
+    close(fd);
+    close(sfd);
+    return 0;
+}
+
+// A write the pool can't hold fails whole: blocks it took before running
+// out go back, and none of their stale contents becomes readable
+static int run_enospc_tests() {
+    std::vector<char> buf(4 << 20), zeros(4 << 20, 0);
+    uint32_t err = 0;
+    int fd = open_export(false);
+    if (fd < 0) return 3;
+    // Fill the pool, then give half of it back holding 0xAA
+    std::vector<char> aa(4 << 20, (char)0xaa);
+    for (uint64_t off = 0; off < (8 << 20); off += 4 << 20) {
+        if (!simple(fd, 1, 0, off, 4 << 20, aa.data(), nullptr, err) || err) {
+            std::cerr << "ERROR: filling the pool at " << off << std::endl;
+            return 3;
+        }
+    }
+    if (!simple(fd, 4, 0, 0, 8 << 20, nullptr, nullptr, err) || err) {
+        std::cerr << "ERROR: trimming the pool" << std::endl;
+        return 3;
+    }
+    // Needs more blocks than the pool has; the first one it takes is partial
+    std::vector<char> big(9 << 20, 0x55);
+    if (!simple(fd, 1, 0, 60 << 10, 9 << 20, big.data(), nullptr, err) || err != 28) {
+        std::cerr << "ERROR: oversized write returned " << err << ", expected ENOSPC" << std::endl;
+        return 3;
+    }
+    if (!simple(fd, 6, 2, 60 << 10, (16 << 20) - (64 << 10), nullptr, nullptr, err) || err != 28) {
+        std::cerr << "ERROR: oversized write-zeroes returned " << err << ", expected ENOSPC" << std::endl;
+        return 3;
+    }
+    for (uint64_t off = 0; off < (16 << 20); off += 4 << 20) {
+        if (!simple(fd, 0, 0, off, 4 << 20, nullptr, buf.data(), err) || err || memcmp(buf.data(), zeros.data(), 4 << 20)) {
+            std::cerr << "ERROR: stale data readable after ENOSPC at " << off << std::endl;
+            return 3;
+        }
+    }
+    // The blocks went back to the pool: a write that fits still succeeds
+    if (!simple(fd, 1, 0, 60 << 10, 4 << 20, big.data(), nullptr, err) || err ||
+        !simple(fd, 0, 0, 0, 4 << 20, nullptr, buf.data(), err) || err ||
+        memcmp(buf.data(), zeros.data(), 60 << 10) || memcmp(buf.data() + (60 << 10), big.data(), (4 << 20) - (60 << 10))) {
+        std::cerr << "ERROR: write after ENOSPC" << std::endl;
+        return 3;
+    }
+    close(fd);
+    return 0;
+}
+
+// FLUSH and FUA wait for the device off the event loop: with slow device
+// operations, a read on another connection of the same loop is answered
+// while they are still waiting
+static int run_flush_tests() {
+    typedef std::chrono::steady_clock clock_type;
+    std::vector<char> buf(4096);
+    uint32_t err = 0;
+    uint64_t handle = 0;
+    int a = open_export(false), b = open_export(false);
+    if (a < 0 || b < 0) return 4;
+    auto t0 = clock_type::now();
+    if (!send_request(a, 6, 3, 1, 0, 4096) || !send_request(a, 3, 0, 2, 0, 0)) return 4;
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    auto t1 = clock_type::now();
+    if (!simple(b, 0, 0, 8 << 20, 4096, nullptr, buf.data(), err) || err) {
+        std::cerr << "ERROR: read during a flush failed" << std::endl;
+        return 4;
+    }
+    auto read_ms = std::chrono::duration_cast<std::chrono::milliseconds>(clock_type::now() - t1).count();
+    for (uint64_t want = 1; want <= 2; ++want) {
+        if (!simple_reply(a, err, handle) || err || handle != want) {
+            std::cerr << "ERROR: reply " << want << " to FUA write-zeroes and flush" << std::endl;
+            return 4;
+        }
+    }
+    auto flush_ms = std::chrono::duration_cast<std::chrono::milliseconds>(clock_type::now() - t0).count();
+    if (flush_ms < 150 || read_ms > 100) {
+        std::cerr << "ERROR: read took " << read_ms << " ms behind a flush of " << flush_ms << " ms" << std::endl;
+        return 4;
+    }
+    close(a);
+    close(b);
+    return 0;
+}
+
+static pid_t start_server(std::vector<const char *> args) {
+    unlink(SOCKET_PATH);
+    args.push_back(nullptr);
+    pid_t pid = fork();
+    if (pid == 0) {
+        execv("./bin/nbd_server", const_cast<char *const *>(args.data()));
+        _exit(127);
+    }
+    return pid;
+}
+
+static bool stop_server(pid_t pid) {
+    kill(pid, SIGTERM);
+    int status = 0;
+    waitpid(pid, &status, 0);
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 0) return true;
+    std::cerr << "ERROR: server exit status " << status << std::endl;
+    return false;
+}
+
+// Extra arguments go to the server (e.g. --queue-depth 2 --buffers 1)
+int main(int argc, char **argv) {
+    std::cout << "test: nbd_server starting" << std::endl;
+    std::vector<const char *> args = {"nbd_server", "--backend", "host", "--host-memory", "64M", "--size", "16M",
+                                      "--socket", SOCKET_PATH, "--threads", "2"};
+    args.insert(args.end(), argv + 1, argv + argc);
+    pid_t pid = start_server(args);
+    int rc = run_tests();
+    if (!stop_server(pid) && !rc) rc = 2;
+    if (rc) return rc;
+
+    // Half the export fits in device memory
+    args[4] = "8M";
+    pid = start_server(args);
+    rc = run_enospc_tests();
+    if (!stop_server(pid) && !rc) rc = 3;
+    if (rc) return rc;
+
+    // One event loop, and 200 ms for every device operation
+    args[4] = "64M";
+    args[10] = "1";
+    args.push_back("--host-latency-us");
+    args.push_back("200000");
+    pid = start_server(args);
+    rc = run_flush_tests();
+    if (!stop_server(pid) && !rc) rc = 4;
+    if (!rc) std::cout << "test: nbd_server finished" << std::endl;
+    return rc;
+}
@@ -0,0 +1,404 @@
+#include "nbdkit_shim.hpp"
+#include "cuda_memory.hpp"
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <string>
+#include <thread>
+#include <chrono>
+#include <random>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+#include <sys/wait.h>
+
+// Drives the plugin's entry points in-process through the nbdkit shim: every
+// write goes to a shadow copy of the export as well, and reads, extents and the
+// metrics file are checked against it. nbdkit loads a plugin once per process,
+// so each configuration runs in a child of its own.
+
+static const size_t BLK = 64 * 1024;
+static const size_t SIZE = 4 << 20;
+
+static nbdkit_plugin *p;
+static void *h;
+static std::vector<uint8_t> shadow;
+static std::string tmp;
+
+static bool start(const std::vector<std::string> &keys) {
+    p = plugin_init();
+    std::vector<std::string> all = {"backend=host", "host_memory=16M", "size=" + std::to_string(SIZE)};
+    all.insert(all.end(), keys.begin(), keys.end());
+    for (const std::string &kv : all) {
+        size_t eq = kv.find('=');
+        if (p->config(kv.substr(0, eq).c_str(), kv.substr(eq + 1).c_str())) return false;
+    }
+    if (p->config_complete && p->config_complete()) return false;
+    h = p->open(0);
+    shadow.assign(SIZE, 0);
+    return p->get_size(h) == (int64_t)SIZE;
+}
+
+static void stop() {
+    p->close(h);
+    p->unload();
+}
+
+static bool write_at(size_t off, const std::vector<uint8_t> &data) {
+    if (p->pwrite(h, data.data(), (uint32_t)data.size(), off, 0)) {
+        std::cerr << "ERROR: pwrite of " << data.size() << " at " << off << " failed" << std::endl;
+        return false;
+    }
+    memcpy(&shadow[off], data.data(), data.size());
+    return true;
+}
+
+// Trim, or write zeroes with `zero_flags` (without NBDKIT_FLAG_MAY_TRIM the
+// client asked for NO_HOLE)
+static bool trim_at(size_t off, size_t len, bool zero, uint32_t zero_flags = NBDKIT_FLAG_MAY_TRIM) {
+    int r = zero ? p->zero(h, (uint32_t)len, off, zero_flags) : p->trim(h, (uint32_t)len, off, 0);
+    if (r) {
+        std::cerr << "ERROR: " << (zero ? "zero" : "trim") << " of " << len << " at " << off << " failed" << std::endl;
+        return false;
+    }
+    memset(&shadow[off], 0, len);
+    return true;
+}
+
+static bool check(size_t off, size_t len, const char *what) {
+    std::vector<uint8_t> out(len, 0xee);
+    if (p->pread(h, out.data(), (uint32_t)len, off, 0)) {
+        std::cerr << "ERROR: " << what << ": pread of " << len << " at " << off << " failed" << std::endl;
+        return false;
+    }
+    for (size_t i = 0; i < len; ++i) {
+        if (out[i] != shadow[off + i]) {
+            std::cerr << "ERROR: " << what << ": byte " << off + i << " is " << (int)out[i] << ", expected " << (int)shadow[off + i] << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool check_all(const char *what) {
+    for (size_t off = 0; off < SIZE; off += 1 << 20)
+        if (!check(off, 1 << 20, what)) return false;
+    return true;
+}
+
+static std::vector<uint8_t> noise(size_t len, uint64_t seed) {
+    std::vector<uint8_t> v(len);
+    std::mt19937_64 rng(seed);
+    for (auto &b : v) b = (uint8_t)rng();
+    return v;
+}
+
+// Extents of the whole export as "H" (hole, reads as zeros) and "D" (data)
+// runs in 64K blocks, e.g. "1H 3D 60H"
+static std::string extent_map() {
+    nbdkit_extents e;
+    if (p->extents(h, SIZE, 0, 0, &e)) return "failed";
+    std::string out;
+    uint64_t pos = 0;
+    for (const shim_extent &x : e.list) {
+        if (x.offset != pos || x.offset % BLK || x.length % BLK) return "misaligned";
+        if (!out.empty()) out += " ";
+        out += std::to_string(x.length / BLK) + (x.type == (NBDKIT_EXTENT_HOLE | NBDKIT_EXTENT_ZERO) ? "H" : x.type ? "?" : "D");
+        pos += x.length;
+    }
+    return pos == SIZE ? out : "short";
+}
+
+static bool expect_extents(const std::string &want, const char *what) {
+    std::string got = extent_map();
+    if (got != want) {
+        std::cerr << "ERROR: " << what << ": extents " << got << ", expected " << want << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// A metric's value from the Prometheus text file, -1 if it isn't there
+static double metric(const std::string &path, const std::string &series) {
+    std::ifstream f(path);
+    std::string line;
+    while (std::getline(f, line))
+        if (!line.compare(0, series.size() + 1, series + " ")) return atof(line.c_str() + series.size() + 1);
+    return -1;
+}
+
+// Random writes, reads, trims, zeros and flushes from several threads, each
+// in its own slice of the export, checked against the shadow as they go
+static bool stress(int threads, int ops) {
+    std::vector<std::thread> ts;
+    std::vector<int> failed(threads, 0);
+    for (int t = 0; t < threads; ++t) {
+        ts.emplace_back([&, t] {
+            std::mt19937_64 rng(t + 1);
+            size_t slice = SIZE / threads, base = t * slice;
+            std::vector<uint8_t> buf(3 * BLK);
+            for (int i = 0; i < ops && !failed[t]; ++i) {
+                size_t len = rng() % 2 ? 4096 * (1 + rng() % 4) : 1 + rng() % buf.size();
+                size_t off = base + rng() % (slice - len);
+                if (rng() % 2) off &= ~(size_t)4095;
+                int op = rng() % 10;
+                if (op < 4) {
+                    uint8_t v = (uint8_t)rng();
+                    bool same = rng() % 4 == 0;
+                    for (size_t k = 0; k < len; ++k) buf[k] = same ? v : (uint8_t)(v + k * 13 + (k >> 9));
+                    memcpy(&shadow[off], buf.data(), len);
+                    if (p->pwrite(h, buf.data(), (uint32_t)len, off, 0)) failed[t] = 1;
+                }
+                else if (op < 8) {
+                    if (p->pread(h, buf.data(), (uint32_t)len, off, 0) || memcmp(buf.data(), &shadow[off], len)) failed[t] = 2;
+                }
+                else if (op == 8) {
+                    memset(&shadow[off], 0, len);
+                    if (rng() % 2 ? p->trim(h, (uint32_t)len, off, 0) : p->zero(h, (uint32_t)len, off, 0)) failed[t] = 3;
+                }
+                else if (p->flush(h, 0)) failed[t] = 4;
+            }
+        });
+    }
+    for (auto &t : ts) t.join();
+    for (int t = 0; t < threads; ++t) {
+        if (failed[t]) {
+            std::cerr << "ERROR: stress thread " << t << " failed (" << failed[t] << ")" << std::endl;
+            return false;
+        }
+    }
+    return p->flush(h, 0) == 0 && check_all("after stress");
+}
+
+// Unwritten blocks are holes, written ones data; trim and zero return whole
+// blocks to the pool and clear partial ranges in place
+static int basic() {
+    std::string prom = tmp + ".prom";
+    if (!start({"populate=eager", "metrics=" + prom})) return 2;
+    if (!expect_extents("64H", "fresh export") || !check(0, 2 * BLK, "fresh export")) return 3;
+    if (!write_at(BLK, noise(3 * BLK, 1)) || !write_at(4 * BLK + 300, noise(1000, 2))) return 4;
+    if (!expect_extents("1H 4D 59H", "after writes") || !check(0, 6 * BLK, "after writes")) return 5;
+
+    // A block of one repeated word is kept as the word, an all-zero one not at all
+    if (!write_at(10 * BLK, std::vector<uint8_t>(BLK, 0xa5)) || !write_at(11 * BLK, noise(BLK, 3)) ||
+        !write_at(11 * BLK, std::vector<uint8_t>(BLK, 0))) return 6;
+    if (!expect_extents("1H 4D 5H 1D 53H", "fill words") || !check(9 * BLK, 4 * BLK, "fill words")) return 7;
+    std::vector<uint8_t> tail(BLK / 2, 0xa5);
+    tail[7] = 1;
+    if (!write_at(10 * BLK + BLK / 2, tail) || !check(10 * BLK, BLK, "partial write over a fill word")) return 8;
+
+    // Whole blocks go back to the pool; partial ranges are cleared in place
+    if (!trim_at(2 * BLK, BLK, false) || !trim_at(BLK + 100, 500, false) || !trim_at(3 * BLK, BLK + 10, true)) return 9;
+    if (!expect_extents("1H 1D 2H 1D 5H 1D 53H", "after trim and zero") || !check_all("after trim and zero")) return 10;
+    // Without MAY_TRIM the range stays allocated, holes included
+    if (!trim_at(4 * BLK, 2 * BLK + 100, true, 0)) return 11;
+    if (!expect_extents("1H 1D 2H 3D 3H 1D 53H", "after zeroing with NO_HOLE") || !check_all("after zeroing with NO_HOLE")) return 12;
+    if (!trim_at(0, SIZE, true) || !expect_extents("64H", "after zeroing everything") || !check_all("after zeroing everything")) return 13;
+    if (!stress(4, 2000)) return 14;
+    stop();
+
+    // Device blocks 1, 2, 3 and 4 were given back by trim and zero; the fill
+    // word and block 11 held none
+    double released = metric(prom, "vram_released_blocks_total");
+    unlink(prom.c_str());
+    if (released < 4) {
+        std::cerr << "ERROR: vram_released_blocks_total " << released << ", expected at least 4" << std::endl;
+        return 15;
+    }
+    return 0;
+}
+
+// With the pool capped below the export and no spill file, writes past it
+// fail with ENOSPC, and are counted as such. Write zeroes with NO_HOLE still
+// keeps holes allocated, and trim skips a partial block it would need device
+// memory for.
+static int full_pool() {
+    std::string limit = tmp + ".limit", prom = tmp + ".prom";
+    std::ofstream(limit) << "1M\n";
+    if (!start({"elastic_limit=" + limit, "populate=eager", "metrics=" + prom})) return 2;
+    if (!write_at(0, std::vector<uint8_t>(BLK, 0xa5))) return 3;
+    size_t b = 1;
+    for (shim_error = 0; b < SIZE / BLK; ++b) {
+        std::vector<uint8_t> data = noise(BLK, b);
+        if (p->pwrite(h, data.data(), BLK, b * BLK, 0)) break;
+        memcpy(&shadow[b * BLK], data.data(), BLK);
+    }
+    if (b == SIZE / BLK || shim_error != ENOSPC) {
+        std::cerr << "ERROR: write to a full pool: error " << shim_error << ", expected ENOSPC" << std::endl;
+        return 4;
+    }
+    // Clearing part of the fill-word block needs a device block
+    shim_error = 0;
+    if (p->zero(h, 100, 10, NBDKIT_FLAG_MAY_TRIM) != -1 || shim_error != ENOSPC) {
+        std::cerr << "ERROR: partial zero in a full pool: error " << shim_error << ", expected ENOSPC" << std::endl;
+        return 5;
+    }
+    if (p->trim(h, 100, 10, 0) || !check(0, BLK, "skipped partial trim")) return 6;
+    if (!trim_at(b * BLK, 2 * BLK, true, 0)) return 7;
+    if (!expect_extents(std::to_string(b + 2) + "D " + std::to_string(SIZE / BLK - b - 2) + "H", "holes zeroed with NO_HOLE")) return 8;
+    // A whole-block trim gives the partial zero its device block
+    if (!trim_at(BLK, BLK, false) || !trim_at(10, 100, true) || !check_all("after freeing a block")) return 9;
+    stop();
+    unlink(limit.c_str());
+    double enospc = metric(prom, "vram_request_errors_total{error=\"ENOSPC\"}"), eio = metric(prom, "vram_request_errors_total{error=\"EIO\"}");
+    unlink(prom.c_str());
+    if (enospc != 2 || eio != 0) {
+        std::cerr << "ERROR: " << enospc << " ENOSPC and " << eio << " EIO errors counted, expected 2 and 0" << std::endl;
+        return 10;
+    }
+    return 0;
+}
+
+// Sub-block writes stay in staging buffers until flushed, and reads see them
+static int write_back() {
+    if (!start({"write_back=1M", "write_back_age_ms=10000", "staging_buffers=8"})) return 2;
+    for (size_t b = 0; b < 4; ++b)
+        for (size_t page = 1; page < 16; page += 3)
+            if (!write_at(b * BLK + page * 4096, noise(4096, b * 100 + page))) return 3;
+    if (!write_at(BLK + 4096 + 7, noise(100, 9)) || !write_at(2 * BLK - 50, noise(100, 10))) return 4;
+    if (!check(0, 5 * BLK, "staged writes")) return 5;
+    // A whole-block write replaces a staged one, a trim drops one
+    if (!write_at(0, noise(BLK, 11)) || !trim_at(3 * BLK, BLK, false)) return 6;
+    if (!check(0, 5 * BLK, "overwritten staged blocks") || !expect_extents("3D 61H", "staged blocks")) return 7;
+    if (p->flush(h, 0) || !check_all("after flush")) return 8;
+    if (!stress(4, 2000)) return 9;
+    stop();
+    return 0;
+}
+
+// Staged blocks on several devices with few staging buffers each: async
+// writers must not starve the flusher of buffers it needs to make progress
+static int write_back_devices() {
+    if (!start({"devices=0,1,2", "write_back=1M", "write_back_age_ms=5", "staging_buffers=2"})) return 2;
+    if (!stress(8, 2000)) return 3;
+    stop();
+    return 0;
+}
+
+// Cached blocks follow writes, trims and zeros
+static int read_cache() {
+    if (!start({"read_cache=1M"})) return 2;
+    if (!write_at(0, noise(8 * BLK, 1))) return 3;
+    for (int round = 0; round < 2; ++round)
+        if (!check(0, 8 * BLK, "cached reads")) return 4;
+    if (!write_at(BLK + 4096, noise(8192, 2)) || !check(0, 8 * BLK, "after overwriting cached data")) return 5;
+    if (!trim_at(2 * BLK, BLK, false) || !trim_at(3 * BLK + 10, 20, true) || !check(0, 8 * BLK, "after trimming cached data")) return 6;
+    if (!stress(4, 2000)) return 7;
+    stop();
+    return 0;
+}
+
+// Compressible blocks are packed, the rest raw; partial writes and trims work on both
+static int compress() {
+    if (!start({"compress=lz4"})) return 2;
+    std::vector<uint8_t> text(BLK);
+    for (size_t i = 0; i < BLK; ++i) text[i] = "swap pages compress well "[i % 25];
+    if (!write_at(0, text) || !write_at(BLK, noise(BLK, 1)) || !write_at(2 * BLK, text)) return 3;
+    if (!check(0, 3 * BLK, "packed and raw blocks") || !expect_extents("3D 61H", "packed blocks")) return 4;
+    if (!write_at(100, noise(300, 2)) || !write_at(2 * BLK + 4096, std::vector<uint8_t>(4096, 0))) return 5;
+    if (!trim_at(BLK / 2, BLK, true) || !check(0, 3 * BLK, "partial writes to packed blocks")) return 6;
+    if (!stress(4, 2000)) return 7;
+    stop();
+    return 0;
+}
+
+// With placement=capacity compressed blocks go to the device with the most
+// free blocks, not to their stripe
+static int compress_capacity() {
+    using namespace vram::cuda_mem;
+    if (!start({"devices=0,1", "placement=capacity", "compress=lz4", "populate=eager"})) return 2;
+    // Images that compress to a bit over a third of a block, two to a pool block
+    for (size_t b = 0; b < 16; b += 2) {
+        std::vector<uint8_t> img = noise(BLK * 3 / 8, b);
+        img.resize(BLK, 0);
+        if (!write_at(b * BLK, img)) return 3;
+    }
+    int used0 = pool_size(0) - pool_available(0), used1 = pool_size(1) - pool_available(1);
+    if (used0 + used1 < 4 || std::abs(used0 - used1) > 1) {
+        std::cerr << "ERROR: compressed blocks took " << used0 << " and " << used1 << " pool blocks on the two devices" << std::endl;
+        return 4;
+    }
+    if (!check_all("compressed blocks placed by capacity")) return 5;
+    stop();
+    return 0;
+}
+
+// With a pool smaller than the export, writes overflow to the spill file
+static int spill() {
+    std::string file = tmp + ".spill";
+    if (!start({"host_memory=2M", "spill=" + file})) return 2;
+    if (!write_at(0, noise(SIZE, 1)) || !check_all("spilled blocks")) return 3;
+    if (!expect_extents("64D", "spilled blocks")) return 4;
+    if (!trim_at(BLK, 10 * BLK, false) || !write_at(5 * BLK + 3, noise(5000, 2)) || !check_all("after trimming spilled blocks")) return 5;
+    if (!stress(4, 2000)) return 6;
+    stop();
+    unlink(file.c_str());
+    return 0;
+}
+
+// Waits for the pool to shrink to at most 16 blocks, or to regrow to 64 with
+// at least 56 of them holding data
+static bool wait_pool(bool shrink) {
+    using namespace vram::cuda_mem;
+    for (int i = 0; i < 500; ++i) {
+        int total = pool_size(), used = total - pool_available();
+        if (shrink ? total <= 16 : total >= 64 && used >= 56) return true;
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    std::cerr << "ERROR: pool stayed at " << pool_size() << " blocks, " << pool_available() << " free" << std::endl;
+    return false;
+}
+
+// An elastic_limit below the data moves blocks to the spill file; lifting it
+// regrows the pool and brings them back
+static int elastic() {
+    std::string file = tmp + ".spill", limit = tmp + ".limit";
+    if (!start({"spill=" + file, "elastic_limit=" + limit, "elastic_interval_ms=10"})) return 2;
+    if (!write_at(0, noise(SIZE, 1))) return 3;
+    std::ofstream(limit) << "1M\n";
+    if (!wait_pool(true)) return 4;
+    if (!check_all("shrunk pool") || !write_at(7 * BLK + 11, noise(3 * BLK, 2)) || !check_all("writes to a shrunk pool")) return 5;
+    unlink(limit.c_str());
+    // Blocks come back until an eighth of the pool is left free for new writes
+    if (!wait_pool(false)) return 6;
+    if (!check_all("regrown pool")) return 7;
+    stop();
+    unlink(file.c_str());
+    return 0;
+}
+
+static bool run(const char *name, int (*scenario)()) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        // A deadlocked scenario fails instead of hanging the test
+        alarm(120);
+        _exit(scenario());
+    }
+    int status = 0;
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+        std::cerr << "ERROR: " << name << " failed (" << (WIFEXITED(status) ? WEXITSTATUS(status) : -WTERMSIG(status)) << ")" << std::endl;
+        return false;
+    }
+    std::cout << name << " verified" << std::endl;
+    return true;
+}
+
+int main() {
+    std::cout << "test: plugin starting" << std::endl;
+    shim_name = "test_plugin";
+    tmp = "/tmp/test_plugin." + std::to_string(getpid());
+
+    if (!run("trim, zero, extents and fill words", basic)) return 2;
+    if (!run("full pool", full_pool)) return 3;
+    if (!run("write-back staging", write_back)) return 4;
+    if (!run("write-back over several devices", write_back_devices)) return 5;
+    if (!run("read cache", read_cache)) return 6;
+    if (!run("compression", compress)) return 7;
+    if (!run("compression placed by capacity", compress_capacity)) return 8;
+    if (!run("spill", spill)) return 9;
+    if (!run("elastic shrink and regrow", elastic)) return 10;
+
+    std::cout << "test: plugin passed" << std::endl;
+    return 0;
+}
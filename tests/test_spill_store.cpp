@@ -0,0 +1,116 @@
+#include "spill_store.hpp"
+#include <iostream>
+#include <vector>
+#include <set>
+#include <cstring>
+#include <cstdlib>
+#include <unistd.h>
+
+using namespace vram;
+
+int main() {
+    std::cout << "test: spill_store starting" << std::endl;
+
+    char path[] = "/tmp/test_spill_XXXXXX";
+    int tmp = mkstemp(path);
+    if (tmp < 0) {
+        std::cerr << "ERROR: mkstemp failed" << std::endl;
+        return 2;
+    }
+    close(tmp);
+
+    const size_t slot_size = 4096, nslots = 8;
+    {
+        spill_store s(path, nslots * slot_size + 100, slot_size);
+        if (!s.enabled() || s.capacity() != nslots * slot_size || s.used() != 0) {
+            std::cerr << "ERROR: spill store not opened with whole slots" << std::endl;
+            return 3;
+        }
+
+        // Fill every slot with its own pattern; the next store must fail
+        std::vector<uint64_t> ids;
+        std::vector<char> buf(slot_size), out(slot_size);
+        for (size_t i = 0; i < nslots; ++i) {
+            memset(buf.data(), (int)('a' + i), slot_size);
+            uint64_t id;
+            if (!s.store(buf.data(), id)) {
+                std::cerr << "ERROR: store into free slot failed" << std::endl;
+                return 3;
+            }
+            ids.push_back(id);
+        }
+        uint64_t extra;
+        if (s.store(buf.data(), extra) || s.used() != nslots || std::set<uint64_t>(ids.begin(), ids.end()).size() != nslots) {
+            std::cerr << "ERROR: full store accepted a block or reused a slot" << std::endl;
+            return 3;
+        }
+        for (size_t i = 0; i < nslots; ++i) {
+            if (!s.load(ids[i], 100, 50, out.data()) || out[0] != (char)('a' + i) || out[49] != (char)('a' + i)) {
+                std::cerr << "ERROR: slot " << i << " read back wrong" << std::endl;
+                return 3;
+            }
+        }
+
+        // Released slots are handed out again without disturbing the others
+        s.release(ids[3]);
+        memset(buf.data(), 'z', slot_size);
+        uint64_t again;
+        if (!s.store(buf.data(), again) || again != ids[3] || !s.load(again, 0, slot_size, out.data()) || memcmp(buf.data(), out.data(), slot_size) != 0) {
+            std::cerr << "ERROR: released slot not reused" << std::endl;
+            return 3;
+        }
+        if (!s.load(ids[4], 0, 1, out.data()) || out[0] != 'e') {
+            std::cerr << "ERROR: reuse overwrote a neighbour" << std::endl;
+            return 3;
+        }
+
+        // Partial rewrite in place
+        if (!s.write(ids[4], 10, 5, "12345") || !s.load(ids[4], 9, 7, out.data()) || memcmp(out.data(), "e12345e", 7) != 0) {
+            std::cerr << "ERROR: in-place write" << std::endl;
+            return 3;
+        }
+
+        // One batch of pieces at odd offsets and odd addresses, across slots
+        std::vector<char> src(3 * slot_size + 1), dst(3 * slot_size + 1, 0);
+        for (size_t i = 0; i < src.size(); ++i)
+            src[i] = (char)(i * 7 + 3);
+        spill_io w[3] = {{ids[0], 1, 300, src.data() + 1},
+                         {ids[1], 4000, 96, src.data() + 301},
+                         {ids[2], 0, slot_size, src.data() + 397}};
+        if (!s.write_batch(w, 3)) {
+            std::cerr << "ERROR: batched write failed" << std::endl;
+            return 3;
+        }
+        spill_io r[3] = {{ids[0], 1, 300, dst.data() + 1},
+                         {ids[1], 4000, 96, dst.data() + 301},
+                         {ids[2], 0, slot_size, dst.data() + 397}};
+        if (!s.read_batch(r, 3) || memcmp(src.data() + 1, dst.data() + 1, 396 + slot_size) != 0) {
+            std::cerr << "ERROR: batched read back wrong" << std::endl;
+            return 3;
+        }
+        if (!s.load(ids[0], 0, 1, out.data()) || out[0] != 'a' || !s.load(ids[1], 3999, 1, out.data()) || out[0] != 'b') {
+            std::cerr << "ERROR: batched write spilled outside its pieces" << std::endl;
+            return 3;
+        }
+
+        // reserve hands out slots without writing them
+        s.release(ids[5]);
+        uint64_t r1, r2;
+        if (!s.reserve(r1) || r1 != ids[5] || s.reserve(r2)) {
+            std::cerr << "ERROR: reserve" << std::endl;
+            return 3;
+        }
+    }
+
+    {
+        spill_store bad("/nonexistent/dir/spill", nslots * slot_size, slot_size);
+        if (bad.enabled()) {
+            std::cerr << "ERROR: unopenable path reported enabled" << std::endl;
+            return 3;
+        }
+    }
+
+    unlink(path);
+    std::cout << "test: spill_store finished" << std::endl;
+    return 0;
+}
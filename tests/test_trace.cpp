@@ -0,0 +1,130 @@
+#include "trace.hpp"
+#include <iostream>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <unistd.h>
+
+using namespace vram;
+
+int main() {
+    std::cout << "test: trace starting" << std::endl;
+    std::string path = "/tmp/test_trace." + std::to_string(getpid());
+
+    // Records from several threads all reach the file, each thread's in
+    // order, and come back sorted by start time
+    const int threads = 4, per = 5000;
+    if (!trace::start(path, 8192, 1)) {
+        std::cerr << "ERROR: cannot create " << path << std::endl;
+        return 2;
+    }
+    if (!trace::enabled()) {
+        std::cerr << "ERROR: trace not enabled after start" << std::endl;
+        return 3;
+    }
+    {
+        std::vector<std::thread> ts;
+        for (int t = 0; t < threads; ++t) {
+            ts.emplace_back([t] {
+                for (int i = 0; i < per; ++i) {
+                    uint64_t start = trace::now_ns();
+                    trace::record_op(i % 7 == 0 ? trace::PWRITE : trace::PREAD, (uint64_t)t << 32 | i, 4096, start, 1000 + i, i % 100 == 0 ? -5 : 0);
+                    // Let the writer drain while threads are still recording
+                    if (i % 1000 == 999) std::this_thread::sleep_for(std::chrono::milliseconds(2));
+                }
+            });
+        }
+        for (auto &t : ts) t.join();
+    }
+    trace::stop();
+    if (trace::enabled()) {
+        std::cerr << "ERROR: trace still enabled after stop" << std::endl;
+        return 4;
+    }
+    // Recording after stop is a no-op
+    trace::record_op(trace::FLUSH, 0, 0, 0, 0, 0);
+
+    trace::file_header hdr;
+    std::vector<trace::record> recs;
+    std::string error;
+    if (!trace::load(path, hdr, recs, error)) {
+        std::cerr << "ERROR: load failed: " << error << std::endl;
+        return 5;
+    }
+    if (hdr.records != recs.size() || hdr.records + hdr.dropped != (uint64_t)threads * per) {
+        std::cerr << "ERROR: " << recs.size() << " records (header " << hdr.records << ", " << hdr.dropped
+                  << " dropped), expected " << threads * per << std::endl;
+        return 6;
+    }
+    if (hdr.dropped) {
+        std::cerr << "ERROR: " << hdr.dropped << " records dropped with room for every record" << std::endl;
+        return 7;
+    }
+    std::vector<int> next(threads, 0);
+    std::vector<int> tid_of(threads, -1);
+    for (size_t i = 0; i < recs.size(); ++i) {
+        const trace::record &r = recs[i];
+        if (i && r.start_ns < recs[i - 1].start_ns) {
+            std::cerr << "ERROR: records not sorted by start time at " << i << std::endl;
+            return 8;
+        }
+        int t = (int)(r.offset >> 32), k = (int)(r.offset & 0xffffffff);
+        if (t >= threads || r.thread >= (uint32_t)threads || k != next[t]++) {
+            std::cerr << "ERROR: record " << i << " out of order (thread " << t << ", request " << k << ")" << std::endl;
+            return 9;
+        }
+        if (tid_of[t] < 0) tid_of[t] = (int)r.thread;
+        if ((int)r.thread != tid_of[t] || r.length != 4096 || r.latency_ns != 1000u + k ||
+            r.type != (k % 7 == 0 ? trace::PWRITE : trace::PREAD) || r.status != (k % 100 == 0 ? 5 : 0)) {
+            std::cerr << "ERROR: record " << i << " fields wrong" << std::endl;
+            return 10;
+        }
+    }
+    std::cout << "capture verified: " << recs.size() << " records from " << threads << " threads" << std::endl;
+
+    // A producer that outruns the writer loses records rather than
+    // blocking, and every lost record is counted
+    if (!trace::start(path, 64, 10000)) {
+        std::cerr << "ERROR: cannot restart trace" << std::endl;
+        return 11;
+    }
+    const int burst = 1000;
+    for (int i = 0; i < burst; ++i) trace::record_op(trace::ZERO, i, 512, trace::now_ns(), 1, 0);
+    uint64_t lost = trace::dropped();
+    trace::stop();
+    if (!trace::load(path, hdr, recs, error)) {
+        std::cerr << "ERROR: load failed: " << error << std::endl;
+        return 12;
+    }
+    if (recs.size() != 64 || hdr.dropped != burst - 64 || lost != hdr.dropped) {
+        std::cerr << "ERROR: overflow kept " << recs.size() << " and dropped " << hdr.dropped << " (" << lost
+                  << " live), expected 64 and " << burst - 64 << std::endl;
+        return 13;
+    }
+    for (int i = 0; i < 64; ++i) {
+        if (recs[i].offset != (uint64_t)i || recs[i].type != trace::ZERO) {
+            std::cerr << "ERROR: overflow kept the wrong records" << std::endl;
+            return 14;
+        }
+    }
+    std::cout << "overflow verified: " << hdr.dropped << " dropped" << std::endl;
+
+    // Anything else is rejected
+    FILE *f = fopen(path.c_str(), "wb");
+    fputs("not a trace file, just some text", f);
+    fclose(f);
+    if (trace::load(path, hdr, recs, error) || error.empty()) {
+        std::cerr << "ERROR: load accepted a file that isn't a trace" << std::endl;
+        return 15;
+    }
+    if (trace::load(path + ".missing", hdr, recs, error)) {
+        std::cerr << "ERROR: load accepted a missing file" << std::endl;
+        return 16;
+    }
+    unlink(path.c_str());
+
+    std::cout << "test: trace passed" << std::endl;
+    return 0;
+}
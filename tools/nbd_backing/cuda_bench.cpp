@@ -2,18 +2,31 @@
 #include <vector>
 #include <chrono>
 #include <cstring>
+#include <cstdlib>
+#include <string>
 
 #include "../../include/cuda_memory.hpp"
 
-int main() {
+// usage: cuda_bench [cuda|host] [host_latency_us] [host_bandwidth_bytes_per_s]
+int main(int argc, char **argv) {
     using namespace vram::cuda_mem;
 
+    std::string backend_name = argc > 1 ? argv[1] : "cuda";
+    host_backend_config hcfg;
+    hcfg.memory = 64 * 1024 * 1024;
+    hcfg.latency_ns = argc > 2 ? strtoull(argv[2], nullptr, 0) * 1000 : 10 * 1000;
+    hcfg.bandwidth = argc > 3 ? strtoull(argv[3], nullptr, 0) : 12ULL * 1000 * 1000 * 1000;
+    if (!select_backend(backend_name, hcfg)) {
+        std::cerr << "unknown backend " << backend_name << std::endl;
+        return 1;
+    }
+
     if (!init()) {
-        std::cerr << "CUDA backend init failed" << std::endl;
+        std::cerr << backend_name << " backend init failed" << std::endl;
         return 1;
     }
 
-    size_t alloc = increase_pool(4 * 1024 * 1024); // 4MB
+    size_t alloc = increase_pool(32 * 1024 * 1024); // 32MB
     std::cerr << "allocated " << alloc << " bytes of device memory" << std::endl;
 
     auto blk = allocate();
@@ -43,5 +56,39 @@ int main() {
     if (memcmp(data.data(), out.data(), block::size) == 0) std::cout << "data OK" << std::endl;
     else std::cout << "data MISMATCH" << std::endl;
 
+    // Per-request cost of an NBD-sized transfer: one copy + sync per block
+    // (the old plugin path) versus a single batched submission.
+    std::vector<block_ref> blocks;
+    while (blocks.size() < 256) {
+        auto b = allocate();
+        if (!b) break;
+        blocks.push_back(b);
+    }
+    std::vector<char> req(blocks.size() * block::size, 0x3C);
+    std::vector<segment> segs;
+    const int iterations = 20;
+
+    std::cout << "request_bytes,per_block_write_us,batch_write_us,per_block_read_us,batch_read_us\n";
+    for (size_t nblocks = 1; nblocks <= blocks.size(); nblocks *= 4) {
+        segs.clear();
+        for (size_t i = 0; i < nblocks; ++i)
+            segs.push_back({blocks[i].get(), 0, block::size, req.data() + i * block::size});
+
+        auto time_us = [&](auto &&fn) {
+            auto s = std::chrono::steady_clock::now();
+            for (int it = 0; it < iterations; ++it) fn();
+            std::chrono::duration<double, std::micro> d = std::chrono::steady_clock::now() - s;
+            return d.count() / iterations;
+        };
+        double pw = time_us([&] { for (auto &sg : segs) { sg.blk->write(0, sg.size, sg.data); sg.blk->sync(); } });
+        double bw = time_us([&] { write_batch(segs.data(), segs.size()); });
+        double pr = time_us([&] { for (auto &sg : segs) sg.blk->read(0, sg.size, sg.data); });
+        double br = time_us([&] { read_batch(segs.data(), segs.size()); });
+        std::cout << nblocks * block::size << "," << pw << "," << bw << "," << pr << "," << br << "\n";
+    }
+
+    blocks.clear();
+    blk.reset();
+    shutdown();
     return 0;
 }
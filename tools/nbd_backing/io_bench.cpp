@@ -0,0 +1,467 @@
+#include <iostream>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+#include <atomic>
+#include <random>
+#include <string>
+#include <cstdio>
+#include <cstdarg>
+#include <cstdlib>
+#include <cstring>
+#include <sys/resource.h>
+
+#include "../../include/cuda_memory.hpp"
+#include "nbdkit_shim.hpp"
+
+// In-process benchmark of the block backend: the plugin's entry points
+// (linked in, called the way nbdkit calls them) and cuda_mem's pipelined
+// batch API underneath. Each run prints one JSON object per line with
+// throughput, latency percentiles and CPU seconds per GB moved, so results
+// can be diffed and gated.
+//
+// Patterns run over `span` bytes that are written once first, split into one
+// slice per worker so concurrent writes never overlap:
+//   seq-read, seq-write   each worker walks its slice in io_size steps
+//   rand-read, rand-write uniform io_size-aligned offsets
+//   mixed                 random, write-pct percent writes
+//   swap                  synthetic swap traffic: swap-out clusters of 1-16
+//                         pages written at a moving cursor, swap-ins of one
+//                         page or an 8-page readahead, 80% of them from a
+//                         hot fifth of the slice; write-pct percent writes
+// The plugin serves one request per call, so depth d on t threads runs t*d
+// workers (nbdkit's worker threads); on cuda_mem each of the t threads
+// keeps d batches in flight. Runs that write end with a flush (a drain on
+// cuda_mem), which counts towards their time.
+//
+// usage: io_bench [--targets plugin,cuda_mem] [--patterns seq-read,...,swap]
+//                 [--threads 1,4] [--depths 1,8] [--io-size 4K] [--write-pct 30]
+//                 [--seconds 1] [--ops N] [--span 64M] [--seed 1]
+//                 [--backend host|cuda] [--host-latency-us 10] [--host-bandwidth 12G]
+//                 [--verbose] [plugin key=value ...]
+//
+// --ops N fixes the requests per worker (per in-flight batch on cuda_mem)
+// instead of running for --seconds; with the same --seed every target and
+// run sees the same request stream.
+
+typedef std::chrono::steady_clock clock_type;
+using namespace vram;
+
+static int64_t parse_size(const char *s) {
+    char *end = nullptr;
+    long long v = strtoll(s, &end, 0);
+    switch (*end) {
+    case 'G': case 'g': return v << 30;
+    case 'M': case 'm': return v << 20;
+    case 'K': case 'k': return v << 10;
+    default: return v;
+    }
+}
+
+static std::vector<std::string> split(const char *v) {
+    std::vector<std::string> out;
+    for (const char *p = v; *p;) {
+        const char *c = strchr(p, ',');
+        out.emplace_back(p, c ? (size_t)(c - p) : strlen(p));
+        p = c ? c + 1 : p + strlen(p);
+    }
+    return out;
+}
+
+enum pattern_kind { SEQ_READ, SEQ_WRITE, RAND_READ, RAND_WRITE, MIXED, SWAP, NPATTERNS };
+static const char *const pattern_names[NPATTERNS] = {"seq-read", "seq-write", "rand-read", "rand-write", "mixed", "swap"};
+
+// Longest request any pattern issues, in io_size units
+static const uint64_t MAX_PAGES = 16;
+
+struct io_op {
+    bool write;
+    uint64_t offset;
+    uint32_t length;
+};
+
+// One worker's request stream over its slice [base, base + size)
+class op_source {
+public:
+    op_source(int kind, uint64_t base, uint64_t size, uint32_t io_size, int write_pct, uint64_t seed)
+        : kind(kind), base(base), pages(size / io_size), io_size(io_size), write_pct(write_pct), rng(seed) {}
+
+    io_op next() {
+        switch (kind) {
+        case SEQ_READ: case SEQ_WRITE:
+            return {kind == SEQ_WRITE, base + cursor++ % pages * io_size, io_size};
+        case RAND_READ: case RAND_WRITE:
+            return {kind == RAND_WRITE, base + rng() % pages * io_size, io_size};
+        case MIXED:
+            return {(int)(rng() % 100) < write_pct, base + rng() % pages * io_size, io_size};
+        }
+        if ((int)(rng() % 100) < write_pct) {
+            uint64_t n = std::min<uint64_t>(1 + rng() % MAX_PAGES, pages);
+            if (cursor % pages + n > pages) cursor += pages - cursor % pages;
+            uint64_t p = cursor % pages;
+            cursor += n;
+            return {true, base + p * io_size, (uint32_t)(n * io_size)};
+        }
+        uint64_t n = std::min<uint64_t>(rng() % 10 < 7 ? 1 : 8, pages);
+        uint64_t hot = std::max<uint64_t>(pages / 5, n);
+        uint64_t p = rng() % 10 < 8 ? rng() % (hot - n + 1) : rng() % (pages - n + 1);
+        return {false, base + p * io_size, (uint32_t)(n * io_size)};
+    }
+
+private:
+    int kind;
+    uint64_t base, pages;
+    uint32_t io_size;
+    int write_pct;
+    std::mt19937_64 rng;
+    uint64_t cursor = 0;
+};
+
+struct bench_config {
+    std::vector<std::string> targets = {"plugin", "cuda_mem"};
+    std::vector<int> patterns = {SEQ_READ, SEQ_WRITE, RAND_READ, RAND_WRITE, MIXED, SWAP};
+    std::vector<int> threads = {1, 4}, depths = {1, 8};
+    uint32_t io_size = 4096;
+    int write_pct = 30;
+    double seconds = 1;
+    uint64_t ops = 0; // per worker; 0 = run for `seconds`
+    uint64_t span = 64ULL << 20;
+    uint64_t seed = 1;
+    std::string backend = "host";
+    cuda_mem::host_backend_config host;
+    std::vector<std::string> plugin_args;
+};
+
+struct run_result {
+    uint64_t ops = 0, bytes = 0;
+    double seconds = 0, cpu = 0;
+    std::vector<double> lat; // microseconds
+};
+
+static double cpu_seconds() {
+    rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
+
+static void fill_random(char *p, size_t n, uint64_t seed) {
+    std::mt19937_64 rng(seed);
+    for (size_t i = 0; i + 8 <= n; i += 8) {
+        uint64_t v = rng();
+        memcpy(p + i, &v, 8);
+    }
+}
+
+static void report(const bench_config &cfg, const char *target, int pattern, int threads, int depth, run_result &r) {
+    std::sort(r.lat.begin(), r.lat.end());
+    double sum = 0;
+    for (double l : r.lat) sum += l;
+    auto pct = [&](double p) { return r.lat.empty() ? 0.0 : r.lat[std::min(r.lat.size() - 1, (size_t)(p * r.lat.size()))]; };
+    printf("{\"target\":\"%s\",\"pattern\":\"%s\",\"backend\":\"%s\",\"threads\":%d,\"depth\":%d,\"io_size\":%u,"
+           "\"ops\":%llu,\"bytes\":%llu,\"seconds\":%.3f,\"iops\":%.0f,\"mb_s\":%.1f,\"avg_us\":%.1f,"
+           "\"p50_us\":%.1f,\"p99_us\":%.1f,\"p999_us\":%.1f,\"cpu_s_per_gb\":%.3f}\n",
+           target, pattern_names[pattern], cfg.backend.c_str(), threads, depth, cfg.io_size,
+           (unsigned long long)r.ops, (unsigned long long)r.bytes, r.seconds, r.ops / r.seconds, r.bytes / r.seconds / 1e6,
+           r.lat.empty() ? 0.0 : sum / r.lat.size(), pct(0.5), pct(0.99), pct(0.999), r.bytes ? r.cpu / (r.bytes / 1e9) : 0.0);
+    fflush(stdout);
+}
+
+// Slice of the span each of `workers` gets, in whole io_size units
+static uint64_t slice_for(const bench_config &cfg, int workers) {
+    return cfg.span / workers / cfg.io_size * cfg.io_size;
+}
+
+static bool plugin_run(const bench_config &cfg, nbdkit_plugin *p, void *h, int pattern, int threads, int depth, run_result &out) {
+    int workers = threads * depth;
+    uint64_t slice = slice_for(cfg, workers);
+    std::vector<std::vector<double>> lats(workers);
+    std::vector<uint64_t> bytes(workers);
+    std::atomic<bool> go{false}, failed{false};
+    clock_type::time_point deadline;
+    std::vector<std::thread> ts;
+    for (int w = 0; w < workers; ++w) {
+        ts.emplace_back([&, w] {
+            op_source src(pattern, w * slice, slice, cfg.io_size, cfg.write_pct, cfg.seed * 1000003 + w);
+            std::vector<char> buf(MAX_PAGES * cfg.io_size);
+            fill_random(buf.data(), buf.size(), cfg.seed + w);
+            std::vector<double> &lat = lats[w];
+            lat.reserve(cfg.ops ? cfg.ops : 1 << 16);
+            while (!go.load(std::memory_order_acquire)) std::this_thread::yield();
+            for (uint64_t n = 0; cfg.ops ? n < cfg.ops : clock_type::now() < deadline; ++n) {
+                io_op o = src.next();
+                auto t0 = clock_type::now();
+                int r = o.write ? p->pwrite(h, buf.data(), o.length, o.offset, 0) : p->pread(h, buf.data(), o.length, o.offset, 0);
+                if (r) { failed = true; return; }
+                lat.push_back(std::chrono::duration<double, std::micro>(clock_type::now() - t0).count());
+                bytes[w] += o.length;
+            }
+        });
+    }
+    double cpu0 = cpu_seconds();
+    auto start = clock_type::now();
+    deadline = start + std::chrono::duration_cast<clock_type::duration>(std::chrono::duration<double>(cfg.seconds));
+    go.store(true, std::memory_order_release);
+    for (auto &t : ts) t.join();
+    if (pattern != SEQ_READ && pattern != RAND_READ && p->flush(h, 0)) failed = true;
+    out.seconds = std::chrono::duration<double>(clock_type::now() - start).count();
+    out.cpu = cpu_seconds() - cpu0;
+    for (int w = 0; w < workers; ++w) {
+        out.ops += lats[w].size();
+        out.bytes += bytes[w];
+        out.lat.insert(out.lat.end(), lats[w].begin(), lats[w].end());
+    }
+    return !failed;
+}
+
+static bool bench_plugin(const bench_config &cfg) {
+    nbdkit_plugin *p = plugin_init();
+    std::vector<std::pair<std::string, std::string>> args = {{"backend", cfg.backend}, {"size", std::to_string(cfg.span)}};
+    if (cfg.backend == "host") {
+        args.push_back({"host_memory", std::to_string(cfg.host.memory)});
+        args.push_back({"host_bandwidth", std::to_string(cfg.host.bandwidth)});
+        args.push_back({"host_latency_us", std::to_string(cfg.host.latency_ns / 1000)});
+    }
+    for (const std::string &a : cfg.plugin_args) {
+        size_t eq = a.find('=');
+        args.push_back({a.substr(0, eq), a.substr(eq + 1)});
+    }
+    for (auto &kv : args)
+        if (p->config(kv.first.c_str(), kv.second.c_str())) return false;
+    if (p->config_complete && p->config_complete()) return false;
+    void *h = p->open(0);
+    if (p->get_size(h) < (int64_t)cfg.span) {
+        std::cerr << "io_bench: plugin export smaller than the span" << std::endl;
+        return false;
+    }
+    // Write the span once so reads move data instead of returning holes
+    const size_t chunk = 1 << 20;
+    std::vector<char> data(chunk);
+    fill_random(data.data(), chunk, cfg.seed);
+    for (uint64_t off = 0; off < cfg.span; off += chunk) {
+        if (p->pwrite(h, data.data(), (uint32_t)std::min<uint64_t>(chunk, cfg.span - off), off, 0)) {
+            std::cerr << "io_bench: prefill failed" << std::endl;
+            return false;
+        }
+    }
+    p->flush(h, 0);
+
+    bool ok = true;
+    for (int pattern : cfg.patterns)
+        for (int threads : cfg.threads)
+            for (int depth : cfg.depths) {
+                run_result r;
+                if (!plugin_run(cfg, p, h, pattern, threads, depth, r)) {
+                    std::cerr << "io_bench: plugin " << pattern_names[pattern] << " run failed" << std::endl;
+                    ok = false;
+                    continue;
+                }
+                report(cfg, "plugin", pattern, threads, depth, r);
+            }
+    p->close(h);
+    if (p->unload) p->unload();
+    return ok;
+}
+
+// Completions of one cuda_mem thread's batches, posted from the reaper
+struct completion_queue {
+    std::mutex m;
+    std::condition_variable cv;
+    std::vector<std::pair<int, clock_type::time_point>> done;
+};
+
+static bool cuda_mem_run(const bench_config &cfg, const std::vector<cuda_mem::block *> &blocks, int pattern, int threads, int depth, run_result &out) {
+    const size_t bs = cuda_mem::block_size();
+    uint64_t slice = slice_for(cfg, threads * depth);
+    size_t buf_size = MAX_PAGES * cfg.io_size;
+    std::vector<std::vector<double>> lats(threads);
+    std::vector<uint64_t> bytes(threads);
+    std::atomic<bool> go{false}, failed{false};
+    clock_type::time_point deadline;
+    std::vector<std::thread> ts;
+    for (int t = 0; t < threads; ++t) {
+        ts.emplace_back([&, t] {
+            cuda_mem::backend &be = cuda_mem::current_backend();
+            char *pool = static_cast<char *>(be.host_alloc(buf_size * depth));
+            if (!pool) { failed = true; return; }
+            fill_random(pool, buf_size * depth, cfg.seed + t);
+            std::vector<op_source> src;
+            for (int s = 0; s < depth; ++s) {
+                int w = t * depth + s;
+                src.emplace_back(pattern, w * slice, slice, cfg.io_size, cfg.write_pct, cfg.seed * 1000003 + w);
+            }
+            std::vector<io_op> ops(depth);
+            std::vector<clock_type::time_point> started(depth);
+            std::vector<cuda_mem::segment> segs;
+            completion_queue q;
+            std::vector<double> &lat = lats[t];
+            lat.reserve(cfg.ops ? cfg.ops * depth : 1 << 16);
+
+            auto submit = [&](int s) {
+                io_op &o = ops[s] = src[s].next();
+                segs.clear();
+                char *data = pool + s * buf_size;
+                for (uint64_t pos = o.offset, end = o.offset + o.length; pos < end;) {
+                    size_t n = std::min<uint64_t>(end - pos, bs - pos % bs);
+                    segs.push_back({blocks[pos / bs], (off_t)(pos % bs), n, data});
+                    data += n;
+                    pos += n;
+                }
+                started[s] = clock_type::now();
+                auto done = [&q, s] {
+                    auto now = clock_type::now();
+                    std::lock_guard<std::mutex> lg(q.m);
+                    q.done.push_back({s, now});
+                    q.cv.notify_one();
+                };
+                if (o.write) cuda_mem::write_batch_async(segs.data(), segs.size(), done);
+                else cuda_mem::read_batch_async(segs.data(), segs.size(), done);
+            };
+
+            while (!go.load(std::memory_order_acquire)) std::this_thread::yield();
+            int in_flight = 0;
+            uint64_t issued = 0;
+            auto more = [&] { return cfg.ops ? issued < cfg.ops * depth : clock_type::now() < deadline; };
+            for (int s = 0; s < depth && more(); ++s, ++issued, ++in_flight) submit(s);
+            std::vector<std::pair<int, clock_type::time_point>> finished;
+            while (in_flight) {
+                {
+                    std::unique_lock<std::mutex> lk(q.m);
+                    q.cv.wait(lk, [&] { return !q.done.empty(); });
+                    finished.swap(q.done);
+                }
+                for (auto &f : finished) {
+                    --in_flight;
+                    lat.push_back(std::chrono::duration<double, std::micro>(f.second - started[f.first]).count());
+                    bytes[t] += ops[f.first].length;
+                    if (more()) { submit(f.first); ++issued; ++in_flight; }
+                }
+                finished.clear();
+            }
+            be.host_free(pool);
+        });
+    }
+    double cpu0 = cpu_seconds();
+    auto start = clock_type::now();
+    deadline = start + std::chrono::duration_cast<clock_type::duration>(std::chrono::duration<double>(cfg.seconds));
+    go.store(true, std::memory_order_release);
+    for (auto &t : ts) t.join();
+    cuda_mem::drain();
+    out.seconds = std::chrono::duration<double>(clock_type::now() - start).count();
+    out.cpu = cpu_seconds() - cpu0;
+    for (int t = 0; t < threads; ++t) {
+        out.ops += lats[t].size();
+        out.bytes += bytes[t];
+        out.lat.insert(out.lat.end(), lats[t].begin(), lats[t].end());
+    }
+    return !failed;
+}
+
+static bool bench_cuda_mem(const bench_config &cfg) {
+    if (!cuda_mem::select_backend(cfg.backend, cfg.host) || !cuda_mem::init()) {
+        std::cerr << "io_bench: " << cfg.backend << " backend init failed" << std::endl;
+        return false;
+    }
+    const size_t bs = cuda_mem::block_size();
+    size_t nblocks = (cfg.span + bs - 1) / bs;
+    cuda_mem::increase_pool(nblocks * bs, false);
+    std::vector<cuda_mem::block *> blocks(nblocks);
+    for (auto &b : blocks) {
+        if (!(b = cuda_mem::acquire_block())) {
+            std::cerr << "io_bench: device pool smaller than the span" << std::endl;
+            cuda_mem::shutdown();
+            return false;
+        }
+    }
+    std::vector<char> data(bs);
+    fill_random(data.data(), bs, cfg.seed);
+    std::vector<cuda_mem::segment> segs;
+    for (auto b : blocks) segs.push_back({b, 0, bs, data.data()});
+    cuda_mem::write_batch(segs.data(), segs.size());
+
+    bool ok = true;
+    for (int pattern : cfg.patterns)
+        for (int threads : cfg.threads)
+            for (int depth : cfg.depths) {
+                run_result r;
+                if (!cuda_mem_run(cfg, blocks, pattern, threads, depth, r)) {
+                    std::cerr << "io_bench: cuda_mem " << pattern_names[pattern] << " run failed" << std::endl;
+                    ok = false;
+                    continue;
+                }
+                report(cfg, "cuda_mem", pattern, threads, depth, r);
+            }
+    for (auto b : blocks) cuda_mem::release_block(b);
+    cuda_mem::shutdown();
+    return ok;
+}
+
+static std::vector<int> parse_list(const char *v) {
+    std::vector<int> out;
+    for (const std::string &s : split(v)) out.push_back(atoi(s.c_str()));
+    return out;
+}
+
+int main(int argc, char **argv) {
+    shim_name = "io_bench";
+    bench_config cfg;
+    cfg.host.latency_ns = 10 * 1000;
+    cfg.host.bandwidth = 12ULL << 30;
+    int64_t host_memory = 0;
+    bool bad = false;
+    for (int i = 1; i < argc && !bad; ++i) {
+        std::string a = argv[i];
+        if (a == "--verbose") { shim_verbose = true; continue; }
+        if (a.compare(0, 2, "--") && a.find('=') != std::string::npos) { cfg.plugin_args.push_back(a); continue; }
+        if (i + 1 >= argc) { bad = true; break; }
+        const char *v = argv[++i];
+        if (a == "--targets") cfg.targets = split(v);
+        else if (a == "--patterns") {
+            cfg.patterns.clear();
+            for (const std::string &s : split(v)) {
+                int k = (int)(std::find_if(pattern_names, pattern_names + NPATTERNS, [&](const char *n) { return s == n; }) - pattern_names);
+                if (k == NPATTERNS) { std::cerr << "io_bench: unknown pattern " << s << std::endl; return 1; }
+                cfg.patterns.push_back(k);
+            }
+        }
+        else if (a == "--threads") cfg.threads = parse_list(v);
+        else if (a == "--depths") cfg.depths = parse_list(v);
+        else if (a == "--io-size") cfg.io_size = (uint32_t)parse_size(v);
+        else if (a == "--write-pct") cfg.write_pct = atoi(v);
+        else if (a == "--seconds") cfg.seconds = atof(v);
+        else if (a == "--ops") cfg.ops = strtoull(v, nullptr, 0);
+        else if (a == "--span") cfg.span = (uint64_t)parse_size(v);
+        else if (a == "--seed") cfg.seed = strtoull(v, nullptr, 0);
+        else if (a == "--backend") cfg.backend = v;
+        else if (a == "--host-memory") host_memory = parse_size(v);
+        else if (a == "--host-latency-us") cfg.host.latency_ns = strtoull(v, nullptr, 0) * 1000;
+        else if (a == "--host-bandwidth") cfg.host.bandwidth = (uint64_t)parse_size(v);
+        else bad = true;
+    }
+    for (int n : cfg.threads) bad = bad || n < 1;
+    for (int n : cfg.depths) bad = bad || n < 1;
+    for (const std::string &t : cfg.targets) bad = bad || (t != "plugin" && t != "cuda_mem");
+    if (bad || cfg.io_size < 512 || cfg.io_size % 8 || cfg.threads.empty() || cfg.depths.empty()) {
+        std::cerr << "usage: io_bench [--targets plugin,cuda_mem] [--patterns seq-read,seq-write,rand-read,rand-write,mixed,swap]\n"
+                     "                [--threads 1,4] [--depths 1,8] [--io-size 4K] [--write-pct 30] [--seconds 1] [--ops N]\n"
+                     "                [--span 64M] [--seed 1] [--backend host|cuda] [--host-memory bytes]\n"
+                     "                [--host-latency-us 10] [--host-bandwidth 12G] [--verbose] [plugin key=value ...]" << std::endl;
+        return 1;
+    }
+    int most = 1;
+    for (int t : cfg.threads)
+        for (int d : cfg.depths) most = std::max(most, t * d);
+    if (slice_for(cfg, most) < cfg.io_size) {
+        std::cerr << "io_bench: span too small for " << most << " workers" << std::endl;
+        return 1;
+    }
+    // Room for the span plus the plugin's spare blocks
+    cfg.host.memory = host_memory > 0 ? (size_t)host_memory : cfg.span + (64ULL << 20);
+
+    bool ok = true;
+    for (const std::string &t : cfg.targets)
+        ok = (t == "plugin" ? bench_plugin(cfg) : bench_cuda_mem(cfg)) && ok;
+    return ok ? 0 : 2;
+}
@@ -1,71 +1,1091 @@
-// Minimal NBD server skeleton (scaffold).
-// This is NOT a full NBD implementation. It's a small TCP server template
-// that will be extended to implement the NBD protocol or used as a basis
-// for an nbdkit plugin.
+// Standalone NBD server exporting the cuda_mem device pool, without nbdkit.
+//
+// Speaks the fixed newstyle handshake (EXPORT_NAME, LIST, INFO, GO,
+// STRUCTURED_REPLY, ABORT) and serves READ, WRITE, FLUSH, TRIM and
+// WRITE_ZEROES over TCP and/or a Unix socket. Connections are spread over
+// event-loop threads, each driving its sockets through its own io_uring.
+//
+// Requests are pipelined: a connection keeps reading requests while fewer
+// than the queue depth are in flight, each read or write is handed to
+// cuda_mem as an asynchronous batch on the next device stream, and replies
+// go out in the order the transfers finish. Every loop owns a pool of
+// pinned request buffers (the backend's host_alloc, so cudaHostAlloc memory
+// on CUDA) registered with its ring: write payloads are received straight
+// into them with READ_FIXED and copied to the device from there, and reads
+// land in them from the device and are sent from them, so payloads are
+// never copied on the host. Larger payloads fall back to a heap buffer.
+//
+// usage: nbd_server [options] [port]
+//   --tcp [host:]port     listen on TCP (default port 10809 if no --socket)
+//   --socket path         listen on a Unix socket
+//   --name name           export name (default "vram"; "" also selects it)
+//   --size bytes          export size (default device memory - 256M)
+//   --backend cuda|host   device backend (default cuda)
+//   --host-memory bytes   emulated device size for --backend host
+//   --host-bandwidth b/s  its emulated link bandwidth (default unlimited)
+//   --host-latency-us n   and the fixed cost of each transfer
+//   --devices 0,1,...     devices to spread the pool over
+//   --threads n           event-loop threads (default 2)
+//   --connections n       connections per thread (default 8)
+//   --queue-depth n       requests in flight per connection (default 128)
+//   --buffers n           pinned request buffers per thread (default 128)
+//   --buffer bytes        size of each (default 256K)
+// Sizes take K, M and G suffixes.
 
 #include <iostream>
 #include <string>
 #include <thread>
 #include <vector>
 #include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+#include <algorithm>
+#include <deque>
+#include <cerrno>
+#include <csignal>
 #include <cstring>
+#include <endian.h>
+#include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <unistd.h>
 
+#include "../../include/cuda_memory.hpp"
+#include "../../include/uring.hpp"
+
+using namespace vram::cuda_mem;
+
 static std::atomic<bool> running(true);
 
-void handle_client(int client_fd) {
-    std::cerr << "nbd_server: client connected" << std::endl;
-    // For now, just read and discard data until the client closes.
-    char buf[4096];
-    while (true) {
-        ssize_t r = read(client_fd, buf, sizeof(buf));
-        if (r <= 0) break;
-        // In a real server we'd parse NBD requests and respond with data
+// Protocol constants (doc/proto.md in the NBD project)
+static const uint64_t NBDMAGIC = 0x4e42444d41474943ULL;
+static const uint64_t IHAVEOPT = 0x49484156454f5054ULL;
+static const uint64_t OPT_REPLY_MAGIC = 0x3e889045565a9ULL;
+static const uint32_t REQUEST_MAGIC = 0x25609513;
+static const uint32_t SIMPLE_REPLY_MAGIC = 0x67446698;
+static const uint32_t STRUCTURED_REPLY_MAGIC = 0x668e33ef;
+enum : uint16_t { FLAG_FIXED_NEWSTYLE = 1, FLAG_NO_ZEROES = 2 };
+enum : uint32_t { OPT_EXPORT_NAME = 1, OPT_ABORT = 2, OPT_LIST = 3, OPT_INFO = 6, OPT_GO = 7, OPT_STRUCTURED_REPLY = 8 };
+enum : uint32_t { REP_ACK = 1, REP_SERVER = 2, REP_INFO = 3, REP_ERR_UNSUP = 0x80000001, REP_ERR_INVALID = 0x80000003, REP_ERR_UNKNOWN = 0x80000006 };
+enum : uint16_t { INFO_EXPORT = 0, INFO_BLOCK_SIZE = 3 };
+enum : uint16_t { TF_HAS_FLAGS = 1, TF_SEND_FLUSH = 4, TF_SEND_FUA = 8, TF_SEND_TRIM = 32, TF_SEND_WRITE_ZEROES = 64, TF_SEND_DF = 128, TF_CAN_MULTI_CONN = 256 };
+enum : uint16_t { CMD_READ = 0, CMD_WRITE = 1, CMD_DISC = 2, CMD_FLUSH = 3, CMD_TRIM = 4, CMD_WRITE_ZEROES = 6 };
+enum : uint16_t { CMD_FLAG_FUA = 1, CMD_FLAG_NO_HOLE = 2, CMD_FLAG_DF = 4 };
+enum : uint16_t { REPLY_FLAG_DONE = 1 };
+enum : uint16_t { REPLY_NONE = 0, REPLY_OFFSET_DATA = 1, REPLY_OFFSET_HOLE = 2, REPLY_ERROR = 32769 };
+static const size_t REQUEST_SIZE = 28;
+// Largest request payload; longer writes end the connection
+static const uint32_t MAX_PAYLOAD = 32 * 1024 * 1024;
+
+static void put16(char *p, uint16_t v) { v = htobe16(v); memcpy(p, &v, 2); }
+static void put32(char *p, uint32_t v) { v = htobe32(v); memcpy(p, &v, 4); }
+static void put64(char *p, uint64_t v) { v = htobe64(v); memcpy(p, &v, 8); }
+static uint16_t get16(const char *p) { uint16_t v; memcpy(&v, p, 2); return be16toh(v); }
+static uint32_t get32(const char *p) { uint32_t v; memcpy(&v, p, 4); return be32toh(v); }
+static uint64_t get64(const char *p) { uint64_t v; memcpy(&v, p, 8); return be64toh(v); }
+
+static int64_t parse_size(const char *s) {
+    char *end = nullptr;
+    long long v = strtoll(s, &end, 0);
+    if (end == s || v < 0) return -1;
+    switch (*end) {
+    case 'G': case 'g': return v << 30;
+    case 'M': case 'm': return v << 20;
+    case 'K': case 'k': return v << 10;
+    case '\0': return v;
+    default: return -1;
+    }
+}
+
+struct server_config {
+    std::string tcp;          // [host:]port, empty = no TCP listener
+    std::string socket_path;  // empty = no Unix listener
+    std::string name = "vram";
+    size_t size = 0;          // 0 = device memory - 256M
+    std::string backend = "cuda";
+    host_backend_config host;
+    std::vector<size_t> devices;
+    int threads = 2;
+    int connections = 8;
+    int queue_depth = 128;
+    int buffers = 128;
+    size_t buffer = 256 * 1024;
+};
+
+// The export: one device block pointer per export block, allocated on first
+// write and returned to the pool on trim. A request in flight holds its
+// blocks shared (reads) or exclusive (everything else) until it completes;
+// one that can't get them waits in its loop's deferred queue.
+struct export_map {
+    static const uint32_t WRITER = 1u << 31;
+    uint64_t size = 0;
+    size_t blk = 0, nblocks = 0;
+    std::unique_ptr<block *[]> blocks;
+    std::unique_ptr<std::atomic<uint32_t>[]> busy; // reader count, or WRITER
+
+    bool lock_block(size_t i, bool exclusive) {
+        uint32_t cur = busy[i].load(std::memory_order_relaxed);
+        do {
+            if ((cur & WRITER) || (exclusive && cur)) return false;
+        } while (!busy[i].compare_exchange_weak(cur, exclusive ? WRITER : cur + 1, std::memory_order_acquire, std::memory_order_relaxed));
+        return true;
+    }
+    void unlock_block(size_t i, bool exclusive) {
+        if (exclusive) busy[i].store(0, std::memory_order_release);
+        else busy[i].fetch_sub(1, std::memory_order_release);
+    }
+    bool try_lock(size_t first, size_t count, bool exclusive) {
+        for (size_t i = first; i < first + count; ++i) {
+            if (lock_block(i, exclusive)) continue;
+            while (i-- > first) unlock_block(i, exclusive);
+            return false;
+        }
+        return true;
+    }
+    void unlock(size_t first, size_t count, bool exclusive) {
+        for (size_t i = first; i < first + count; ++i) unlock_block(i, exclusive);
+    }
+
+    block *take(size_t idx) {
+        block *b = device_count() > 1 ? acquire_block(idx % device_count()) : nullptr;
+        return b ? b : acquire_block();
+    }
+};
+
+static export_map ex;
+
+static uint16_t transmission_flags(bool structured) {
+    uint16_t f = TF_HAS_FLAGS | TF_SEND_FLUSH | TF_SEND_FUA | TF_SEND_TRIM | TF_SEND_WRITE_ZEROES | TF_CAN_MULTI_CONN;
+    return structured ? f | TF_SEND_DF : f;
+}
+
+struct connection;
+
+// One request from its header to the end of its reply. Read data and write
+// payloads live in a buffer of the loop's pinned pool when they fit.
+struct request {
+    connection *conn = nullptr;
+    uint16_t flags = 0, type = 0;
+    uint64_t handle = 0, offset = 0;
+    uint32_t length = 0;
+    char *buf = nullptr;
+    int pinned = -1;          // index in the pinned pool, -1 if in `heap`
+    std::vector<char> heap;
+    size_t first = 0, blocks = 0; // export blocks held while in flight
+    bool exclusive = false, locked = false;
+    bool structured = false;  // the connection negotiated structured replies
+    std::vector<bool> data;   // reads: which blocks hold data
+    int err = 0;
+    std::vector<char> meta;   // reply headers
+    std::vector<iovec> iov;   // the reply: headers and data
+};
+
+// Commands run on the loop threads with the request's blocks held. The
+// transfers return 0 once queued (`done` follows when they complete) or an
+// NBD errno value.
+
+static int do_read(request &r, completion done) {
+    static thread_local std::vector<segment> segs;
+    segs.clear(); r.data.clear();
+    // Structured replies send holes as chunks of their own, so they need no zeros
+    bool fill_holes = !r.structured || (r.flags & CMD_FLAG_DF);
+    for (uint64_t pos = r.offset; pos < r.offset + r.length;) {
+        size_t idx = pos / ex.blk, off = pos % ex.blk, n = std::min<uint64_t>(ex.blk - off, r.offset + r.length - pos);
+        block *b = ex.blocks[idx];
+        r.data.push_back(b != nullptr);
+        // A segment without a block reads as zeros
+        if (b || fill_holes) segs.push_back({b, (off_t)off, n, r.buf + (pos - r.offset)});
+        pos += n;
+    }
+    read_batch_async(segs.data(), segs.size(), std::move(done));
+    return 0;
+}
+
+// Give every block of [offset, offset + len) that has none a device block,
+// queueing on `fresh` a clear of each new one the range doesn't cover whole:
+// pool blocks hold stale data. All or nothing, so a full pool fails the
+// request without leaving blocks whose old contents would read back.
+static int take_blocks(uint64_t offset, uint32_t len, std::vector<segment> &fresh) {
+    static thread_local std::vector<size_t> taken;
+    taken.clear();
+    for (uint64_t pos = offset; pos < offset + len;) {
+        size_t idx = pos / ex.blk, n = std::min<uint64_t>(ex.blk - pos % ex.blk, offset + len - pos);
+        if (!ex.blocks[idx]) {
+            block *b = ex.take(idx);
+            if (!b) {
+                for (size_t i : taken) { release_block(ex.blocks[i]); ex.blocks[i] = nullptr; }
+                fresh.clear();
+                return ENOSPC;
+            }
+            ex.blocks[idx] = b;
+            taken.push_back(idx);
+            if (n < ex.blk) fresh.push_back({b, 0, ex.blk, nullptr});
+        }
+        pos += n;
+    }
+    return 0;
+}
+
+static int do_write(request &r, completion done) {
+    static thread_local std::vector<segment> segs, fresh;
+    segs.clear(); fresh.clear();
+    if (take_blocks(r.offset, r.length, fresh)) return ENOSPC;
+    for (uint64_t pos = r.offset; pos < r.offset + r.length;) {
+        size_t idx = pos / ex.blk, off = pos % ex.blk, n = std::min<uint64_t>(ex.blk - off, r.offset + r.length - pos);
+        segs.push_back({ex.blocks[idx], (off_t)off, n, r.buf + (pos - r.offset)});
+        pos += n;
     }
-    close(client_fd);
-    std::cerr << "nbd_server: client disconnected" << std::endl;
+    zero_batch_async(fresh.data(), fresh.size());
+    write_batch_async(segs.data(), segs.size(), std::move(done));
+    return 0;
+}
+
+// Trim and write-zeroes: whole blocks go back to the pool unless the client
+// asked to keep them allocated; partial ranges are cleared on the device
+static int do_zero(uint64_t offset, uint32_t len, bool keep) {
+    static thread_local std::vector<segment> segs;
+    segs.clear();
+    if (keep && take_blocks(offset, len, segs)) return ENOSPC;
+    for (uint64_t pos = offset; pos < offset + len;) {
+        size_t idx = pos / ex.blk, off = pos % ex.blk, n = std::min<uint64_t>(ex.blk - off, offset + len - pos);
+        block *&b = ex.blocks[idx];
+        if (n == ex.blk && !keep) {
+            if (b) release_block(b);
+            b = nullptr;
+        }
+        else if (b) segs.push_back({b, (off_t)off, n, nullptr});
+        pos += n;
+    }
+    zero_batch_async(segs.data(), segs.size());
+    return 0;
 }
 
-int main(int argc, char** argv) {
-    int port = 10809; // default
-    if (argc >= 2) port = atoi(argv[1]);
+// One client connection, owned by one event loop. It keeps receiving
+// requests while fewer than the queue depth are in flight, and replies in
+// the order the requests complete. At most one receive and one send are
+// queued on the ring at a time.
+struct connection {
+    int fd = -1;
+    bool structured = false;
+    char hdr[REQUEST_SIZE];
+    size_t got = 0;              // bytes of the header or payload received so far
+    request *incoming = nullptr; // write whose payload is being received
+    request *waiting = nullptr;  // request waiting for a pinned buffer
+    bool receiving = false, sending = false;
+    bool closing = false;        // no more requests: disconnect, EOF or protocol error
+    bool broken = false;         // sending failed; replies are dropped
+    size_t in_flight = 0;        // requests received and not yet replied
+    std::deque<request *> ready; // replies waiting for the socket
+    std::vector<request *> batch; // replies in the current send
+    std::vector<iovec> iov;
+    size_t iov_at = 0;
+    msghdr msg;
+};
+
+class event_loop {
+public:
+    event_loop(const server_config &cfg)
+        : ring(512), conns(cfg.connections), depth((size_t)cfg.queue_depth), buf_size(cfg.buffer) {
+        wake_fd = eventfd(0, EFD_CLOEXEC);
+        available = conns.size();
+        for (size_t i = conns.size(); i--;) free_slots.push_back(i);
+        flusher = std::thread([this] { flush_requests(); });
+        // One pinned allocation carved into the request buffers, each
+        // registered as its own fixed buffer
+        size_t count = (size_t)cfg.buffers;
+        pool = static_cast<char *>(current_backend().host_alloc(count * buf_size));
+        if (!pool) return;
+        std::vector<iovec> bufs;
+        for (size_t i = count; i--;) free_bufs.push_back((int)i);
+        for (size_t i = 0; i < count; ++i) bufs.push_back({pool + i * buf_size, buf_size});
+        fixed = ring.ok() && ring.register_buffers(bufs.data(), (unsigned)bufs.size());
+    }
+
+    ~event_loop() {
+        {
+            std::lock_guard<std::mutex> lg(flush_m);
+            stopping = true;
+        }
+        flush_cv.notify_one();
+        flusher.join();
+        if (pool) current_backend().host_free(pool);
+        if (wake_fd >= 0) close(wake_fd);
+    }
+
+    bool ok() const { return ring.ok() && wake_fd >= 0; }
+    bool registered() const { return fixed; }
+
+    // Take over a connection that finished its handshake; false if full
+    bool adopt(int fd, bool structured) {
+        std::lock_guard<std::mutex> lg(m);
+        if (!available.load()) return false;
+        --available;
+        fresh.push_back({fd, structured});
+        wake();
+        return true;
+    }
+
+    void wake() { uint64_t one = 1; if (write(wake_fd, &one, sizeof(one)) < 0) {} }
+
+    void run() {
+        owner = std::this_thread::get_id();
+        arm_wake();
+        while (running.load() || live) {
+            int r = ring.enter(1);
+            if (r < 0 && r != -EINTR && r != -EAGAIN && r != -EBUSY) {
+                std::cerr << "nbd_server: io_uring_enter: " << strerror(-r) << std::endl;
+                break;
+            }
+            ring.reap([&](const io_uring_cqe &c) {
+                if (c.user_data == WAKE) on_wake();
+                else if (c.user_data == TIMER) timer_armed = false;
+                else if (c.user_data & 1) on_send(conns[c.user_data >> 1], c.res);
+                else on_recv(conns[c.user_data >> 1], c.res);
+            });
+            // Requests finished while handling the completions above
+            while (!local_done.empty()) {
+                std::vector<request *> done;
+                done.swap(local_done);
+                for (request *q : done) finish(q);
+            }
+            retry_deferred();
+            // Requests held up by another loop's blocks get no wakeup; poll for them
+            if (!deferred.empty() && !timer_armed) arm_timer();
+        }
+    }
+
+private:
+    static const uint64_t WAKE = ~0ULL, TIMER = ~1ULL;
+    static const size_t MAX_IOV = 1024;
+
+    // Completion of a request's transfers, from a reaper thread or inline
+    void completed(request *r) {
+        if (std::this_thread::get_id() == owner) { local_done.push_back(r); return; }
+        bool first;
+        {
+            std::lock_guard<std::mutex> lg(m);
+            first = finished.empty();
+            finished.push_back(r);
+        }
+        if (first) wake();
+    }
+
+    void arm_wake() {
+        io_uring_sqe *s = ring.next_sqe();
+        s->opcode = IORING_OP_READ;
+        s->fd = wake_fd;
+        s->addr = (uint64_t)(uintptr_t)&wake_count;
+        s->len = sizeof(wake_count);
+        s->user_data = WAKE;
+    }
+
+    void arm_timer() {
+        io_uring_sqe *s = ring.next_sqe();
+        if (!s) return;
+        retry_after = {0, 20 * 1000};
+        s->opcode = IORING_OP_TIMEOUT;
+        s->addr = (uint64_t)(uintptr_t)&retry_after;
+        s->len = 1;
+        s->user_data = TIMER;
+        timer_armed = true;
+    }
 
-    int sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (sock < 0) {
-        perror("socket");
-        return 1;
+    void on_wake() {
+        std::vector<std::pair<int, bool>> accepted;
+        std::vector<request *> done;
+        {
+            std::lock_guard<std::mutex> lg(m);
+            accepted.swap(fresh);
+            done.swap(finished);
+        }
+        for (auto &p : accepted) {
+            size_t slot = free_slots.back();
+            free_slots.pop_back();
+            connection &c = conns[slot];
+            c.fd = p.first; c.structured = p.second;
+            c.closing = c.broken = false;
+            c.got = 0;
+            ++live;
+            receive(c);
+        }
+        for (request *r : done) finish(r);
+        // Stopping: end every connection once its requests are done
+        if (!running.load())
+            for (connection &c : conns)
+                if (c.fd >= 0 && !c.closing) {
+                    shutdown(c.fd, SHUT_RDWR);
+                    if (!c.receiving) stop_receiving(c);
+                }
+        arm_wake();
     }
 
-    int opt = 1;
-    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    uint64_t slot_of(const connection &c) const { return (uint64_t)(&c - conns.data()); }
 
-    struct sockaddr_in addr{};
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(port);
-    addr.sin_addr.s_addr = INADDR_ANY;
+    request *new_request(connection &c) {
+        request *r;
+        if (spare.empty()) { requests.emplace_back(new request); r = requests.back().get(); }
+        else { r = spare.back(); spare.pop_back(); }
+        r->conn = &c;
+        r->structured = c.structured;
+        r->locked = false;
+        r->err = 0;
+        ++c.in_flight;
+        return r;
+    }
 
-    if (bind(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
-        perror("bind");
-        close(sock);
-        return 1;
+    // A buffer for the request's data: pinned if it fits and one is free
+    bool attach_buffer(request *r) {
+        if (r->length > buf_size) {
+            r->heap.resize(r->length);
+            r->buf = r->heap.data();
+            r->pinned = -1;
+            return true;
+        }
+        if (free_bufs.empty()) return false;
+        r->pinned = free_bufs.back();
+        free_bufs.pop_back();
+        r->buf = pool + (size_t)r->pinned * buf_size;
+        return true;
     }
 
-    if (listen(sock, 4) < 0) {
-        perror("listen");
-        close(sock);
-        return 1;
+    // Done with a request: its reply is out (or will never be sent)
+    void release(request *r) {
+        connection &c = *r->conn;
+        --c.in_flight;
+        if (r->pinned >= 0) free_bufs.push_back(r->pinned);
+        r->pinned = -1;
+        if (r->heap.capacity() > buf_size) r->heap = std::vector<char>();
+        spare.push_back(r);
+        // Hand freed buffers to connections waiting for one
+        while (!free_bufs.empty() && !starved.empty()) {
+            connection &w = *starved.front();
+            starved.pop_front();
+            request *q = w.waiting;
+            w.waiting = nullptr;
+            attach_buffer(q);
+            if (q->type == CMD_WRITE) w.incoming = q;
+            else submit(q);
+            receive(w);
+        }
     }
 
-    std::cerr << "nbd_server: listening on port " << port << std::endl;
+    void stop_receiving(connection &c) {
+        c.closing = true;
+        if (c.waiting) {
+            starved.erase(std::find(starved.begin(), starved.end(), &c));
+            release(c.waiting);
+            c.waiting = nullptr;
+        }
+        if (c.incoming) { release(c.incoming); c.incoming = nullptr; }
+        maybe_drop(c);
+    }
+
+    void maybe_drop(connection &c) {
+        if (c.fd < 0 || !c.closing || c.receiving || c.sending || c.in_flight) return;
+        close(c.fd);
+        c.fd = -1;
+        free_slots.push_back(slot_of(c));
+        ++available;
+        --live;
+    }
+
+    // Queue the next receive: a payload, or the next header while the
+    // connection has room for another request
+    void receive(connection &c) {
+        if (c.receiving || c.closing || c.waiting || c.fd < 0) return;
+        io_uring_sqe *s;
+        if (c.incoming) {
+            request &r = *c.incoming;
+            s = ring.next_sqe();
+            // Payloads into a registered buffer skip the per-call page pinning
+            if (fixed && r.pinned >= 0) {
+                s->opcode = IORING_OP_READ_FIXED;
+                s->buf_index = (uint16_t)r.pinned;
+            }
+            else {
+                s->opcode = IORING_OP_RECV;
+                s->msg_flags = MSG_WAITALL;
+            }
+            s->addr = (uint64_t)(uintptr_t)(r.buf + c.got);
+            s->len = (uint32_t)(r.length - c.got);
+        }
+        else {
+            if (c.in_flight >= depth) return; // resumed when a reply goes out
+            s = ring.next_sqe();
+            s->opcode = IORING_OP_RECV;
+            s->msg_flags = MSG_WAITALL;
+            s->addr = (uint64_t)(uintptr_t)(c.hdr + c.got);
+            s->len = (uint32_t)(REQUEST_SIZE - c.got);
+        }
+        s->fd = c.fd;
+        s->user_data = slot_of(c) << 1;
+        c.receiving = true;
+    }
+
+    void on_recv(connection &c, int res) {
+        c.receiving = false;
+        if (res <= 0 || c.closing) { stop_receiving(c); return; }
+        c.got += (size_t)res;
+        if (c.incoming) {
+            if (c.got == c.incoming->length) {
+                request *r = c.incoming;
+                c.incoming = nullptr;
+                c.got = 0;
+                submit(r);
+            }
+        }
+        else if (c.got == REQUEST_SIZE) {
+            c.got = 0;
+            if (!on_header(c)) { stop_receiving(c); return; }
+        }
+        receive(c);
+    }
+
+    // Start a request from the header just received; false ends the connection
+    bool on_header(connection &c) {
+        if (get32(c.hdr) != REQUEST_MAGIC) return false;
+        uint16_t type = get16(c.hdr + 6);
+        uint32_t length = get32(c.hdr + 24);
+        if (type == CMD_DISC) return false; // outstanding requests still complete
+        if (type == CMD_WRITE && length > MAX_PAYLOAD) return false;
+        request *r = new_request(c);
+        r->flags = get16(c.hdr + 4); r->type = type;
+        r->handle = get64(c.hdr + 8); r->offset = get64(c.hdr + 16); r->length = length;
+        r->buf = nullptr;
+        bool needs_buffer = (type == CMD_WRITE && length) || (type == CMD_READ && length && length <= MAX_PAYLOAD);
+        if (needs_buffer && !attach_buffer(r)) {
+            c.waiting = r;
+            starved.push_back(&c);
+            return true;
+        }
+        if (type == CMD_WRITE && length) c.incoming = r;
+        else submit(r);
+        return true;
+    }
+
+    // Validate, take the blocks and start the transfer
+    void submit(request *r) {
+        bool in_range = r->offset <= ex.size && r->length <= ex.size - r->offset;
+        switch (r->type) {
+        case CMD_READ:
+            if (!in_range || r->length > MAX_PAYLOAD) r->err = EINVAL;
+            break;
+        case CMD_WRITE:
+        case CMD_WRITE_ZEROES:
+            if (!in_range) r->err = ENOSPC;
+            break;
+        case CMD_TRIM:
+            if (!in_range) r->err = EINVAL;
+            break;
+        case CMD_FLUSH:
+            // Writes are replied to once on the device; only queued zeroing remains
+            flush_later(r);
+            return;
+        default:
+            r->err = EINVAL;
+        }
+        if (r->err || !r->length) { completed(r); return; }
+        r->first = r->offset / ex.blk;
+        r->blocks = (r->offset + r->length - 1) / ex.blk - r->first + 1;
+        r->exclusive = r->type != CMD_READ;
+        // Overlapping requests start in arrival order
+        bool behind = std::any_of(deferred.begin(), deferred.end(), [r](const request *q) {
+            return q->first < r->first + r->blocks && r->first < q->first + q->blocks;
+        });
+        if (behind || !ex.try_lock(r->first, r->blocks, r->exclusive)) { deferred.push_back(r); return; }
+        r->locked = true;
+        start(r);
+    }
+
+    void start(request *r) {
+        completion done = [this, r] { completed(r); };
+        switch (r->type) {
+        case CMD_READ:
+            r->err = do_read(*r, std::move(done));
+            return;
+        case CMD_WRITE:
+            if ((r->err = do_write(*r, std::move(done))) != 0) completed(r);
+            return;
+        default:
+            r->err = do_zero(r->offset, r->length, r->type == CMD_WRITE_ZEROES && (r->flags & CMD_FLAG_NO_HOLE));
+            // Zeroing is queued behind earlier writes; FUA waits for it
+            if (!r->err && (r->flags & CMD_FLAG_FUA)) flush_later(r);
+            else completed(r);
+        }
+    }
+
+    // Reply once everything queued so far is on the device. The flusher
+    // thread waits for it, so the loop keeps serving other connections
+    void flush_later(request *r) {
+        {
+            std::lock_guard<std::mutex> lg(flush_m);
+            to_flush.push_back(r);
+        }
+        flush_cv.notify_one();
+    }
+
+    // One drain() covers every request queued before it started
+    void flush_requests() {
+        std::unique_lock<std::mutex> lk(flush_m);
+        for (;;) {
+            flush_cv.wait(lk, [this] { return stopping || !to_flush.empty(); });
+            if (to_flush.empty()) return;
+            std::vector<request *> batch;
+            batch.swap(to_flush);
+            lk.unlock();
+            drain();
+            for (request *r : batch) completed(r);
+            lk.lock();
+        }
+    }
+
+    // Deferred requests in arrival order, each started once its blocks are
+    // free and no earlier deferred request overlaps it
+    void retry_deferred() {
+        for (size_t i = 0; i < deferred.size();) {
+            request *r = deferred[i];
+            bool behind = std::any_of(deferred.begin(), deferred.begin() + i, [r](const request *q) {
+                return q->first < r->first + r->blocks && r->first < q->first + q->blocks;
+            });
+            if (behind || !ex.try_lock(r->first, r->blocks, r->exclusive)) { ++i; continue; }
+            deferred.erase(deferred.begin() + i);
+            r->locked = true;
+            start(r);
+        }
+    }
+
+    void finish(request *r) {
+        if (r->locked) ex.unlock(r->first, r->blocks, r->exclusive);
+        r->locked = false;
+        connection &c = *r->conn;
+        if (c.broken) { release(r); maybe_drop(c); return; }
+        if (r->type == CMD_READ && !r->err) build_read_reply(*r);
+        else build_reply(*r);
+        c.ready.push_back(r);
+        send(c);
+    }
+
+    // Send the replies that are ready, several per call
+    void send(connection &c) {
+        if (c.sending || c.ready.empty()) return;
+        c.batch.clear(); c.iov.clear(); c.iov_at = 0;
+        do {
+            request *r = c.ready.front();
+            c.ready.pop_front();
+            c.batch.push_back(r);
+            c.iov.insert(c.iov.end(), r->iov.begin(), r->iov.end());
+        } while (!c.ready.empty() && c.iov.size() + c.ready.front()->iov.size() <= MAX_IOV);
+        queue_send(c);
+    }
+
+    void queue_send(connection &c) {
+        memset(&c.msg, 0, sizeof(c.msg));
+        c.msg.msg_iov = c.iov.data() + c.iov_at;
+        c.msg.msg_iovlen = std::min(c.iov.size() - c.iov_at, MAX_IOV);
+        io_uring_sqe *s = ring.next_sqe();
+        s->opcode = IORING_OP_SENDMSG;
+        s->fd = c.fd;
+        s->addr = (uint64_t)(uintptr_t)&c.msg;
+        s->msg_flags = MSG_NOSIGNAL;
+        s->user_data = slot_of(c) << 1 | 1;
+        c.sending = true;
+    }
+
+    void on_send(connection &c, int res) {
+        c.sending = false;
+        if (res <= 0) {
+            // The client is gone: drop every reply and stop reading
+            c.broken = true;
+            for (request *r : c.batch) release(r);
+            c.batch.clear();
+            while (!c.ready.empty()) { release(c.ready.front()); c.ready.pop_front(); }
+            if (c.receiving) shutdown(c.fd, SHUT_RDWR);
+            else stop_receiving(c);
+            maybe_drop(c);
+            return;
+        }
+        // Skip what went out and send the rest
+        for (size_t n = (size_t)res; n && c.iov_at < c.iov.size();) {
+            iovec &v = c.iov[c.iov_at];
+            size_t k = std::min(n, v.iov_len);
+            v.iov_base = static_cast<char *>(v.iov_base) + k; v.iov_len -= k; n -= k;
+            if (!v.iov_len) ++c.iov_at;
+        }
+        if (c.iov_at < c.iov.size()) { queue_send(c); return; }
+        for (request *r : c.batch) release(r);
+        c.batch.clear();
+        send(c);
+        receive(c);
+        maybe_drop(c);
+    }
+
+    // Header of one structured reply chunk with `len` payload bytes
+    static void chunk_header(char *p, uint16_t flags, uint16_t type, uint64_t handle, uint32_t len) {
+        put32(p, STRUCTURED_REPLY_MAGIC); put16(p + 4, flags); put16(p + 6, type); put64(p + 8, handle); put32(p + 16, len);
+    }
+
+    void build_reply(request &r) {
+        r.meta.resize(32); r.iov.clear();
+        char *p = r.meta.data();
+        if (!r.conn->structured) {
+            put32(p, SIMPLE_REPLY_MAGIC); put32(p + 4, (uint32_t)r.err); put64(p + 8, r.handle);
+            r.iov.push_back({p, 16});
+        }
+        else if (!r.err) {
+            chunk_header(p, REPLY_FLAG_DONE, REPLY_NONE, r.handle, 0);
+            r.iov.push_back({p, 20});
+        }
+        else {
+            // Error chunk without a message
+            chunk_header(p, REPLY_FLAG_DONE, REPLY_ERROR, r.handle, 6);
+            put32(p + 20, (uint32_t)r.err); put16(p + 24, 0);
+            r.iov.push_back({p, 26});
+        }
+    }
+
+    // Structured replies send holes as OFFSET_HOLE chunks and only the data
+    // runs as OFFSET_DATA; a simple reply (or DF) sends the whole range
+    void build_read_reply(request &r) {
+        r.iov.clear();
+        if (!r.conn->structured) {
+            r.meta.resize(16);
+            put32(r.meta.data(), SIMPLE_REPLY_MAGIC); put32(r.meta.data() + 4, 0); put64(r.meta.data() + 8, r.handle);
+            r.iov.push_back({r.meta.data(), 16});
+            if (r.length) r.iov.push_back({r.buf, r.length});
+            return;
+        }
+        std::vector<extent> &runs = runs_scratch;
+        runs.clear();
+        uint64_t pos = r.offset;
+        for (size_t i = 0; pos < r.offset + r.length; ++i) {
+            uint32_t n = (uint32_t)std::min<uint64_t>(ex.blk - pos % ex.blk, r.offset + r.length - pos);
+            bool d = (r.flags & CMD_FLAG_DF) || r.data[i];
+            if (!runs.empty() && runs.back().data == d) runs.back().len += n;
+            else runs.push_back({pos, n, d});
+            pos += n;
+        }
+        r.meta.resize(std::max<size_t>(1, runs.size()) * 32);
+        if (runs.empty()) {
+            chunk_header(r.meta.data(), REPLY_FLAG_DONE, REPLY_NONE, r.handle, 0);
+            r.iov.push_back({r.meta.data(), 20});
+            return;
+        }
+        for (size_t i = 0; i < runs.size(); ++i) {
+            char *p = r.meta.data() + i * 32;
+            uint16_t flags = i + 1 == runs.size() ? REPLY_FLAG_DONE : 0;
+            const extent &e = runs[i];
+            if (e.data) {
+                chunk_header(p, flags, REPLY_OFFSET_DATA, r.handle, 8 + e.len);
+                put64(p + 20, e.offset);
+                r.iov.push_back({p, 28});
+                r.iov.push_back({r.buf + (e.offset - r.offset), e.len});
+            }
+            else {
+                chunk_header(p, flags, REPLY_OFFSET_HOLE, r.handle, 12);
+                put64(p + 20, e.offset); put32(p + 28, e.len);
+                r.iov.push_back({p, 32});
+            }
+        }
+    }
+
+    vram::uring ring;
+    std::vector<connection> conns;
+    std::vector<size_t> free_slots;   // loop thread only
+    std::atomic<size_t> available{0}; // free slots not yet promised to adopt()
+    size_t live = 0;
+    size_t depth, buf_size;
+    char *pool = nullptr;
+    std::vector<int> free_bufs;
+    std::deque<connection *> starved;  // connections waiting for a buffer
+    bool fixed = false;
+    std::vector<std::unique_ptr<request>> requests;
+    std::vector<request *> spare;
+    std::deque<request *> deferred;    // waiting for their blocks
+    std::vector<request *> local_done; // finished on the loop thread
+    std::thread::id owner;
+    int wake_fd = -1;
+    uint64_t wake_count = 0;
+    __kernel_timespec retry_after = {0, 0};
+    bool timer_armed = false;
+    std::mutex m;                      // guards `fresh` and `finished`
+    std::vector<std::pair<int, bool>> fresh;
+    std::vector<request *> finished;
+    std::mutex flush_m;                // guards `to_flush` and `stopping`
+    std::condition_variable flush_cv;
+    std::vector<request *> to_flush;   // FLUSH and FUA requests waiting for drain()
+    bool stopping = false;
+    std::thread flusher;
+    // Runs of blocks in a read that are all data or all holes
+    struct extent { uint64_t offset; uint32_t len; bool data; };
+    std::vector<extent> runs_scratch;
+};
+
+// Blocking helpers for the handshake, which runs on the accepting thread
+static bool read_all(int fd, void *p, size_t n) {
+    for (char *c = static_cast<char *>(p); n;) {
+        ssize_t r = recv(fd, c, n, 0);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) return false;
+        c += r; n -= (size_t)r;
+    }
+    return true;
+}
+
+static bool write_all(int fd, const void *p, size_t n) {
+    for (const char *c = static_cast<const char *>(p); n;) {
+        ssize_t r = send(fd, c, n, MSG_NOSIGNAL);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) return false;
+        c += r; n -= (size_t)r;
+    }
+    return true;
+}
+
+static bool opt_reply(int fd, uint32_t opt, uint32_t type, const std::string &data = "") {
+    char h[20];
+    put64(h, OPT_REPLY_MAGIC); put32(h + 8, opt); put32(h + 12, type); put32(h + 16, (uint32_t)data.size());
+    return write_all(fd, h, sizeof(h)) && write_all(fd, data.data(), data.size());
+}
+
+static std::string info_export(bool structured) {
+    std::string d(12, '\0');
+    put16(&d[0], INFO_EXPORT); put64(&d[2], ex.size); put16(&d[10], transmission_flags(structured));
+    return d;
+}
+
+// Fixed newstyle negotiation; true once the client enters transmission
+static bool negotiate(int fd, const std::string &name, bool &structured) {
+    char greet[18];
+    put64(greet, NBDMAGIC); put64(greet + 8, IHAVEOPT); put16(greet + 16, FLAG_FIXED_NEWSTYLE | FLAG_NO_ZEROES);
+    char cflags[4];
+    if (!write_all(fd, greet, sizeof(greet)) || !read_all(fd, cflags, 4)) return false;
+    bool no_zeroes = get32(cflags) & FLAG_NO_ZEROES;
+    structured = false;
+    for (;;) {
+        char h[16];
+        if (!read_all(fd, h, sizeof(h)) || get64(h) != IHAVEOPT) return false;
+        uint32_t opt = get32(h + 8), len = get32(h + 12);
+        if (len > 65536) return false;
+        std::string data(len, '\0');
+        if (len && !read_all(fd, &data[0], len)) return false;
+        switch (opt) {
+        case OPT_EXPORT_NAME: {
+            if (!data.empty() && data != name) return false;
+            char r[10 + 124] = {};
+            put64(r, ex.size); put16(r + 8, transmission_flags(structured));
+            return write_all(fd, r, no_zeroes ? 10 : sizeof(r));
+        }
+        case OPT_ABORT:
+            opt_reply(fd, opt, REP_ACK);
+            return false;
+        case OPT_LIST: {
+            if (len) { if (!opt_reply(fd, opt, REP_ERR_INVALID)) return false; break; }
+            std::string d(4, '\0');
+            put32(&d[0], (uint32_t)name.size());
+            if (!opt_reply(fd, opt, REP_SERVER, d + name) || !opt_reply(fd, opt, REP_ACK)) return false;
+            break;
+        }
+        case OPT_STRUCTURED_REPLY:
+            if (len) { if (!opt_reply(fd, opt, REP_ERR_INVALID)) return false; break; }
+            structured = true;
+            if (!opt_reply(fd, opt, REP_ACK)) return false;
+            break;
+        case OPT_INFO:
+        case OPT_GO: {
+            // u32 name length, name, u16 request count, u16 requests
+            uint32_t nlen = len >= 4 ? get32(&data[0]) : ~0u;
+            if (nlen > len - 4 || len - 4 - nlen < 2 || len - 6 - nlen != 2u * get16(&data[4 + nlen])) {
+                if (!opt_reply(fd, opt, REP_ERR_INVALID)) return false;
+                break;
+            }
+            if (nlen && data.compare(4, nlen, name) != 0) {
+                if (!opt_reply(fd, opt, REP_ERR_UNKNOWN)) return false;
+                break;
+            }
+            bool sizes = false;
+            for (uint32_t i = 0; i < get16(&data[4 + nlen]); ++i)
+                sizes |= get16(&data[6 + nlen + 2 * i]) == INFO_BLOCK_SIZE;
+            if (!opt_reply(fd, opt, REP_INFO, info_export(structured))) return false;
+            if (sizes) {
+                // Any byte granularity works. A write smaller than a block is
+                // copied straight into it, with no read-modify-write, so pages
+                // are preferred; a larger size would have clients merge them
+                std::string d(14, '\0');
+                put16(&d[0], INFO_BLOCK_SIZE); put32(&d[2], 1); put32(&d[6], (uint32_t)std::min<size_t>(ex.blk, 4096)); put32(&d[10], MAX_PAYLOAD);
+                if (!opt_reply(fd, opt, REP_INFO, d)) return false;
+            }
+            if (!opt_reply(fd, opt, REP_ACK)) return false;
+            if (opt == OPT_GO) return true;
+            break;
+        }
+        default:
+            if (!opt_reply(fd, opt, REP_ERR_UNSUP)) return false;
+        }
+    }
+}
+
+static int listen_tcp(const std::string &spec) {
+    size_t colon = spec.rfind(':');
+    std::string host = colon == std::string::npos ? "" : spec.substr(0, colon);
+    std::string port = colon == std::string::npos ? spec : spec.substr(colon + 1);
+    addrinfo hints = {}, *res = nullptr;
+    hints.ai_family = AF_UNSPEC; hints.ai_socktype = SOCK_STREAM; hints.ai_flags = AI_PASSIVE;
+    if (getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &res) != 0) return -1;
+    int fd = -1;
+    for (addrinfo *a = res; a && fd < 0; a = a->ai_next) {
+        fd = socket(a->ai_family, a->ai_socktype | SOCK_CLOEXEC, a->ai_protocol);
+        if (fd < 0) continue;
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (bind(fd, a->ai_addr, a->ai_addrlen) < 0 || listen(fd, 64) < 0) { close(fd); fd = -1; }
+    }
+    freeaddrinfo(res);
+    return fd;
+}
+
+static int listen_unix(const std::string &path) {
+    sockaddr_un addr = {};
+    if (path.size() >= sizeof(addr.sun_path)) return -1;
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    unlink(path.c_str());
+    if (bind(fd, (sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 64) < 0) { close(fd); return -1; }
+    return fd;
+}
+
+static void on_signal(int) { running = false; }
+
+static void usage() {
+    std::cerr << "usage: nbd_server [--tcp [host:]port] [--socket path] [--name name] [--size bytes]\n"
+                 "                  [--backend cuda|host] [--host-memory bytes] [--host-bandwidth bytes/s]\n"
+                 "                  [--host-latency-us n] [--devices 0,1,...]\n"
+                 "                  [--threads n] [--connections n] [--queue-depth n] [--buffers n]\n"
+                 "                  [--buffer bytes] [port]" << std::endl;
+}
+
+static bool parse_args(int argc, char **argv, server_config &cfg) {
+    for (int i = 1; i < argc; ++i) {
+        std::string a = argv[i];
+        bool has_value = i + 1 < argc;
+        const char *v = has_value ? argv[i + 1] : nullptr;
+        int64_t n = 0;
+        if (a[0] != '-') { cfg.tcp = a; continue; } // port, as before the options existed
+        if (!has_value) return false;
+        ++i;
+        if (a == "--tcp") cfg.tcp = v;
+        else if (a == "--socket") cfg.socket_path = v;
+        else if (a == "--name") cfg.name = v;
+        else if (a == "--backend") cfg.backend = v;
+        else if (a == "--size" && (n = parse_size(v)) > 0) cfg.size = (size_t)n;
+        else if (a == "--host-memory" && (n = parse_size(v)) > 0) cfg.host.memory = (size_t)n;
+        else if (a == "--host-bandwidth" && (n = parse_size(v)) >= 0) cfg.host.bandwidth = (uint64_t)n;
+        else if (a == "--host-latency-us" && (n = parse_size(v)) >= 0) cfg.host.latency_ns = (uint64_t)n * 1000;
+        else if (a == "--buffer" && (n = parse_size(v)) > 0) cfg.buffer = (size_t)n;
+        else if (a == "--threads" && (cfg.threads = atoi(v)) > 0) {}
+        else if (a == "--connections" && (cfg.connections = atoi(v)) > 0) {}
+        else if (a == "--queue-depth" && (cfg.queue_depth = atoi(v)) > 0) {}
+        else if (a == "--buffers" && (cfg.buffers = atoi(v)) > 0) {}
+        else if (a == "--devices") {
+            for (const char *p = v; *p;) {
+                char *end = nullptr;
+                cfg.devices.push_back(strtoul(p, &end, 10));
+                if (end == p) return false;
+                p = *end == ',' ? end + 1 : end;
+            }
+        }
+        else return false;
+    }
+    if (cfg.tcp.empty() && cfg.socket_path.empty()) cfg.tcp = "10809";
+    return true;
+}
+
+int main(int argc, char **argv) {
+    server_config cfg;
+    if (!parse_args(argc, argv, cfg)) { usage(); return 1; }
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+
+    if (!select_backend(cfg.backend, cfg.host)) { std::cerr << "nbd_server: unknown backend " << cfg.backend << std::endl; return 1; }
+    if (!cfg.devices.empty()) set_devices(cfg.devices);
+    if (!init()) { std::cerr << "nbd_server: " << current_backend().name() << " backend init failed" << std::endl; return 1; }
+    init_staging_pool();
+    init_streams();
+    if (!cfg.size) {
+        size_t total = total_device_memory(), reserve = 256ULL * 1024 * 1024;
+        cfg.size = total > reserve ? total - reserve : total;
+    }
+    ex.size = cfg.size;
+    ex.blk = block_size();
+    ex.nblocks = (ex.size + ex.blk - 1) / ex.blk;
+    ex.blocks.reset(new block *[ex.nblocks]());
+    ex.busy.reset(new std::atomic<uint32_t>[ex.nblocks]());
+    // Blocks are cleared when first written, so the pool needn't be
+    size_t pooled = increase_pool(ex.size, false);
+    if (pooled < ex.size) std::cerr << "nbd_server: pool holds " << pooled << " of " << ex.size << " bytes; writes past that fail with ENOSPC" << std::endl;
+
+    std::vector<int> listeners;
+    if (!cfg.tcp.empty()) {
+        int fd = listen_tcp(cfg.tcp);
+        if (fd < 0) { std::cerr << "nbd_server: cannot listen on " << cfg.tcp << std::endl; return 1; }
+        listeners.push_back(fd);
+    }
+    if (!cfg.socket_path.empty()) {
+        int fd = listen_unix(cfg.socket_path);
+        if (fd < 0) { std::cerr << "nbd_server: cannot listen on " << cfg.socket_path << std::endl; return 1; }
+        listeners.push_back(fd);
+    }
+
+    std::vector<std::unique_ptr<event_loop>> loops;
+    std::vector<std::thread> threads;
+    for (int t = 0; t < cfg.threads; ++t) {
+        loops.emplace_back(new event_loop(cfg));
+        if (!loops.back()->ok()) { std::cerr << "nbd_server: io_uring unavailable" << std::endl; return 1; }
+    }
+    for (auto &l : loops) threads.emplace_back([&l] { l->run(); });
+    std::cerr << "nbd_server: exporting " << ex.size << " bytes in " << ex.blk << "-byte blocks on " << current_backend().name()
+              << (loops[0]->registered() ? "" : " (buffers not registered)") << std::endl;
 
-    while (running.load()) {
-        int client = accept(sock, nullptr, nullptr);
-        if (client < 0) continue;
-        std::thread(handle_client, client).detach();
+    std::vector<pollfd> pfds;
+    for (int fd : listeners) pfds.push_back({fd, POLLIN, 0});
+    size_t next = 0;
+    while (running) {
+        if (poll(pfds.data(), pfds.size(), 200) <= 0) continue;
+        for (pollfd &p : pfds) {
+            if (!(p.revents & POLLIN)) continue;
+            int fd = accept4(p.fd, nullptr, nullptr, SOCK_CLOEXEC);
+            if (fd < 0) continue;
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)); // fails harmlessly on Unix sockets
+            // A stalled client holds up accepting for at most this long
+            timeval tv = {10, 0};
+            setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+            setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+            bool structured = false;
+            if (!negotiate(fd, cfg.name, structured)) { close(fd); continue; }
+            tv = {0, 0};
+            setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+            setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+            bool taken = false;
+            for (size_t i = 0; i < loops.size() && !taken; ++i) taken = loops[next++ % loops.size()]->adopt(fd, structured);
+            if (!taken) { std::cerr << "nbd_server: connection limit reached" << std::endl; close(fd); }
+        }
     }
 
-    close(sock);
+    for (auto &l : loops) l->wake();
+    for (auto &t : threads) t.join();
+    for (int fd : listeners) close(fd);
+    if (!cfg.socket_path.empty()) unlink(cfg.socket_path.c_str());
+    drain();
+    for (size_t i = 0; i < ex.nblocks; ++i) if (ex.blocks[i]) release_block(ex.blocks[i]);
+    loops.clear();
+    shutdown();
     return 0;
 }
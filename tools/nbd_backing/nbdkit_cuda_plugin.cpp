@@ -3,10 +3,26 @@
 #include <cstdint>
 #include <errno.h>
 #include "cuda_memory.hpp"
+#include "read_cache.hpp"
+#include "fill_detect.hpp"
+#include "numa_topology.hpp"
+#include "spill_store.hpp"
+#include "block_codec.hpp"
+#include "metrics.hpp"
+#include "io_scheduler.hpp"
+#include "trace.hpp"
 #include <vector>
 #include <mutex>
 #include <memory>
 #include <atomic>
+#include <string>
+#include <algorithm>
+#include <cstdlib>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <thread>
+#include <cstdio>
 
 // Request API v2 to get pread/pwrite with flags
 #define NBDKIT_API_VERSION 2
@@ -20,15 +36,521 @@ extern "C"
 
 using namespace vram::cuda_mem;
 
-static bool backend_inited = false;
+static std::atomic<bool> backend_inited{false};
+static std::mutex init_mutex;
 static int64_t plugin_size_bytes = 0; /* 0 = auto-detect */
+static std::string backend_name = "cuda";
+static host_backend_config host_cfg;
+static bool async_write = true;   /* writes return once staged; flush is the durability barrier */
+static int stream_count = 4;
+static int max_staging_buffers = 256;
+static size_t blk_size = block::size; /* allocation and map granularity */
+static std::vector<size_t> device_list; /* empty = the default device */
+static bool stripe_placement = true; /* block i on device i % n; otherwise the one with most free blocks */
+static std::string worker_cpus_arg; /* empty = workers unpinned, "auto" = CPUs of the devices' NUMA nodes */
+static std::vector<int> worker_cpus;
+static size_t read_cache_bytes = 0; /* 0 = no host read cache */
+static size_t write_back_bytes = 0; /* 0 = sub-block writes go straight to the device */
+static uint32_t write_back_age_ms = 20;
+static std::string populate_mode = "background"; /* eager | background | lazy */
+static size_t elastic_reserve = 0; /* device memory left free for other processes; 0 = none */
+static std::string elastic_limit_path; /* file holding a cap on the pool size, re-read while running */
+static uint32_t elastic_interval_ms = 1000;
+static std::string spill_path; /* empty = blocks that don't fit in device memory can't be evicted */
+static size_t spill_bytes = 0; /* 0 = the export size */
+static uint32_t spill_demote = 0; /* percent of the pool kept free by demoting cold blocks; 0 = off */
+static std::unique_ptr<vram::spill_store> spill;
+static std::string compress_name; /* empty = blocks stored raw */
+static bool packing = false;      /* compressed storage active */
+static std::unique_ptr<vram::read_cache> cache;
+static std::string scheduler_mode = "off"; /* off | strict | weighted */
+static vram::io_scheduler::config sched_cfg;
+static std::unique_ptr<vram::io_scheduler> sched; /* null = threads submit transfers directly */
+static std::string metrics_path; /* empty = no metrics */
+static uint32_t metrics_interval_ms = 1000;
+static std::string trace_path; /* empty = no request trace */
+static size_t trace_buffer = 65536; /* trace records buffered per thread */
 static const size_t SAFETY_RESERVE = 256ULL * 1024 * 1024;
+// Largest request advertised to clients; each one becomes a single batched transfer
+static const uint32_t MAX_REQUEST_SIZE = 32 * 1024 * 1024;
 
-struct BlockEntry { block_ref b; std::mutex m; };
-static std::vector<std::shared_ptr<BlockEntry>> backing_map;
-static std::mutex backing_map_mutex;
+// Write-back tracks staged data in 4K pages, one bit each in WbBuffer::dirty
+static const size_t WB_PAGE = 4096;
+static_assert(block::size / WB_PAGE <= 64, "write-back page bitmap must fit in 64 bits");
+static size_t wb_pages = 0;
+static uint64_t wb_full = 0; // all wb_pages bits set
+
+// One export block in 16 bytes, with no heap allocation of its own. `data` is
+// the device block (HAS_BLOCK), its compressed slot (PACKED), its slot in the
+// spill file (SPILLED) or, for
+// a block written entirely with one repeated non-zero word, that word
+// (FILLED); reads expand it. `wb` indexes the block's write-back buffer,
+// 0 = none. ACCESSED is set by every read and write and cleared by the
+// demotion sweep. The state word doubles as the slot's lock (waiters sleep on
+// it); everything but DIRTY and ACCESSED is guarded by it.
+struct BlockSlot
+{
+    enum : uint32_t { LOCKED = 1, WAITERS = 2, DIRTY = 4, HAS_BLOCK = 8, FILLED = 16, SPILLED = 32, ACCESSED = 64, PACKED = 128 };
+    std::atomic<uint32_t> state{0}; uint32_t wb = 0; uint64_t data = 0;
+
+    void lock()
+    {
+        uint32_t s = state.load(std::memory_order_relaxed);
+        for (;;) {
+            if (!(s & LOCKED)) { if (state.compare_exchange_weak(s, s | LOCKED, std::memory_order_acquire, std::memory_order_relaxed)) return; continue; }
+            if (!(s & WAITERS) && !state.compare_exchange_weak(s, s | WAITERS, std::memory_order_relaxed)) continue;
+            state.wait(s | WAITERS, std::memory_order_relaxed);
+            s = state.load(std::memory_order_relaxed);
+        }
+    }
+    void unlock() { if (state.fetch_and(~(LOCKED | WAITERS), std::memory_order_release) & WAITERS) state.notify_all(); }
+    bool has(uint32_t flag) const { return state.load(std::memory_order_relaxed) & flag; }
+    void set(uint32_t flag, bool on) { if (on) state.fetch_or(flag, std::memory_order_relaxed); else state.fetch_and(~flag, std::memory_order_relaxed); }
+    block *blk() const { return has(HAS_BLOCK) ? reinterpret_cast<block *>(data) : nullptr; }
+    void touch() { if (!has(ACCESSED)) state.fetch_or(ACCESSED, std::memory_order_relaxed); }
+};
+static_assert(sizeof(BlockSlot) == 16, "block map slots should stay 16 bytes");
+
+// A staging buffer holding sub-block writes not yet sent to the device
+// (pages set in `dirty` are newer than the device copy). At most wb_limit
+// exist; free ones are listed in wb_free. Guarded by the owning slot's lock.
+struct WbBuffer { uint8_t *buf = nullptr; uint64_t dirty = 0; uint64_t gen = 0; };
+static std::unique_ptr<WbBuffer[]> wb_buffers;
+static std::vector<uint32_t> wb_free; // guarded by wb_mutex
+static uint64_t wb_next_gen = 0;      // guarded by wb_mutex
+
+// Flat block map sized once at init; the slot index is the block index
+static std::unique_ptr<BlockSlot[]> backing_map;
+static size_t backing_map_size = 0;
+
+// Blocks with asynchronous writes not yet covered by a flush. Each block is
+// queued at most once (guarded by BlockSlot::DIRTY), so flush is O(dirty).
+static std::vector<size_t> dirty_blocks;
+static std::mutex dirty_mutex;
+
+static void mark_dirty(size_t block_idx)
+{
+    if (backing_map[block_idx].state.fetch_or(BlockSlot::DIRTY, std::memory_order_acq_rel) & BlockSlot::DIRTY) return;
+    std::lock_guard<std::mutex> lg(dirty_mutex);
+    dirty_blocks.push_back(block_idx);
+}
+
+// Blocks currently holding device memory; drops again on trim and zero
 static std::atomic<size_t> total_allocated_blocks{0};
 
+// Device blocks trim and zero have given back to the pool, ever
+static std::atomic<uint64_t> released_blocks{0};
+
+// Blocks stored as a fill word instead of device memory
+static std::atomic<size_t> filled_blocks{0};
+
+// Blocks evicted to the spill file
+static std::atomic<size_t> spilled_blocks{0};
+
+// Blocks stored compressed
+static std::atomic<size_t> packed_blocks{0};
+
+// One bit per block, set while it holds device memory, a compressed or spill slot or a non-zero fill
+// (updated under the entry lock). Extents scan it a word at a time to skip holes.
+static std::unique_ptr<std::atomic<uint64_t>[]> alloc_bitmap;
+
+static void set_allocated(size_t block_idx, bool on)
+{
+    uint64_t bit = 1ULL << (block_idx % 64);
+    if (on) alloc_bitmap[block_idx / 64].fetch_or(bit, std::memory_order_relaxed);
+    else alloc_bitmap[block_idx / 64].fetch_and(~bit, std::memory_order_relaxed);
+}
+
+static bool block_allocated(size_t block_idx) { return alloc_bitmap[block_idx / 64].load(std::memory_order_relaxed) >> (block_idx % 64) & 1; }
+
+// First block in [block_idx, end) whose allocation bit is `want`, else `end`
+static size_t next_block_with(size_t block_idx, size_t end, bool want)
+{
+    while (block_idx < end) {
+        uint64_t w = alloc_bitmap[block_idx / 64].load(std::memory_order_relaxed);
+        if (!want) w = ~w;
+        w &= ~0ULL << (block_idx % 64);
+        if (w) return std::min(end, block_idx / 64 * 64 + (size_t)__builtin_ctzll(w));
+        block_idx = (block_idx / 64 + 1) * 64;
+    }
+    return end;
+}
+
+static void free_backing_map()
+{
+    { std::lock_guard<std::mutex> lg(dirty_mutex); dirty_blocks.clear(); }
+    for (size_t i = 0; i < backing_map_size; ++i) {
+        BlockSlot &s = backing_map[i];
+        if (s.wb) release_staging_buffer(wb_buffers[s.wb].buf, s.blk());
+        if (s.blk()) release_block(s.blk());
+        if (s.has(BlockSlot::PACKED)) free_packed(s.data);
+    }
+    backing_map.reset(); backing_map_size = 0;
+    wb_buffers.reset(); wb_free.clear();
+    alloc_bitmap.reset();
+    total_allocated_blocks.store(0); filled_blocks.store(0); spilled_blocks.store(0); packed_blocks.store(0);
+    released_blocks.store(0);
+}
+
+// Metrics (metrics=<path>): request counts, bytes and errors, latency of
+// each NBD request and of the transfers it makes, and pool occupancy,
+// rewritten to the file in Prometheus text format every metrics_interval_ms.
+// Updates go to per-thread shards and are skipped entirely (no clock reads)
+// when metrics are off.
+enum MetricOp { OP_PREAD, OP_PWRITE, OP_FLUSH, OP_TRIM, OP_ZERO, NOPS };
+struct PluginMetrics {
+    vram::metrics::id requests[NOPS], bytes[NOPS], latency[NOPS];
+    vram::metrics::id enospc, eio;
+    vram::metrics::id device_read, device_write, spill_read, spill_write;
+};
+static PluginMetrics pm;
+static bool metrics_on = false;
+static std::thread metrics_thread;
+static std::mutex metrics_mutex;
+static std::condition_variable metrics_cv;
+static bool metrics_stop = false;
+
+static uint64_t now_ns() { return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count(); }
+
+// Time a scope into a histogram
+struct MetricTimer {
+    vram::metrics::id h; uint64_t start;
+    explicit MetricTimer(vram::metrics::id h) : h(h), start(metrics_on ? now_ns() : 0) {}
+    ~MetricTimer() { if (metrics_on) vram::metrics::observe(h, now_ns() - start); }
+};
+
+// Run one NBD request, which returns 0 or an errno, and account for it; with
+// trace=<path> it is also appended to the calling thread's trace ring. A
+// failure goes to nbdkit as -1 with the errno set.
+static_assert((int)OP_ZERO == (int)vram::trace::ZERO, "metric and trace ops line up");
+template <class F> static int measured(MetricOp op, uint64_t offset, uint32_t bytes, F run)
+{
+    bool tracing = vram::trace::enabled();
+    int err;
+    if (!metrics_on && !tracing) err = run();
+    else {
+        uint64_t start = now_ns(), trace_start = tracing ? vram::trace::now_ns() : 0;
+        err = run();
+        uint64_t elapsed = now_ns() - start;
+        if (tracing) vram::trace::record_op((vram::trace::op)op, offset, bytes, trace_start, elapsed, err);
+        if (metrics_on) {
+            vram::metrics::observe(pm.latency[op], elapsed);
+            vram::metrics::add(pm.requests[op]);
+            if (!err) vram::metrics::add(pm.bytes[op], bytes);
+            else vram::metrics::add(err == ENOSPC ? pm.enospc : pm.eio); // anything else is an I/O error
+        }
+    }
+    if (!err) return 0;
+    nbdkit_set_error(err);
+    return -1;
+}
+
+static void register_metrics()
+{
+    using namespace vram::metrics;
+    static const char *ops[NOPS] = {"pread", "pwrite", "flush", "trim", "zero"};
+    for (int op = 0; op < NOPS; ++op) {
+        std::string l = std::string("op=\"") + ops[op] + "\"";
+        pm.requests[op] = counter("vram_requests_total", l, "NBD requests completed, including failed ones");
+        pm.bytes[op] = counter("vram_request_bytes_total", l, "Bytes read, written or discarded by successful requests");
+        pm.latency[op] = histogram("vram_request_duration_seconds", l, "Time to serve an NBD request");
+    }
+    pm.enospc = counter("vram_request_errors_total", "error=\"ENOSPC\"", "Failed NBD requests");
+    pm.eio = counter("vram_request_errors_total", "error=\"EIO\"", "Failed NBD requests");
+    const char *transfer_help = "Time of one request's batched transfer (submission only for async device writes)";
+    pm.device_read = histogram("vram_transfer_duration_seconds", "path=\"device_read\"", transfer_help);
+    pm.device_write = histogram("vram_transfer_duration_seconds", "path=\"device_write\"", transfer_help);
+    pm.spill_read = histogram("vram_transfer_duration_seconds", "path=\"spill_read\"", transfer_help);
+    pm.spill_write = histogram("vram_transfer_duration_seconds", "path=\"spill_write\"", transfer_help);
+    sampled("vram_pool_blocks", "state=\"free\"", "Device pool blocks", false, [] { return (double)pool_available(); });
+    sampled("vram_pool_blocks", "state=\"total\"", "Device pool blocks", false, [] { return (double)pool_size(); });
+    sampled("vram_block_size_bytes", "", "Allocation granularity", false, [] { return (double)blk_size; });
+    const char *stored_help = "Export blocks by where their data is kept";
+    sampled("vram_stored_blocks", "store=\"device\"", stored_help, false, [] { return (double)total_allocated_blocks.load(); });
+    sampled("vram_stored_blocks", "store=\"fill\"", stored_help, false, [] { return (double)filled_blocks.load(); });
+    sampled("vram_stored_blocks", "store=\"compressed\"", stored_help, false, [] { return (double)packed_blocks.load(); });
+    sampled("vram_stored_blocks", "store=\"spill\"", stored_help, false, [] { return (double)spilled_blocks.load(); });
+    sampled("vram_released_blocks_total", "", "Device blocks returned to the pool by trim and zero", true, [] { return (double)released_blocks.load(); });
+    if (cache) {
+        sampled("vram_read_cache_hits_total", "", "Read cache hits", true, [] { return (double)cache->hits(); });
+        sampled("vram_read_cache_misses_total", "", "Read cache misses", true, [] { return (double)cache->misses(); });
+    }
+}
+
+static void metrics_publisher()
+{
+    std::unique_lock<std::mutex> lk(metrics_mutex);
+    bool failed = false;
+    while (!metrics_stop) {
+        metrics_cv.wait_for(lk, std::chrono::milliseconds(metrics_interval_ms));
+        // Once more on the way out, so the file ends with the final counts
+        bool ok = vram::metrics::publish(metrics_path);
+        if (!ok && !failed) nbdkit_debug("vram-cuda: unable to write metrics to %s", metrics_path.c_str());
+        failed = !ok;
+    }
+}
+
+static void stop_metrics()
+{
+    if (!metrics_thread.joinable()) return;
+    { std::lock_guard<std::mutex> lg(metrics_mutex); metrics_stop = true; }
+    metrics_cv.notify_all();
+    metrics_thread.join();
+    metrics_stop = false; metrics_on = false;
+    vram::metrics::clear();
+}
+
+// Write-back coalescing: sub-block writes are merged in a per-block staging
+// buffer and sent as one transfer per run of dirty pages when the block is
+// fully written, when it has been staged for write_back_age_ms, when the
+// write_back budget runs low, or on flush. Staged blocks are queued oldest
+// first; a record whose generation no longer matches the entry is stale.
+struct WbQueued { size_t block_idx; uint64_t gen; std::chrono::steady_clock::time_point since; };
+static std::deque<WbQueued> wb_queue;
+static std::mutex wb_mutex;
+static std::condition_variable wb_cv;
+static std::mutex wb_flush_mutex; // held while a popped batch is being submitted
+static std::atomic<size_t> wb_staged{0};
+static size_t wb_limit = 0;
+// Staging pools are per device, so each device also keeps half of its own
+// buffers for async writes: a writer waiting for one may hold slot locks the
+// flusher needs to give staged buffers back.
+static std::unique_ptr<std::atomic<size_t>[]> wb_staged_on;
+static size_t wb_device_limit = 0;
+static std::thread wb_thread;
+static bool wb_stop = false;
+
+// Detach a slot's write-back buffer and put its index back on the free list.
+// Caller holds the slot lock.
+static void wb_release(BlockSlot *slot)
+{
+    WbBuffer &w = wb_buffers[slot->wb];
+    w.buf = nullptr; w.dirty = 0;
+    { std::lock_guard<std::mutex> lg(wb_mutex); wb_free.push_back(slot->wb); }
+    slot->wb = 0;
+    wb_staged.fetch_sub(1);
+}
+
+// Queue the dirty runs of a staged block for writing and hand its buffer over
+// to `bufs`. Caller holds the slot lock and calls wb_submitted() once the
+// buffer has gone to write_staged_async.
+static void wb_collect(BlockSlot *slot, std::vector<segment> &segs, std::vector<void *> &bufs)
+{
+    const WbBuffer &w = wb_buffers[slot->wb];
+    for (size_t p = 0; p < wb_pages;) {
+        if (!(w.dirty >> p & 1)) { ++p; continue; }
+        size_t first = p;
+        while (p < wb_pages && (w.dirty >> p & 1)) ++p;
+        segs.push_back({slot->blk(), (off_t)(first * WB_PAGE), (p - first) * WB_PAGE, w.buf + first * WB_PAGE});
+    }
+    bufs.push_back(w.buf);
+    wb_release(slot);
+}
+
+// A collected buffer counts against its device's share until it is submitted:
+// the collector may block on another slot lock while holding it
+static void wb_submitted(size_t block_idx)
+{
+    wb_staged_on[backing_map[block_idx].blk()->device()].fetch_sub(1);
+    mark_dirty(block_idx);
+}
+
+// Discard staged data superseded by a full-block write. Caller holds the slot lock.
+static void wb_drop(BlockSlot *slot)
+{
+    release_staging_buffer(wb_buffers[slot->wb].buf, slot->blk());
+    wb_staged_on[slot->blk()->device()].fetch_sub(1);
+    wb_release(slot);
+}
+
+// Copy staged pages overlapping [off, off + len) of the block over `out`
+static void wb_overlay(const BlockSlot *slot, size_t off, size_t len, uint8_t *out)
+{
+    const WbBuffer &w = wb_buffers[slot->wb];
+    for (size_t p = off / WB_PAGE; p * WB_PAGE < off + len; ++p) {
+        if (!(w.dirty >> p & 1)) continue;
+        size_t lo = std::max(off, p * WB_PAGE), hi = std::min(off + len, (p + 1) * WB_PAGE);
+        memcpy(out + (lo - off), w.buf + lo, hi - lo);
+    }
+}
+
+// Stage a sub-block write. Returns false if no buffer is available, in which
+// case the caller writes to the device directly. Caller holds the slot lock
+// and the block is allocated.
+static bool wb_stage(size_t block_idx, BlockSlot *slot, size_t off, size_t len, const uint8_t *in)
+{
+    if (!slot->wb) {
+        if (wb_staged.load(std::memory_order_relaxed) >= wb_limit) { wb_cv.notify_one(); return false; }
+        // Reserve before acquiring, so racing writers can't overshoot the device's share
+        std::atomic<size_t> &on_dev = wb_staged_on[slot->blk()->device()];
+        if (on_dev.fetch_add(1) >= wb_device_limit) { on_dev.fetch_sub(1); wb_cv.notify_one(); return false; }
+        void *buf = acquire_staging_buffer(false, slot->blk());
+        if (!buf) { on_dev.fetch_sub(1); return false; }
+        {
+            std::lock_guard<std::mutex> lg(wb_mutex);
+            if (wb_free.empty()) { release_staging_buffer(buf, slot->blk()); on_dev.fetch_sub(1); return false; }
+            slot->wb = wb_free.back(); wb_free.pop_back();
+            wb_buffers[slot->wb] = {(uint8_t *)buf, 0, ++wb_next_gen};
+            wb_queue.push_back({block_idx, wb_next_gen, std::chrono::steady_clock::now()});
+        }
+        size_t staged = wb_staged.fetch_add(1) + 1;
+        if (staged * 4 >= wb_limit * 3) wb_cv.notify_one();
+    }
+    // Pages only partly covered must hold the device contents around the write
+    WbBuffer &w = wb_buffers[slot->wb];
+    size_t first = off / WB_PAGE, last = (off + len - 1) / WB_PAGE;
+    for (size_t p : {first, last}) {
+        bool covered = off <= p * WB_PAGE && off + len >= (p + 1) * WB_PAGE;
+        if (!covered && !(w.dirty >> p & 1)) { slot->blk()->read((off_t)(p * WB_PAGE), WB_PAGE, w.buf + p * WB_PAGE); w.dirty |= 1ULL << p; }
+    }
+    memcpy(w.buf + off, in, len);
+    for (size_t p = first; p <= last; ++p) w.dirty |= 1ULL << p;
+    return true;
+}
+
+// Write out staged blocks: those older than the age threshold, enough of the
+// oldest to get back under 3/4 of the budget, or all of them with `all`.
+// Blocks are batched into one transfer and locked in ascending order.
+static void wb_flush(bool all)
+{
+    std::lock_guard<std::mutex> flush_lg(wb_flush_mutex);
+    std::vector<WbQueued> batch;
+    {
+        std::lock_guard<std::mutex> lg(wb_mutex);
+        auto cutoff = std::chrono::steady_clock::now() - std::chrono::milliseconds(write_back_age_ms);
+        size_t over = wb_staged.load() * 4 > wb_limit * 3 ? wb_staged.load() - wb_limit * 3 / 4 : 0;
+        while (!wb_queue.empty() && (all || over || wb_queue.front().since <= cutoff)) {
+            batch.push_back(wb_queue.front()); wb_queue.pop_front();
+            if (over) --over;
+        }
+    }
+    if (batch.empty()) return;
+    std::sort(batch.begin(), batch.end(), [](const WbQueued &a, const WbQueued &b) { return a.block_idx != b.block_idx ? a.block_idx < b.block_idx : a.gen > b.gen; });
+    std::vector<std::unique_lock<BlockSlot>> locks;
+    std::vector<segment> segs; std::vector<void *> bufs; std::vector<size_t> written;
+    // Lock every block before taking any buffer: one taken while waiting for
+    // the next lock can't reach the pool, and that lock's holder may be
+    // waiting on the pool
+    batch.erase(std::unique(batch.begin(), batch.end(), [](const WbQueued &a, const WbQueued &b) { return a.block_idx == b.block_idx; }), batch.end());
+    for (const WbQueued &q : batch) locks.emplace_back(backing_map[q.block_idx]);
+    for (const WbQueued &q : batch) {
+        BlockSlot *slot = &backing_map[q.block_idx];
+        // Records of buffers already sent or dropped are stale
+        if (!slot->wb || wb_buffers[slot->wb].gen != q.gen) continue;
+        wb_collect(slot, segs, bufs);
+        written.push_back(q.block_idx);
+    }
+    if (!bufs.empty()) write_staged_async(segs.data(), segs.size(), bufs.data(), bufs.size());
+    for (size_t idx : written) wb_submitted(idx);
+}
+
+// Pin the calling thread to worker_cpus the first time it does I/O. nbdkit
+// owns its worker threads, so each one is pinned on its first request.
+static void pin_worker()
+{
+    static thread_local bool pinned = false;
+    if (pinned) return;
+    pinned = true;
+    if (!worker_cpus.empty() && !vram::pin_thread(worker_cpus)) nbdkit_debug("vram-cuda: unable to pin worker thread");
+}
+
+static void wb_flusher()
+{
+    pin_worker();
+    std::unique_lock<std::mutex> lk(wb_mutex);
+    while (!wb_stop) {
+        wb_cv.wait_for(lk, std::chrono::milliseconds(std::max<uint32_t>(1, write_back_age_ms / 2)));
+        if (wb_stop) break;
+        lk.unlock();
+        wb_flush(false);
+        lk.lock();
+    }
+}
+
+static void stop_wb_flusher()
+{
+    if (!wb_thread.joinable()) return;
+    { std::lock_guard<std::mutex> lg(wb_mutex); wb_stop = true; }
+    wb_cv.notify_all();
+    wb_thread.join();
+    std::lock_guard<std::mutex> lg(wb_mutex);
+    wb_stop = false; wb_queue.clear(); wb_next_gen = 0;
+}
+
+// Pool population. The export size is reported before the pool holds it:
+// unwritten blocks read as zeros from the map, so device memory is only
+// needed once a block is written. A background thread (or a writer that
+// finds the pool empty) grows the pool a step at a time until every device
+// holds its share of the export, or as much as the elastic limits allow.
+static const size_t POPULATE_STEP = 256ULL * 1024 * 1024;
+static std::mutex populate_mutex;
+static std::vector<size_t> pool_share; // bytes per device, in proportion to its memory
+static std::atomic<bool> populate_done{true};
+static std::atomic<bool> populate_stop{false};
+static std::thread populate_thread;
+static std::atomic<size_t> pool_cap{SIZE_MAX}; // from elastic_limit, split like the pool
+static std::thread elastic_thread;
+static std::mutex elastic_mutex;
+static std::condition_variable elastic_cv;
+static std::atomic<bool> elastic_stop{false};
+
+static bool elastic() { return elastic_reserve || !elastic_limit_path.empty(); }
+
+// Device `d`'s part of a byte count split like the pool
+static size_t share_of(size_t bytes, size_t d)
+{
+    size_t sum = 0;
+    for (size_t s : pool_share) sum += s;
+    return sum ? (size_t)((unsigned __int128)bytes * pool_share[d] / sum) : 0;
+}
+
+// Whole blocks device `d` may still grow by
+static size_t headroom(size_t d)
+{
+    size_t have = (size_t)pool_size(d) * blk_size + pool_retiring(d);
+    size_t room = pool_share[d] > have ? pool_share[d] - have : 0;
+    size_t cap = pool_cap.load(std::memory_order_relaxed);
+    if (cap != SIZE_MAX) room = std::min(room, share_of(cap, d) > have ? share_of(cap, d) - have : 0);
+    if (elastic_reserve) { size_t f = free_device_memory(d); room = std::min(room, f > elastic_reserve ? f - elastic_reserve : 0); }
+    return room / blk_size * blk_size;
+}
+
+static void log_pool()
+{
+    for (size_t d = 0; d < device_count(); ++d) nbdkit_debug("vram-cuda: device %zu: %d blocks, NUMA node %d", d, pool_size(d), device_numa_node(d));
+}
+
+// Add up to one step of device memory; false once nothing more fits
+static bool populate_step()
+{
+    std::lock_guard<std::mutex> lg(populate_mutex);
+    size_t got = 0;
+    for (size_t d = 0; d < device_count(); ++d) {
+        size_t room = std::min(headroom(d), POPULATE_STEP / device_count());
+        // New blocks are never read before being written, so skip clearing them
+        if (room) got += increase_pool_on(d, room, false);
+    }
+    if (!got) populate_done.store(true);
+    return got != 0;
+}
+
+static void populator()
+{
+    auto start = std::chrono::steady_clock::now();
+    while (!populate_stop.load(std::memory_order_relaxed) && populate_step()) {}
+    std::chrono::duration<double> d = std::chrono::steady_clock::now() - start;
+    nbdkit_debug("vram-cuda: pool populated in %.2fs", d.count());
+    log_pool();
+}
+
+static void stop_populator()
+{
+    if (!populate_thread.joinable()) return;
+    populate_stop = true;
+    populate_thread.join();
+    populate_stop = false;
+}
+
 static int64_t parse_size_str(const char *s)
 {
     if (!s) return 0;
@@ -44,6 +566,20 @@ static int64_t parse_size_str(const char *s)
     return v;
 }
 
+// Pool size cap from the elastic_limit file ("2G", "0", ...); missing or
+// empty means no cap
+static size_t read_pool_cap()
+{
+    if (elastic_limit_path.empty()) return SIZE_MAX;
+    FILE *f = fopen(elastic_limit_path.c_str(), "r");
+    if (!f) return SIZE_MAX;
+    char buf[64] = {};
+    size_t n = fread(buf, 1, sizeof(buf) - 1, f);
+    fclose(f);
+    if (!n || buf[0] < '0' || buf[0] > '9') return SIZE_MAX;
+    return (size_t)parse_size_str(buf);
+}
+
 static int vram_config(const char *key, const char *value)
 {
     if (!strcmp(key, "size")) {
@@ -52,32 +588,311 @@ static int vram_config(const char *key, const char *value)
         plugin_size_bytes = parsed;
         return 0;
     }
+    if (!strcmp(key, "backend")) {
+        if (strcmp(value, "cuda") && strcmp(value, "host")) { nbdkit_error("unknown backend '%s' (expected cuda or host)", value); return -1; }
+        backend_name = value;
+        return 0;
+    }
+    if (!strcmp(key, "host_memory")) {
+        int64_t parsed = parse_size_str(value);
+        if (parsed <= 0) { nbdkit_error("invalid host_memory '%s'", value); return -1; }
+        host_cfg.memory = (size_t)parsed;
+        return 0;
+    }
+    if (!strcmp(key, "host_bandwidth")) {
+        int64_t parsed = parse_size_str(value);
+        if (parsed < 0) { nbdkit_error("invalid host_bandwidth '%s'", value); return -1; }
+        host_cfg.bandwidth = (uint64_t)parsed;
+        return 0;
+    }
+    if (!strcmp(key, "host_numa_node")) {
+        char *end = NULL;
+        long n = strtol(value, &end, 10);
+        if (end == value || *end || n < -1) { nbdkit_error("invalid host_numa_node '%s'", value); return -1; }
+        host_cfg.numa_node = (int)n;
+        return 0;
+    }
+    if (!strcmp(key, "host_latency_us")) {
+        int64_t parsed = parse_size_str(value);
+        if (parsed < 0) { nbdkit_error("invalid host_latency_us '%s'", value); return -1; }
+        host_cfg.latency_ns = (uint64_t)parsed * 1000;
+        return 0;
+    }
+    if (!strcmp(key, "async_write")) {
+        int b = nbdkit_parse_bool(value);
+        if (b == -1) return -1;
+        async_write = b;
+        return 0;
+    }
+    if (!strcmp(key, "streams")) {
+        int n = atoi(value);
+        if (n <= 0) { nbdkit_error("invalid streams '%s'", value); return -1; }
+        stream_count = n;
+        return 0;
+    }
+    if (!strcmp(key, "devices")) {
+        device_list.clear();
+        for (const char *p = value; *p;) {
+            char *end = NULL;
+            long n = strtol(p, &end, 10);
+            if (end == p || n < 0 || (*end && *end != ',')) { nbdkit_error("invalid devices '%s' (expected e.g. 0,1,2)", value); return -1; }
+            if (std::find(device_list.begin(), device_list.end(), (size_t)n) != device_list.end()) { nbdkit_error("device %ld listed twice in devices '%s'", n, value); return -1; }
+            device_list.push_back((size_t)n);
+            p = *end ? end + 1 : end;
+        }
+        if (device_list.empty()) { nbdkit_error("invalid devices '%s'", value); return -1; }
+        return 0;
+    }
+    if (!strcmp(key, "placement")) {
+        if (strcmp(value, "stripe") && strcmp(value, "capacity")) { nbdkit_error("unknown placement '%s' (expected stripe or capacity)", value); return -1; }
+        stripe_placement = !strcmp(value, "stripe");
+        return 0;
+    }
+    if (!strcmp(key, "worker_cpus")) {
+        std::vector<int> cpus;
+        if (strcmp(value, "auto") && !vram::parse_cpulist(value, cpus)) { nbdkit_error("invalid worker_cpus '%s' (expected auto or a CPU list like 0-7,16-23)", value); return -1; }
+        worker_cpus_arg = value;
+        return 0;
+    }
+    if (!strcmp(key, "staging_buffers")) {
+        int n = atoi(value);
+        if (n <= 0) { nbdkit_error("invalid staging_buffers '%s'", value); return -1; }
+        max_staging_buffers = n;
+        return 0;
+    }
+    if (!strcmp(key, "block_size")) {
+        int64_t parsed = parse_size_str(value);
+        if (parsed < 4096 || parsed > (int64_t)block::size || (parsed & (parsed - 1))) { nbdkit_error("invalid block_size '%s' (power of two from 4K to %zuK)", value, block::size / 1024); return -1; }
+        blk_size = (size_t)parsed;
+        return 0;
+    }
+    if (!strcmp(key, "read_cache")) {
+        int64_t parsed = parse_size_str(value);
+        if (parsed < 0) { nbdkit_error("invalid read_cache '%s'", value); return -1; }
+        read_cache_bytes = (size_t)parsed;
+        return 0;
+    }
+    if (!strcmp(key, "write_back")) {
+        int64_t parsed = parse_size_str(value);
+        if (parsed < 0) { nbdkit_error("invalid write_back '%s'", value); return -1; }
+        write_back_bytes = (size_t)parsed;
+        return 0;
+    }
+    if (!strcmp(key, "populate")) {
+        if (strcmp(value, "eager") && strcmp(value, "background") && strcmp(value, "lazy")) { nbdkit_error("unknown populate '%s' (expected eager, background or lazy)", value); return -1; }
+        populate_mode = value;
+        return 0;
+    }
+    if (!strcmp(key, "elastic_reserve")) {
+        int64_t parsed = parse_size_str(value);
+        if (parsed < 0) { nbdkit_error("invalid elastic_reserve '%s'", value); return -1; }
+        elastic_reserve = (size_t)parsed;
+        return 0;
+    }
+    if (!strcmp(key, "elastic_limit")) { elastic_limit_path = value; return 0; }
+    if (!strcmp(key, "elastic_interval_ms")) {
+        int n = atoi(value);
+        if (n <= 0) { nbdkit_error("invalid elastic_interval_ms '%s'", value); return -1; }
+        elastic_interval_ms = (uint32_t)n;
+        return 0;
+    }
+    if (!strcmp(key, "spill")) { spill_path = value; return 0; }
+    if (!strcmp(key, "metrics")) { metrics_path = value; return 0; }
+    if (!strcmp(key, "metrics_interval_ms")) {
+        int n = atoi(value);
+        if (n <= 0) { nbdkit_error("invalid metrics_interval_ms '%s'", value); return -1; }
+        metrics_interval_ms = (uint32_t)n;
+        return 0;
+    }
+    if (!strcmp(key, "trace")) { trace_path = value; return 0; }
+    if (!strcmp(key, "trace_buffer")) {
+        int64_t n = parse_size_str(value);
+        if (n < 64) { nbdkit_error("invalid trace_buffer '%s' (at least 64 records)", value); return -1; }
+        trace_buffer = (size_t)n;
+        return 0;
+    }
+    if (!strcmp(key, "spill_size")) {
+        int64_t parsed = parse_size_str(value);
+        if (parsed <= 0) { nbdkit_error("invalid spill_size '%s'", value); return -1; }
+        spill_bytes = (size_t)parsed;
+        return 0;
+    }
+    if (!strcmp(key, "compress")) {
+        if (strcmp(value, "none") && !vram::make_codec(value)) { nbdkit_error("unknown compress codec '%s'", value); return -1; }
+        compress_name = strcmp(value, "none") ? value : "";
+        return 0;
+    }
+    if (!strcmp(key, "spill_demote")) {
+        int n = atoi(value);
+        if (n < 0 || n > 90) { nbdkit_error("invalid spill_demote '%s' (0-90)", value); return -1; }
+        spill_demote = (uint32_t)n;
+        return 0;
+    }
+    if (!strcmp(key, "scheduler")) {
+        if (strcmp(value, "off") && strcmp(value, "strict") && strcmp(value, "weighted")) { nbdkit_error("unknown scheduler '%s' (expected off, strict or weighted)", value); return -1; }
+        scheduler_mode = value;
+        return 0;
+    }
+    if (!strcmp(key, "read_weight")) {
+        int n = atoi(value);
+        if (n <= 0) { nbdkit_error("invalid read_weight '%s'", value); return -1; }
+        sched_cfg.read_weight = (unsigned)n;
+        return 0;
+    }
+    if (!strcmp(key, "write_depth")) {
+        char *end = NULL;
+        long n = strtol(value, &end, 10);
+        if (end == value || *end || n < 0) { nbdkit_error("invalid write_depth '%s'", value); return -1; }
+        sched_cfg.write_depth = (size_t)n;
+        return 0;
+    }
+    if (!strcmp(key, "write_back_age_ms")) {
+        int n = atoi(value);
+        if (n <= 0) { nbdkit_error("invalid write_back_age_ms '%s'", value); return -1; }
+        write_back_age_ms = (uint32_t)n;
+        return 0;
+    }
     nbdkit_error("unknown config key '%s'", key);
     return -1;
 }
 
-static int vram_config_complete(void) { return 0; }
+static int vram_config_complete(void)
+{
+    if (!select_backend(backend_name, host_cfg)) { nbdkit_error("unable to select backend '%s'", backend_name.c_str()); return -1; }
+    size_t available = current_backend().list_devices().size();
+    for (size_t id : device_list)
+        if (id >= available) { nbdkit_error("no device %zu: the %s backend has %zu", id, backend_name.c_str(), available); return -1; }
+    if (spill_demote && spill_path.empty()) { nbdkit_error("spill_demote needs a spill file"); return -1; }
+    return 0;
+}
+
+static void elastic_watch();
+static void stop_elastic();
 
 static void ensure_init()
 {
-    if (backend_inited) return;
-    if (!vram::cuda_mem::init()) { nbdkit_error("CUDA backend init failed"); return; }
-    vram::cuda_mem::init_staging_pool(8);
+    if (backend_inited.load(std::memory_order_acquire)) return;
+    std::lock_guard<std::mutex> init_lg(init_mutex);
+    if (backend_inited.load(std::memory_order_relaxed)) return;
+    if (!device_list.empty()) set_devices(device_list);
+    if (!vram::cuda_mem::init()) { nbdkit_error("%s backend init failed", current_backend().name()); return; }
+    if (!set_block_size(blk_size)) { nbdkit_error("unable to use block_size %zu", blk_size); return; }
+    wb_pages = blk_size / WB_PAGE; wb_full = wb_pages == 64 ? ~0ULL : (1ULL << wb_pages) - 1;
+    if (!compress_name.empty()) { set_codec(vram::make_codec(compress_name)); packing = true; }
+    vram::cuda_mem::init_staging_pool(std::min(8, max_staging_buffers), max_staging_buffers);
+    vram::cuda_mem::init_streams(stream_count);
+    if (scheduler_mode != "off") {
+        sched_cfg.order = scheduler_mode == "strict" ? vram::io_scheduler::STRICT : vram::io_scheduler::WEIGHTED;
+        sched.reset(new vram::io_scheduler(sched_cfg));
+    }
+    if (read_cache_bytes) {
+        cache.reset(new vram::read_cache(read_cache_bytes, blk_size));
+        if (!cache->enabled()) nbdkit_debug("vram-cuda: read cache of %zu bytes unavailable; running without", read_cache_bytes);
+        else nbdkit_debug("vram-cuda: read cache %zu bytes", cache->capacity());
+    }
+    // Staged blocks share the staging pool with async writes; keep some for those
+    wb_device_limit = (size_t)max_staging_buffers / 2;
+    wb_limit = std::min<size_t>(write_back_bytes / blk_size, wb_device_limit * device_count());
+    wb_staged_on.reset(new std::atomic<size_t>[device_count()]);
+    for (size_t d = 0; d < device_count(); ++d) wb_staged_on[d].store(0, std::memory_order_relaxed);
+    if (write_back_bytes && !wb_limit) nbdkit_debug("vram-cuda: write_back below one block per staging buffer; disabled");
     if (plugin_size_bytes == 0) {
         size_t total = vram::cuda_mem::total_device_memory();
         if (total == 0) { nbdkit_error("unable to query device memory for auto-detect"); return; }
         size_t use = (total > SAFETY_RESERVE) ? (total - SAFETY_RESERVE) : total;
+        // A sized spill file extends the export beyond device memory
+        if (!spill_path.empty()) use += spill_bytes;
         plugin_size_bytes = (int64_t)use;
         nbdkit_debug("vram-cuda: auto-detected device total=%zu; using %lld bytes", total, (long long)plugin_size_bytes);
     }
-    size_t allocated = vram::cuda_mem::increase_pool((size_t)plugin_size_bytes);
-    nbdkit_debug("vram-cuda: increase_pool requested=%lld allocated=%zu", (long long)plugin_size_bytes, allocated);
+    if (!spill_path.empty()) {
+        spill.reset(new vram::spill_store(spill_path, spill_bytes ? spill_bytes : (size_t)plugin_size_bytes, blk_size));
+        if (!spill->enabled()) { nbdkit_error("unable to open spill file '%s'", spill_path.c_str()); spill.reset(); }
+        else nbdkit_debug("vram-cuda: spill file %s, %zu bytes%s", spill_path.c_str(), spill->capacity(), spill->direct() ? ", O_DIRECT" : "");
+    }
     {
-        std::lock_guard<std::mutex> lg(backing_map_mutex);
-        size_t blocks = (plugin_size_bytes + block::size - 1) / block::size;
-        backing_map.clear(); backing_map.resize(blocks);
+        // Each device's share of the export, weighted like increase_pool(), in
+        // whole blocks so the shares still add up to every block of the export
+        std::lock_guard<std::mutex> lg(populate_mutex);
+        size_t sum = 0, blocks = ((size_t)plugin_size_bytes + blk_size - 1) / blk_size, left = blocks;
+        pool_share.assign(device_count(), 0);
+        for (size_t d = 0; d < device_count(); ++d) sum += total_device_memory(d);
+        for (size_t d = 0; d + 1 < device_count(); ++d) { pool_share[d] = sum ? (size_t)((unsigned __int128)blocks * total_device_memory(d) / sum) : blocks / device_count(); left -= pool_share[d]; pool_share[d] *= blk_size; }
+        pool_share.back() = left * blk_size;
+        // With a spill tier the export may exceed device memory; leave each
+        // device its part of the safety reserve and overflow the rest
+        if (spill)
+            for (size_t d = 0; d < device_count(); ++d) {
+                size_t total = total_device_memory(d), reserve = SAFETY_RESERVE / device_count();
+                pool_share[d] = std::min(pool_share[d], total > reserve ? total - reserve : total);
+            }
+        populate_done.store(plugin_size_bytes == 0);
     }
-    backend_inited = true;
+    pool_cap.store(read_pool_cap());
+    if (populate_mode == "eager") {
+        while (populate_step()) {}
+        nbdkit_debug("vram-cuda: pool holds %zu of %lld bytes", (size_t)pool_size() * blk_size, (long long)plugin_size_bytes);
+        log_pool();
+    }
+    else if (populate_mode == "background") populate_thread = std::thread(populator);
+    if (worker_cpus_arg == "auto") {
+        // Keep request handling on the sockets the devices hang off
+        worker_cpus.clear();
+        for (size_t d = 0; d < device_count(); ++d)
+            for (int c : vram::node_cpus(device_numa_node(d)))
+                if (std::find(worker_cpus.begin(), worker_cpus.end(), c) == worker_cpus.end()) worker_cpus.push_back(c);
+        if (worker_cpus.empty()) nbdkit_debug("vram-cuda: device NUMA nodes unknown; workers left unpinned");
+    }
+    else if (!worker_cpus_arg.empty()) vram::parse_cpulist(worker_cpus_arg, worker_cpus);
+    {
+        size_t blocks = (plugin_size_bytes + blk_size - 1) / blk_size;
+        free_backing_map();
+        backing_map.reset(new BlockSlot[blocks]);
+        wb_buffers.reset(new WbBuffer[wb_limit + 1]);
+        for (uint32_t i = (uint32_t)wb_limit; i > 0; --i) wb_free.push_back(i);
+        alloc_bitmap.reset(new std::atomic<uint64_t>[(blocks + 63) / 64]);
+        for (size_t i = 0; i < (blocks + 63) / 64; ++i) alloc_bitmap[i].store(0, std::memory_order_relaxed);
+        backing_map_size = blocks;
+    }
+    if (wb_limit) wb_thread = std::thread(wb_flusher);
+    if (elastic() || spill) elastic_thread = std::thread(elastic_watch);
+    if (!metrics_path.empty()) { register_metrics(); metrics_on = true; metrics_thread = std::thread(metrics_publisher); }
+    if (!trace_path.empty() && !vram::trace::start(trace_path, trace_buffer)) nbdkit_error("unable to create trace file '%s'; not tracing", trace_path.c_str());
+    backend_inited.store(true, std::memory_order_release);
+}
+
+static void vram_unload(void)
+{
+    if (vram::trace::enabled()) {
+        vram::trace::stop();
+        nbdkit_debug("vram-cuda: trace: %llu requests written to %s, %llu dropped", (unsigned long long)vram::trace::written(), trace_path.c_str(), (unsigned long long)vram::trace::dropped());
+    }
+    stop_metrics();
+    stop_elastic();
+    if (cache) {
+        nbdkit_debug("vram-cuda: read cache hits=%llu misses=%llu", (unsigned long long)cache->hits(), (unsigned long long)cache->misses());
+        cache.reset();
+    }
+    if (sched) {
+        nbdkit_debug("vram-cuda: scheduler: %llu reads in %llu batches, %llu writes in %llu batches",
+                     (unsigned long long)sched->requests(false), (unsigned long long)sched->batches(false), (unsigned long long)sched->requests(true), (unsigned long long)sched->batches(true));
+        sched.reset();
+    }
+    nbdkit_debug("vram-cuda: %zu blocks allocated, %zu stored as a fill word, %zu compressed, %zu spilled, %d of %d pool blocks free, %llu released by trim/zero", total_allocated_blocks.load(), filled_blocks.load(), packed_blocks.load(), spilled_blocks.load(), pool_available(), pool_size(), (unsigned long long)released_blocks.load());
+    if (packing) {
+        packed_stats st = packed_statistics();
+        uint64_t tried = st.stored + st.rejected;
+        nbdkit_debug("vram-cuda: %s: %llu blocks compressed %.2fx, %llu left raw; %.1f us per block to compress, %.1f us to expand; %zu live slots in %zu bytes of device memory",
+                     codec()->name(), (unsigned long long)st.stored, st.bytes_out ? (double)st.bytes_in / st.bytes_out : 0.0, (unsigned long long)st.rejected,
+                     tried ? st.compress_ns / 1e3 / tried : 0.0, st.loads ? st.decompress_ns / 1e3 / st.loads : 0.0, st.live, st.carrier_bytes);
+    }
+    // Drop all blocks before the pools they return to are torn down
+    stop_populator();
+    stop_wb_flusher();
+    free_backing_map();
+    if (packing) { set_codec(nullptr); packing = false; }
+    spill.reset();
+    vram::cuda_mem::shutdown();
 }
 
 static int64_t vram_get_size(void *handle) { (void)handle; ensure_init(); return plugin_size_bytes; }
@@ -86,47 +901,657 @@ static int vram_can_fua(void *handle) { (void)handle; return 0; }
 static void *vram_open(int readonly) { (void)readonly; ensure_init(); return NBDKIT_HANDLE_NOT_NEEDED; }
 static void vram_close(void *handle) { (void)handle; }
 
-static int vram_pread(void *handle, void *buf, uint32_t count, uint64_t offset, uint32_t flags)
+// The device export block `block_idx` should live on. Striping spreads
+// sequential I/O over every device's link; placement=capacity picks the
+// device with the most free blocks.
+static size_t home_device(size_t block_idx)
+{
+    if (stripe_placement) return block_idx % device_count();
+    size_t best = 0;
+    for (size_t d = 1; d < device_count(); ++d) if (pool_available(d) > pool_available(best)) best = d;
+    return best;
+}
+
+// A free device block for export block `block_idx`, or nullptr if the pool is exhausted
+static block *take_block(size_t block_idx)
+{
+    // A full device falls back to whichever has room
+    block *b = acquire_block(home_device(block_idx));
+    if (!b) b = acquire_block();
+    // Pool not fully populated yet: grow it here rather than fail the write
+    while (!b && !populate_done.load(std::memory_order_relaxed) && populate_step()) b = acquire_block();
+    return b;
+}
+
+// Make `b` the block's device memory (dropping any fill, compressed or spill slot). Caller holds the slot lock.
+static void install_block(size_t block_idx, BlockSlot *slot, block *b)
+{
+    if (slot->has(BlockSlot::FILLED)) { slot->set(BlockSlot::FILLED, false); filled_blocks.fetch_sub(1); }
+    if (slot->has(BlockSlot::PACKED)) { free_packed(slot->data); slot->set(BlockSlot::PACKED, false); packed_blocks.fetch_sub(1); }
+    if (slot->has(BlockSlot::SPILLED)) { spill->release(slot->data); slot->set(BlockSlot::SPILLED, false); spilled_blocks.fetch_sub(1); }
+    slot->data = reinterpret_cast<uint64_t>(b); slot->set(BlockSlot::HAS_BLOCK, true);
+    total_allocated_blocks.fetch_add(1); set_allocated(block_idx, true);
+}
+
+// Give a block device memory (clearing any fill). Caller holds the slot lock.
+static bool allocate_block(size_t block_idx, BlockSlot *slot)
+{
+    block *b = take_block(block_idx);
+    if (!b) return false;
+    install_block(block_idx, slot, b);
+    return true;
+}
+
+// Drop everything a block holds so it reads as zeros. Caller holds the slot lock.
+static void clear_block(size_t block_idx, BlockSlot *slot)
+{
+    if (slot->wb) wb_drop(slot);
+    if (cache) cache->invalidate(block_idx);
+    if (slot->has(BlockSlot::FILLED)) { slot->set(BlockSlot::FILLED, false); filled_blocks.fetch_sub(1); set_allocated(block_idx, false); }
+    if (slot->has(BlockSlot::PACKED)) { free_packed(slot->data); slot->set(BlockSlot::PACKED, false); packed_blocks.fetch_sub(1); set_allocated(block_idx, false); }
+    if (slot->has(BlockSlot::SPILLED)) { spill->release(slot->data); slot->set(BlockSlot::SPILLED, false); spilled_blocks.fetch_sub(1); set_allocated(block_idx, false); }
+    block *b = slot->blk();
+    if (!b) return;
+    slot->set(BlockSlot::HAS_BLOCK, false); slot->data = 0;
+    release_block(b); // waits for the block's pending writes, then returns it to the pool
+    total_allocated_blocks.fetch_sub(1); set_allocated(block_idx, false);
+}
+
+// Compressed mode: keep a whole block image in a compressed slot instead of
+// whatever the block held. False, leaving the block as it was, if the image
+// doesn't compress or no slot is free. Caller holds the slot lock.
+static bool store_image_packed(size_t block_idx, BlockSlot *slot, const uint8_t *img)
+{
+    if (!packing) return false;
+    packed_ref ref = store_packed(img, home_device(block_idx));
+    if (!ref) return false;
+    clear_block(block_idx, slot);
+    slot->data = ref; slot->set(BlockSlot::PACKED, true);
+    packed_blocks.fetch_add(1); set_allocated(block_idx, true);
+    return true;
+}
+
+// Whole-block images of blocks being partly overwritten; a request only has
+// partial blocks at its two ends
+static thread_local std::vector<uint8_t> fill_scratch;
+
+static uint8_t *scratch_image(int scratch)
+{
+    fill_scratch.resize(2 * blk_size);
+    return fill_scratch.data() + scratch * blk_size;
+}
+
+// The contents of a block without a device block of its own (a hole, fill
+// word, compressed or spill slot) as a whole image in scratch image
+// `scratch`; nullptr if they can't be read. Caller holds the slot lock.
+static uint8_t *block_image(const BlockSlot *slot, int scratch)
+{
+    uint8_t *img = scratch_image(scratch);
+    if (slot->has(BlockSlot::FILLED)) vram::expand_fill(slot->data, 0, blk_size, img);
+    else if (slot->has(BlockSlot::PACKED)) { if (!load_packed(slot->data, img)) return nullptr; }
+    else if (slot->has(BlockSlot::SPILLED)) { if (!spill->load(slot->data, 0, blk_size, img)) return nullptr; }
+    else memset(img, 0, blk_size);
+    return img;
+}
+
+// Turn a same-filled, compressed or spilled block back into device data:
+// allocates it and returns the block's image in scratch image `scratch` for
+// the caller to patch and write out whole, or nullptr if the pool is
+// exhausted (or the slot unreadable). Caller holds the slot lock.
+static uint8_t *materialize(size_t block_idx, BlockSlot *slot, int scratch)
+{
+    block *b = take_block(block_idx);
+    if (!b) return nullptr;
+    uint8_t *img = block_image(slot, scratch);
+    if (!img) { release_block(b); return nullptr; }
+    install_block(block_idx, slot, b);
+    return img;
+}
+
+// Spill writes of the current request, submitted as one batch once its slots
+// are all locked, and the cache updates that go with them
+static thread_local std::vector<vram::spill_io> request_spill;
+static thread_local std::vector<size_t> request_spill_blocks;
+
+// Overflow: with no device memory to spare, write [off, off + len) of the
+// block to its spill slot instead, giving a hole, same-filled or compressed
+// block a free slot first (a partial write then goes out whole, built in
+// scratch image `scratch`). Queued on request_spill; false if the spill file
+// is full or absent. Caller holds the slot lock.
+static bool spill_write(size_t block_idx, BlockSlot *slot, int scratch, size_t off, size_t len, const uint8_t *in)
+{
+    if (!spill) return false;
+    if (!slot->has(BlockSlot::SPILLED)) {
+        uint64_t spill_slot;
+        if (!spill->reserve(spill_slot)) return false;
+        if (len < blk_size) {
+            uint8_t *img = block_image(slot, scratch);
+            if (!img) { spill->release(spill_slot); return false; }
+            memcpy(img + off, in, len);
+            in = img; off = 0; len = blk_size;
+        }
+        if (slot->has(BlockSlot::FILLED)) { slot->set(BlockSlot::FILLED, false); filled_blocks.fetch_sub(1); }
+        if (slot->has(BlockSlot::PACKED)) { free_packed(slot->data); slot->set(BlockSlot::PACKED, false); packed_blocks.fetch_sub(1); }
+        slot->data = spill_slot; slot->set(BlockSlot::SPILLED, true);
+        spilled_blocks.fetch_add(1); set_allocated(block_idx, true);
+        // Make room in device memory for the next writes
+        if (spill_demote) elastic_cv.notify_one();
+    }
+    request_spill.push_back({slot->data, off, len, const_cast<uint8_t *>(in)});
+    request_spill_blocks.push_back(block_idx);
+    return true;
+}
+
+// Submit the queued spill writes; the read cache follows once they landed
+static bool submit_spill_writes()
+{
+    if (request_spill.empty()) return true;
+    MetricTimer t(pm.spill_write);
+    if (!spill->write_batch(request_spill.data(), request_spill.size())) return false;
+    if (cache)
+        for (size_t i = 0; i < request_spill.size(); ++i)
+            cache->update(request_spill_blocks[i], request_spill[i].offset, request_spill[i].size, static_cast<const uint8_t *>(request_spill[i].data));
+    return true;
+}
+
+// Elastic pool: every elastic_interval_ms the pool is fitted to what the
+// devices can spare. A device with less than elastic_reserve free, or a pool
+// above its share of the elastic_limit cap, retires its least used slabs.
+// Blocks still in them move to free blocks elsewhere or, failing that, to the
+// spill file, and each slab is freed once emptied. When memory is free again
+// the pool regrows and spilled blocks are brought back. The same thread
+// demotes cold blocks to the spill file to keep spill_demote percent of the
+// pool free for new writes.
+
+// The block's data is in spill slot `spill_slot` now; give back its device
+// block or compressed slot. Caller holds the slot lock.
+static void spilled_to(BlockSlot *slot, uint64_t spill_slot)
 {
-    (void)handle; (void)flags; ensure_init(); if (!backend_inited) return -EIO;
-    if (offset + (uint64_t)count > (uint64_t)plugin_size_bytes) return -EIO;
+    if (slot->has(BlockSlot::PACKED)) { free_packed(slot->data); slot->set(BlockSlot::PACKED, false); packed_blocks.fetch_sub(1); }
+    else {
+        block *old = slot->blk();
+        // The staged pages are in the copy now
+        if (slot->wb) wb_drop(slot);
+        slot->set(BlockSlot::HAS_BLOCK, false); total_allocated_blocks.fetch_sub(1);
+        release_block(old); // a retired slab is freed with its last block
+    }
+    slot->set(BlockSlot::SPILLED, true); slot->data = spill_slot; spilled_blocks.fetch_add(1);
+}
+
+// Move a block out of its retired slab. Caller holds the slot lock; false if
+// there is neither a free block nor spill space for it.
+static bool relocate(BlockSlot *slot)
+{
+    static std::vector<uint8_t> img; // only the elastic thread relocates
+    img.resize(blk_size);
+    block *old = slot->blk();
+    old->read(0, blk_size, img.data());
+    if (slot->wb) wb_overlay(slot, 0, blk_size, img.data());
+    block *b = acquire_block(old->device());
+    if (!b) b = acquire_block();
+    uint64_t spill_slot = 0;
+    if (!b) {
+        if (!spill || !spill->store(img.data(), spill_slot)) return false;
+        spilled_to(slot, spill_slot);
+        return true;
+    }
+    b->write(0, blk_size, img.data());
+    if (slot->wb) wb_drop(slot);
+    slot->data = reinterpret_cast<uint64_t>(b);
+    release_block(old); // the slab is freed with its last block
+    return true;
+}
+
+// Same for a compressed block whose slot lies in a retired slab
+static bool repack(BlockSlot *slot)
+{
+    static std::vector<uint8_t> img; // only the elastic thread relocates
+    img.resize(blk_size);
+    if (!load_packed(slot->data, img.data())) return false;
+    packed_ref ref = store_packed(img.data(), packed_device(slot->data));
+    uint64_t spill_slot = 0;
+    if (ref) { free_packed(slot->data); slot->data = ref; }
+    else if (spill && spill->store(img.data(), spill_slot)) spilled_to(slot, spill_slot);
+    else return false;
+    return true;
+}
+
+// Relocate every block living in a retired slab; returns how many had nowhere to go
+static size_t evacuate()
+{
+    size_t stuck = 0;
+    for (size_t idx = next_block_with(0, backing_map_size, true); idx < backing_map_size && !elastic_stop.load(); idx = next_block_with(idx + 1, backing_map_size, true)) {
+        BlockSlot *slot = &backing_map[idx];
+        std::lock_guard<BlockSlot> lg(*slot);
+        block *b = slot->blk();
+        if (b && b->retired() && !relocate(slot)) ++stuck;
+        else if (slot->has(BlockSlot::PACKED) && packed_retired(slot->data) && !repack(slot)) ++stuck;
+    }
+    return stuck;
+}
+
+// Free blocks demotion aims to keep
+static size_t demote_target() { return (size_t)pool_size() * spill_demote / 100; }
+
+// Cold demotion: a CLOCK sweep over the blocks held in device memory, raw or
+// compressed. The hand clears ACCESSED and moves blocks that haven't been
+// touched since its last pass to the spill file, a batch at a time, until the
+// target is free.
+static void demote()
+{
+    static const size_t BATCH = 64;
+    static size_t hand = 0;
+    static std::vector<uint8_t> imgs;
+    std::vector<std::unique_lock<BlockSlot>> locks;
+    std::vector<segment> segs;
+    std::vector<vram::spill_io> ios;
+    imgs.resize(BATCH * blk_size);
+    // Two turns: the first may only clear ACCESSED bits
+    size_t scanned = 0, target = demote_target();
+    bool full = false;
+    while (!full && !elastic_stop.load() && (size_t)pool_available() < target && scanned < 2 * backing_map_size) {
+        locks.clear(); segs.clear(); ios.clear();
+        size_t want = std::min(BATCH, target - (size_t)pool_available());
+        while (ios.size() < want && scanned < 2 * backing_map_size) {
+            size_t idx = next_block_with(hand, backing_map_size, true);
+            // Locks go in ascending order, so a batch ends at the wrap
+            if (idx >= backing_map_size) { scanned += backing_map_size - hand; hand = 0; if (ios.empty()) continue; break; }
+            scanned += idx + 1 - hand; hand = idx + 1;
+            BlockSlot *slot = &backing_map[idx];
+            std::unique_lock<BlockSlot> lk(*slot);
+            block *b = slot->blk();
+            if (!b && !slot->has(BlockSlot::PACKED)) continue;
+            if (slot->has(BlockSlot::ACCESSED)) { slot->set(BlockSlot::ACCESSED, false); continue; }
+            uint8_t *img = imgs.data() + ios.size() * blk_size;
+            if (!b && !load_packed(slot->data, img)) continue;
+            uint64_t spill_slot;
+            if (!spill->reserve(spill_slot)) { full = true; break; }
+            if (b) segs.push_back({b, 0, blk_size, img});
+            ios.push_back({spill_slot, 0, blk_size, img});
+            locks.push_back(std::move(lk));
+        }
+        if (ios.empty()) break;
+        read_batch(segs.data(), segs.size());
+        for (size_t i = 0; i < ios.size(); ++i) {
+            const BlockSlot *slot = locks[i].mutex();
+            if (slot->wb) wb_overlay(slot, 0, blk_size, static_cast<uint8_t *>(ios[i].data));
+        }
+        if (!spill->write_batch(ios.data(), ios.size())) {
+            for (const vram::spill_io &io : ios) spill->release(io.slot);
+            nbdkit_debug("vram-cuda: spill write failed; demotion stopped");
+            return;
+        }
+        for (size_t i = 0; i < ios.size(); ++i) spilled_to(locks[i].mutex(), ios[i].slot);
+    }
+}
+
+// Bring spilled blocks back while the pool has blocks to spare, beyond what
+// demotion keeps free so the two don't chase each other
+static void unspill()
+{
+    for (size_t idx = next_block_with(0, backing_map_size, true); idx < backing_map_size && spilled_blocks.load() && !elastic_stop.load(); idx = next_block_with(idx + 1, backing_map_size, true)) {
+        if ((size_t)pool_available() <= demote_target() + pool_size() / 8) return;
+        BlockSlot *slot = &backing_map[idx];
+        std::lock_guard<BlockSlot> lg(*slot);
+        if (!slot->has(BlockSlot::SPILLED)) continue;
+        uint8_t *img;
+        if (packing && (img = block_image(slot, 0)) && store_image_packed(idx, slot, img)) continue;
+        if (!(img = materialize(idx, slot, 0))) return;
+        slot->blk()->write(0, blk_size, img);
+    }
+}
+
+static void elastic_tick()
+{
+    pool_cap.store(read_pool_cap());
+    bool pressure = false;
+    for (size_t d = 0; d < device_count(); ++d) {
+        size_t have = (size_t)pool_size(d) * blk_size, free = free_device_memory(d), over = 0;
+        if (elastic_reserve && free < elastic_reserve) over = elastic_reserve - free;
+        size_t cap = pool_cap.load();
+        if (cap != SIZE_MAX && have > share_of(cap, d)) over = std::max(over, have - share_of(cap, d));
+        // Slabs retired earlier free their memory as soon as they are emptied
+        size_t retiring = pool_retiring(d);
+        if (over > retiring) {
+            size_t got = shrink_pool_on(d, over - retiring);
+            nbdkit_debug("vram-cuda: device %zu: %zu bytes free, releasing %zu of %zu pool bytes", d, free, got, have);
+        }
+        if (pool_retiring(d)) pressure = true;
+    }
+    if (pressure) {
+        size_t stuck = evacuate();
+        if (stuck) nbdkit_debug("vram-cuda: %zu blocks in released memory have nowhere to go", stuck);
+        return;
+    }
+    // Lazy pools only grow as writers need blocks
+    populate_done.store(false);
+    if (populate_mode != "lazy") while (!elastic_stop.load() && populate_step()) {}
+    if (spill_demote && (size_t)pool_available() < demote_target()) demote();
+    else unspill();
+}
+
+static void elastic_watch()
+{
+    std::unique_lock<std::mutex> lk(elastic_mutex);
+    while (!elastic_stop) {
+        elastic_cv.wait_for(lk, std::chrono::milliseconds(elastic_interval_ms));
+        if (elastic_stop) break;
+        lk.unlock();
+        elastic_tick();
+        lk.lock();
+    }
+}
+
+static void stop_elastic()
+{
+    if (!elastic_thread.joinable()) return;
+    { std::lock_guard<std::mutex> lg(elastic_mutex); elastic_stop = true; }
+    elastic_cv.notify_all();
+    elastic_thread.join();
+    elastic_stop = false;
+}
+
+// Per-thread scratch for gathering one request's block segments. Slot locks
+// are always taken in ascending block order, so concurrent batches can't deadlock.
+static thread_local std::vector<segment> request_segs;
+static thread_local std::vector<std::unique_lock<BlockSlot>> request_locks;
+static thread_local std::vector<size_t> request_blocks;
+
+// Read-cache misses being filled by the current batch: the whole block is
+// read into the cache slot and the requested range copied out afterwards
+struct CacheFill { size_t block_idx; size_t off; size_t len; uint8_t *out; uint8_t *slot; const BlockSlot *entry; };
+static thread_local std::vector<CacheFill> request_fills;
+
+// Device reads of write-back blocks, patched with the staged pages afterwards
+struct WbRead { const BlockSlot *entry; size_t off; size_t len; uint8_t *out; };
+static thread_local std::vector<WbRead> request_overlays;
+
+// Whole-block writes a request queues besides its main batch: write-back
+// buffers it completed, or same-filled blocks it turned back into data
+static thread_local std::vector<segment> request_staged;
+static thread_local std::vector<void *> request_staged_bufs;
+static thread_local std::vector<size_t> request_staged_blocks;
+
+// Expand a compressed block for a read, through the read cache if there is
+// one. Caller holds the slot lock.
+static bool read_packed(size_t block_idx, const BlockSlot *slot, size_t off, size_t len, uint8_t *out)
+{
+    if (cache && cache->lookup(block_idx, off, len, out)) return true;
+    void *fill = cache ? cache->begin_fill(block_idx) : nullptr;
+    uint8_t *img = fill ? (uint8_t *)fill : len == blk_size ? out : scratch_image(0);
+    if (!load_packed(slot->data, img)) { if (fill) cache->abort_fill(block_idx); return false; }
+    if (img != out) memcpy(out, img + off, len);
+    if (fill) cache->end_fill(block_idx);
+    return true;
+}
+
+static int read_range(void *buf, uint32_t count, uint64_t offset)
+{
+    ensure_init(); if (!backend_inited) return EIO;
+    pin_worker();
+    if (offset + (uint64_t)count > (uint64_t)plugin_size_bytes) return EIO;
     uint8_t *out = (uint8_t *)buf; uint64_t pos = offset; uint32_t remaining = count;
+    request_segs.clear(); request_locks.clear(); request_fills.clear(); request_overlays.clear(); request_spill.clear();
     while (remaining) {
-        size_t block_idx = pos / block::size; size_t block_off = pos % block::size;
-        size_t toread = std::min<size_t>(remaining, block::size - block_off);
-        std::shared_ptr<BlockEntry> entry;
-        { std::lock_guard<std::mutex> lg(backing_map_mutex); if (block_idx < backing_map.size()) entry = backing_map[block_idx]; }
-        if (!entry || !entry->b) memset(out, 0, toread);
-        else { std::lock_guard<std::mutex> lg(entry->m); entry->b->read((off_t)block_off, toread, out); }
+        size_t block_idx = pos / blk_size; size_t block_off = pos % blk_size;
+        size_t toread = std::min<size_t>(remaining, blk_size - block_off);
+        // Holes read as zeros without taking the slot lock
+        if (block_idx >= backing_map_size || !block_allocated(block_idx)) memset(out, 0, toread);
+        else {
+            BlockSlot *entry = &backing_map[block_idx];
+            request_locks.emplace_back(*entry);
+            entry->touch();
+            block *b = entry->blk();
+            void *slot;
+            if (!b) {
+                if (entry->has(BlockSlot::FILLED)) vram::expand_fill(entry->data, block_off, toread, out);
+                else if (entry->has(BlockSlot::PACKED)) { if (!read_packed(block_idx, entry, block_off, toread, out)) { request_locks.clear(); return EIO; } }
+                else if (!entry->has(BlockSlot::SPILLED)) memset(out, 0, toread);
+                else request_spill.push_back({entry->data, block_off, toread, out});
+            }
+            else if (cache && cache->lookup(block_idx, block_off, toread, out)) {}
+            else if (entry->wb && !(~wb_buffers[entry->wb].dirty & wb_full)) memcpy(out, wb_buffers[entry->wb].buf + block_off, toread);
+            else if (cache && (slot = cache->begin_fill(block_idx))) {
+                request_segs.push_back({b, 0, blk_size, slot});
+                request_fills.push_back({block_idx, block_off, toread, out, (uint8_t *)slot, entry});
+            }
+            else {
+                request_segs.push_back({b, (off_t)block_off, toread, out});
+                if (entry->wb) request_overlays.push_back({entry, block_off, toread, out});
+            }
+        }
         out += toread; pos += toread; remaining -= (uint32_t)toread;
     }
+    if (!request_segs.empty()) {
+        MetricTimer t(pm.device_read);
+        if (sched) sched->read(request_segs.data(), request_segs.size());
+        else read_batch(request_segs.data(), request_segs.size());
+    }
+    if (!request_spill.empty()) {
+        MetricTimer t(pm.spill_read);
+        if (!spill->read_batch(request_spill.data(), request_spill.size())) { request_locks.clear(); return EIO; }
+    }
+    // Staged write-back data is newer than the device copy
+    for (const WbRead &o : request_overlays) wb_overlay(o.entry, o.off, o.len, o.out);
+    for (const CacheFill &f : request_fills) {
+        if (f.entry->wb) wb_overlay(f.entry, 0, blk_size, f.slot);
+        memcpy(f.out, f.slot + f.off, f.len); cache->end_fill(f.block_idx);
+    }
+    request_locks.clear();
     return 0;
 }
 
-static int vram_pwrite(void *handle, const void *buf, uint32_t count, uint64_t offset, uint32_t flags)
+static int write_range(const void *buf, uint32_t count, uint64_t offset)
 {
-    (void)handle; (void)flags; ensure_init(); if (!backend_inited) return -EIO;
-    if (offset + (uint64_t)count > (uint64_t)plugin_size_bytes) return -EIO;
+    ensure_init(); if (!backend_inited) return EIO;
+    pin_worker();
+    if (offset + (uint64_t)count > (uint64_t)plugin_size_bytes) return EIO;
     const uint8_t *in = (const uint8_t *)buf; uint64_t pos = offset; uint32_t remaining = count;
+    request_segs.clear(); request_locks.clear(); request_blocks.clear();
+    request_staged.clear(); request_staged_bufs.clear(); request_staged_blocks.clear();
+    request_spill.clear(); request_spill_blocks.clear();
+    int partials = 0;
     while (remaining) {
-        size_t block_idx = pos / block::size; size_t block_off = pos % block::size;
-        size_t towrite = std::min<size_t>(remaining, block::size - block_off);
-        std::shared_ptr<BlockEntry> entry;
-        { std::lock_guard<std::mutex> lg(backing_map_mutex); if (block_idx >= backing_map.size()) return -EIO; entry = backing_map[block_idx]; }
-        if (!entry) { std::lock_guard<std::mutex> lg(backing_map_mutex); if (!backing_map[block_idx]) backing_map[block_idx] = std::make_shared<BlockEntry>(); entry = backing_map[block_idx]; }
-        {
-            std::lock_guard<std::mutex> lg(entry->m);
-            if (!entry->b) { entry->b = allocate(); if (!entry->b) return -ENOSPC; total_allocated_blocks.fetch_add(1); }
-            entry->b->write((off_t)block_off, towrite, in, false);
-            entry->b->sync();
+        size_t block_idx = pos / blk_size; size_t block_off = pos % blk_size;
+        size_t towrite = std::min<size_t>(remaining, blk_size - block_off);
+        if (block_idx >= backing_map_size) { request_locks.clear(); return EIO; }
+        BlockSlot *entry = &backing_map[block_idx];
+        request_locks.emplace_back(*entry);
+        entry->touch();
+        uint64_t word = 0;
+        bool same = block_off % 8 == 0 && towrite % 8 == 0 && vram::same_filled(in, towrite, word);
+        bool filled = entry->has(BlockSlot::FILLED), spilled = entry->has(BlockSlot::SPILLED);
+        const uint8_t *data = in; size_t off = block_off, len = towrite;
+        if (same && towrite == blk_size) {
+            // Keep only the fill word; an all-zero block needs nothing at all
+            clear_block(block_idx, entry);
+            if (word) { entry->data = word; entry->set(BlockSlot::FILLED, true); filled_blocks.fetch_add(1); set_allocated(block_idx, true); }
+            len = 0;
+        }
+        else if (filled && same && word == entry->data) len = 0; // rewrites the existing pattern
+        else if (packing && (towrite == blk_size || !entry->blk())) {
+            // Compressed mode: whole images go to a compressed slot when they
+            // shrink enough, and are written raw below when they don't
+            if (towrite < blk_size) {
+                uint8_t *img = block_image(entry, partials++);
+                if (!img) { request_locks.clear(); return EIO; }
+                memcpy(img + block_off, in, towrite); data = img; off = 0; len = blk_size;
+            }
+            if (store_image_packed(block_idx, entry, data)) { if (cache) cache->update(block_idx, 0, blk_size, data); len = 0; }
+            else if (entry->blk() || allocate_block(block_idx, entry)) {}
+            else if (spill_write(block_idx, entry, 0, 0, blk_size, data)) len = 0;
+            else { request_locks.clear(); return ENOSPC; }
+        }
+        else if ((filled || spilled) && towrite < blk_size) {
+            uint8_t *img = materialize(block_idx, entry, partials++);
+            if (img) { memcpy(img + block_off, in, towrite); data = img; off = 0; len = blk_size; }
+            // No device memory to spare: the block lives in the spill file
+            else if (spill_write(block_idx, entry, partials - 1, block_off, towrite, in)) len = 0;
+            else { request_locks.clear(); return ENOSPC; }
+        }
+        else if (!entry->blk()) {
+            if (allocate_block(block_idx, entry)) {
+                // Blocks come back from trim with old contents; clear what this write won't cover
+                if (towrite < blk_size) { segment z = {entry->blk(), 0, blk_size, nullptr}; zero_batch_async(&z, 1); }
+            }
+            else if (spill_write(block_idx, entry, towrite < blk_size ? partials++ : 0, block_off, towrite, in)) len = 0;
+            else { request_locks.clear(); return ENOSPC; }
+        }
+        if (!len) {}
+        else if (wb_limit && len < blk_size && wb_stage(block_idx, entry, off, len, data)) {
+            if (cache) cache->update(block_idx, off, len, data);
+            // A fully rewritten block goes out now as one whole-block transfer
+            if (wb_buffers[entry->wb].dirty == wb_full) { wb_collect(entry, request_staged, request_staged_bufs); request_staged_blocks.push_back(block_idx); }
+        }
+        else {
+            if (entry->wb) wb_drop(entry);
+            request_segs.push_back({entry->blk(), (off_t)off, len, const_cast<uint8_t *>(data)});
+            request_blocks.push_back(block_idx);
         }
         in += towrite; pos += towrite; remaining -= (uint32_t)towrite;
     }
+    if (!submit_spill_writes()) { request_locks.clear(); return EIO; }
+    if (!request_staged_bufs.empty()) {
+        write_staged_async(request_staged.data(), request_staged.size(), request_staged_bufs.data(), request_staged_bufs.size());
+        for (size_t idx : request_staged_blocks) wb_submitted(idx);
+    }
+    // One submission for the whole request; in async mode the data is only
+    // staged here and vram_flush waits for it to reach the device
+    if (cache) for (size_t i = 0; i < request_segs.size(); ++i) cache->update(request_blocks[i], (size_t)request_segs[i].offset, request_segs[i].size, request_segs[i].data);
+    if (!request_segs.empty()) {
+        MetricTimer t(pm.device_write);
+        if (sched) sched->write(request_segs.data(), request_segs.size(), async_write);
+        else if (async_write) write_batch_async(request_segs.data(), request_segs.size());
+        else write_batch(request_segs.data(), request_segs.size());
+        if (async_write) for (size_t idx : request_blocks) mark_dirty(idx);
+    }
+    request_locks.clear();
+    return 0;
+}
+
+static int flush_all()
+{
+    if (!backend_inited) return EIO;
+    // Send everything still coalescing in write-back buffers first
+    if (wb_limit) wb_flush(true);
+    // Wait only for blocks written since the last flush, each on its own
+    // completion token; clean blocks and unrelated traffic are not touched
+    std::vector<size_t> todo;
+    { std::lock_guard<std::mutex> lg(dirty_mutex); todo.swap(dirty_blocks); }
+    for (size_t idx : todo) {
+        BlockSlot &entry = backing_map[idx];
+        entry.set(BlockSlot::DIRTY, false);
+        std::lock_guard<BlockSlot> lg(entry);
+        if (block *b = entry.blk()) b->sync();
+    }
+    return 0;
+}
+// Source for write-through of zeroed ranges into the read cache
+static const uint8_t zero_block[block::size] = {}; // covers any blk_size
+
+// Zero [offset, offset + count). Whole blocks go back to the device pool and
+// read as zeros from then on, unless `keep` (write zeroes without
+// NBDKIT_FLAG_MAY_TRIM) asks for the range to stay allocated: device blocks
+// are then cleared in place, and holes and blocks without device memory
+// become a zero fill word. Partial ranges are cleared on the device without
+// any data crossing the bus. Trim is the same operation but `advisory`: a
+// partial range that needs device memory the pool can't give is left as it
+// is rather than failing the request.
+static int discard_range(uint32_t count, uint64_t offset, bool keep, bool advisory)
+{
+    ensure_init(); if (!backend_inited) return EIO;
+    pin_worker();
+    if (offset + (uint64_t)count > (uint64_t)plugin_size_bytes) return EIO;
+    uint64_t pos = offset; uint32_t remaining = count;
+    request_segs.clear(); request_locks.clear(); request_blocks.clear();
+    request_staged.clear(); request_staged_blocks.clear();
+    request_spill.clear(); request_spill_blocks.clear();
+    int partials = 0;
+    while (remaining) {
+        size_t block_idx = pos / blk_size; size_t block_off = pos % blk_size;
+        size_t len = std::min<size_t>(remaining, blk_size - block_off);
+        bool allocated = block_idx < backing_map_size && block_allocated(block_idx);
+        if (allocated || (keep && block_idx < backing_map_size)) {
+            BlockSlot *entry = &backing_map[block_idx];
+            request_locks.emplace_back(*entry);
+            if (len == blk_size && !keep) {
+                if (entry->blk()) released_blocks.fetch_add(1, std::memory_order_relaxed);
+                clear_block(block_idx, entry);
+            }
+            else if (entry->has(BlockSlot::FILLED) && !entry->data) {} // reads as zeros already
+            else if (keep && !entry->blk() && (len == blk_size || !allocated)) {
+                clear_block(block_idx, entry);
+                entry->data = 0; entry->set(BlockSlot::FILLED, true); filled_blocks.fetch_add(1); set_allocated(block_idx, true);
+            }
+            else if (entry->has(BlockSlot::FILLED) || entry->has(BlockSlot::PACKED) || entry->has(BlockSlot::SPILLED)) {
+                // The rest of the block keeps its data, so it needs device memory now
+                uint8_t *img = materialize(block_idx, entry, partials++);
+                if (!img && (spill_write(block_idx, entry, partials - 1, block_off, len, zero_block) || advisory)) {
+                    pos += len; remaining -= (uint32_t)len;
+                    continue;
+                }
+                if (!img) { request_locks.clear(); return ENOSPC; }
+                memset(img + block_off, 0, len);
+                if (cache) cache->update(block_idx, block_off, len, zero_block);
+                request_staged.push_back({entry->blk(), 0, blk_size, img});
+                request_staged_blocks.push_back(block_idx);
+            }
+            else if (!entry->blk()) {}
+            else {
+                // Staged pages outside the range keep their data
+                if (entry->wb) memset(wb_buffers[entry->wb].buf + block_off, 0, len);
+                if (cache) cache->update(block_idx, block_off, len, zero_block);
+                request_segs.push_back({entry->blk(), (off_t)block_off, len, nullptr});
+                request_blocks.push_back(block_idx);
+            }
+        }
+        pos += len; remaining -= (uint32_t)len;
+    }
+    if (!submit_spill_writes()) { request_locks.clear(); return EIO; }
+    zero_batch_async(request_segs.data(), request_segs.size());
+    if (async_write) {
+        write_batch_async(request_staged.data(), request_staged.size());
+        for (size_t idx : request_blocks) mark_dirty(idx);
+        for (size_t idx : request_staged_blocks) mark_dirty(idx);
+    }
+    else {
+        for (const segment &sg : request_segs) sg.blk->sync();
+        write_batch(request_staged.data(), request_staged.size());
+    }
+    request_locks.clear();
+    return 0;
+}
+
+static int vram_pread(void *handle, void *buf, uint32_t count, uint64_t offset, uint32_t flags) { (void)handle; (void)flags; return measured(OP_PREAD, offset, count, [&] { return read_range(buf, count, offset); }); }
+static int vram_pwrite(void *handle, const void *buf, uint32_t count, uint64_t offset, uint32_t flags) { (void)handle; (void)flags; return measured(OP_PWRITE, offset, count, [&] { return write_range(buf, count, offset); }); }
+static int vram_flush(void *handle, uint32_t flags) { (void)handle; (void)flags; return measured(OP_FLUSH, 0, 0, flush_all); }
+static int vram_trim(void *handle, uint32_t count, uint64_t offset, uint32_t flags) { (void)handle; (void)flags; return measured(OP_TRIM, offset, count, [&] { return discard_range(count, offset, false, true); }); }
+// Zeroing never falls back to writing zero buffers, so it is always fast
+static int vram_zero(void *handle, uint32_t count, uint64_t offset, uint32_t flags) { (void)handle; return measured(OP_ZERO, offset, count, [&] { return discard_range(count, offset, !(flags & NBDKIT_FLAG_MAY_TRIM), false); }); }
+static int vram_can_trim(void *handle) { (void)handle; return 1; }
+static int vram_can_zero(void *handle) { (void)handle; return 1; }
+static int vram_can_fast_zero(void *handle) { (void)handle; return 1; }
+
+// Block status from the allocation bitmap: blocks never written, or trimmed
+// since, are reported as holes that read as zeros
+static int vram_extents(void *handle, uint32_t count, uint64_t offset, uint32_t flags, struct nbdkit_extents *extents)
+{
+    (void)handle; ensure_init(); if (!backend_inited) { nbdkit_set_error(EIO); return -1; }
+    uint64_t end = std::min(offset + (uint64_t)count, (uint64_t)plugin_size_bytes);
+    size_t idx = offset / blk_size, last = (end + blk_size - 1) / blk_size;
+    while (idx < last) {
+        bool allocated = block_allocated(idx);
+        size_t next = next_block_with(idx, last, !allocated);
+        uint64_t lo = std::max<uint64_t>(offset, (uint64_t)idx * blk_size), hi = std::min<uint64_t>(end, (uint64_t)next * blk_size);
+        if (nbdkit_add_extent(extents, lo, hi - lo, allocated ? 0 : NBDKIT_EXTENT_HOLE | NBDKIT_EXTENT_ZERO) == -1) return -1;
+        if (flags & NBDKIT_FLAG_REQ_ONE) break;
+        idx = next;
+    }
     return 0;
 }
+static int vram_can_extents(void *handle) { (void)handle; return 1; }
 
-static int vram_flush(void *handle, uint32_t flags) { (void)handle; (void)flags; if (!backend_inited) return -EIO; std::lock_guard<std::mutex> lg(backing_map_mutex); for (auto &entry_ptr : backing_map) { if (!entry_ptr) continue; std::lock_guard<std::mutex> lg2(entry_ptr->m); if (entry_ptr->b) entry_ptr->b->sync(); } return 0; }
-static int vram_block_size(void *handle, uint32_t *minimum, uint32_t *preferred, uint32_t *maximum) { (void)handle; uint32_t m = (uint32_t)block::size; if (minimum) *minimum = m; if (preferred) *preferred = m; if (maximum) *maximum = m; nbdkit_debug("vram-cuda: block_size reply min=%u pref=%u max=%u", m, m, m); return 0; }
+static int vram_block_size(void *handle, uint32_t *minimum, uint32_t *preferred, uint32_t *maximum) { (void)handle; uint32_t m = (uint32_t)blk_size; if (minimum) *minimum = m; if (preferred) *preferred = m; if (maximum) *maximum = MAX_REQUEST_SIZE; nbdkit_debug("vram-cuda: block_size reply min=%u pref=%u max=%u", m, m, MAX_REQUEST_SIZE); return 0; }
 static int vram_can_multi_conn(void *handle) { (void)handle; return 1; }
 static int vram_can_flush(void *handle) { (void)handle; return 1; }
 
@@ -136,17 +1561,47 @@ static struct nbdkit_plugin plugin = {
     .version = "0.1",
     .description = "Prototype plugin exposing GPU VRAM as a block device",
     .load = NULL,
-    .unload = NULL,
+    .unload = vram_unload,
     .config = vram_config,
     .config_complete = vram_config_complete,
-    .config_help = "size=<bytes|K|M|G>    Export size (e.g. 4G). If omitted, auto-detect device_total - 256M",
+    .config_help = "size=<bytes|K|M|G>    Export size (e.g. 4G). If omitted, auto-detect device_total - 256M\n"
+                   "backend=cuda|host     Device backend; host emulates a GPU in system RAM (default cuda)\n"
+                   "host_memory=<bytes>   Emulated device size for backend=host (default 1G)\n"
+                   "host_bandwidth=<B/s>  Emulated copy bandwidth per direction, 0 = unlimited (e.g. 12G)\n"
+                   "host_latency_us=<n>   Emulated fixed cost per copy in microseconds\n"
+                   "host_numa_node=<n>    NUMA node the emulated devices report (default -1 = none)\n"
+                   "async_write=<bool>    Return from writes once staged in pinned memory (default true)\n"
+                   "streams=<n>           Transfer streams shared by worker threads (default 4)\n"
+                   "devices=<i,j,...>     Pool over several devices, e.g. 0,1,2 (default: the first device)\n"
+                   "placement=stripe|capacity  Block i on device i mod n, or on the device with most free blocks (default stripe)\n"
+                   "worker_cpus=auto|<list>  Pin I/O threads to these CPUs; auto = the devices' NUMA nodes (default: unpinned)\n"
+                   "staging_buffers=<n>   Max 64K pinned staging buffers per device for async writes (default 256)\n"
+                   "block_size=<bytes>    Allocation granularity, power of two from 4K to 64K (default 64K)\n"
+                   "read_cache=<bytes>    Pinned host cache for hot blocks, 2Q replacement (default 0 = off)\n"
+                   "write_back=<bytes>    Coalesce sub-block writes in staging buffers up to this much (default 0 = off)\n"
+                   "write_back_age_ms=<n> Send coalesced writes after at most this long (default 20)\n"
+                   "scheduler=off|strict|weighted  Merge concurrent transfers into batches, reads ahead of writes (default off)\n"
+                   "read_weight=<n>       Weighted scheduler: read batches let past waiting writes in a row (default 4)\n"
+                   "write_depth=<n>       Scheduler: async write batches in flight per device before writes wait, 0 = no bound (default 8)\n"
+                   "populate=eager|background|lazy  Fill the pool before serving, behind it, or only as blocks are written (default background)\n"
+                   "compress=lz4|none     Keep blocks that compress to half or less packed in device memory (default none)\n"
+                   "elastic_reserve=<bytes>  Keep this much device memory free for other processes, shrinking the pool under pressure (default 0 = off)\n"
+                   "elastic_limit=<path>  File holding a cap on the pool size (e.g. 2G), re-read while running\n"
+                   "elastic_interval_ms=<n>  How often elastic limits are checked (default 1000)\n"
+                   "spill=<path>          File or block device (e.g. an NVMe partition) for blocks that don't fit in device memory\n"
+                   "spill_size=<bytes>    Spill capacity (default: the export size; with auto size, added to it)\n"
+                   "spill_demote=<pct>    Keep this share of the pool free by demoting the coldest blocks to the spill file (default 0 = off)\n"
+                   "metrics=<path>        Write counters and latency histograms in Prometheus text format to this file\n"
+                   "metrics_interval_ms=<n>  How often the metrics file is rewritten (default 1000)\n"
+                   "trace=<path>          Record every request (time, offset, length, thread, latency) to this binary file for trace_replay\n"
+                   "trace_buffer=<n>      Trace records buffered per thread before new ones are dropped (default 64K)",
     .open = vram_open,
     .close = vram_close,
     .get_size = vram_get_size,
     .can_write = vram_can_write,
     .can_flush = vram_can_flush,
     .is_rotational = NULL,
-    .can_trim = NULL,
+    .can_trim = vram_can_trim,
     ._pread_v1 = NULL,
     ._pwrite_v1 = NULL,
     ._flush_v1 = NULL,
@@ -154,21 +1609,21 @@ static struct nbdkit_plugin plugin = {
     ._zero_v1 = NULL,
     .errno_is_preserved = 0,
     .dump_plugin = NULL,
-    .can_zero = NULL,
+    .can_zero = vram_can_zero,
     .can_fua = vram_can_fua,
     .pread = vram_pread,
     .pwrite = vram_pwrite,
     .flush = vram_flush,
-    .trim = NULL,
-    .zero = NULL,
+    .trim = vram_trim,
+    .zero = vram_zero,
     .magic_config_key = NULL,
     .can_multi_conn = vram_can_multi_conn,
-    .can_extents = NULL,
-    .extents = NULL,
+    .can_extents = vram_can_extents,
+    .extents = vram_extents,
     .can_cache = NULL,
     .cache = NULL,
     .thread_model = NULL,
-    .can_fast_zero = NULL,
+    .can_fast_zero = vram_can_fast_zero,
     .preconnect = NULL,
     .get_ready = NULL,
     .after_fork = NULL,
@@ -0,0 +1,77 @@
+// The few nbdkit functions the plugin calls, for tools and tests that link
+// the plugin source and call its entry points in-process (io_bench,
+// trace_replay, test_plugin). Include from exactly one translation unit of
+// each.
+#ifndef VRAM_NBDKIT_SHIM_HPP
+#define VRAM_NBDKIT_SHIM_HPP
+
+#include <cstdarg>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#define NBDKIT_API_VERSION 2
+extern "C" {
+#include <nbdkit-plugin.h>
+}
+
+// nbdkit keeps extents opaque; here they are a list the caller can inspect,
+// with neighbours of the same type merged as nbdkit merges them
+struct shim_extent {
+    uint64_t offset, length;
+    uint32_t type;
+};
+struct nbdkit_extents {
+    std::vector<shim_extent> list;
+};
+
+// Set to print the plugin's debug messages (nbdkit -v)
+static bool shim_verbose = false;
+static const char *shim_name = "plugin";
+// What the plugin last passed to nbdkit_set_error on this thread
+static thread_local int shim_error = 0;
+
+extern "C" {
+void nbdkit_error(const char *fs, ...) {
+    va_list a;
+    va_start(a, fs);
+    fprintf(stderr, "%s: ", shim_name);
+    vfprintf(stderr, fs, a);
+    fprintf(stderr, "\n");
+    va_end(a);
+}
+void nbdkit_debug(const char *fs, ...) {
+    if (!shim_verbose) return;
+    va_list a;
+    va_start(a, fs);
+    vfprintf(stderr, fs, a);
+    fprintf(stderr, "\n");
+    va_end(a);
+}
+void nbdkit_set_error(int err) { shim_error = err; }
+int nbdkit_add_extent(struct nbdkit_extents *e, uint64_t offset, uint64_t length, uint32_t type) {
+    if (!length) return 0;
+    if (!e->list.empty()) {
+        shim_extent &last = e->list.back();
+        if (last.offset + last.length != offset) {
+            nbdkit_error("extent at %llu does not follow the previous one", (unsigned long long)offset);
+            return -1;
+        }
+        if (last.type == type) {
+            last.length += length;
+            return 0;
+        }
+    }
+    e->list.push_back({offset, length, type});
+    return 0;
+}
+int nbdkit_parse_bool(const char *s) {
+    if (!strcmp(s, "1") || !strcmp(s, "true") || !strcmp(s, "on") || !strcmp(s, "yes")) return 1;
+    if (!strcmp(s, "0") || !strcmp(s, "false") || !strcmp(s, "off") || !strcmp(s, "no")) return 0;
+    nbdkit_error("invalid boolean '%s'", s);
+    return -1;
+}
+struct nbdkit_plugin *plugin_init(void);
+}
+
+#endif
@@ -0,0 +1,90 @@
+#include <iostream>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <mutex>
+#include <atomic>
+#include <string>
+#include <cstdlib>
+
+#include "../../include/cuda_memory.hpp"
+#include "../../include/free_list.hpp"
+
+// Allocate/free throughput of the block and staging pools at 1..64 threads,
+// against a single mutex-protected vector (what the pools used before).
+// usage: pool_bench [ops_per_thread]
+
+// Run `fn(ops)` on `threads` threads at once; returns million ops per second
+template <typename Fn>
+static double run(int threads, int ops, Fn fn) {
+    std::atomic<bool> go{false};
+    std::vector<std::thread> ts;
+    for (int t = 0; t < threads; ++t)
+        ts.emplace_back([&] { while (!go) std::this_thread::yield(); fn(ops); });
+    auto s = std::chrono::steady_clock::now();
+    go = true;
+    for (auto &t : ts) t.join();
+    std::chrono::duration<double> d = std::chrono::steady_clock::now() - s;
+    return (double)threads * ops / d.count() / 1e6;
+}
+
+struct mutex_list {
+    std::mutex m;
+    std::vector<void *> v;
+    void *get() { std::lock_guard<std::mutex> lg(m); if (v.empty()) return nullptr; void *p = v.back(); v.pop_back(); return p; }
+    void put(void *p) { std::lock_guard<std::mutex> lg(m); v.push_back(p); }
+};
+
+int main(int argc, char **argv) {
+    using namespace vram::cuda_mem;
+
+    int ops = argc > 1 ? atoi(argv[1]) : 200000;
+    const size_t N = 4096;
+    std::vector<char> storage(N);
+    std::vector<void *> items(N);
+    for (size_t i = 0; i < N; ++i) items[i] = &storage[i];
+
+    host_backend_config hcfg;
+    hcfg.memory = 256 * 1024 * 1024;
+    if (!select_backend("host", hcfg) || !init() || !set_block_size(64 * 1024)) {
+        std::cerr << "host backend init failed" << std::endl;
+        return 1;
+    }
+    increase_pool(hcfg.memory);
+    init_staging_pool(256, 256);
+
+    // Each thread holds a few pointers at a time, like concurrent NBD requests
+    auto churn = [](auto get, auto put) {
+        return [=](int n) {
+            void *held[4];
+            for (int i = 0; i < n; i += 4) {
+                for (auto &h : held) h = get();
+                for (auto h : held) if (h) put(h);
+            }
+        };
+    };
+
+    std::cout << "threads,mutex_vector_mops,free_list_mops,block_alloc_mops,staging_mops\n";
+    for (int threads = 1; threads <= 64; threads *= 2) {
+        mutex_list ml;
+        ml.v = items;
+        vram::free_list fl;
+        fl.add(items.data(), N);
+
+        double mv = run(threads, ops, churn([&] { return ml.get(); }, [&](void *p) { ml.put(p); }));
+        double fv = run(threads, ops, churn([&] { return fl.get(); }, [&](void *p) { fl.put(p); }));
+        double bv = run(threads, ops / 4, [](int n) {
+            block_ref held[4];
+            for (int i = 0; i < n; i += 4) {
+                for (auto &h : held) h = allocate();
+                for (auto &h : held) h.reset();
+            }
+        });
+        double sv = run(threads, ops, churn([] { return acquire_staging_buffer(false); },
+                                            [](void *p) { release_staging_buffer(p); }));
+        std::cout << threads << "," << mv << "," << fv << "," << bv << "," << sv << std::endl;
+    }
+
+    shutdown();
+    return 0;
+}
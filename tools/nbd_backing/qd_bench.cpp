@@ -0,0 +1,268 @@
+#include <iostream>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+#include <random>
+#include <string>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <endian.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Queue-depth sweep against a running NBD server (nbd_server or nbdkit):
+// keeps `depth` requests in flight on one connection, one thread sending and
+// one collecting replies, and reports IOPS, bandwidth and latency
+// percentiles per depth. The span is written once first so reads hit data.
+// usage: qd_bench (--socket path | --tcp host:port) [--depths 1,2,4,...]
+//                 [--io-size 4K] [--write-pct 0] [--seconds 2] [--span 256M]
+
+typedef std::chrono::steady_clock clock_type;
+
+static bool read_all(int fd, void *p, size_t n) {
+    for (char *c = static_cast<char *>(p); n;) {
+        ssize_t r = recv(fd, c, n, 0);
+        if (r <= 0) return false;
+        c += r; n -= (size_t)r;
+    }
+    return true;
+}
+
+static bool write_all(int fd, const void *p, size_t n) {
+    for (const char *c = static_cast<const char *>(p); n;) {
+        ssize_t r = send(fd, c, n, MSG_NOSIGNAL);
+        if (r <= 0) return false;
+        c += r; n -= (size_t)r;
+    }
+    return true;
+}
+
+static int64_t parse_size(const char *s) {
+    char *end = nullptr;
+    long long v = strtoll(s, &end, 0);
+    switch (*end) {
+    case 'G': case 'g': return v << 30;
+    case 'M': case 'm': return v << 20;
+    case 'K': case 'k': return v << 10;
+    default: return v;
+    }
+}
+
+static int connect_to(const std::string &socket_path, const std::string &tcp) {
+    if (!socket_path.empty()) {
+        sockaddr_un addr = {};
+        addr.sun_family = AF_UNIX;
+        snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", socket_path.c_str());
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (connect(fd, (sockaddr *)&addr, sizeof(addr)) == 0) return fd;
+        close(fd);
+        return -1;
+    }
+    size_t colon = tcp.rfind(':');
+    std::string host = colon == std::string::npos ? "localhost" : tcp.substr(0, colon);
+    std::string port = colon == std::string::npos ? tcp : tcp.substr(colon + 1);
+    addrinfo hints = {}, *res = nullptr;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host.c_str(), port.c_str(), &hints, &res) != 0) return -1;
+    int fd = -1;
+    for (addrinfo *a = res; a && fd < 0; a = a->ai_next) {
+        fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+        if (fd >= 0 && connect(fd, a->ai_addr, a->ai_addrlen) < 0) { close(fd); fd = -1; }
+    }
+    freeaddrinfo(res);
+    int one = 1;
+    if (fd >= 0) setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+// Fixed newstyle handshake with NBD_OPT_GO on the default export; returns its size
+static int64_t handshake(int fd) {
+    char greet[18], flags[4] = {0, 0, 0, 3};
+    if (!read_all(fd, greet, 18) || !write_all(fd, flags, 4)) return -1;
+    char opt[16 + 6] = {};
+    uint64_t magic = htobe64(0x49484156454f5054ULL);
+    uint32_t go = htobe32(7), len = htobe32(6);
+    memcpy(opt, &magic, 8); memcpy(opt + 8, &go, 4); memcpy(opt + 12, &len, 4);
+    if (!write_all(fd, opt, sizeof(opt))) return -1;
+    int64_t size = -1;
+    for (;;) {
+        char h[20];
+        if (!read_all(fd, h, 20)) return -1;
+        uint32_t type, dlen;
+        memcpy(&type, h + 12, 4); memcpy(&dlen, h + 16, 4);
+        type = be32toh(type); dlen = be32toh(dlen);
+        std::vector<char> data(dlen);
+        if (dlen && !read_all(fd, data.data(), dlen)) return -1;
+        if (type == 3 && dlen >= 12 && data[0] == 0 && data[1] == 0) {
+            uint64_t s;
+            memcpy(&s, data.data() + 2, 8);
+            size = (int64_t)be64toh(s);
+        }
+        else if (type == 1) return size;
+        else if (type != 3) return -1;
+    }
+}
+
+static void request_header(char *h, uint16_t type, uint64_t handle, uint64_t offset, uint32_t len) {
+    uint32_t magic = htobe32(0x25609513), l = htobe32(len);
+    uint16_t flags = 0, t = htobe16(type);
+    uint64_t hd = htobe64(handle), off = htobe64(offset);
+    memcpy(h, &magic, 4); memcpy(h + 4, &flags, 2); memcpy(h + 6, &t, 2);
+    memcpy(h + 8, &hd, 8); memcpy(h + 16, &off, 8); memcpy(h + 24, &l, 4);
+}
+
+struct result {
+    double iops, mbps, avg_us, p50_us, p99_us, p999_us;
+};
+
+// Keep `depth` requests in flight for `seconds`
+static bool run_depth(int fd, int depth, size_t io_size, int write_pct, double seconds, uint64_t span, result &out) {
+    std::vector<clock_type::time_point> sent_at(depth);
+    std::vector<char> is_write(depth);
+    std::vector<int> free_slots;
+    for (int i = depth; i--;) free_slots.push_back(i);
+    std::mutex m;
+    std::condition_variable cv;
+    bool sending = true, failed = false;
+    std::vector<double> lat;
+    lat.reserve(1 << 20);
+    std::vector<char> payload(io_size, 0x5a), sink(io_size);
+
+    auto deadline = clock_type::now() + std::chrono::duration<double>(seconds);
+    std::thread sender([&] {
+        std::mt19937_64 rng(depth);
+        uint64_t slots_in_span = span / io_size;
+        char h[28];
+        while (clock_type::now() < deadline) {
+            int slot;
+            {
+                std::unique_lock<std::mutex> lk(m);
+                cv.wait(lk, [&] { return !free_slots.empty() || failed; });
+                if (failed) break;
+                slot = free_slots.back();
+                free_slots.pop_back();
+            }
+            bool w = (int)(rng() % 100) < write_pct;
+            is_write[slot] = w;
+            sent_at[slot] = clock_type::now();
+            request_header(h, w ? 1 : 0, (uint64_t)slot, rng() % slots_in_span * io_size, (uint32_t)io_size);
+            if (!write_all(fd, h, 28) || (w && !write_all(fd, payload.data(), io_size))) { failed = true; break; }
+        }
+        std::lock_guard<std::mutex> lg(m);
+        sending = false;
+    });
+
+    auto start = clock_type::now();
+    for (;;) {
+        {
+            std::lock_guard<std::mutex> lg(m);
+            if (!sending && (int)free_slots.size() == depth) break;
+        }
+        // Replies still owed: collect the next one
+        {
+            std::lock_guard<std::mutex> lg(m);
+            if ((int)free_slots.size() == depth) { std::this_thread::yield(); continue; }
+        }
+        char r[16];
+        if (!read_all(fd, r, 16)) { failed = true; break; }
+        uint32_t err;
+        uint64_t handle;
+        memcpy(&err, r + 4, 4); memcpy(&handle, r + 8, 8);
+        int slot = (int)be64toh(handle);
+        if (err || slot < 0 || slot >= depth || (!is_write[slot] && !read_all(fd, sink.data(), io_size))) { failed = true; break; }
+        lat.push_back(std::chrono::duration<double, std::micro>(clock_type::now() - sent_at[slot]).count());
+        std::lock_guard<std::mutex> lg(m);
+        free_slots.push_back(slot);
+        cv.notify_one();
+    }
+    double elapsed = std::chrono::duration<double>(clock_type::now() - start).count();
+    {
+        std::lock_guard<std::mutex> lg(m);
+        if (failed) cv.notify_all();
+    }
+    sender.join();
+    if (failed || lat.empty()) return false;
+    std::sort(lat.begin(), lat.end());
+    double sum = 0;
+    for (double l : lat) sum += l;
+    auto pct = [&](double p) { return lat[std::min(lat.size() - 1, (size_t)(p * lat.size()))]; };
+    out = {lat.size() / elapsed, lat.size() * io_size / elapsed / 1e6, sum / lat.size(), pct(0.5), pct(0.99), pct(0.999)};
+    return true;
+}
+
+int main(int argc, char **argv) {
+    std::string socket_path, tcp;
+    std::vector<int> depths = {1, 2, 4, 8, 16, 32, 64, 128, 256};
+    size_t io_size = 4096;
+    int write_pct = 0;
+    double seconds = 2;
+    uint64_t span = 256ULL << 20;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        std::string a = argv[i];
+        const char *v = argv[i + 1];
+        if (a == "--socket") socket_path = v;
+        else if (a == "--tcp") tcp = v;
+        else if (a == "--io-size") io_size = (size_t)parse_size(v);
+        else if (a == "--write-pct") write_pct = atoi(v);
+        else if (a == "--seconds") seconds = atof(v);
+        else if (a == "--span") span = (uint64_t)parse_size(v);
+        else if (a == "--depths") {
+            depths.clear();
+            for (const char *p = v; *p;) {
+                char *end = nullptr;
+                depths.push_back((int)strtol(p, &end, 10));
+                p = *end == ',' ? end + 1 : end;
+            }
+        }
+    }
+    if (socket_path.empty() && tcp.empty()) {
+        std::cerr << "usage: qd_bench (--socket path | --tcp host:port) [--depths 1,2,4,...] [--io-size 4K]\n"
+                     "                [--write-pct 0] [--seconds 2] [--span 256M]" << std::endl;
+        return 1;
+    }
+    int fd = connect_to(socket_path, tcp);
+    int64_t size = fd < 0 ? -1 : handshake(fd);
+    if (size <= 0) { std::cerr << "qd_bench: cannot open the export" << std::endl; return 1; }
+    span = std::min<uint64_t>(span, (uint64_t)size) / io_size * io_size;
+    if (!span) { std::cerr << "qd_bench: export smaller than one request" << std::endl; return 1; }
+
+    // Fill the span so reads move data instead of returning holes
+    {
+        const size_t chunk = 256 * 1024;
+        std::vector<char> data(chunk, 0x3c);
+        char h[28], r[16];
+        for (uint64_t off = 0; off < span; off += chunk) {
+            uint32_t n = (uint32_t)std::min<uint64_t>(chunk, span - off);
+            request_header(h, 1, off, off, n);
+            if (!write_all(fd, h, 28) || !write_all(fd, data.data(), n) || !read_all(fd, r, 16)) {
+                std::cerr << "qd_bench: prefill failed" << std::endl;
+                return 1;
+            }
+        }
+    }
+
+    printf("# io_size=%zu write_pct=%d span=%llu seconds=%.1f\n", io_size, write_pct, (unsigned long long)span, seconds);
+    printf("%5s %10s %9s %9s %9s %9s %9s\n", "qd", "iops", "MB/s", "avg_us", "p50_us", "p99_us", "p99.9_us");
+    for (int depth : depths) {
+        result r;
+        if (depth < 1 || !run_depth(fd, depth, io_size, write_pct, seconds, span, r)) {
+            std::cerr << "qd_bench: run at depth " << depth << " failed" << std::endl;
+            return 1;
+        }
+        printf("%5d %10.0f %9.1f %9.1f %9.1f %9.1f %9.1f\n", depth, r.iops, r.mbps, r.avg_us, r.p50_us, r.p99_us, r.p999_us);
+        fflush(stdout);
+    }
+    char h[28];
+    request_header(h, 2, 0, 0, 0);
+    write_all(fd, h, 28);
+    close(fd);
+    return 0;
+}
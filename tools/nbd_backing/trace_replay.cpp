@@ -0,0 +1,238 @@
+#include <iostream>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+#include <atomic>
+#include <random>
+#include <string>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "../../include/cuda_memory.hpp"
+#include "../../include/trace.hpp"
+#include "nbdkit_shim.hpp"
+
+// Replay a request trace recorded with the plugin's trace=<path> through the
+// plugin's entry points, in-process. Each traced thread becomes a replay
+// worker (or --threads of them, sharing the traced threads round-robin)
+// that issues its requests in their recorded order, each at its recorded
+// time divided by --speed; --speed 0 issues them back to back. Write data
+// is not traced, so writes carry random bytes.
+//
+// Prints one JSON line per request type (replayed and traced latency) and a
+// summary line with the replay time and how late requests were issued
+// against the schedule.
+//
+// usage: trace_replay --trace file [--speed 1] [--threads N] [--size bytes]
+//                     [--prefill] [--backend host|cuda] [--host-memory bytes]
+//                     [--host-latency-us 10] [--host-bandwidth 12G]
+//                     [--verbose] [plugin key=value ...]
+
+typedef std::chrono::steady_clock clock_type;
+using namespace vram;
+
+static const char *const op_names[] = {"pread", "pwrite", "flush", "trim", "zero"};
+static const int NOPS = 5;
+
+static int64_t parse_size(const char *s) {
+    char *end = nullptr;
+    long long v = strtoll(s, &end, 0);
+    switch (*end) {
+    case 'G': case 'g': return v << 30;
+    case 'M': case 'm': return v << 20;
+    case 'K': case 'k': return v << 10;
+    default: return v;
+    }
+}
+
+struct stats {
+    std::vector<double> replay_us, trace_us;
+    uint64_t bytes = 0, errors = 0;
+};
+
+static double pct(std::vector<double> &v, double p) {
+    return v.empty() ? 0.0 : v[std::min(v.size() - 1, (size_t)(p * v.size()))];
+}
+
+static double avg(const std::vector<double> &v) {
+    double sum = 0;
+    for (double x : v) sum += x;
+    return v.empty() ? 0.0 : sum / v.size();
+}
+
+int main(int argc, char **argv) {
+    shim_name = "trace_replay";
+    std::string trace_path, backend = "host";
+    double speed = 1;
+    int threads = 0;
+    int64_t size = 0, host_memory = 0;
+    bool prefill = false, bad = false;
+    cuda_mem::host_backend_config host;
+    host.latency_ns = 10 * 1000;
+    host.bandwidth = 12ULL << 30;
+    std::vector<std::string> plugin_args;
+    for (int i = 1; i < argc && !bad; ++i) {
+        std::string a = argv[i];
+        if (a == "--verbose") { shim_verbose = true; continue; }
+        if (a == "--prefill") { prefill = true; continue; }
+        if (a.compare(0, 2, "--") && a.find('=') != std::string::npos) { plugin_args.push_back(a); continue; }
+        if (i + 1 >= argc) { bad = true; break; }
+        const char *v = argv[++i];
+        if (a == "--trace") trace_path = v;
+        else if (a == "--speed") speed = atof(v);
+        else if (a == "--threads") threads = atoi(v);
+        else if (a == "--size") size = parse_size(v);
+        else if (a == "--backend") backend = v;
+        else if (a == "--host-memory") host_memory = parse_size(v);
+        else if (a == "--host-latency-us") host.latency_ns = strtoull(v, nullptr, 0) * 1000;
+        else if (a == "--host-bandwidth") host.bandwidth = (uint64_t)parse_size(v);
+        else bad = true;
+    }
+    if (bad || trace_path.empty() || speed < 0 || threads < 0) {
+        std::cerr << "usage: trace_replay --trace file [--speed 1] [--threads N] [--size bytes] [--prefill]\n"
+                     "                    [--backend host|cuda] [--host-memory bytes] [--host-latency-us 10]\n"
+                     "                    [--host-bandwidth 12G] [--verbose] [plugin key=value ...]" << std::endl;
+        return 1;
+    }
+
+    trace::file_header hdr;
+    std::vector<trace::record> recs;
+    std::string error;
+    if (!trace::load(trace_path, hdr, recs, error)) {
+        std::cerr << "trace_replay: " << error << std::endl;
+        return 1;
+    }
+    if (recs.empty()) {
+        std::cerr << "trace_replay: " << trace_path << " holds no requests" << std::endl;
+        return 1;
+    }
+    uint32_t traced_threads = 0, longest = 0;
+    uint64_t end = 0;
+    for (const trace::record &r : recs) {
+        traced_threads = std::max(traced_threads, r.thread + 1);
+        if (r.type == trace::PREAD || r.type == trace::PWRITE) longest = std::max(longest, r.length);
+        end = std::max<uint64_t>(end, r.offset + r.length);
+    }
+    if (!threads) threads = (int)traced_threads;
+    if (!size) size = (int64_t)((end + (1 << 20) - 1) >> 20 << 20);
+    if ((uint64_t)size < end) {
+        std::cerr << "trace_replay: the trace reaches " << end << " bytes, beyond --size" << std::endl;
+        return 1;
+    }
+
+    nbdkit_plugin *p = plugin_init();
+    std::vector<std::pair<std::string, std::string>> args = {{"backend", backend}, {"size", std::to_string(size)}};
+    if (backend == "host") {
+        args.push_back({"host_memory", std::to_string(host_memory > 0 ? host_memory : size + (64LL << 20))});
+        args.push_back({"host_bandwidth", std::to_string(host.bandwidth)});
+        args.push_back({"host_latency_us", std::to_string(host.latency_ns / 1000)});
+    }
+    for (const std::string &a : plugin_args) {
+        size_t eq = a.find('=');
+        args.push_back({a.substr(0, eq), a.substr(eq + 1)});
+    }
+    for (auto &kv : args)
+        if (p->config(kv.first.c_str(), kv.second.c_str())) return 2;
+    if (p->config_complete && p->config_complete()) return 2;
+    void *h = p->open(0);
+    if (p->get_size(h) < size) {
+        std::cerr << "trace_replay: plugin export smaller than " << size << " bytes" << std::endl;
+        return 2;
+    }
+    if (prefill) {
+        // Reads of blocks the trace never writes then move data, as they
+        // would on a device that was in use before the trace started
+        const size_t chunk = 1 << 20;
+        std::vector<char> data(chunk);
+        std::mt19937_64 rng(1);
+        for (size_t i = 0; i + 8 <= chunk; i += 8) { uint64_t v = rng(); memcpy(&data[i], &v, 8); }
+        for (int64_t off = 0; off < size; off += chunk)
+            if (p->pwrite(h, data.data(), (uint32_t)std::min<int64_t>(chunk, size - off), off, 0)) {
+                std::cerr << "trace_replay: prefill failed" << std::endl;
+                return 2;
+            }
+        p->flush(h, 0);
+    }
+
+    // Traced thread t replays on worker t % threads, keeping its order
+    std::vector<std::vector<uint32_t>> work(threads);
+    for (uint32_t i = 0; i < recs.size(); ++i) work[recs[i].thread % threads].push_back(i);
+    std::vector<stats> per_worker(threads * NOPS);
+    std::vector<std::vector<double>> lag(threads);
+    std::atomic<bool> go{false};
+    clock_type::time_point t0;
+    std::vector<std::thread> ts;
+    for (int w = 0; w < threads; ++w) {
+        ts.emplace_back([&, w] {
+            std::vector<char> buf(std::max<uint32_t>(longest, 4096));
+            std::mt19937_64 rng(w + 1);
+            for (size_t i = 0; i + 8 <= buf.size(); i += 8) { uint64_t v = rng(); memcpy(&buf[i], &v, 8); }
+            lag[w].reserve(work[w].size());
+            while (!go.load(std::memory_order_acquire)) std::this_thread::yield();
+            for (uint32_t i : work[w]) {
+                const trace::record &r = recs[i];
+                if (r.type >= NOPS) continue;
+                auto issue = clock_type::now();
+                if (speed > 0) {
+                    auto due = t0 + std::chrono::nanoseconds((uint64_t)(r.start_ns / speed));
+                    if (due > issue) { std::this_thread::sleep_until(due); issue = clock_type::now(); }
+                    lag[w].push_back(std::chrono::duration<double, std::micro>(issue - due).count());
+                }
+                int rc = 0;
+                switch (r.type) {
+                case trace::PREAD: rc = p->pread(h, buf.data(), r.length, r.offset, 0); break;
+                case trace::PWRITE: rc = p->pwrite(h, buf.data(), r.length, r.offset, 0); break;
+                case trace::FLUSH: rc = p->flush(h, 0); break;
+                case trace::TRIM: rc = p->trim(h, r.length, r.offset, 0); break;
+                // Traces don't keep flags; nbdkit sets MAY_TRIM unless the client asked for NO_HOLE
+                case trace::ZERO: rc = p->zero(h, r.length, r.offset, NBDKIT_FLAG_MAY_TRIM); break;
+                }
+                stats &s = per_worker[w * NOPS + r.type];
+                s.replay_us.push_back(std::chrono::duration<double, std::micro>(clock_type::now() - issue).count());
+                s.trace_us.push_back(r.latency_ns / 1e3);
+                if (rc) ++s.errors;
+                else s.bytes += r.length;
+            }
+        });
+    }
+    t0 = clock_type::now();
+    go.store(true, std::memory_order_release);
+    for (auto &t : ts) t.join();
+    p->flush(h, 0);
+    double seconds = std::chrono::duration<double>(clock_type::now() - t0).count();
+    p->close(h);
+    if (p->unload) p->unload();
+
+    uint64_t ops = 0, errors = 0;
+    for (int op = 0; op < NOPS; ++op) {
+        stats s;
+        for (int w = 0; w < threads; ++w) {
+            stats &x = per_worker[w * NOPS + op];
+            s.replay_us.insert(s.replay_us.end(), x.replay_us.begin(), x.replay_us.end());
+            s.trace_us.insert(s.trace_us.end(), x.trace_us.begin(), x.trace_us.end());
+            s.bytes += x.bytes;
+            s.errors += x.errors;
+        }
+        if (s.replay_us.empty()) continue;
+        std::sort(s.replay_us.begin(), s.replay_us.end());
+        std::sort(s.trace_us.begin(), s.trace_us.end());
+        ops += s.replay_us.size();
+        errors += s.errors;
+        printf("{\"op\":\"%s\",\"ops\":%zu,\"bytes\":%llu,\"errors\":%llu,\"avg_us\":%.1f,\"p50_us\":%.1f,\"p99_us\":%.1f,\"p999_us\":%.1f,"
+               "\"trace_avg_us\":%.1f,\"trace_p50_us\":%.1f,\"trace_p99_us\":%.1f,\"trace_p999_us\":%.1f}\n",
+               op_names[op], s.replay_us.size(), (unsigned long long)s.bytes, (unsigned long long)s.errors,
+               avg(s.replay_us), pct(s.replay_us, 0.5), pct(s.replay_us, 0.99), pct(s.replay_us, 0.999),
+               avg(s.trace_us), pct(s.trace_us, 0.5), pct(s.trace_us, 0.99), pct(s.trace_us, 0.999));
+    }
+    std::vector<double> all_lag;
+    for (auto &l : lag) all_lag.insert(all_lag.end(), l.begin(), l.end());
+    std::sort(all_lag.begin(), all_lag.end());
+    double traced = (recs.back().start_ns + recs.back().latency_ns) / 1e9;
+    printf("{\"op\":\"all\",\"ops\":%llu,\"errors\":%llu,\"threads\":%d,\"speed\":%g,\"seconds\":%.3f,\"trace_seconds\":%.3f,"
+           "\"lag_p50_us\":%.1f,\"lag_p99_us\":%.1f,\"trace_dropped\":%llu}\n",
+           (unsigned long long)ops, (unsigned long long)errors, threads, speed, seconds, traced,
+           pct(all_lag, 0.5), pct(all_lag, 0.99), (unsigned long long)hdr.dropped);
+    return errors ? 3 : 0;
+}